@@ -37,12 +37,136 @@
 
 extern int local_flag;
 
+/*
+ * hdb_foreach() hands us entries one at a time on the main thread; we
+ * batch them up and have the pipeline's threads turn them into dump
+ * text, which we then write out in the original order.
+ */
+
+#define DUMP_BATCH_ENTRIES 256
+
+struct dump_batch {
+    size_t n;
+    hdb_entry_ex ents[DUMP_BATCH_ENTRIES];
+    krb5_error_code ret;
+    krb5_data text;
+};
+
+struct dump_ctx {
+    struct pipeline *pipeline;
+    struct dump_batch *batch;		/* being filled */
+    hdb_dump_format_t fmt;
+    FILE *out;
+    unsigned long count;
+    int warned;				/* a batch's error was reported */
+};
+
+static void
+dump_batch_free(krb5_context kcontext, struct dump_batch *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+	hdb_free_entry(kcontext, &b->ents[i]);
+    /* With --decrypt the text has keys in the clear */
+    if (b->text.data)
+	memset_s(b->text.data, b->text.length, 0, b->text.length);
+    krb5_data_free(&b->text);
+    free(b);
+}
+
+/* Runs on a pipeline thread */
+static void
+dump_batch_format(krb5_context kcontext, void *batch, void *arg)
+{
+    struct dump_batch *b = batch;
+    struct dump_ctx *d = arg;
+    krb5_storage *sp;
+    size_t i;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL) {
+	b->ret = krb5_enomem(kcontext);
+	return;
+    }
+    for (i = 0; i < b->n && b->ret == 0; i++)
+	b->ret = hdb_entry2dump(kcontext, sp, d->fmt, &b->ents[i].entry);
+    if (b->ret == 0)
+	b->ret = krb5_storage_to_data(sp, &b->text);
+    krb5_storage_free(sp);
+
+    /* Don't leave key material lying around until it's written out */
+    for (i = 0; i < b->n; i++)
+	hdb_free_entry(kcontext, &b->ents[i]);
+    b->n = 0;
+}
+
+static krb5_error_code
+dump_batch_write(struct dump_ctx *d)
+{
+    struct dump_batch *b = pipeline_get(d->pipeline);
+    krb5_error_code ret;
+
+    ret = b->ret;
+    errno = 0;
+    if (ret)
+	krb5_warn(context, ret, "dump");
+    else if (b->text.length &&
+	     fwrite(b->text.data, b->text.length, 1, d->out) != 1) {
+	ret = errno ? errno : EIO;
+	krb5_warn(context, ret, "write");
+    }
+    if (ret)
+	d->warned = 1;
+    dump_batch_free(context, b);
+    return ret;
+}
+
+static krb5_error_code
+dump_batch_put(struct dump_ctx *d)
+{
+    krb5_error_code ret;
+
+    while (pipeline_full(d->pipeline)) {
+	ret = dump_batch_write(d);
+	if (ret)
+	    return ret;
+    }
+    pipeline_put(d->pipeline, d->batch);
+    d->batch = NULL;
+    return 0;
+}
+
+/* hdb_foreach() callback */
+static krb5_error_code
+dump_entry(krb5_context kcontext, HDB *db, hdb_entry_ex *entry, void *data)
+{
+    struct dump_ctx *d = data;
+    krb5_error_code ret;
+
+    if (d->batch == NULL) {
+	d->batch = calloc(1, sizeof(*d->batch));
+	if (d->batch == NULL)
+	    return krb5_enomem(kcontext);
+    }
+
+    /* Take the entry over; hdb_foreach() will free what's left */
+    d->batch->ents[d->batch->n++].entry = entry->entry;
+    memset(&entry->entry, 0, sizeof(entry->entry));
+    d->count++;
+
+    if (d->batch->n < DUMP_BATCH_ENTRIES)
+	return 0;
+    return dump_batch_put(d);
+}
+
 int
 dump(struct dump_options *opt, int argc, char **argv)
 {
     krb5_error_code ret;
     FILE *f;
-    struct hdb_print_entry_arg parg;
+    struct dump_ctx d;
+    struct timeval start;
     HDB *db = NULL;
 
     if (!local_flag) {
@@ -50,6 +174,7 @@ dump(struct dump_options *opt, int argc, char **argv)
 	return 0;
     }
 
+    memset(&d, 0, sizeof(d));
     db = _kadm5_s_get_db(kadm_handle);
 
     if (argc == 0)
@@ -58,7 +183,8 @@ dump(struct dump_options *opt, int argc, char **argv)
 	f = fopen(argv[0], "w");
 
     if (f == NULL) {
-	krb5_warn(context, errno, "open: %s", argv[0]);
+	ret = errno;
+	krb5_warn(context, ret, "open: %s", argv[0]);
 	goto out;
     }
     ret = db->hdb_open(context, db, O_RDONLY, 0600);
@@ -68,20 +194,55 @@ dump(struct dump_options *opt, int argc, char **argv)
     }
 
     if (!opt->format_string || strcmp(opt->format_string, "Heimdal") == 0) {
-        parg.fmt = HDB_DUMP_HEIMDAL;
+        d.fmt = HDB_DUMP_HEIMDAL;
     } else if (opt->format_string && strcmp(opt->format_string, "MIT") == 0) {
-        parg.fmt = HDB_DUMP_MIT;
+        d.fmt = HDB_DUMP_MIT;
         fprintf(f, "kdb5_util load_dump version 5\n"); /* 5||6, either way */
     } else {
         krb5_errx(context, 1, "Supported dump formats: Heimdal and MIT");
     }
-    parg.out = f;
-    hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
-		hdb_print_entry, &parg);
+    d.out = f;
+
+    ret = pipeline_create(context,
+			  opt->threads_integer < 0 ?
+			  pipeline_default_threads() : opt->threads_integer,
+			  dump_batch_format, &d, &d.pipeline);
+    if (ret) {
+	krb5_warn(context, ret, "dump");
+	db->hdb_close(context, db);
+	goto out;
+    }
+
+    gettimeofday(&start, NULL);
+    ret = hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
+		      dump_entry, &d);
+    if (ret && !d.warned)
+	krb5_warn(context, ret, "hdb_foreach");
+    if (ret == 0 && d.batch != NULL)
+	ret = dump_batch_put(&d);
+    if (d.batch != NULL)
+	dump_batch_free(context, d.batch);
+
+    /* Write out (or after an error, discard) what's still in flight */
+    while (pipeline_pending(d.pipeline)) {
+	if (ret == 0)
+	    ret = dump_batch_write(&d);
+	else
+	    dump_batch_free(context, pipeline_get(d.pipeline));
+    }
+    pipeline_destroy(d.pipeline);
+
+    errno = 0;
+    if (ret == 0 && fflush(f) != 0) {
+	ret = errno ? errno : EIO;
+	krb5_warn(context, ret, "write");
+    }
+    if (ret == 0 && opt->verbose_flag)
+	pipeline_report("dumped", d.count, &start);
 
     db->hdb_close(context, db);
 out:
     if(f && f != stdout)
 	fclose(f);
-    return 0;
+    return ret != 0;
 }
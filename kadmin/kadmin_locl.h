@@ -161,4 +161,19 @@ handle_mit(krb5_context, void *, size_t, int, int);
 void
 add_tl(kadm5_principal_ent_rec *, int, krb5_data *);
 
+/* pipeline.c */
+
+struct pipeline;
+typedef void (*pipeline_work_func)(krb5_context, void *, void *);
+
+int pipeline_default_threads(void);
+krb5_error_code pipeline_create(krb5_context, int, pipeline_work_func,
+				void *, struct pipeline **);
+size_t pipeline_pending(struct pipeline *);
+int pipeline_full(struct pipeline *);
+void pipeline_put(struct pipeline *, void *);
+void *pipeline_get(struct pipeline *);
+void pipeline_destroy(struct pipeline *);
+void pipeline_report(const char *, unsigned long, const struct timeval *);
+
 #endif /* __ADMIN_LOCL_H__ */
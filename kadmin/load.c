@@ -237,7 +237,7 @@ parse_keys(hdb_entry *ent, char *str)
  */
 
 static int
-parse_event(Event *ev, char *s)
+parse_event(krb5_context kcontext, Event *ev, char *s)
 {
     krb5_error_code ret;
     char *p;
@@ -249,20 +249,20 @@ parse_event(Event *ev, char *s)
     if(parse_time_string(&ev->time, p) != 1)
 	return -1;
     p = strsep(&s, ":");
-    ret = krb5_parse_name(context, p, &ev->principal);
+    ret = krb5_parse_name(kcontext, p, &ev->principal);
     if (ret)
 	return -1;
     return 1;
 }
 
 static int
-parse_event_alloc (Event **ev, char *s)
+parse_event_alloc (krb5_context kcontext, Event **ev, char *s)
 {
     Event tmp;
     int ret;
 
     *ev = NULL;
-    ret = parse_event (&tmp, s);
+    ret = parse_event (kcontext, &tmp, s);
     if (ret == 1) {
 	*ev = malloc (sizeof (**ev));
 	if (*ev == NULL)
@@ -400,13 +400,243 @@ my_fgetln(FILE *f, char **bufp, size_t *szp, size_t *lenp)
     return 0; /* *len == 0 || no EOL -> EOF */
 }
 
+/*
+ * Parse one dump `line' into `ent'.  Returns 0 on success, or 1 after
+ * reporting why the line could not be parsed.  Runs on the pipeline's
+ * threads, hence `kcontext'.
+ */
+
+static int
+parse_entry(krb5_context kcontext, const char *filename, int lineno,
+	    char *line, hdb_entry_ex *ent)
+{
+    krb5_error_code ret;
+    struct entry e;
+    char *p;
+
+    p = line;
+    while (isspace((unsigned char)*p))
+	p++;
+
+    e.principal = p;
+    for (p = line; *p; p++){
+	if (*p == '\\') /* Support '\n' escapes??? */
+	    p++;
+	else if (isspace((unsigned char)*p)) {
+	    *p = 0;
+	    break;
+	}
+    }
+    p = skip_next(p);
+
+    e.key = p;
+    p = skip_next(p);
+
+    e.created = p;
+    p = skip_next(p);
+
+    e.modified = p;
+    p = skip_next(p);
+
+    e.valid_start = p;
+    p = skip_next(p);
+
+    e.valid_end = p;
+    p = skip_next(p);
+
+    e.pw_end = p;
+    p = skip_next(p);
+
+    e.max_life = p;
+    p = skip_next(p);
+
+    e.max_renew = p;
+    p = skip_next(p);
+
+    e.flags = p;
+    p = skip_next(p);
+
+    e.generation = p;
+    p = skip_next(p);
+
+    e.extensions = p;
+    skip_next(p);
+
+    memset(ent, 0, sizeof(*ent));
+    ret = krb5_parse_name(kcontext, e.principal, &ent->entry.principal);
+    if (ret) {
+	const char *msg = krb5_get_error_message(kcontext, ret);
+	fprintf(stderr, "%s:%d:%s (%s)\n",
+		filename, lineno, msg, e.principal);
+	krb5_free_error_message(kcontext, msg);
+	return 1;
+    }
+
+    if (parse_keys(&ent->entry, e.key)) {
+	fprintf (stderr, "%s:%d:error parsing keys (%s)\n",
+		 filename, lineno, e.key);
+	goto fail;
+    }
+
+    if (parse_event(kcontext, &ent->entry.created_by, e.created) == -1) {
+	fprintf (stderr, "%s:%d:error parsing created event (%s)\n",
+		 filename, lineno, e.created);
+	goto fail;
+    }
+    if (parse_event_alloc (kcontext, &ent->entry.modified_by, e.modified) == -1) {
+	fprintf (stderr, "%s:%d:error parsing event (%s)\n",
+		 filename, lineno, e.modified);
+	goto fail;
+    }
+    if (parse_time_string_alloc (&ent->entry.valid_start, e.valid_start) == -1) {
+	fprintf (stderr, "%s:%d:error parsing time (%s)\n",
+		 filename, lineno, e.valid_start);
+	goto fail;
+    }
+    if (parse_time_string_alloc (&ent->entry.valid_end,   e.valid_end) == -1) {
+	fprintf (stderr, "%s:%d:error parsing time (%s)\n",
+		 filename, lineno, e.valid_end);
+	goto fail;
+    }
+    if (parse_time_string_alloc (&ent->entry.pw_end,      e.pw_end) == -1) {
+	fprintf (stderr, "%s:%d:error parsing time (%s)\n",
+		 filename, lineno, e.pw_end);
+	goto fail;
+    }
+
+    if (parse_integer_alloc (&ent->entry.max_life,  e.max_life) == -1) {
+	fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
+		 filename, lineno, e.max_life);
+	goto fail;
+    }
+    if (parse_integer_alloc (&ent->entry.max_renew, e.max_renew) == -1) {
+	fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
+		 filename, lineno, e.max_renew);
+	goto fail;
+    }
+
+    if (parse_hdbflags2int (&ent->entry.flags, e.flags) != 1) {
+	fprintf (stderr, "%s:%d:error parsing flags (%s)\n",
+		 filename, lineno, e.flags);
+	goto fail;
+    }
+
+    if(parse_generation(e.generation, &ent->entry.generation) == -1) {
+	fprintf (stderr, "%s:%d:error parsing generation (%s)\n",
+		 filename, lineno, e.generation);
+	goto fail;
+    }
+
+    if (parse_extensions(&e.extensions, &ent->entry.extensions) == -1) {
+	fprintf (stderr, "%s:%d:error parsing extension (%s)\n",
+		 filename, lineno, e.extensions);
+	goto fail;
+    }
+    return 0;
+
+fail:
+    hdb_free_entry (kcontext, ent);
+    return 1;
+}
+
+/*
+ * The main thread reads the dump in batches of lines, the pipeline's
+ * threads parse them, and the main thread stores the parsed entries, in
+ * dump order, one transaction per batch where the HDB has them.
+ */
+
+#define LOAD_BATCH_LINES 512
+
+struct load_batch {
+    size_t n;
+    int lineno;				/* of lines[0] */
+    int errors;
+    char *lines[LOAD_BATCH_LINES];
+    size_t lens[LOAD_BATCH_LINES];	/* parsing cuts lines up */
+    int parsed[LOAD_BATCH_LINES];
+    hdb_entry_ex ents[LOAD_BATCH_LINES];
+};
+
+/* Lines of a dump made with --decrypt have keys in the clear */
+static void
+load_batch_free_line(struct load_batch *b, size_t i)
+{
+    if (b->lines[i] != NULL)
+	memset_s(b->lines[i], b->lens[i], 0, b->lens[i]);
+    free(b->lines[i]);
+    b->lines[i] = NULL;
+}
+
+static void
+load_batch_free(krb5_context kcontext, struct load_batch *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+	if (b->parsed[i])
+	    hdb_free_entry(kcontext, &b->ents[i]);
+	load_batch_free_line(b, i);
+    }
+    free(b);
+}
+
+/* Runs on a pipeline thread */
+static void
+load_batch_parse(krb5_context kcontext, void *batch, void *arg)
+{
+    struct load_batch *b = batch;
+    const char *filename = arg;
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+	if (parse_entry(kcontext, filename, b->lineno + (int)i, b->lines[i],
+			&b->ents[i]) == 0)
+	    b->parsed[i] = 1;
+	else
+	    b->errors++;
+	load_batch_free_line(b, i);
+    }
+}
+
+static krb5_error_code
+load_batch_store(HDB *db, struct load_batch *b, unsigned long *count)
+{
+    krb5_error_code ret = 0;
+    int txn = 0;
+    size_t i;
+
+    if ((db->hdb_capability_flags & HDB_CAP_F_TRANSACTIONS) &&
+	db->hdb_begin_txn(context, db) == 0)
+	txn = 1;
+
+    for (i = 0; i < b->n && ret == 0; i++) {
+	if (!b->parsed[i])
+	    continue;
+	ret = db->hdb_store(context, db, HDB_F_REPLACE, &b->ents[i]);
+	if (ret)
+	    krb5_warn(context, ret, "db_store");
+	else
+	    (*count)++;
+    }
+
+    if (txn) {
+	if (ret == 0) {
+	    ret = db->hdb_end_txn(context, db, 1);
+	    if (ret)
+		krb5_warn(context, ret, "hdb_end_txn");
+	} else
+	    (void) db->hdb_end_txn(context, db, 0);
+    }
+    return ret;
+}
+
 /*
  * Parse the dump file in `filename' and create the database (merging
  * iff merge)
  */
 
 static int
-doit(const char *filename, int mergep)
+doit(const char *filename, int mergep, int nthreads, int verbose)
 {
     krb5_error_code ret = 0;
     krb5_error_code ret2 = 0;
@@ -414,11 +644,13 @@ doit(const char *filename, int mergep)
     char *line = NULL;
     size_t linesz = 0;
     size_t linelen = 0;
-    char *p;
-    int lineno;
+    int lineno = 1;
     int flags = O_RDWR;
-    struct entry e;
-    hdb_entry_ex ent;
+    int eof = 0;
+    unsigned long count = 0;
+    struct load_batch *b;
+    struct pipeline *pipeline;
+    struct timeval start;
     HDB *db = _kadm5_s_get_db(kadm_handle);
 
     f = fopen(filename, "r");
@@ -445,168 +677,75 @@ doit(const char *filename, int mergep)
 	return 1;
     }
 
+    ret = pipeline_create(context, nthreads, load_batch_parse,
+			  (void *)(uintptr_t)filename, &pipeline);
+    if (ret) {
+	(void) kadm5_log_end(kadm_handle);
+	fclose(f);
+	krb5_warn(context, ret, "%s", filename);
+	return 1;
+    }
+
     if (!mergep)
 	flags |= O_CREAT | O_TRUNC;
     ret = db->hdb_open(context, db, flags, 0600);
     if (ret){
 	krb5_warn(context, ret, "hdb_open");
+	pipeline_destroy(pipeline);
+	(void) kadm5_log_end(kadm_handle);
 	fclose(f);
 	return 1;
     }
     (void) db->hdb_set_sync(context, db, 0);
-    for (lineno = 1;
-         (ret2 = my_fgetln(f, &line, &linesz, &linelen)) == 0 && linelen > 0;
-	 ++lineno) {
-	p = line;
-	while (isspace((unsigned char)*p))
-	    p++;
+    gettimeofday(&start, NULL);
 
-	e.principal = p;
-	for (p = line; *p; p++){
-	    if (*p == '\\') /* Support '\n' escapes??? */
-		p++;
-	    else if (isspace((unsigned char)*p)) {
-		*p = 0;
+    while (!eof || pipeline_pending(pipeline)) {
+	if (!eof && !pipeline_full(pipeline)) {
+	    b = calloc(1, sizeof(*b));
+	    if (b == NULL) {
+		ret2 = krb5_enomem(context);
 		break;
 	    }
-	}
-	p = skip_next(p);
-
-	e.key = p;
-	p = skip_next(p);
-
-	e.created = p;
-	p = skip_next(p);
-
-	e.modified = p;
-	p = skip_next(p);
-
-	e.valid_start = p;
-	p = skip_next(p);
-
-	e.valid_end = p;
-	p = skip_next(p);
-
-	e.pw_end = p;
-	p = skip_next(p);
-
-	e.max_life = p;
-	p = skip_next(p);
-
-	e.max_renew = p;
-	p = skip_next(p);
-
-	e.flags = p;
-	p = skip_next(p);
-
-	e.generation = p;
-	p = skip_next(p);
-
-	e.extensions = p;
-	skip_next(p);
-
-	memset(&ent, 0, sizeof(ent));
-	ret2 = krb5_parse_name(context, e.principal, &ent.entry.principal);
-	if (ret2) {
-	    const char *msg = krb5_get_error_message(context, ret);
-	    fprintf(stderr, "%s:%d:%s (%s)\n",
-		    filename, lineno, msg, e.principal);
-	    krb5_free_error_message(context, msg);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_keys(&ent.entry, e.key)) {
-	    fprintf (stderr, "%s:%d:error parsing keys (%s)\n",
-		     filename, lineno, e.key);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_event(&ent.entry.created_by, e.created) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing created event (%s)\n",
-		     filename, lineno, e.created);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_event_alloc (&ent.entry.modified_by, e.modified) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing event (%s)\n",
-		     filename, lineno, e.modified);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.valid_start, e.valid_start) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.valid_start);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.valid_end,   e.valid_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.valid_end);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.pw_end,      e.pw_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.pw_end);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_integer_alloc (&ent.entry.max_life,  e.max_life) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, lineno, e.max_life);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-
-	}
-	if (parse_integer_alloc (&ent.entry.max_renew, e.max_renew) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, lineno, e.max_renew);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_hdbflags2int (&ent.entry.flags, e.flags) != 1) {
-	    fprintf (stderr, "%s:%d:error parsing flags (%s)\n",
-		     filename, lineno, e.flags);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if(parse_generation(e.generation, &ent.entry.generation) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing generation (%s)\n",
-		     filename, lineno, e.generation);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_extensions(&e.extensions, &ent.entry.extensions) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing extension (%s)\n",
-		     filename, lineno, e.extensions);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
+	    b->lineno = lineno;
+	    while (b->n < LOAD_BATCH_LINES) {
+		ret2 = my_fgetln(f, &line, &linesz, &linelen);
+		if (ret2 || linelen == 0) {
+		    eof = 1;
+		    break;
+		}
+		if ((b->lines[b->n] = strdup(line)) == NULL) {
+		    ret2 = krb5_enomem(context);
+		    eof = 1;
+		    break;
+		}
+		b->lens[b->n] = strlen(line);
+		b->n++;
+		lineno++;
+	    }
+	    if (ret2 || b->n == 0) {
+		load_batch_free(context, b);
+		if (ret2)
+		    break;
+		continue;
+	    }
+	    pipeline_put(pipeline, b);
 	    continue;
 	}
 
-	ret2 = db->hdb_store(context, db, HDB_F_REPLACE, &ent);
-	hdb_free_entry (context, &ent);
-	if (ret2) {
-	    krb5_warn(context, ret2, "db_store");
+	b = pipeline_get(pipeline);
+	if (b->errors)
+	    ret = 1;
+	ret2 = load_batch_store(db, b, &count);
+	load_batch_free(context, b);
+	if (ret2)
 	    break;
-	}
     }
+    /* After an error, wait for and discard what's still in flight */
+    while ((b = pipeline_get(pipeline)) != NULL)
+	load_batch_free(context, b);
+    pipeline_destroy(pipeline);
+    if (line)
+	memset_s(line, linesz, 0, linesz);
     free(line);
     if (ret2)
         ret = ret2;
@@ -615,6 +754,8 @@ doit(const char *filename, int mergep)
         krb5_err(context, 1, ret2, "failed to sync the HDB");
         ret = ret2;
     }
+    if (ret == 0 && verbose)
+	pipeline_report(mergep ? "merged" : "loaded", count, &start);
     (void) kadm5_log_end(kadm_handle);
     ret2 = db->hdb_close(context, db);
     if (ret2)
@@ -627,24 +768,29 @@ doit(const char *filename, int mergep)
 extern int local_flag;
 
 static int
-loadit(int mergep, const char *name, int argc, char **argv)
+loadit(int mergep, const char *name, int nthreads, int verbose,
+       int argc, char **argv)
 {
     if(!local_flag) {
 	krb5_warnx(context, "%s is only available in local (-l) mode", name);
 	return 0;
     }
 
-    return doit(argv[0], mergep);
+    if (nthreads < 0)
+	nthreads = pipeline_default_threads();
+    return doit(argv[0], mergep, nthreads, verbose);
 }
 
 int
-load(void *opt, int argc, char **argv)
+load(struct load_options *opt, int argc, char **argv)
 {
-    return loadit(0, "load", argc, argv);
+    return loadit(0, "load", opt->threads_integer, opt->verbose_flag,
+		  argc, argv);
 }
 
 int
-merge(void *opt, int argc, char **argv)
+merge(struct merge_options *opt, int argc, char **argv)
 {
-    return loadit(1, "merge", argc, argv);
+    return loadit(1, "merge", opt->threads_integer, opt->verbose_flag,
+		  argc, argv);
 }
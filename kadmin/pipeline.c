@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kadmin_locl.h"
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define PIPELINE_THREADS 1
+#endif
+
+/*
+ * pipeline.c - fan batches of work (parsing a dump, formatting entries)
+ * out to worker threads for dump and load.
+ *
+ * The main thread puts batches in with pipeline_put() and takes them
+ * back out, in the same order, with pipeline_get(); it keeps all HDB
+ * access to itself.  Each worker thread has its own krb5_context.
+ * Without thread support, or with no threads, pipeline_put() does the
+ * work right away.
+ */
+
+#define PIPELINE_MAX_THREADS 64
+
+struct pipeline_slot {
+    void *batch;
+    int done;
+};
+
+struct pipeline {
+    pipeline_work_func work;
+    void *arg;
+    unsigned long next_in;		/* sequence number of the next put */
+    unsigned long next_out;		/* ... and of the next get */
+    size_t nslots;			/* bound on batches in flight */
+    struct pipeline_slot *slots;	/* indexed by seq % nslots */
+#ifdef PIPELINE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;		/* for workers: batches to do */
+    pthread_cond_t done_cv;		/* for the main thread: batches done */
+    unsigned long next_work;		/* next batch to hand to a worker */
+    int shutdown;
+    int nthreads;
+    pthread_t *threads;
+    krb5_context *contexts;
+#endif
+};
+
+#ifdef PIPELINE_THREADS
+
+static void *
+pipeline_thread(void *arg)
+{
+    struct pipeline *p = arg;
+    krb5_context tcontext = NULL;
+    struct pipeline_slot *slot;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < p->nthreads; i++) {
+	if (pthread_equal(p->threads[i], pthread_self()))
+	    tcontext = p->contexts[i];
+    }
+    for (;;) {
+	while (p->next_work == p->next_in && !p->shutdown)
+	    pthread_cond_wait(&p->work_cv, &p->lock);
+	if (p->next_work == p->next_in)
+	    break;
+	slot = &p->slots[p->next_work++ % p->nslots];
+	pthread_mutex_unlock(&p->lock);
+
+	(*p->work)(tcontext, slot->batch, p->arg);
+
+	pthread_mutex_lock(&p->lock);
+	slot->done = 1;
+	pthread_cond_signal(&p->done_cv);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+#endif
+
+/*
+ * Number of worker threads to use by default: one per CPU
+ */
+
+int
+pipeline_default_threads(void)
+{
+#if defined(PIPELINE_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 1)
+	return n > PIPELINE_MAX_THREADS ? PIPELINE_MAX_THREADS : (int)n;
+#endif
+    return 0;
+}
+
+krb5_error_code
+pipeline_create(krb5_context kcontext, int nthreads,
+		pipeline_work_func work, void *arg, struct pipeline **pp)
+{
+    struct pipeline *p;
+
+    *pp = NULL;
+#ifndef PIPELINE_THREADS
+    nthreads = 0;
+#endif
+    if (nthreads < 0)
+	nthreads = 0;
+    if (nthreads > PIPELINE_MAX_THREADS)
+	nthreads = PIPELINE_MAX_THREADS;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+	return krb5_enomem(kcontext);
+    p->work = work;
+    p->arg = arg;
+    /* Enough batches in flight to keep the workers and us busy */
+    p->nslots = nthreads ? 4 * nthreads : 1;
+    p->slots = calloc(p->nslots, sizeof(p->slots[0]));
+    if (p->slots == NULL) {
+	free(p);
+	return krb5_enomem(kcontext);
+    }
+
+#ifdef PIPELINE_THREADS
+    if (nthreads > 0) {
+	krb5_error_code ret = 0;
+	int i;
+
+	p->threads = calloc(nthreads, sizeof(p->threads[0]));
+	p->contexts = calloc(nthreads, sizeof(p->contexts[0]));
+	if (p->threads == NULL || p->contexts == NULL) {
+	    free(p->threads);
+	    free(p->contexts);
+	    free(p->slots);
+	    free(p);
+	    return krb5_enomem(kcontext);
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work_cv, NULL);
+	pthread_cond_init(&p->done_cv, NULL);
+
+	/* Hold the lock so threads find their contexts set up */
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < nthreads; i++) {
+	    ret = krb5_copy_context(kcontext, &p->contexts[i]);
+	    if (ret)
+		break;
+	    ret = pthread_create(&p->threads[i], NULL, pipeline_thread, p);
+	    if (ret) {
+		krb5_free_context(p->contexts[i]);
+		break;
+	    }
+	    p->nthreads++;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (ret)
+	    krb5_warn(kcontext, ret, "could only start %d of %d threads",
+		      p->nthreads, nthreads);
+	if (p->nthreads == 0) {
+	    pipeline_destroy(p);
+	    return ret;
+	}
+    }
+#endif
+
+    *pp = p;
+    return 0;
+}
+
+/*
+ * Number of batches put in but not yet taken out
+ */
+
+size_t
+pipeline_pending(struct pipeline *p)
+{
+    return p->next_in - p->next_out;
+}
+
+/*
+ * Returns non-zero if the caller must pipeline_get() a batch before it
+ * can pipeline_put() another
+ */
+
+int
+pipeline_full(struct pipeline *p)
+{
+    return p->next_in - p->next_out >= p->nslots;
+}
+
+void
+pipeline_put(struct pipeline *p, void *batch)
+{
+    struct pipeline_slot *slot;
+
+    heim_assert(!pipeline_full(p), "pipeline_put() on full pipeline");
+
+#ifdef PIPELINE_THREADS
+    if (p->nthreads > 0) {
+	pthread_mutex_lock(&p->lock);
+	slot = &p->slots[p->next_in++ % p->nslots];
+	slot->batch = batch;
+	slot->done = 0;
+	pthread_cond_signal(&p->work_cv);
+	pthread_mutex_unlock(&p->lock);
+	return;
+    }
+#endif
+
+    slot = &p->slots[p->next_in++ % p->nslots];
+    slot->batch = batch;
+    (*p->work)(context, batch, p->arg);
+    slot->done = 1;
+}
+
+/*
+ * Take out the oldest batch put in, waiting for it to be done.  Returns
+ * NULL if there are none in flight.
+ */
+
+void *
+pipeline_get(struct pipeline *p)
+{
+    struct pipeline_slot *slot;
+    void *batch;
+
+    if (p->next_out == p->next_in)
+	return NULL;
+    slot = &p->slots[p->next_out % p->nslots];
+
+#ifdef PIPELINE_THREADS
+    if (p->nthreads > 0) {
+	pthread_mutex_lock(&p->lock);
+	while (!slot->done)
+	    pthread_cond_wait(&p->done_cv, &p->lock);
+	batch = slot->batch;
+	slot->batch = NULL;
+	p->next_out++;
+	pthread_mutex_unlock(&p->lock);
+	return batch;
+    }
+#endif
+
+    batch = slot->batch;
+    slot->batch = NULL;
+    p->next_out++;
+    return batch;
+}
+
+/*
+ * Stop the workers.  Batches still in flight must be taken out with
+ * pipeline_get() first.
+ */
+
+void
+pipeline_destroy(struct pipeline *p)
+{
+    if (p == NULL)
+	return;
+
+#ifdef PIPELINE_THREADS
+    if (p->threads != NULL) {
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->work_cv);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < p->nthreads; i++) {
+	    pthread_join(p->threads[i], NULL);
+	    krb5_free_context(p->contexts[i]);
+	}
+	pthread_cond_destroy(&p->done_cv);
+	pthread_cond_destroy(&p->work_cv);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p->contexts);
+    }
+#endif
+    free(p->slots);
+    free(p);
+}
+
+/*
+ * For --verbose: how long a dump or load took
+ */
+
+void
+pipeline_report(const char *what, unsigned long count,
+		const struct timeval *start)
+{
+    struct timeval now;
+    double secs;
+
+    gettimeofday(&now, NULL);
+    secs = (now.tv_sec - start->tv_sec) +
+	(now.tv_usec - start->tv_usec) / 1000000.0;
+    fprintf(stderr, "%s %lu entries in %.2f seconds", what, count, secs);
+    if (secs > 0)
+	fprintf(stderr, " (%.0f entries/s)", count / secs);
+    fprintf(stderr, "\n");
+}
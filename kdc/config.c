@@ -65,6 +65,22 @@ const char *request_log;
 /* A string describing on what ports to listen */
 const char *port_str;
 
+/* Readiness notification backend for the worker loop (NULL = best) */
+const char *io_backend;
+
+/* Should each worker process open its own SO_REUSEPORT sockets? */
+int reuseport = -1;
+
+/* Should worker processes be pinned to a CPU each? */
+int worker_cpu_affinity = -1;
+
+/* Number of request threads per worker process (0 = none) */
+int num_kdc_threads = -1;
+
+/* Where to serve metrics: a Unix socket and/or a loopback TCP port */
+const char *metrics_socket;
+int metrics_port = -1;
+
 krb5_addresses explicit_addresses;
 
 size_t max_request_udp;
@@ -266,6 +282,30 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 	enable_http = krb5_config_get_bool(context, NULL, "kdc",
 					   "enable-http", NULL);
 
+    if(io_backend == NULL)
+	io_backend = krb5_config_get_string(context, NULL, "kdc",
+					    "io-backend", NULL);
+
+    if(reuseport == -1)
+	reuseport = krb5_config_get_bool(context, NULL, "kdc",
+					 "reuseport", NULL);
+
+    if(worker_cpu_affinity == -1)
+	worker_cpu_affinity = krb5_config_get_bool(context, NULL, "kdc",
+						   "worker-cpu-affinity", NULL);
+
+    if(num_kdc_threads == -1)
+	num_kdc_threads = krb5_config_get_int_default(context, NULL, 0, "kdc",
+						      "num-kdc-threads", NULL);
+
+    if(metrics_socket == NULL)
+	metrics_socket = krb5_config_get_string(context, NULL, "kdc",
+						"metrics-socket", NULL);
+
+    if(metrics_port == -1)
+	metrics_port = krb5_config_get_int_default(context, NULL, 0, "kdc",
+						   "metrics-port", NULL);
+
     if(request_log == NULL)
 	request_log = krb5_config_get_string(context, NULL,
 					     "kdc",
@@ -33,6 +33,11 @@
 
 #include "kdc_locl.h"
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define KDC_THREADS 1
+#endif
+
 /*
  * a tuple describing on what to listen
  */
@@ -199,6 +204,7 @@ struct descr {
     size_t size;
     size_t len;
     time_t timeout;
+    int tprev, tnext;	/* timeout queue, or free list (tnext only) */
     struct sockaddr_storage __ss;
     struct sockaddr *sa;
     socklen_t sock_len;
@@ -211,6 +217,7 @@ init_descr(struct descr *d)
     memset(d, 0, sizeof(*d));
     d->sa = (struct sockaddr *)&d->__ss;
     d->s = rk_INVALID_SOCKET;
+    d->tprev = d->tnext = -1;
 }
 
 /*
@@ -265,6 +272,14 @@ init_socket(krb5_context context,
 	int one = 1;
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
+#endif
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_REUSEPORT)
+    if (reuseport > 0) {
+	int one = 1;
+	if (setsockopt(d->s, SOL_SOCKET, SO_REUSEPORT,
+		       (void *)&one, sizeof(one)) < 0)
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+    }
 #endif
     d->type = type;
     d->port = port;
@@ -417,160 +432,1015 @@ send_reply(krb5_context context,
 }
 
 /*
- * Handle the request in `buf, len' to socket `d'
+ * Process the request in `buf, len' from socket `d' and return the
+ * reply, if any, in `reply'
  */
 
 static void
-do_request(krb5_context context,
-	   krb5_kdc_configuration *config,
-	   void *buf, size_t len, krb5_boolean prependlength,
-	   struct descr *d)
+process_request(krb5_context context,
+		krb5_kdc_configuration *config,
+		void *buf, size_t len, krb5_boolean *prependlength,
+		struct descr *d, krb5_data *reply)
 {
     krb5_error_code ret;
-    krb5_data reply;
     int datagram_reply = (d->type == SOCK_DGRAM);
 
     krb5_kdc_update_time(NULL);
 
-    krb5_data_zero(&reply);
+    krb5_data_zero(reply);
     ret = krb5_kdc_process_request(context, config,
-				   buf, len, &reply, &prependlength,
+				   buf, len, reply, prependlength,
 				   d->addr_string, d->sa,
 				   datagram_reply);
     if(request_log)
-	krb5_kdc_save_request(context, request_log, buf, len, &reply, d->sa);
+	krb5_kdc_save_request(context, request_log, buf, len, reply, d->sa);
+    if(ret)
+	kdc_log(context, config, 1,
+		"Failed processing %lu byte request from %s",
+		(unsigned long)len, d->addr_string);
+}
+
+/*
+ * Handle the request in `buf, len' to socket `d'
+ */
+
+static void
+do_request(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   void *buf, size_t len, krb5_boolean prependlength,
+	   struct descr *d)
+{
+    krb5_data reply;
+
+    process_request(context, config, buf, len, &prependlength, d, &reply);
     if(reply.length){
 	send_reply(context, config, prependlength, d, &reply);
 	krb5_data_free(&reply);
     }
-    if(ret)
+}
+
+#ifdef KDC_THREADS
+
+/*
+ * Threaded request processing.  With [kdc] num-kdc-threads set, each
+ * worker process keeps a single I/O thread running loop() and hands
+ * complete requests to a pool of request threads.  Every request thread
+ * has its own krb5_context and its own HDB handles, since neither is
+ * safe to share between threads; the rest of the configuration is
+ * shared read-only.
+ *
+ * A job carries a private copy of the descriptor.  For TCP the job owns
+ * the connection and closes it once the reply has been sent; for UDP
+ * the reply is sent on the shared listening socket.
+ */
+
+#define KDC_QUEUE_MAX 4096
+
+struct kdc_job {
+    struct kdc_job *next;
+    krb5_boolean prependlength;
+    struct descr d;
+};
+
+struct kdc_pool;
+
+struct kdc_pool_thread {
+    struct kdc_pool *pool;
+    pthread_t thread;
+    krb5_context context;
+    krb5_kdc_configuration config;
+    unsigned long cache_hits;		/* published under the pool lock */
+    unsigned long cache_misses;
+};
+
+struct kdc_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    struct kdc_job *head;
+    struct kdc_job **tail;
+    size_t queued;
+    int shutdown;
+    int nthreads;
+    struct kdc_pool_thread *threads;
+    struct kdc_metrics *metrics;	/* the worker's, for the queue depth */
+};
+
+static struct kdc_pool *pool;
+
+static void
+run_job(krb5_context context,
+	krb5_kdc_configuration *config,
+	struct kdc_job *job)
+{
+    krb5_data reply;
+
+    process_request(context, config, job->d.buf, job->d.len,
+		    &job->prependlength, &job->d, &reply);
+    if (reply.length) {
+	send_reply(context, config, job->prependlength, &job->d, &reply);
+	krb5_data_free(&reply);
+    }
+    if (job->d.type == SOCK_STREAM)
+	rk_closesocket(job->d.s);
+    free(job);
+}
+
+static void *
+pool_thread(void *arg)
+{
+    struct kdc_pool_thread *t = arg;
+    struct kdc_pool *p = t->pool;
+    unsigned long hits = 0, misses = 0;
+
+    for (;;) {
+	struct kdc_job *job;
+
+	pthread_mutex_lock(&p->lock);
+	/*
+	 * Our config and its entry cache are ours alone; the main
+	 * thread only sees the counters we copy out here.
+	 */
+	t->cache_hits = hits;
+	t->cache_misses = misses;
+	while (p->head == NULL && !p->shutdown)
+	    pthread_cond_wait(&p->cv, &p->lock);
+	job = p->head;
+	if (job == NULL) {
+	    pthread_mutex_unlock(&p->lock);
+	    break;
+	}
+	p->head = job->next;
+	if (p->head == NULL)
+	    p->tail = &p->head;
+	p->queued--;
+	if (p->metrics)
+	    p->metrics->queued = p->queued;
+	pthread_mutex_unlock(&p->lock);
+
+	run_job(t->context, &t->config, job);
+	krb5_kdc_get_entry_cache_stats(&t->config, &hits, &misses);
+    }
+    return NULL;
+}
+
+/*
+ * Give request thread `t' its own context and database handles
+ */
+
+static krb5_error_code
+pool_thread_init(krb5_context context,
+		 krb5_kdc_configuration *config,
+		 struct kdc_pool_thread *t)
+{
+    krb5_error_code ret;
+
+    ret = krb5_copy_context(context, &t->context);
+    if (ret)
+	return ret;
+
+    t->config = *config;
+    t->config.db = NULL;
+    t->config.num_db = 0;
+    t->config.db_state = NULL;
+    ret = krb5_kdc_set_dbinfo(t->context, &t->config);
+    if (ret) {
+	krb5_free_context(t->context);
+	t->context = NULL;
+    }
+    return ret;
+}
+
+static void
+pool_thread_free(struct kdc_pool_thread *t)
+{
+    krb5_kdc_free_dbinfo(t->context, &t->config);
+    krb5_free_context(t->context);
+}
+
+static void
+pool_start(krb5_context context, krb5_kdc_configuration *config)
+{
+    krb5_error_code ret;
+    struct kdc_pool *p;
+    int i;
+
+    if (num_kdc_threads <= 0)
+	return;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL ||
+	(p->threads = calloc(num_kdc_threads, sizeof(p->threads[0]))) == NULL)
+	krb5_errx(context, 1, "out of memory");
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cv, NULL);
+    p->tail = &p->head;
+    p->metrics = config->metrics;
+
+    for (i = 0; i < num_kdc_threads; i++) {
+	struct kdc_pool_thread *t = &p->threads[i];
+
+	t->pool = p;
+	ret = pool_thread_init(context, config, t);
+	if (ret)
+	    krb5_err(context, 1, ret, "could not set up request thread");
+	if (config->metrics)
+	    t->config.metrics = config->metrics + 1 + i;
+	if (pthread_create(&t->thread, NULL, pool_thread, t) != 0) {
+	    krb5_warn(context, errno, "pthread_create");
+	    pool_thread_free(t);
+	    break;
+	}
+    }
+    p->nthreads = i;
+    if (p->nthreads == 0) {
+	pthread_cond_destroy(&p->cv);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p);
+	return;
+    }
+    kdc_log(context, config, 3, "KDC worker %d started %d request threads",
+	    (int)getpid(), p->nthreads);
+    pool = p;
+}
+
+static void
+pool_stop(void)
+{
+    struct kdc_pool *p = pool;
+    int i;
+
+    if (p == NULL)
+	return;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->cv);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nthreads; i++) {
+	pthread_join(p->threads[i].thread, NULL);
+	pool_thread_free(&p->threads[i]);
+    }
+
+    pool = NULL;
+    pthread_cond_destroy(&p->cv);
+    pthread_mutex_destroy(&p->lock);
+    free(p->threads);
+    free(p);
+}
+
+/*
+ * Add the entry cache counters of the request threads to `hits, misses'
+ */
+
+static void
+pool_entry_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    int i;
+
+    if (pool == NULL)
+	return;
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+	*hits += pool->threads[i].cache_hits;
+	*misses += pool->threads[i].cache_misses;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Hand the request in `buf, len' from `d' to the request threads.
+ * For TCP the job takes over the connection and `d->s' is invalidated.
+ * Returns FALSE if the request should be processed inline instead.
+ */
+
+static krb5_boolean
+pool_submit(struct descr *d, void *buf, size_t len, krb5_boolean prependlength)
+{
+    struct kdc_job *job;
+
+    if (pool == NULL)
+	return FALSE;
+
+    job = malloc(sizeof(*job) + len);
+    if (job == NULL)
+	return FALSE;
+    job->next = NULL;
+    job->prependlength = prependlength;
+    job->d = *d;
+    job->d.sa = (struct sockaddr *)&job->d.__ss;
+    job->d.buf = (unsigned char *)(job + 1);
+    job->d.size = job->d.len = len;
+    memcpy(job->d.buf, buf, len);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queued >= KDC_QUEUE_MAX) {
+	pthread_mutex_unlock(&pool->lock);
+	free(job);
+	return FALSE;
+    }
+    if (d->type == SOCK_STREAM)
+	d->s = rk_INVALID_SOCKET;
+    *pool->tail = job;
+    pool->tail = &job->next;
+    pool->queued++;
+    if (pool->metrics)
+	pool->metrics->queued = pool->queued;
+    pthread_cond_signal(&pool->cv);
+    pthread_mutex_unlock(&pool->lock);
+    return TRUE;
+}
+
+#else
+
+static void
+pool_start(krb5_context context, krb5_kdc_configuration *config)
+{
+    if (num_kdc_threads > 0)
 	kdc_log(context, config, 1,
-		"Failed processing %lu byte request from %s",
-		(unsigned long)len, d->addr_string);
+		"num-kdc-threads is not supported, built without threads");
+}
+
+static void pool_stop(void) { }
+
+static void
+pool_entry_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+}
+
+static krb5_boolean
+pool_submit(struct descr *d, void *buf, size_t len, krb5_boolean prependlength)
+{
+    return FALSE;
+}
+
+#endif /* KDC_THREADS */
+
+/*
+ * Datagrams are received, processed and answered in batches of up to
+ * UDP_BATCH per wakeup, with recvmmsg()/sendmmsg() where available.
+ * The receive buffers are allocated once per process and reused.
+ */
+
+#define UDP_BATCH 16
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define USE_MMSG 1
+#endif
+
+struct udp_batch {
+    unsigned char *buf;		/* UDP_BATCH buffers of max_request_udp */
+    size_t len[UDP_BATCH];
+    struct sockaddr_storage ss[UDP_BATCH];
+    socklen_t ss_len[UDP_BATCH];
+    krb5_data reply[UDP_BATCH];
+#ifdef USE_MMSG
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+#endif
+};
+
+static struct udp_batch *udp_batch;
+
+static struct udp_batch *
+get_udp_batch(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct udp_batch *b;
+
+    if (udp_batch != NULL)
+	return udp_batch;
+
+    b = calloc(1, sizeof(*b));
+    if (b != NULL)
+	b->buf = malloc(UDP_BATCH * max_request_udp);
+    if (b == NULL || b->buf == NULL) {
+	kdc_log(context, config, 1, "Failed to allocate %lu bytes",
+		(unsigned long)(UDP_BATCH * max_request_udp));
+	free(b);
+	return NULL;
+    }
+    udp_batch = b;
+    return b;
 }
 
 /*
- * Handle incoming data to the UDP socket in `d'
+ * Read up to UDP_BATCH datagrams from `d' into `b' and return how
+ * many were read
  */
 
+static int
+udp_batch_recv(krb5_context context, struct descr *d, struct udp_batch *b)
+{
+    int n;
+#ifdef USE_MMSG
+    int i;
+
+    memset(b->msgs, 0, sizeof(b->msgs));
+    for (i = 0; i < UDP_BATCH; i++) {
+	b->iov[i].iov_base = b->buf + i * max_request_udp;
+	b->iov[i].iov_len = max_request_udp;
+	b->msgs[i].msg_hdr.msg_name = &b->ss[i];
+	b->msgs[i].msg_hdr.msg_namelen = sizeof(b->ss[i]);
+	b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(d->s, b->msgs, UDP_BATCH, 0, NULL);
+    if (n == -1) {
+	if (errno != EAGAIN && errno != EINTR)
+	    krb5_warn(context, errno, "recvmmsg");
+	return 0;
+    }
+    for (i = 0; i < n; i++) {
+	b->len[i] = b->msgs[i].msg_len;
+	b->ss_len[i] = b->msgs[i].msg_hdr.msg_namelen;
+    }
+#else
+    for (n = 0; n < UDP_BATCH; n++) {
+	ssize_t len;
+
+	b->ss_len[n] = sizeof(b->ss[n]);
+	len = recvfrom(d->s, b->buf + n * max_request_udp, max_request_udp, 0,
+		       (struct sockaddr *)&b->ss[n], &b->ss_len[n]);
+	if (rk_IS_SOCKET_ERROR(len)) {
+	    /* the socket is non-blocking, so running dry ends the batch */
+	    if (n == 0 && rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
+		krb5_warn(context, rk_SOCK_ERRNO, "recvfrom");
+	    break;
+	}
+	b->len[n] = len;
+    }
+#endif
+    return n;
+}
+
+/*
+ * Send the replies to the first `n' datagrams in `b' and free them
+ */
+
+static void
+udp_batch_send(krb5_context context,
+	       krb5_kdc_configuration *config,
+	       struct descr *d, struct udp_batch *b, int n)
+{
+    int i;
+#ifdef USE_MMSG
+    int m = 0, sent = 0;
+
+    for (i = 0; i < n; i++) {
+	if (b->reply[i].length == 0)
+	    continue;
+	b->iov[m].iov_base = b->reply[i].data;
+	b->iov[m].iov_len = b->reply[i].length;
+	memset(&b->msgs[m], 0, sizeof(b->msgs[m]));
+	b->msgs[m].msg_hdr.msg_name = &b->ss[i];
+	b->msgs[m].msg_hdr.msg_namelen = b->ss_len[i];
+	b->msgs[m].msg_hdr.msg_iov = &b->iov[m];
+	b->msgs[m].msg_hdr.msg_iovlen = 1;
+	m++;
+    }
+    while (sent < m) {
+	int ret = sendmmsg(d->s, b->msgs + sent, m - sent, 0);
+
+	if (ret == -1) {
+	    if (errno == EINTR)
+		continue;
+	    kdc_log(context, config, 1, "sendmmsg(%d replies): %s",
+		    m - sent, strerror(errno));
+	    break;
+	}
+	sent += ret;
+    }
+#else
+    for (i = 0; i < n; i++) {
+	if (b->reply[i].length == 0)
+	    continue;
+	if (rk_IS_SOCKET_ERROR(sendto(d->s, b->reply[i].data,
+				      b->reply[i].length, 0,
+				      (struct sockaddr *)&b->ss[i],
+				      b->ss_len[i])))
+	    kdc_log(context, config, 1, "sendto: %s",
+		    strerror(rk_SOCK_ERRNO));
+    }
+#endif
+    for (i = 0; i < n; i++)
+	krb5_data_free(&b->reply[i]);
+}
+
+/*
+ * Handle incoming data to the UDP socket in `d' and return the number
+ * of datagrams processed
+ */
+
+static int
+handle_udp(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   struct descr *d)
+{
+    struct udp_batch *b;
+    int i, n;
+
+    b = get_udp_batch(context, config);
+    if (b == NULL)
+	return 0;
+
+    n = udp_batch_recv(context, d, b);
+    for (i = 0; i < n; i++) {
+	krb5_boolean prependlength = FALSE;
+
+	memcpy(&d->__ss, &b->ss[i], b->ss_len[i]);
+	d->sock_len = b->ss_len[i];
+	addr_to_string (context, d->sa, d->sock_len,
+			d->addr_string, sizeof(d->addr_string));
+	krb5_data_zero(&b->reply[i]);
+	if (b->len[i] == max_request_udp) {
+	    krb5_warnx(context,
+		       "recvfrom: truncated packet from %s, asking for TCP",
+		       d->addr_string);
+	    krb5_mk_error(context,
+			  KRB5KRB_ERR_RESPONSE_TOO_BIG,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  &b->reply[i]);
+	} else if (!pool_submit(d, b->buf + i * max_request_udp,
+			       b->len[i], FALSE)) {
+	    process_request(context, config, b->buf + i * max_request_udp,
+			    b->len[i], &prependlength, d, &b->reply[i]);
+	}
+	if (b->reply[i].length)
+	    kdc_log(context, config, 4, "sending %lu bytes to %s",
+		    (unsigned long)b->reply[i].length, d->addr_string);
+    }
+    if (n > 0)
+	udp_batch_send(context, config, d, b, n);
+    return n;
+}
+
+static void
+clear_descr(struct descr *d)
+{
+    if(d->buf)
+	memset(d->buf, 0, d->size);
+    d->len = 0;
+    if(d->s != rk_INVALID_SOCKET)
+	rk_closesocket(d->s);
+    d->s = rk_INVALID_SOCKET;
+}
+
+
+/* remove HTTP %-quoting from buf */
+static int
+de_http(char *buf)
+{
+    unsigned char *p, *q;
+    unsigned int x;
+
+    for (p = q = (unsigned char *)buf; *p; p++, q++) {
+	if (*p == '%') {
+	    if (!(isxdigit(p[1]) && isxdigit(p[2])))
+		return -1;
+
+	    if (sscanf((char *)p + 1, "%2x", &x) != 1)
+		return -1;
+
+	    *q = x;
+	    p += 2;
+	} else {
+	    *q = *p;
+	}
+    }
+    *q = '\0';
+    return 0;
+}
+
+#define TCP_TIMEOUT 4
+
+/* How often a worker logs its request counters, in seconds */
+#define WORKER_REPORT_INTERVAL 60
+
+/*
+ * Readiness notification.  Each socket is registered with the backend
+ * once, when it is created, and the worker loop then only visits the
+ * descriptors that the backend reports as readable instead of
+ * rebuilding an fd_set over every descriptor on each iteration.
+ *
+ * epoll (Linux) and kqueue (BSD) are preferred when available.  select()
+ * is kept as the portable fallback; it is the only backend that is still
+ * limited by FD_SETSIZE.  All backends are level-triggered so that a
+ * socket we did not drain completely is simply reported again.
+ */
+
+#define POLLER_ISLIVE		(-1)
+#define POLLER_MAX_EVENTS	64
+
+enum poller_type {
+    POLLER_SELECT,
+    POLLER_EPOLL,
+    POLLER_KQUEUE
+};
+
+struct poller_reg {
+    krb5_socket_t s;
+    int token;
+};
+
+struct poller {
+    enum poller_type type;
+    int fd;				/* epoll/kqueue descriptor */
+    fd_set fds;				/* select() state */
+    int max_fd;
+    struct poller_reg *regs;
+    size_t nregs;
+    size_t sregs;
+};
+
+static const char *
+poller_name(struct poller *p)
+{
+    switch (p->type) {
+    case POLLER_EPOLL:	return "epoll";
+    case POLLER_KQUEUE:	return "kqueue";
+    default:		return "select";
+    }
+}
+
+static int
+poller_init(krb5_context context,
+	    krb5_kdc_configuration *config,
+	    struct poller *p)
+{
+    const char *want = io_backend;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    FD_ZERO(&p->fds);
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+    if (want == NULL || strcmp(want, "epoll") == 0) {
+	p->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (p->fd != -1) {
+	    p->type = POLLER_EPOLL;
+	    return 0;
+	}
+	krb5_warn(context, errno, "epoll_create1");
+    }
+#endif
+#if defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+    if (want == NULL || strcmp(want, "kqueue") == 0) {
+	p->fd = kqueue();
+	if (p->fd != -1) {
+	    rk_cloexec(p->fd);
+	    p->type = POLLER_KQUEUE;
+	    return 0;
+	}
+	krb5_warn(context, errno, "kqueue");
+    }
+#endif
+    if (want != NULL && strcmp(want, "select") != 0)
+	kdc_log(context, config, 1,
+		"I/O backend %s not available, using select", want);
+    p->type = POLLER_SELECT;
+    return 0;
+}
+
+static void
+poller_free(struct poller *p)
+{
+    if (p->fd != -1)
+	close(p->fd);
+    p->fd = -1;
+    free(p->regs);
+    p->regs = NULL;
+    p->nregs = p->sregs = 0;
+}
+
+/*
+ * Register `s' for read readiness; `token' is handed back by
+ * poller_wait() when the socket becomes readable.
+ */
+
+static int
+poller_add(krb5_context context, struct poller *p, krb5_socket_t s, int token)
+{
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+    if (p->type == POLLER_EPOLL) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = (uint32_t)token;
+	if (epoll_ctl(p->fd, EPOLL_CTL_ADD, s, &ev) == -1) {
+	    krb5_warn(context, errno, "epoll_ctl");
+	    return errno;
+	}
+	return 0;
+    }
+#endif
+#if defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+    if (p->type == POLLER_KQUEUE) {
+	struct kevent ev;
+
+	EV_SET(&ev, s, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)token);
+	if (kevent(p->fd, &ev, 1, NULL, 0, NULL) == -1) {
+	    krb5_warn(context, errno, "kevent");
+	    return errno;
+	}
+	return 0;
+    }
+#endif
+
+#ifndef NO_LIMIT_FD_SETSIZE
+#ifdef FD_SETSIZE
+    if (s >= FD_SETSIZE) {
+	krb5_warnx(context, "socket FD too large");
+	return EMFILE;
+    }
+#endif
+#endif
+    if (p->nregs == p->sregs) {
+	struct poller_reg *tmp;
+	size_t n = p->sregs ? p->sregs * 2 : 16;
+
+	tmp = realloc(p->regs, n * sizeof(*tmp));
+	if (tmp == NULL) {
+	    krb5_warnx(context, "No memory");
+	    return ENOMEM;
+	}
+	p->regs = tmp;
+	p->sregs = n;
+    }
+    p->regs[p->nregs].s = s;
+    p->regs[p->nregs].token = token;
+    p->nregs++;
+    FD_SET(s, &p->fds);
+#ifndef NO_LIMIT_FD_SETSIZE
+    if (p->max_fd < (int)s)
+	p->max_fd = s;
+#endif
+    return 0;
+}
+
+/*
+ * Forget about `s'.  This may be called after `s' has been closed, in
+ * which case epoll and kqueue have already dropped it.
+ */
+
+static void
+poller_del(struct poller *p, krb5_socket_t s)
+{
+    size_t i;
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+    if (p->type == POLLER_EPOLL) {
+	struct epoll_event ev;
+
+	(void) epoll_ctl(p->fd, EPOLL_CTL_DEL, s, &ev);
+	return;
+    }
+#endif
+#if defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+    if (p->type == POLLER_KQUEUE) {
+	struct kevent ev;
+
+	EV_SET(&ev, s, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	(void) kevent(p->fd, &ev, 1, NULL, 0, NULL);
+	return;
+    }
+#endif
+
+    for (i = 0; i < p->nregs; i++) {
+	if (p->regs[i].s == s) {
+	    FD_CLR(s, &p->fds);
+	    p->regs[i] = p->regs[--p->nregs];
+	    return;
+	}
+    }
+}
+
+/*
+ * Wait at most `msec' milliseconds for readable sockets and store their
+ * tokens in `tokens'.  Returns the number of tokens, or -1 and sets
+ * errno.
+ */
+
+static int
+poller_wait(struct poller *p, int msec, int *tokens, int max_tokens)
+{
+    int i, n;
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+    if (p->type == POLLER_EPOLL) {
+	struct epoll_event ev[POLLER_MAX_EVENTS];
+
+	if (max_tokens > POLLER_MAX_EVENTS)
+	    max_tokens = POLLER_MAX_EVENTS;
+	n = epoll_wait(p->fd, ev, max_tokens, msec);
+	for (i = 0; i < n; i++)
+	    tokens[i] = (int)ev[i].data.u32;
+	return n;
+    }
+#endif
+#if defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+    if (p->type == POLLER_KQUEUE) {
+	struct kevent ev[POLLER_MAX_EVENTS];
+	struct timespec ts;
+
+	if (max_tokens > POLLER_MAX_EVENTS)
+	    max_tokens = POLLER_MAX_EVENTS;
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000;
+	n = kevent(p->fd, NULL, 0, ev, max_tokens, &ts);
+	for (i = 0; i < n; i++)
+	    tokens[i] = (int)(intptr_t)ev[i].udata;
+	return n;
+    }
+#endif
+
+    {
+	struct timeval tmout;
+	fd_set fds;
+	size_t j;
+
+	tmout.tv_sec = msec / 1000;
+	tmout.tv_usec = (msec % 1000) * 1000;
+	fds = p->fds;
+	n = select(p->max_fd + 1, &fds, NULL, NULL, &tmout);
+	if (n <= 0)
+	    return n;
+	for (i = 0, j = 0; j < p->nregs && i < max_tokens; j++)
+	    if (FD_ISSET(p->regs[j].s, &fds))
+		tokens[i++] = p->regs[j].token;
+	return i;
+    }
+}
+
+/*
+ * State of a worker's event loop.  Descriptors are referred to by their
+ * index in `*dp' since the array is reallocated as it grows.
+ *
+ * Every TCP connection gets the same TCP_TIMEOUT, so appending new
+ * connections at the tail keeps the timeout queue sorted by deadline
+ * and expiry only ever needs to look at its head.
+ *
+ * Descriptors released while handling a batch of events go on the
+ * `dead' list and are only made available for reuse once the batch is
+ * done, so a stale event from the same batch can never be mistaken for
+ * activity on a freshly accepted connection.
+ */
+
+struct kdc_loop {
+    struct descr **dp;
+    unsigned int *ndescrp;
+    struct poller p;
+    int free_head;
+    int dead_head;
+    int timer_head;
+    int timer_tail;
+    unsigned long udp_requests;	/* per-worker load counters */
+    unsigned long tcp_connections;
+};
+
+static void
+timer_append(struct kdc_loop *l, int idx)
+{
+    struct descr *d = *l->dp;
+
+    d[idx].tnext = -1;
+    d[idx].tprev = l->timer_tail;
+    if (l->timer_tail == -1)
+	l->timer_head = idx;
+    else
+	d[l->timer_tail].tnext = idx;
+    l->timer_tail = idx;
+}
+
 static void
-handle_udp(krb5_context context,
-	   krb5_kdc_configuration *config,
-	   struct descr *d)
+timer_unlink(struct kdc_loop *l, int idx)
 {
-    unsigned char *buf;
-    ssize_t n;
-
-    buf = malloc(max_request_udp);
-    if (buf == NULL){
-	kdc_log(context, config, 1, "Failed to allocate %lu bytes",
-	        (unsigned long)max_request_udp);
-	return;
-    }
+    struct descr *d = *l->dp;
 
-    d->sock_len = sizeof(d->__ss);
-    n = recvfrom(d->s, buf, max_request_udp, 0, d->sa, &d->sock_len);
-    if (rk_IS_SOCKET_ERROR(n)) {
-	if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
-	    krb5_warn(context, rk_SOCK_ERRNO, "recvfrom");
-    } else {
-	addr_to_string (context, d->sa, d->sock_len,
-			d->addr_string, sizeof(d->addr_string));
-	if ((size_t)n == max_request_udp) {
-	    krb5_data data;
-	    krb5_warn(context, errno,
-		      "recvfrom: truncated packet from %s, asking for TCP",
-		      d->addr_string);
-	    krb5_mk_error(context,
-			  KRB5KRB_ERR_RESPONSE_TOO_BIG,
-			  NULL,
-			  NULL,
-			  NULL,
-			  NULL,
-			  NULL,
-			  NULL,
-			  &data);
-	    send_reply(context, config, FALSE, d, &data);
-	    krb5_data_free(&data);
-	} else {
-	    do_request(context, config, buf, n, FALSE, d);
-	}
-    }
-    free (buf);
+    if (d[idx].tprev == -1)
+	l->timer_head = d[idx].tnext;
+    else
+	d[d[idx].tprev].tnext = d[idx].tnext;
+    if (d[idx].tnext == -1)
+	l->timer_tail = d[idx].tprev;
+    else
+	d[d[idx].tnext].tprev = d[idx].tprev;
+    d[idx].tprev = d[idx].tnext = -1;
 }
 
-static void
-clear_descr(struct descr *d)
+static krb5_boolean
+realloc_descrs(struct descr **d, unsigned int *ndescr)
 {
-    if(d->buf)
-	memset(d->buf, 0, d->size);
-    d->len = 0;
-    if(d->s != rk_INVALID_SOCKET)
-	rk_closesocket(d->s);
-    d->s = rk_INVALID_SOCKET;
+    struct descr *tmp;
+    unsigned int grow = *ndescr < 4 ? 4 : *ndescr;
+    size_t i;
+
+    tmp = realloc(*d, (*ndescr + grow) * sizeof(**d));
+    if(tmp == NULL)
+        return FALSE;
+
+    *d = tmp;
+    reinit_descrs (*d, *ndescr);
+    memset(*d + *ndescr, 0, grow * sizeof(**d));
+    for(i = *ndescr; i < *ndescr + grow; i++)
+        init_descr (*d + i);
+
+    *ndescr += grow;
+
+    return TRUE;
 }
 
+/*
+ * Return the index of an unused descriptor, growing the descriptor
+ * array if needed, or -1 if out of memory.
+ */
 
-/* remove HTTP %-quoting from buf */
 static int
-de_http(char *buf)
+alloc_descr(krb5_context context, struct kdc_loop *l)
 {
-    unsigned char *p, *q;
-    unsigned int x;
-
-    for (p = q = (unsigned char *)buf; *p; p++, q++) {
-	if (*p == '%') {
-	    if (!(isxdigit(p[1]) && isxdigit(p[2])))
-		return -1;
+    int idx;
 
-	    if (sscanf((char *)p + 1, "%2x", &x) != 1)
-		return -1;
+    if (l->free_head == -1) {
+	unsigned int i, n = *l->ndescrp;
 
-	    *q = x;
-	    p += 2;
-	} else {
-	    *q = *p;
+	if (!realloc_descrs(l->dp, l->ndescrp)) {
+	    krb5_warnx(context, "No memory");
+	    return -1;
+	}
+	for (i = *l->ndescrp; i > n; i--) {
+	    (*l->dp)[i - 1].tnext = l->free_head;
+	    l->free_head = i - 1;
 	}
     }
-    *q = '\0';
-    return 0;
+    idx = l->free_head;
+    l->free_head = (*l->dp)[idx].tnext;
+    (*l->dp)[idx].tnext = -1;
+    return idx;
 }
 
-#define TCP_TIMEOUT 4
+/*
+ * Forget about the descriptor at `idx' whose socket `s' has been closed
+ * by clear_descr().
+ */
+
+static void
+release_descr(struct kdc_loop *l, int idx, krb5_socket_t s)
+{
+    struct descr *d = *l->dp + idx;
+
+    poller_del(&l->p, s);
+    if (d->timeout != 0)
+	timer_unlink(l, idx);
+    d->timeout = 0;
+    d->tnext = l->dead_head;
+    l->dead_head = idx;
+}
 
 /*
- * accept a new TCP connection on `d[parent]' and store it in `d[child]'
+ * accept a new TCP connection on the listening socket at `parent'
  */
 
 static void
 add_new_tcp (krb5_context context,
 	     krb5_kdc_configuration *config,
-	     struct descr *d, int parent, int child)
+	     struct kdc_loop *l, int parent, time_t now)
 {
+    struct descr *d;
     krb5_socket_t s;
+    int child;
 
+    child = alloc_descr(context, l);
     if (child == -1)
 	return;
+    d = *l->dp;
 
     d[child].sock_len = sizeof(d[child].__ss);
     s = accept(d[parent].s, d[child].sa, &d[child].sock_len);
     if(rk_IS_BAD_SOCKET(s)) {
 	if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
 	    krb5_warn(context, rk_SOCK_ERRNO, "accept");
+	d[child].tnext = l->free_head;
+	l->free_head = child;
 	return;
     }
 
-#ifdef FD_SETSIZE
-    if (s >= FD_SETSIZE) {
-	krb5_warnx(context, "socket FD too large");
+    if (poller_add(context, &l->p, s, child)) {
 	rk_closesocket (s);
+	d[child].tnext = l->free_head;
+	l->free_head = child;
 	return;
     }
-#endif
 
     d[child].s = s;
-    d[child].timeout = time(NULL) + TCP_TIMEOUT;
+    d[child].timeout = now + TCP_TIMEOUT;
     d[child].type = SOCK_STREAM;
+    timer_append(l, child);
     addr_to_string (context,
 		    d[child].sa, d[child].sock_len,
 		    d[child].addr_string, sizeof(d[child].addr_string));
@@ -791,17 +1661,12 @@ http1_request_is_complete(const unsigned char *req, size_t len)
 static void
 handle_tcp(krb5_context context,
 	   krb5_kdc_configuration *config,
-	   struct descr *d, int idx, int min_free)
+	   struct descr *d, int idx)
 {
     unsigned char buf[1024];
     int n;
     int ret = 0;
 
-    if (d[idx].timeout == 0) {
-	add_new_tcp (context, config, d, idx, min_free);
-	return;
-    }
-
     n = recvfrom(d[idx].s, buf, sizeof(buf), 0, NULL, NULL);
     if(rk_IS_SOCKET_ERROR(n)){
 	krb5_warn(context, rk_SOCK_ERRNO, "recvfrom failed from %s to %s/%d",
@@ -863,7 +1728,7 @@ handle_tcp(krb5_context context,
      * ret == 1 -> go ahead and perform the request
      * ret != 0 (really, < 0) -> error, probably ENOMEM, close connection
      */
-    if (ret == 1)
+    if (ret == 1 && !pool_submit(&d[idx], d[idx].buf, d[idx].len, TRUE))
 	do_request(context, config,
 		   d[idx].buf, d[idx].len, TRUE, &d[idx]);
 
@@ -888,117 +1753,161 @@ handle_islive(int fd)
 }
 #endif
 
-static krb5_boolean
-realloc_descrs(struct descr **d, unsigned int *ndescr)
-{
-    struct descr *tmp;
-    size_t i;
-
-    tmp = realloc(*d, (*ndescr + 4) * sizeof(**d));
-    if(tmp == NULL)
-        return FALSE;
+/*
+ * Dispatch a readiness event for the descriptor at `idx'
+ */
 
-    *d = tmp;
-    reinit_descrs (*d, *ndescr);
-    memset(*d + *ndescr, 0, 4 * sizeof(**d));
-    for(i = *ndescr; i < *ndescr + 4; i++)
-        init_descr (*d + i);
+static void
+handle_descr(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     struct kdc_loop *l, int idx, time_t now)
+{
+    struct descr *d = *l->dp;
+    krb5_socket_t s = d[idx].s;
 
-    *ndescr += 4;
+    if (rk_IS_BAD_SOCKET(s))
+	return;
 
-    return TRUE;
+    if (d[idx].type == SOCK_DGRAM) {
+	l->udp_requests += handle_udp(context, config, &d[idx]);
+    } else if (d[idx].type == SOCK_STREAM) {
+	if (d[idx].timeout == 0) {
+	    l->tcp_connections++;
+	    add_new_tcp(context, config, l, idx, now);
+	    return;
+	}
+	handle_tcp(context, config, d, idx);
+	if (rk_IS_BAD_SOCKET(d[idx].s))
+	    release_descr(l, idx, s);
+    }
 }
 
-static int
-next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
-{
-    size_t i;
-    int min_free;
+/*
+ * Close TCP connections that have been idle past their deadline
+ */
 
-    for(i = 0; i < *ndescr; i++) {
-        int s = (*d + i)->s;
-        if(rk_IS_BAD_SOCKET(s))
-            return i;
-    }
+static void
+expire_tcp(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   struct kdc_loop *l, time_t now)
+{
+    while (l->timer_head != -1) {
+	int idx = l->timer_head;
+	struct descr *d = *l->dp + idx;
+	krb5_socket_t s = d->s;
 
-    min_free = *ndescr;
-    if(!realloc_descrs(d, ndescr)) {
-        min_free = -1;
-        krb5_warnx(context, "No memory");
+	if (d->timeout >= now)
+	    break;
+	kdc_log(context, config, 2,
+		"TCP-connection from %s expired after %lu bytes",
+		d->addr_string, (unsigned long)d->len);
+	clear_descr(d);
+	release_descr(l, idx, s);
     }
-
-    return min_free;
 }
 
 static void
 loop(krb5_context context, krb5_kdc_configuration *config,
      struct descr **dp, unsigned int *ndescrp, int islive)
 {
-    struct descr *d = *dp;
-    unsigned int ndescr = *ndescrp;
+    struct kdc_loop l;
+    int tokens[POLLER_MAX_EVENTS];
+    time_t next_report;
+    unsigned int i;
+
+    l.dp = dp;
+    l.ndescrp = ndescrp;
+    l.free_head = l.dead_head = -1;
+    l.timer_head = l.timer_tail = -1;
+    l.udp_requests = l.tcp_connections = 0;
+    poller_init(context, config, &l.p);
+    pool_start(context, config);
+    kdc_log(context, config, 4, "KDC worker using %s for I/O",
+	    poller_name(&l.p));
+
+    for (i = *ndescrp; i > 0; i--) {
+	struct descr *d = *dp + i - 1;
+
+	if (rk_IS_BAD_SOCKET(d->s)) {
+	    d->tnext = l.free_head;
+	    l.free_head = i - 1;
+	} else if (poller_add(context, &l.p, d->s, i - 1)) {
+	    krb5_errx(context, 1, "could not register listener with %s",
+		      poller_name(&l.p));
+	}
+    }
+    if (islive > -1 && poller_add(context, &l.p, islive, POLLER_ISLIVE))
+	krb5_errx(context, 1, "could not register with %s",
+		  poller_name(&l.p));
+
+    next_report = time(NULL) + WORKER_REPORT_INTERVAL;
 
     while (exit_flag == 0) {
-	struct timeval tmout;
-	fd_set fds;
-	int min_free = -1;
-	int max_fd = 0;
-	size_t i;
-
-	FD_ZERO(&fds);
-        if (islive > -1) {
-            FD_SET(islive, &fds);
-            max_fd = islive;
-        }
-	for (i = 0; i < ndescr; i++) {
-	    if (!rk_IS_BAD_SOCKET(d[i].s)) {
-		if (d[i].type == SOCK_STREAM &&
-		   d[i].timeout && d[i].timeout < time(NULL)) {
-		    kdc_log(context, config, 2,
-			    "TCP-connection from %s expired after %lu bytes",
-			    d[i].addr_string, (unsigned long)d[i].len);
-		    clear_descr(&d[i]);
-		    continue;
-		}
-#ifndef NO_LIMIT_FD_SETSIZE
-		if (max_fd < d[i].s)
-		    max_fd = d[i].s;
-#ifdef FD_SETSIZE
-		if (max_fd >= FD_SETSIZE)
-		    krb5_errx(context, 1, "fd too large");
-#endif
-#endif
-		FD_SET(d[i].s, &fds);
+	time_t now = time(NULL);
+	int msec = TCP_TIMEOUT * 1000;
+	int k, n;
+
+	if (now >= next_report) {
+	    kdc_log(context, config, 4,
+		    "KDC worker %d: %lu UDP requests, %lu TCP connections",
+		    (int)getpid(), l.udp_requests, l.tcp_connections);
+	    if (config->entry_cache_size > 0) {
+		unsigned long hits, misses;
+
+		krb5_kdc_get_entry_cache_stats(config, &hits, &misses);
+		pool_entry_cache_stats(&hits, &misses);
+		kdc_log(context, config, 4,
+			"KDC worker %d: entry cache %lu hits, %lu misses",
+			(int)getpid(), hits, misses);
 	    }
+	    next_report = now + WORKER_REPORT_INTERVAL;
 	}
 
-	tmout.tv_sec = TCP_TIMEOUT;
-	tmout.tv_usec = 0;
-	switch(select(max_fd + 1, &fds, 0, 0, &tmout)){
-	case 0:
-	    break;
-	case -1:
+	expire_tcp(context, config, &l, now);
+	if (l.timer_head != -1) {
+	    time_t left = (*dp)[l.timer_head].timeout + 1 - now;
+
+	    if (left < TCP_TIMEOUT)
+		msec = left * 1000;
+	}
+
+	n = poller_wait(&l.p, msec, tokens, POLLER_MAX_EVENTS);
+	if (n == -1) {
 	    if (errno != EINTR)
-		krb5_warn(context, rk_SOCK_ERRNO, "select");
-	    break;
-	default:
+		krb5_warn(context, rk_SOCK_ERRNO, "%s", poller_name(&l.p));
+	    continue;
+	}
+	if (n == 0)
+	    krb5_log_flush(context, config->logf); /* idle */
+
+	if (n > 0)
+	    now = time(NULL);
+	for (k = 0; k < n; k++) {
+	    if (tokens[k] == POLLER_ISLIVE) {
 #ifdef HAVE_FORK
-	    if (islive > -1 && FD_ISSET(islive, &fds))
 		handle_islive(islive);
 #endif
-	    for (i = 0; i < ndescr; i++)
-		if (!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds)) {
-		    min_free = next_min_free(context, dp, ndescrp);
-                    ndescr = *ndescrp;
-                    d = *dp;
-
-		    if (d[i].type == SOCK_DGRAM)
-			handle_udp(context, config, &d[i]);
-		    else if (d[i].type == SOCK_STREAM)
-			handle_tcp(context, config, d, i, min_free);
-		}
+		continue;
+	    }
+	    handle_descr(context, config, &l, tokens[k], now);
+	}
+
+	while (l.dead_head != -1) {
+	    int idx = l.dead_head;
+
+	    l.dead_head = (*dp)[idx].tnext;
+	    (*dp)[idx].tnext = l.free_head;
+	    l.free_head = idx;
 	}
     }
 
+    pool_stop();
+    poller_free(&l.p);
+
+    kdc_log(context, config, 3,
+	    "KDC worker %d handled %lu UDP requests and %lu TCP connections",
+	    (int)getpid(), l.udp_requests, l.tcp_connections);
+
     switch (exit_flag) {
     case -1:
 	kdc_log(context, config, 0,
@@ -1017,6 +1926,7 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 	kdc_log(context, config, 0, "Unexpected exit reason: %d", exit_flag);
 	break;
     }
+    krb5_log_flush(context, config->logf);
 }
 
 #ifdef __APPLE__
@@ -1047,6 +1957,249 @@ bonjour_kid(krb5_context context, krb5_kdc_configuration *config, const char *ar
 #endif
 
 #ifdef HAVE_FORK
+/*
+ * Metrics.  The master maps a struct kdc_metrics for every request
+ * thread of every worker, shared with its children, and forks a process
+ * that serves their sum on the metrics socket and port.  A client that
+ * sends an HTTP request gets an HTTP response, one that sends nothing
+ * just the metrics.
+ */
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(NO_MMAP) && defined(MAP_SHARED)
+#define KDC_METRICS 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#define METRICS_FIRST_WAIT	200	/* ms to wait for a request */
+#define METRICS_WAIT		1000	/* ms to wait for the rest of it */
+
+static pid_t metrics_pid = -1;
+static struct kdc_metrics *metrics;
+static size_t metrics_per_worker;
+static size_t metrics_nslots;
+
+#ifdef KDC_METRICS
+
+static int
+metrics_listen(krb5_context context, krb5_kdc_configuration *config,
+	       krb5_socket_t *fds)
+{
+    krb5_socket_t s;
+    int one = 1;
+    int n = 0;
+
+    if (metrics_socket) {
+	struct sockaddr_un sua;
+
+	memset(&sua, 0, sizeof(sua));
+	sua.sun_family = AF_UNIX;
+	if (strlcpy(sua.sun_path, metrics_socket,
+		    sizeof(sua.sun_path)) >= sizeof(sua.sun_path)) {
+	    kdc_log(context, config, 0, "metrics-socket %s: name too long",
+		    metrics_socket);
+	} else if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == rk_INVALID_SOCKET) {
+	    krb5_warn(context, errno, "metrics-socket %s", metrics_socket);
+	} else {
+	    (void) unlink(metrics_socket);
+	    if (bind(s, (struct sockaddr *)&sua, sizeof(sua)) == -1 ||
+		listen(s, SOMAXCONN) == -1) {
+		krb5_warn(context, errno, "metrics-socket %s", metrics_socket);
+		rk_closesocket(s);
+	    } else {
+		fds[n++] = s;
+	    }
+	}
+    }
+
+    if (metrics_port > 0) {
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(metrics_port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == rk_INVALID_SOCKET) {
+	    krb5_warn(context, errno, "metrics-port %d", metrics_port);
+	} else {
+	    (void) setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (void *)&one,
+			      sizeof(one));
+	    if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+		listen(s, SOMAXCONN) == -1) {
+		krb5_warn(context, errno, "metrics-port %d", metrics_port);
+		rk_closesocket(s);
+	    } else {
+		fds[n++] = s;
+	    }
+	}
+    }
+    return n;
+}
+
+/* Wait up to `msec' for `s' to become readable */
+static int
+metrics_wait(krb5_socket_t s, int msec)
+{
+    struct timeval tv;
+    fd_set fds;
+
+    tv.tv_sec = msec / 1000;
+    tv.tv_usec = (msec % 1000) * 1000;
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    return select(s + 1, &fds, NULL, NULL, &tv) == 1;
+}
+
+static void
+metrics_reply(krb5_context context, krb5_socket_t s)
+{
+    char req[2048];
+    char hdr[160];
+    krb5_data data;
+    struct timeval tv;
+    size_t len = 0;
+    ssize_t n;
+    int http;
+
+    /* Read the request, if any, so closing doesn't reset the connection */
+    while (len < sizeof(req) - 1 &&
+	   metrics_wait(s, len ? METRICS_WAIT : METRICS_FIRST_WAIT)) {
+	n = recv(s, req + len, sizeof(req) - 1 - len, 0);
+	if (n <= 0)
+	    break;
+	len += n;
+	req[len] = '\0';
+	if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+	    break;
+    }
+    req[len] = '\0';
+    http = len > 0 && strstr(req, " HTTP/") != NULL;
+
+    if (krb5_kdc_metrics_format(context, metrics, metrics_nslots, &data))
+	return;
+
+    tv.tv_sec = METRICS_WAIT / 1000;
+    tv.tv_usec = 0;
+    (void) setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+    if (http) {
+	n = snprintf(hdr, sizeof(hdr),
+		     "HTTP/1.0 200 OK\r\n"
+		     "Content-Type: text/plain; version=0.0.4\r\n"
+		     "Content-Length: %lu\r\n"
+		     "Connection: close\r\n\r\n",
+		     (unsigned long)data.length);
+	if (n > 0 && (size_t)n < sizeof(hdr))
+	    (void) net_write(s, hdr, n);
+    }
+    (void) net_write(s, data.data, data.length);
+    krb5_data_free(&data);
+}
+
+static void
+metrics_serve(krb5_context context, krb5_kdc_configuration *config,
+	      krb5_socket_t *fds, int nfds, int islive)
+{
+    int tokens[4];
+    struct poller p;
+    krb5_socket_t s;
+    int i, k, n;
+
+    poller_init(context, config, &p);
+    for (i = 0; i < nfds; i++)
+	if (poller_add(context, &p, fds[i], i))
+	    krb5_errx(context, 1, "could not register metrics listener");
+    if (poller_add(context, &p, islive, POLLER_ISLIVE))
+	krb5_errx(context, 1, "could not register with %s", poller_name(&p));
+
+    while (exit_flag == 0) {
+	n = poller_wait(&p, TCP_TIMEOUT * 1000, tokens, 4);
+	for (k = 0; k < n; k++) {
+	    if (tokens[k] == POLLER_ISLIVE) {
+		handle_islive(islive);
+		continue;
+	    }
+	    s = accept(fds[tokens[k]], NULL, NULL);
+	    if (rk_IS_BAD_SOCKET(s))
+		continue;
+	    metrics_reply(context, s);
+	    rk_closesocket(s);
+	}
+    }
+
+    poller_free(&p);
+    for (i = 0; i < nfds; i++)
+	rk_closesocket(fds[i]);
+    if (metrics_socket)
+	(void) unlink(metrics_socket);
+}
+
+#endif /* KDC_METRICS */
+
+/*
+ * Set up shared metrics for `max_kdcs' workers and start the process
+ * serving them, if so configured.
+ */
+
+static void
+metrics_start(krb5_context context, krb5_kdc_configuration *config,
+	      int max_kdcs, int *islive, struct descr *d, unsigned int ndescr)
+{
+#ifdef KDC_METRICS
+    krb5_socket_t fds[2];
+    void *m;
+    int i, nfds;
+
+    if (metrics_socket == NULL && metrics_port <= 0)
+	return;
+
+    metrics_per_worker = 1 + (num_kdc_threads > 0 ? num_kdc_threads : 0);
+    metrics_nslots = max_kdcs * metrics_per_worker;
+    m = mmap(NULL, metrics_nslots * sizeof(metrics[0]),
+	     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+	krb5_warn(context, errno, "could not map memory for metrics");
+	return;
+    }
+
+    nfds = metrics_listen(context, config, fds);
+    if (nfds == 0) {
+	(void) munmap(m, metrics_nslots * sizeof(metrics[0]));
+	return;
+    }
+    metrics = m;
+
+    krb5_log_flush(context, config->logf);
+    metrics_pid = fork();
+    if (metrics_pid == 0) {
+	close(islive[0]);
+	for (i = 0; i < ndescr; i++)
+	    clear_descr(&d[i]);
+	kdc_log(context, config, 3, "KDC metrics process started: %d",
+		(int)getpid());
+	metrics_serve(context, config, fds, nfds, islive[1]);
+	krb5_log_flush(context, config->logf);
+	exit(0);
+    }
+    if (metrics_pid == -1)
+	krb5_warn(context, errno, "could not fork metrics process");
+    for (i = 0; i < nfds; i++)
+	rk_closesocket(fds[i]);
+#else
+    if (metrics_socket != NULL || metrics_port > 0)
+	kdc_log(context, config, 1,
+		"metrics are not supported on this platform");
+#endif
+}
+
+/* Point `config' at the metrics of request thread 0 of worker `slot' */
+static void
+metrics_attach(krb5_kdc_configuration *config, int slot)
+{
+    if (metrics)
+	config->metrics = &metrics[slot * metrics_per_worker];
+}
+
 static void
 kill_kids(pid_t *pids, int max_kids, int sig)
 {
@@ -1054,9 +2207,11 @@ kill_kids(pid_t *pids, int max_kids, int sig)
 
     for (i=0; i < max_kids; i++)
 	if (pids[i] > 0)
-	    kill(sig, pids[i]);
+	    kill(pids[i], sig);
     if (bonjour_pid > 0)
-        kill(sig, bonjour_pid);
+        kill(bonjour_pid, sig);
+    if (metrics_pid > 0)
+        kill(metrics_pid, sig);
 }
 
 static int
@@ -1078,6 +2233,9 @@ reap_kid(krb5_context context, krb5_kdc_configuration *config,
     if (pid == bonjour_pid) {
         bonjour_pid = (pid_t)-1;
         what = "bonjour";
+    } else if (pid == metrics_pid) {
+        metrics_pid = (pid_t)-1;
+        what = "metrics";
     } else {
         for (i=0; i < max_kids; i++) {
             if (pids[i] == pid) {
@@ -1127,6 +2285,52 @@ reap_kids(krb5_context context, krb5_kdc_configuration *config,
     return reaped;
 }
 
+/*
+ * Close the listening sockets inherited from the master so that a
+ * worker can open its own SO_REUSEPORT sockets instead.
+ */
+
+static void
+close_sockets(struct descr *d, unsigned int ndescr)
+{
+    unsigned int i;
+
+    for (i = 0; i < ndescr; i++)
+	clear_descr(&d[i]);
+    free(d);
+}
+
+/*
+ * Pin the worker in slot `slot' to one CPU, spreading workers
+ * round-robin over the online CPUs.
+ */
+
+static void
+pin_worker(krb5_context context, krb5_kdc_configuration *config, int slot)
+{
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET)
+    cpu_set_t set;
+    long ncpu = -1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (ncpu < 1)
+	return;
+
+    CPU_ZERO(&set);
+    CPU_SET(slot % ncpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+	krb5_warn(context, errno, "sched_setaffinity");
+    else
+	kdc_log(context, config, 4, "KDC worker %d pinned to CPU %ld",
+		(int)getpid(), slot % ncpu);
+#else
+    kdc_log(context, config, 1,
+	    "worker-cpu-affinity is not supported on this platform");
+#endif
+}
+
 static void
 select_sleep(int microseconds)
 {
@@ -1151,7 +2355,7 @@ start_kdc(krb5_context context,
     pid_t *pids;
     int max_kdcs = config->num_kdc_processes;
     int num_kdcs = 0;
-    int i;
+    int i, slot;
     int islive[2];
 #endif
 
@@ -1203,10 +2407,35 @@ start_kdc(krb5_context context,
     roken_detach_finish(NULL, daemon_child);
 
 #ifdef HAVE_FORK
+    metrics_start(context, config, max_kdcs, islive, d, ndescr);
+
     if (!testing_flag) {
+#ifdef SO_REUSEPORT
+        /*
+         * With reuseport each worker binds its own sockets and the
+         * kernel spreads incoming requests over them.  The master only
+         * opened its sockets to check that the ports can be bound; keep
+         * them open and the kernel would hand it requests too.
+         */
+        if (reuseport > 0) {
+            for (i = 0; i < ndescr; ++i)
+                clear_descr(&d[i]);
+        }
+#else
+        if (reuseport > 0) {
+            kdc_log(context, config, 1,
+                    "reuseport is not supported on this platform");
+            reuseport = 0;
+        }
+#endif
         /* Note that we might never execute the body of this loop */
         while (exit_flag == 0) {
 
+            if (reopen_flag) {
+                reopen_flag = 0;
+                kill_kids(pids, max_kdcs, SIGHUP);
+            }
+
             if (num_kdcs >= max_kdcs) {
                 num_kdcs -= reap_kid(context, config, pids, max_kdcs, 0);
                 continue;
@@ -1215,10 +2444,25 @@ start_kdc(krb5_context context,
             if (num_kdcs > 0)
                 num_kdcs -= reap_kids(context, config, pids, max_kdcs);
 
+            for (slot = 0; slot < max_kdcs; slot++)
+                if (pids[slot] <= 0)
+                    break;
+
+            krb5_log_flush(context, config->logf);
             pid = fork();
             switch (pid) {
             case 0:
                 close(islive[0]);
+                if (reuseport > 0) {
+                    close_sockets(d, ndescr);
+                    ndescr = init_sockets(context, config, &d);
+                    if (ndescr <= 0)
+                        krb5_errx(context, 1, "No sockets!");
+                }
+                if (worker_cpu_affinity > 0)
+                    pin_worker(context, config, slot);
+                if (slot < max_kdcs)
+                    metrics_attach(config, slot);
                 loop(context, config, &d, &ndescr, islive[1]);
                 exit(0);
             case -1:
@@ -1228,13 +2472,9 @@ start_kdc(krb5_context context,
                 sleep(10);
                 break;
             default:
-		for (i = 0; i < max_kdcs; i++) {
-		    if (pids[i] <= 0) {
-			pids[i] = pid;
-			break;
-		    }
-		}
-                if (i >= max_kdcs) {
+                if (slot < max_kdcs) {
+                    pids[slot] = pid;
+                } else {
                     /* This should not happen */
                     kdc_log(context, config, 1,
                             "warning: forked untracked child process: %d",
@@ -1265,7 +2505,7 @@ start_kdc(krb5_context context,
         for (;;) {
             struct timeval tv3;
             num_kdcs -= reap_kids(context, config, pids, max_kdcs);
-            if (num_kdcs == 0 && bonjour_pid <= 0)
+            if (num_kdcs == 0 && bonjour_pid <= 0 && metrics_pid <= 0)
                 goto end;
             /*
              * Using select to sleep will fail with EINTR if we receive a
@@ -1287,7 +2527,7 @@ start_kdc(krb5_context context,
         for (;;) {
             kill_kids(pids, max_kdcs, SIGKILL);
             num_kdcs -= reap_kids(context, config, pids, max_kdcs);
-            if (num_kdcs == 0 && bonjour_pid <= 0)
+            if (num_kdcs == 0 && bonjour_pid <= 0 && metrics_pid <= 0)
                 break;
             select_sleep(200000);
             gettimeofday(&tv2, NULL);
@@ -1299,6 +2539,7 @@ start_kdc(krb5_context context,
      end:
         kdc_log(context, config, 3, "KDC master process exiting");
     } else {
+        metrics_attach(config, 0);
         loop(context, config, &d, &ndescr, -1);
         kdc_log(context, config, 3, "KDC exiting");
     }
@@ -107,6 +107,11 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     c->pkinit_dh_min_bits = 1024;
     c->db = NULL;
     c->num_db = 0;
+    c->db_keep_open = FALSE;
+    c->entry_cache_size = 0;
+    c->entry_cache_ttl = 60;
+    c->crypto_cache_size = 16;
+    c->db_state = NULL;
     c->logf = NULL;
 
     c->num_kdc_processes =
@@ -117,6 +122,31 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 	krb5_config_get_bool_default(context, NULL,
 				     c->require_preauth,
 				     "kdc", "require-preauth", NULL);
+
+    c->db_keep_open =
+	krb5_config_get_bool_default(context, NULL,
+				     c->db_keep_open,
+				     "kdc", "hdb-keep-open", NULL);
+
+    c->entry_cache_size =
+	krb5_config_get_int_default(context, NULL,
+				    c->entry_cache_size,
+				    "kdc", "entry-cache-size", NULL);
+    c->entry_cache_ttl =
+	krb5_config_get_time_default(context, NULL,
+				     c->entry_cache_ttl,
+				     "kdc", "entry-cache-ttl", NULL);
+
+    /*
+     * The crypto context cache is off by default in libkrb5; the KDC
+     * uses the same service and krbtgt keys over and over.  Request
+     * threads copy the context, and with it this setting.
+     */
+    c->crypto_cache_size =
+	krb5_config_get_int_default(context, NULL,
+				    c->crypto_cache_size,
+				    "kdc", "crypto-cache-size", NULL);
+    krb5_set_crypto_cache_size(context, c->crypto_cache_size);
 #ifdef DIGEST
     c->enable_digest =
 	krb5_config_get_bool_default(context, NULL,
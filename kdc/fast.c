@@ -550,6 +550,7 @@ _kdc_fast_unwrap_request(astgs_request_t r)
 
     free_KrbFastReq(&fastreq);
     free_PA_FX_FAST_REQUEST(&fxreq);
+    _kdc_metrics_fast(r->config);
 
  out:
     if (armor_server)
@@ -100,6 +100,13 @@ typedef struct krb5_kdc_configuration {
     int enable_kx509;
 
     const char *app;
+
+    krb5_boolean db_keep_open;		/* keep HDBs open across requests */
+    size_t entry_cache_size;		/* max cached entries per HDB */
+    time_t entry_cache_ttl;		/* lifetime of a cached entry */
+    int crypto_cache_size;		/* krb5_crypto contexts to cache */
+    struct kdc_db_state *db_state;	/* per-HDB state, see misc.c */
+    struct kdc_metrics *metrics;	/* this thread's counters, or NULL */
 } krb5_kdc_configuration;
 
 typedef struct kdc_request_desc *kdc_request_t;
@@ -111,14 +111,55 @@ typedef struct kx509_req_context_desc {
     unsigned int have_csr:1;            /* Client sent a CSR */
 } *kx509_req_context;
 
+/*
+ * Request counters and latency histograms, see metrics.c.  Each request
+ * thread of each worker process has a struct kdc_metrics of its own, in
+ * memory shared with the master, so they are updated without atomics or
+ * locks and summed when exported.
+ */
+
+enum kdc_metrics_type {
+    KDC_METRICS_AS,
+    KDC_METRICS_TGS,
+    KDC_METRICS_DIGEST,
+    KDC_METRICS_KX509,
+    KDC_METRICS_OTHER,
+    KDC_METRICS_NTYPES
+};
+
+#define KDC_METRICS_NBUCKETS	48	/* up to 2^24us, 2 buckets/octave */
+#define KDC_METRICS_NERRORS	129	/* KRB5KDC_ERR_NONE + 0..127, other */
+
+struct kdc_histogram {
+    uint64_t bucket[KDC_METRICS_NBUCKETS];
+    uint64_t count;
+    uint64_t sum;			/* microseconds */
+};
+
+struct kdc_metrics {
+    uint64_t fast;			/* FAST-armored requests */
+    uint64_t pkinit;			/* PKINIT pre-authentications */
+    uint64_t errors[KDC_METRICS_NERRORS];
+    uint64_t queued;			/* request thread queue depth */
+    struct kdc_histogram latency[KDC_METRICS_NTYPES];
+    struct kdc_histogram hdb;		/* HDB fetches */
+};
+
 #undef heim_pconfig
 #undef heim_pcontext
 
 extern sig_atomic_t exit_flag;
+extern sig_atomic_t reopen_flag;
 extern size_t max_request_udp;
 extern size_t max_request_tcp;
 extern const char *request_log;
 extern const char *port_str;
+extern const char *io_backend;
+extern int reuseport;
+extern int worker_cpu_affinity;
+extern int num_kdc_threads;
+extern const char *metrics_socket;
+extern int metrics_port;
 extern krb5_addresses explicit_addresses;
 
 extern int enable_http;
@@ -133,7 +174,7 @@ extern const struct units _kdc_digestunits[];
 
 #define KDC_LOG_FILE		"kdc.log"
 
-extern struct timeval _kdc_now;
+extern HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
 #define kdc_time (_kdc_now.tv_sec)
 
 extern char *runas_string;
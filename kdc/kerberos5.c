@@ -486,6 +486,7 @@ pa_pkinit_validate(astgs_request_t r, const PA_DATA *pa)
     _kdc_r_log(r, 4, "PKINIT pre-authentication succeeded -- %s using %s",
 	       r->cname, client_cert);
     free(client_cert);
+    _kdc_metrics_pkinit(r->config);
 
     ret = _kdc_pk_mk_pa_reply(r, pkp);
     if (ret) {
@@ -970,7 +971,7 @@ _kdc_encode_reply(krb5_context context,
     if(buf_size != len)
 	krb5_abortx(context, "Internal error in ASN.1 encoder");
 
-    ret = krb5_crypto_init(context, skey, etype, &crypto);
+    ret = krb5_crypto_init_cached(context, skey, etype, &crypto);
     if (ret) {
         const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
@@ -141,7 +141,7 @@ _kdc_add_KRB5SignedPath(krb5_context context,
 	Key *key;
 	ret = hdb_enctype2key(context, &krbtgt->entry, NULL, enctype, &key);
 	if (ret == 0)
-	    ret = krb5_crypto_init(context, &key->key, 0, &crypto);
+	    ret = krb5_crypto_init_cached(context, &key->key, 0, &crypto);
 	if (ret) {
 	    free(data.data);
 	    return ret;
@@ -229,7 +229,7 @@ check_KRB5SignedPath(krb5_context context,
 	    ret = hdb_enctype2key(context, &krbtgt->entry, NULL, /* XXX use correct kvno! */
 				  sp.etype, &key);
 	    if (ret == 0)
-		ret = krb5_crypto_init(context, &key->key, 0, &crypto);
+		ret = krb5_crypto_init_cached(context, &key->key, 0, &crypto);
 	    if (ret) {
 		free(data.data);
 		free_KRB5SignedPath(&sp);
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kdc_locl.h"
+
+/*
+ * KDC request metrics.
+ *
+ * Latencies are kept in HDR-style log-linear histograms of microseconds:
+ * bucket 2e holds [2^e, 1.5 * 2^e) and bucket 2e + 1 [1.5 * 2^e, 2^(e+1)),
+ * so bucket widths stay within a factor 1.5 of the value measured.
+ * Slower requests only show up in the count and sum.
+ */
+
+static void
+observe(struct kdc_histogram *h, uint64_t usec)
+{
+    unsigned e = 0;
+    unsigned i;
+
+    if (usec == 0)
+	usec = 1;
+    while (e < 63 && (usec >> (e + 1)) != 0)
+	e++;
+    i = 2 * e;
+    if (e > 0 && ((usec >> (e - 1)) & 1))
+	i++;
+    if (i < KDC_METRICS_NBUCKETS)
+	h->bucket[i]++;
+    h->sum += usec;
+    h->count++;
+}
+
+/* The largest value that goes in bucket `i' */
+static uint64_t
+bucket_max(unsigned i)
+{
+    unsigned e = i / 2;
+
+    if (i % 2)
+	return (2ULL << e) - 1;
+    if (e == 0)
+	return 1;
+    return (1ULL << e) + (1ULL << (e - 1)) - 1;
+}
+
+static uint64_t
+usec_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < start->tv_sec ||
+	(now.tv_sec == start->tv_sec && now.tv_usec < start->tv_usec))
+	return 0;
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+	now.tv_usec - start->tv_usec;
+}
+
+void
+_kdc_metrics_request(krb5_kdc_configuration *config, const char *type,
+		     krb5_error_code ret, const struct timeval *start)
+{
+    struct kdc_metrics *m = config->metrics;
+    enum kdc_metrics_type t = KDC_METRICS_OTHER;
+
+    if (m == NULL)
+	return;
+
+    if (strcmp(type, "AS-REQ") == 0)
+	t = KDC_METRICS_AS;
+    else if (strcmp(type, "TGS-REQ") == 0)
+	t = KDC_METRICS_TGS;
+    else if (strcmp(type, "DIGEST") == 0)
+	t = KDC_METRICS_DIGEST;
+    else if (strcmp(type, "KX509") == 0)
+	t = KDC_METRICS_KX509;
+    observe(&m->latency[t], usec_since(start));
+
+    if (ret == 0)
+	return;
+    if (ret >= KRB5KDC_ERR_NONE &&
+	ret < KRB5KDC_ERR_NONE + KDC_METRICS_NERRORS - 1)
+	m->errors[ret - KRB5KDC_ERR_NONE]++;
+    else
+	m->errors[KDC_METRICS_NERRORS - 1]++;
+}
+
+void
+_kdc_metrics_hdb(krb5_kdc_configuration *config, const struct timeval *start)
+{
+    if (config->metrics)
+	observe(&config->metrics->hdb, usec_since(start));
+}
+
+void
+_kdc_metrics_fast(krb5_kdc_configuration *config)
+{
+    if (config->metrics)
+	config->metrics->fast++;
+}
+
+void
+_kdc_metrics_pkinit(krb5_kdc_configuration *config)
+{
+    if (config->metrics)
+	config->metrics->pkinit++;
+}
+
+/*
+ * Prometheus text exposition
+ */
+
+static const char *type_names[KDC_METRICS_NTYPES] = {
+    "AS", "TGS", "DIGEST", "KX509", "OTHER"
+};
+
+static krb5_error_code
+out(krb5_storage *sp, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(buf))
+	return ERANGE;
+    if (krb5_storage_write(sp, buf, n) != n)
+	return ENOMEM;
+    return 0;
+}
+
+static krb5_error_code
+out_histogram(krb5_storage *sp, const char *name, const char *labels,
+	      const struct kdc_histogram *h)
+{
+    krb5_error_code ret = 0;
+    uint64_t cum = 0;
+    unsigned i;
+
+    for (i = 0; ret == 0 && i < KDC_METRICS_NBUCKETS; i++) {
+	cum += h->bucket[i];
+	if (i == 1)
+	    continue;		/* always empty, and has the same bound as 0 */
+	ret = out(sp, "%s_bucket{%s%sle=\"%.6f\"} %llu\n", name,
+		  labels, *labels ? "," : "", bucket_max(i) / 1e6,
+		  (unsigned long long)cum);
+    }
+    if (ret == 0)
+	ret = out(sp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name,
+		  labels, *labels ? "," : "", (unsigned long long)h->count);
+    if (ret == 0)
+	ret = out(sp, "%s_sum%s%s%s %.6f\n", name, *labels ? "{" : "",
+		  labels, *labels ? "}" : "", h->sum / 1e6);
+    if (ret == 0)
+	ret = out(sp, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "",
+		  labels, *labels ? "}" : "", (unsigned long long)h->count);
+    return ret;
+}
+
+static void
+add_histogram(struct kdc_histogram *sum, const struct kdc_histogram *h)
+{
+    unsigned i;
+
+    for (i = 0; i < KDC_METRICS_NBUCKETS; i++)
+	sum->bucket[i] += h->bucket[i];
+    sum->count += h->count;
+    sum->sum += h->sum;
+}
+
+/**
+ * Sum the `n' per-thread metrics in `m' and format them in the
+ * Prometheus text exposition format.
+ *
+ * @param context a krb5 context
+ * @param m array of metrics
+ * @param n number of elements in m
+ * @param data the formatted metrics, free with krb5_data_free()
+ *
+ * @return 0 on success or an error code
+ */
+
+krb5_error_code
+krb5_kdc_metrics_format(krb5_context context, const struct kdc_metrics *m,
+			size_t n, krb5_data *data)
+{
+    struct kdc_metrics *sum;
+    krb5_error_code ret;
+    krb5_storage *sp;
+    const char *name;
+    char labels[64];
+    size_t i;
+    unsigned j;
+
+    krb5_data_zero(data);
+
+    sum = calloc(1, sizeof(*sum));
+    sp = krb5_storage_emem();
+    if (sum == NULL || sp == NULL) {
+	free(sum);
+	if (sp)
+	    krb5_storage_free(sp);
+	return krb5_enomem(context);
+    }
+
+    for (i = 0; i < n; i++) {
+	sum->fast += m[i].fast;
+	sum->pkinit += m[i].pkinit;
+	sum->queued += m[i].queued;
+	for (j = 0; j < KDC_METRICS_NERRORS; j++)
+	    sum->errors[j] += m[i].errors[j];
+	for (j = 0; j < KDC_METRICS_NTYPES; j++)
+	    add_histogram(&sum->latency[j], &m[i].latency[j]);
+	add_histogram(&sum->hdb, &m[i].hdb);
+    }
+
+    ret = out(sp, "# HELP kdc_requests_total Requests processed.\n"
+	      "# TYPE kdc_requests_total counter\n");
+    for (j = 0; ret == 0 && j < KDC_METRICS_NTYPES; j++)
+	ret = out(sp, "kdc_requests_total{type=\"%s\"} %llu\n",
+		  type_names[j], (unsigned long long)sum->latency[j].count);
+
+    if (ret == 0)
+	ret = out(sp, "# HELP kdc_fast_requests_total FAST-armored requests.\n"
+		  "# TYPE kdc_fast_requests_total counter\n"
+		  "kdc_fast_requests_total %llu\n",
+		  (unsigned long long)sum->fast);
+    if (ret == 0)
+	ret = out(sp, "# HELP kdc_pkinit_total PKINIT pre-authentications.\n"
+		  "# TYPE kdc_pkinit_total counter\n"
+		  "kdc_pkinit_total %llu\n",
+		  (unsigned long long)sum->pkinit);
+
+    if (ret == 0)
+	ret = out(sp, "# HELP kdc_errors_total Requests that failed, "
+		  "by Kerberos error code.\n"
+		  "# TYPE kdc_errors_total counter\n");
+    for (j = 0; ret == 0 && j < KDC_METRICS_NERRORS; j++) {
+	if (sum->errors[j] == 0)
+	    continue;
+	if (j == KDC_METRICS_NERRORS - 1) {
+	    ret = out(sp, "kdc_errors_total{code=\"other\"} %llu\n",
+		      (unsigned long long)sum->errors[j]);
+	    continue;
+	}
+	name = _kdc_error_name(KRB5KDC_ERR_NONE + j);
+	if (name)
+	    ret = out(sp, "kdc_errors_total{code=\"%u\",name=\"%s\"} %llu\n",
+		      j, name, (unsigned long long)sum->errors[j]);
+	else
+	    ret = out(sp, "kdc_errors_total{code=\"%u\"} %llu\n",
+		      j, (unsigned long long)sum->errors[j]);
+    }
+
+    if (ret == 0)
+	ret = out(sp, "# HELP kdc_request_duration_seconds Request "
+		  "processing time.\n"
+		  "# TYPE kdc_request_duration_seconds histogram\n");
+    for (j = 0; ret == 0 && j < KDC_METRICS_NTYPES; j++) {
+	snprintf(labels, sizeof(labels), "type=\"%s\"", type_names[j]);
+	ret = out_histogram(sp, "kdc_request_duration_seconds", labels,
+			    &sum->latency[j]);
+    }
+
+    if (ret == 0)
+	ret = out(sp, "# HELP kdc_hdb_fetch_duration_seconds Time spent "
+		  "fetching entries from the HDB.\n"
+		  "# TYPE kdc_hdb_fetch_duration_seconds histogram\n");
+    if (ret == 0)
+	ret = out_histogram(sp, "kdc_hdb_fetch_duration_seconds", "",
+			    &sum->hdb);
+
+    if (ret == 0)
+	ret = out(sp, "# HELP kdc_queue_depth Requests waiting for a "
+		  "request thread.\n"
+		  "# TYPE kdc_queue_depth gauge\n"
+		  "kdc_queue_depth %llu\n",
+		  (unsigned long long)sum->queued);
+
+    if (ret == 0)
+	ret = krb5_storage_to_data(sp, data);
+    krb5_storage_free(sp);
+    free(sum);
+    return ret;
+}
@@ -49,7 +49,407 @@ name_type_ok(krb5_context context,
     return 0;
 }
 
-struct timeval _kdc_now;
+HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
+
+/*
+ * Per-database state kept across requests.
+ *
+ * The backing file of each database is stat()ed before every fetch so
+ * that we notice when it was replaced (hprop, iprop full resync) or
+ * modified (kadmind, ipropd-slave).  Databases without a backing file
+ * that we can find (e.g. LDAP) are neither kept open nor cached.
+ *
+ * With [kdc] hdb-keep-open a database is opened on first use and kept
+ * open instead of being opened and closed around every fetch; it is
+ * reopened when the file changes, since db1/db3 handles cache pages.
+ *
+ * With [kdc] entry-cache-size the decoded and decrypted entries
+ * fetched from a database are kept in a bounded LRU cache keyed by
+ * principal, fetch flags and kvno, for at most [kdc] entry-cache-ttl
+ * seconds.  The cache of a database is flushed when its file changes.
+ * Callers always get their own copy of a cached entry.
+ */
+
+struct kdc_cached_entry {
+    struct kdc_cached_entry *lru_prev;
+    struct kdc_cached_entry *lru_next;
+    struct kdc_cached_entry *hash_next;
+    unsigned long hash;
+    char *name;
+    unsigned flags;
+    krb5_kvno kvno;
+    time_t expires;
+    hdb_entry entry;
+};
+
+struct kdc_db_state {
+    int open;
+    int probed;
+    int stamped;
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    struct kdc_cached_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    struct kdc_cached_entry *lru_head;
+    struct kdc_cached_entry *lru_tail;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static char *
+db_backing_file(HDB *db)
+{
+    const char *suffixes[] = { ".db", ".mdb", ".pag", "" };
+    const char *m = db->hdb_method_name;
+    struct stat st;
+    size_t i;
+    char *fn;
+
+    if (db->hdb_name == NULL)
+	return NULL;
+
+    /* LMDB keeps its data in `name'.mdb, look there first */
+    if (m != NULL && (strncmp(m, "mdb", 3) == 0 || strncmp(m, "lmdb", 4) == 0)) {
+	suffixes[0] = ".mdb";
+	suffixes[1] = ".db";
+    }
+
+    for (i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); i++) {
+	if (asprintf(&fn, "%s%s", db->hdb_name, suffixes[i]) == -1)
+	    return NULL;
+	if (stat(fn, &st) == 0 && S_ISREG(st.st_mode))
+	    return fn;
+	free(fn);
+    }
+    return NULL;
+}
+
+static void
+cache_unlink(struct kdc_db_state *s, struct kdc_cached_entry *e)
+{
+    struct kdc_cached_entry **pp;
+
+    for (pp = &s->buckets[e->hash % s->nbuckets]; *pp != e; pp = &(*pp)->hash_next)
+	;
+    *pp = e->hash_next;
+
+    if (e->lru_prev)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	s->lru_head = e->lru_next;
+    if (e->lru_next)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	s->lru_tail = e->lru_prev;
+    s->nentries--;
+}
+
+static void
+cache_free_entry(struct kdc_cached_entry *e)
+{
+    size_t i;
+
+    for (i = 0; i < e->entry.keys.len; i++)
+	memset_s(e->entry.keys.val[i].key.keyvalue.data,
+		 e->entry.keys.val[i].key.keyvalue.length, 0,
+		 e->entry.keys.val[i].key.keyvalue.length);
+    free_HDB_entry(&e->entry);
+    free(e->name);
+    free(e);
+}
+
+static void
+cache_flush(struct kdc_db_state *s)
+{
+    while (s->lru_head != NULL) {
+	struct kdc_cached_entry *e = s->lru_head;
+
+	cache_unlink(s, e);
+	cache_free_entry(e);
+    }
+}
+
+static unsigned long
+cache_hash(const char *name, unsigned flags, krb5_kvno kvno)
+{
+    unsigned long h = 5381;
+
+    while (*name)
+	h = h * 33 + (unsigned char)*name++;
+    return h ^ (flags * 2654435761UL) ^ kvno;
+}
+
+static struct kdc_cached_entry *
+cache_find(struct kdc_db_state *s, unsigned long hash,
+	   const char *name, unsigned flags, krb5_kvno kvno)
+{
+    struct kdc_cached_entry *e;
+
+    for (e = s->buckets[hash % s->nbuckets]; e != NULL; e = e->hash_next) {
+	if (e->hash == hash && e->flags == flags && e->kvno == kvno &&
+	    strcmp(e->name, name) == 0)
+	    return e;
+    }
+    return NULL;
+}
+
+/*
+ * Look `name' up in the cache of database `i' and copy it to `ent'
+ */
+
+static krb5_error_code
+cache_lookup(krb5_context context, krb5_kdc_configuration *config, int i,
+	     const char *name, unsigned flags, krb5_kvno kvno,
+	     hdb_entry_ex *ent)
+{
+    struct kdc_db_state *s = &config->db_state[i];
+    struct kdc_cached_entry *e;
+    unsigned long hash;
+
+    if (s->buckets == NULL)
+	return HDB_ERR_NOENTRY;
+
+    hash = cache_hash(name, flags, kvno);
+    e = cache_find(s, hash, name, flags, kvno);
+    if (e != NULL && e->expires < kdc_time) {
+	cache_unlink(s, e);
+	cache_free_entry(e);
+	e = NULL;
+    }
+    if (e == NULL) {
+	s->misses++;
+	return HDB_ERR_NOENTRY;
+    }
+    s->hits++;
+
+    /* move to the front of the LRU list */
+    if (e != s->lru_head) {
+	e->lru_prev->lru_next = e->lru_next;
+	if (e->lru_next)
+	    e->lru_next->lru_prev = e->lru_prev;
+	else
+	    s->lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = s->lru_head;
+	s->lru_head->lru_prev = e;
+	s->lru_head = e;
+    }
+
+    memset(ent, 0, sizeof(*ent));
+    if (copy_hdb_entry(&e->entry, &ent->entry))
+	return krb5_enomem(context);
+    return 0;
+}
+
+static void
+cache_add(krb5_kdc_configuration *config, int i,
+	  const char *name, unsigned flags, krb5_kvno kvno,
+	  const hdb_entry_ex *ent)
+{
+    struct kdc_db_state *s = &config->db_state[i];
+    struct kdc_cached_entry *e;
+
+    /* backends with private entry state can't be copied */
+    if (ent->ctx != NULL || ent->free_entry != NULL)
+	return;
+
+    if (s->buckets == NULL) {
+	size_t n = 16;
+
+	while (n < config->entry_cache_size)
+	    n <<= 1;
+	s->buckets = calloc(n, sizeof(s->buckets[0]));
+	if (s->buckets == NULL)
+	    return;
+	s->nbuckets = n;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+	return;
+    if ((e->name = strdup(name)) == NULL ||
+	copy_hdb_entry(&ent->entry, &e->entry)) {
+	free(e->name);
+	free(e);
+	return;
+    }
+    e->hash = cache_hash(name, flags, kvno);
+    e->flags = flags;
+    e->kvno = kvno;
+    e->expires = kdc_time + config->entry_cache_ttl;
+
+    if (s->nentries >= config->entry_cache_size) {
+	struct kdc_cached_entry *old = s->lru_tail;
+
+	cache_unlink(s, old);
+	cache_free_entry(old);
+    }
+
+    e->hash_next = s->buckets[e->hash % s->nbuckets];
+    s->buckets[e->hash % s->nbuckets] = e;
+    e->lru_next = s->lru_head;
+    if (s->lru_head)
+	s->lru_head->lru_prev = e;
+    s->lru_head = e;
+    if (s->lru_tail == NULL)
+	s->lru_tail = e;
+    s->nentries++;
+}
+
+static void
+db_unkeep(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_state *s = &config->db_state[i];
+
+    if (s->open) {
+	config->db[i]->hdb_close(context, config->db[i]);
+	config->db[i]->hdb_openp = 0;
+	s->open = 0;
+    }
+}
+
+/*
+ * stat() the backing file of database `i' and drop the kept-open
+ * handle and cached entries if it changed.  Returns TRUE if the
+ * database has a backing file that we can watch.
+ */
+
+static krb5_boolean
+db_check(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_state *s;
+    struct stat st;
+    long nsec = 0;
+
+    if (!config->db_keep_open && config->entry_cache_size == 0)
+	return FALSE;
+
+    if (config->db_state == NULL) {
+	config->db_state = calloc(config->num_db,
+				  sizeof(config->db_state[0]));
+	if (config->db_state == NULL)
+	    return FALSE;
+    }
+    s = &config->db_state[i];
+    if (!s->probed) {
+	s->path = db_backing_file(config->db[i]);
+	s->probed = 1;
+    }
+    if (s->path == NULL)
+	return FALSE;
+
+    if (stat(s->path, &st) != 0) {
+	/* being replaced right now */
+	db_unkeep(context, config, i);
+	cache_flush(s);
+	s->stamped = 0;
+	return FALSE;
+    }
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    nsec = st.st_mtim.tv_nsec;
+#endif
+
+    if (s->stamped &&
+	st.st_dev == s->dev && st.st_ino == s->ino &&
+	st.st_size == s->size && st.st_mtime == s->mtime &&
+	nsec == s->mtime_nsec)
+	return TRUE;
+
+    if (s->stamped)
+	kdc_log(context, config, 4, "Database %s changed", s->path);
+    db_unkeep(context, config, i);
+    cache_flush(s);
+    s->stamped = 1;
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->size = st.st_size;
+    s->mtime = st.st_mtime;
+    s->mtime_nsec = nsec;
+    return TRUE;
+}
+
+/*
+ * Open database `i' for a fetch, or reuse the handle kept open from a
+ * previous request.  `watched' is the result of db_check().
+ */
+
+static krb5_error_code
+db_open(krb5_context context, krb5_kdc_configuration *config, int i,
+	krb5_boolean watched)
+{
+    HDB *db = config->db[i];
+    krb5_error_code ret;
+
+    if (!watched || !config->db_keep_open)
+	return db->hdb_open(context, db, O_RDONLY, 0);
+
+    if (config->db_state[i].open)
+	return 0;
+
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret)
+	return ret;
+    config->db_state[i].open = 1;
+    db->hdb_openp = 1;
+    return 0;
+}
+
+static void
+db_close(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    if (config->db_state != NULL && config->db_state[i].open)
+	return;
+    config->db[i]->hdb_close(context, config->db[i]);
+}
+
+/*
+ * Close database `i' if it is being kept open and forget its state
+ */
+
+void
+_kdc_db_release(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_state *s;
+
+    if (config->db_state == NULL)
+	return;
+    db_unkeep(context, config, i);
+    s = &config->db_state[i];
+    cache_flush(s);
+    free(s->buckets);
+    s->buckets = NULL;
+    s->nbuckets = 0;
+    free(s->path);
+    s->path = NULL;
+    s->probed = 0;
+    s->stamped = 0;
+}
+
+/**
+ * Return the number of hits and misses of the KDC's entry cache
+ * summed over all databases.  Like the cache itself, the counters are
+ * not locked: only the thread using `config' may call this.
+ */
+
+void
+krb5_kdc_get_entry_cache_stats(krb5_kdc_configuration *config,
+			       unsigned long *hits, unsigned long *misses)
+{
+    int i;
+
+    *hits = *misses = 0;
+    if (config->db_state == NULL)
+	return;
+    for (i = 0; i < config->num_db; i++) {
+	*hits += config->db_state[i].hits;
+	*misses += config->db_state[i].misses;
+    }
+}
 
 krb5_error_code
 _kdc_db_fetch(krb5_context context,
@@ -66,6 +466,8 @@ _kdc_db_fetch(krb5_context context,
     unsigned kvno = 0;
     krb5_principal enterprise_principal = NULL;
     krb5_const_principal princ;
+    struct timeval fetch_start;
+    char *cache_name = NULL;
 
     *h = NULL;
 
@@ -99,10 +501,26 @@ _kdc_db_fetch(krb5_context context,
             goto out;
     }
 
+    /* without a cache key we just don't use the cache */
+    if (config->entry_cache_size > 0 &&
+        krb5_unparse_name(context, principal, &cache_name) != 0)
+        cache_name = NULL;
+
     for (i = 0; i < config->num_db; i++) {
 	HDB *curdb = config->db[i];
+	krb5_boolean watched = db_check(context, config, i);
 
-	ret = curdb->hdb_open(context, curdb, O_RDONLY, 0);
+	if (watched && cache_name &&
+	    cache_lookup(context, config, i, cache_name, flags, kvno, ent) == 0) {
+	    ret = 0;
+	    if (db)
+		*db = curdb;
+	    *h = ent;
+	    ent = NULL;
+	    goto out;
+	}
+
+	ret = db_open(context, config, i, watched);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
@@ -114,8 +532,15 @@ _kdc_db_fetch(krb5_context context,
         if (!(curdb->hdb_capability_flags & HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL) && enterprise_principal)
             princ = enterprise_principal;
 
+	if (config->metrics)
+	    gettimeofday(&fetch_start, NULL);
         ret = hdb_fetch_kvno(context, curdb, princ, flags, 0, 0, kvno, ent);
-	curdb->hdb_close(context, curdb);
+	if (config->metrics)
+	    _kdc_metrics_hdb(config, &fetch_start);
+	db_close(context, config, i);
+
+	if (ret == 0 && watched && cache_name)
+	    cache_add(config, i, cache_name, flags, kvno, ent);
 
 	switch (ret) {
 	case HDB_ERR_WRONG_REALM:
@@ -154,6 +579,7 @@ out2:
     }
 out:
     krb5_free_principal(context, enterprise_principal);
+    free(cache_name);
     free(ent);
     return ret;
 }
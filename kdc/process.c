@@ -118,12 +118,15 @@ _kdc_audit_addaddrs(kdc_request_t r, HostAddresses *a, const char *key)
     }
 }
 
-void
-_kdc_audit_trail(kdc_request_t r, krb5_error_code ret)
+/*
+ * Return a symbolic name for some error codes, or NULL
+ */
+
+const char *
+_kdc_error_name(krb5_error_code ret)
 {
     const char *retname = NULL;
 
-    /* Get a symbolic name for some error codes */
 #define CASE(x)	case x : retname = #x; break
     switch (ret) {
     CASE(ENOMEM);
@@ -168,7 +171,13 @@ _kdc_audit_trail(kdc_request_t r, krb5_error_code ret)
 	retname += strlen(PREFIX);
 #undef PREFIX
 
-    heim_audit_trail((heim_svc_req_desc)r, ret, retname);
+    return retname;
+}
+
+void
+_kdc_audit_trail(kdc_request_t r, krb5_error_code ret)
+{
+    heim_audit_trail((heim_svc_req_desc)r, ret, _kdc_error_name(ret));
 }
 
 void
@@ -351,6 +360,8 @@ process_request(krb5_context context,
 	    if (prependlength && services[i].flags & KS_NO_LENGTH)
 		*prependlength = 0;
 
+	    _kdc_metrics_request(config, services[i].name, ret, &r->tv_start);
+
 	    if (r->use_request_t) {
 		gettimeofday(&r->tv_end, NULL);
 		_kdc_audit_trail(r, ret);
@@ -426,11 +437,11 @@ krb5_kdc_save_request(krb5_context context,
 		      const krb5_data *reply,
 		      const struct sockaddr *sa)
 {
-    krb5_storage *sp;
+    krb5_storage *sp, *fsp;
     krb5_address a;
     int fd, ret;
     uint32_t t;
-    krb5_data d;
+    krb5_data d, rec;
 
     memset(&a, 0, sizeof(a));
 
@@ -438,17 +449,13 @@ krb5_kdc_save_request(krb5_context context,
     d.length = len;
     t = _kdc_now.tv_sec;
 
-    fd = open(fn, O_WRONLY|O_CREAT|O_APPEND, 0600);
-    if (fd < 0) {
-	int saved_errno = errno;
-	krb5_set_error_message(context, saved_errno, "Failed to open: %s", fn);
-	return saved_errno;
-    }
-
-    sp = krb5_storage_from_fd(fd);
-    close(fd);
+    /*
+     * Build the whole record in memory so that it reaches the file in
+     * a single write(2) rather than one per field.
+     */
+    sp = krb5_storage_emem_capacity(len + 128);
     if (sp == NULL) {
-	krb5_set_error_message(context, ENOMEM, "Storage failed to open fd");
+	krb5_set_error_message(context, ENOMEM, "Storage failed to allocate");
 	return ENOMEM;
     }
 
@@ -476,6 +483,25 @@ krb5_kdc_save_request(krb5_context context,
     }
 
     krb5_free_address(context, &a);
+
+    if (krb5_storage_to_data(sp, &rec) != 0)
+	goto out;
+
+    fd = open(fn, O_WRONLY|O_CREAT|O_APPEND, 0600);
+    if (fd < 0) {
+	int saved_errno = errno;
+	krb5_data_free(&rec);
+	krb5_storage_free(sp);
+	krb5_set_error_message(context, saved_errno, "Failed to open: %s", fn);
+	return saved_errno;
+    }
+    fsp = krb5_storage_from_fd(fd);
+    close(fd);
+    if (fsp != NULL) {
+	(void) krb5_storage_write(fsp, rec.data, rec.length);
+	krb5_storage_free(fsp);
+    }
+    krb5_data_free(&rec);
 out:
     krb5_storage_free(sp);
 
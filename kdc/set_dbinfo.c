@@ -69,7 +69,6 @@ krb5_kdc_set_dbinfo(krb5_context context, struct krb5_kdc_configuration *c)
 {
     struct hdb_dbinfo *info, *d;
     krb5_error_code ret;
-    int i;
 
     /* fetch the databases */
     ret = hdb_get_dbinfo(context, &info);
@@ -98,16 +97,34 @@ krb5_kdc_set_dbinfo(krb5_context context, struct krb5_kdc_configuration *c)
 
     return 0;
 out:
-    for (i = 0; i < c->num_db; i++)
-	if (c->db[i] && c->db[i]->hdb_destroy)
+    krb5_kdc_free_dbinfo(context, c);
+    hdb_free_dbinfo(context, &info);
+
+    return ret;
+}
+
+/**
+ * Close and release the databases set up by krb5_kdc_set_dbinfo(),
+ * including any that are being kept open across requests.
+ */
+
+void
+krb5_kdc_free_dbinfo(krb5_context context, struct krb5_kdc_configuration *c)
+{
+    int i;
+
+    for (i = 0; i < c->num_db; i++) {
+	if (c->db[i] == NULL)
+	    continue;
+	_kdc_db_release(context, c, i);
+	if (c->db[i]->hdb_destroy)
 	    (*c->db[i]->hdb_destroy)(context, c->db[i]);
+    }
+    free(c->db_state);
+    c->db_state = NULL;
     c->num_db = 0;
     free(c->db);
     c->db = NULL;
-
-    hdb_free_dbinfo(context, &info);
-
-    return ret;
 }
 
 
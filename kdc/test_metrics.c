@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the latency histograms and the Prometheus text format of
+ * metrics.c.  It is compiled in here so that observe() can be called
+ * with known durations.
+ */
+
+#include "metrics.c"
+
+#include <err.h>
+
+/*
+ * _kdc_error_name() lives in process.c, which brings in the rest of
+ * the KDC; name just the one error this test records.
+ */
+const char *
+_kdc_error_name(krb5_error_code ret)
+{
+    return ret == KRB5KDC_ERR_PREAUTH_FAILED ?
+	"KRB5KDC_ERR_PREAUTH_FAILED" : NULL;
+}
+
+/* The upper bound of each bucket in seconds; bucket 1 is never output */
+static const char *le[KDC_METRICS_NBUCKETS] = {
+    "0.000001", NULL, "0.000002", "0.000003", "0.000005", "0.000007",
+    "0.000011", "0.000015", "0.000023", "0.000031", "0.000047", "0.000063",
+    "0.000095", "0.000127", "0.000191", "0.000255", "0.000383", "0.000511",
+    "0.000767", "0.001023", "0.001535", "0.002047", "0.003071", "0.004095",
+    "0.006143", "0.008191", "0.012287", "0.016383", "0.024575", "0.032767",
+    "0.049151", "0.065535", "0.098303", "0.131071", "0.196607", "0.262143",
+    "0.393215", "0.524287", "0.786431", "1.048575", "1.572863", "2.097151",
+    "3.145727", "4.194303", "6.291455", "8.388607", "12.582911",
+    "16.777215",
+};
+
+/* Durations on either side of bucket boundaries, and where they go */
+static const struct {
+    uint64_t usec;
+    int bucket;			/* -1 if past the last one */
+} observations[] = {
+    { 0, 0 },
+    { 1, 0 },
+    { 2, 2 },
+    { 3, 3 },
+    { 4, 4 },
+    { 5, 4 },
+    { 6, 5 },
+    { 7, 5 },
+    { 8, 6 },
+    { 767, 18 },
+    { 768, 19 },
+    { 1000, 19 },
+    { 1023, 19 },
+    { 1024, 20 },
+    { 16777215, 47 },
+    { 16777216, -1 },
+    { 1ULL << 40, -1 },
+};
+
+static void
+test_observe(void)
+{
+    struct kdc_histogram h;
+    size_t i;
+    unsigned j;
+
+    for (i = 0; i < sizeof(observations)/sizeof(observations[0]); i++) {
+	memset(&h, 0, sizeof(h));
+	observe(&h, observations[i].usec);
+	for (j = 0; j < KDC_METRICS_NBUCKETS; j++) {
+	    if (h.bucket[j] != (j == observations[i].bucket))
+		errx(1, "observe(%llu): bucket %u has %llu",
+		     (unsigned long long)observations[i].usec, j,
+		     (unsigned long long)h.bucket[j]);
+	}
+	if (h.count != 1)
+	    errx(1, "observe(%llu): count %llu",
+		 (unsigned long long)observations[i].usec,
+		 (unsigned long long)h.count);
+	if (h.sum != (observations[i].usec ? observations[i].usec : 1))
+	    errx(1, "observe(%llu): sum %llu",
+		 (unsigned long long)observations[i].usec,
+		 (unsigned long long)h.sum);
+    }
+}
+
+static char expected[64 * 1024];
+static size_t expected_len;
+
+static void
+expect(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(expected + expected_len,
+		  sizeof(expected) - expected_len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(expected) - expected_len)
+	errx(1, "expected output too long");
+    expected_len += n;
+}
+
+/*
+ * Expect a histogram whose buckets hold `counts' (indexed by bucket,
+ * zero elsewhere), `count' observations in all and `sum' seconds.
+ */
+static void
+expect_histogram(const char *name, const char *labels,
+		 const uint64_t *counts, uint64_t count, const char *sum)
+{
+    uint64_t cum = 0;
+    unsigned i;
+
+    for (i = 0; i < KDC_METRICS_NBUCKETS; i++) {
+	cum += counts[i];
+	if (le[i] != NULL)
+	    expect("%s_bucket{%s%sle=\"%s\"} %llu\n", name, labels,
+		   *labels ? "," : "", le[i], (unsigned long long)cum);
+    }
+    expect("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+	   *labels ? "," : "", (unsigned long long)count);
+    if (*labels) {
+	expect("%s_sum{%s} %s\n", name, labels, sum);
+	expect("%s_count{%s} %llu\n", name, labels,
+	       (unsigned long long)count);
+    } else {
+	expect("%s_sum %s\n", name, sum);
+	expect("%s_count %llu\n", name, (unsigned long long)count);
+    }
+}
+
+/*
+ * Two threads' worth of metrics, which krb5_kdc_metrics_format() must
+ * add up.
+ */
+static void
+test_format(krb5_context context)
+{
+    static struct kdc_metrics m[2];
+    uint64_t as[KDC_METRICS_NBUCKETS] = { 0 };
+    uint64_t tgs[KDC_METRICS_NBUCKETS] = { 0 };
+    uint64_t none[KDC_METRICS_NBUCKETS] = { 0 };
+    uint64_t hdb[KDC_METRICS_NBUCKETS] = { 0 };
+    krb5_error_code ret;
+    krb5_data data;
+
+    observe(&m[0].latency[KDC_METRICS_AS], 3);
+    observe(&m[0].latency[KDC_METRICS_AS], 1000);
+    observe(&m[1].latency[KDC_METRICS_AS], 767);
+    observe(&m[1].latency[KDC_METRICS_TGS], 768);
+    observe(&m[0].hdb, 16);
+    observe(&m[1].hdb, 1ULL << 24);
+    m[0].fast = 2;
+    m[1].fast = 1;
+    m[1].pkinit = 1;
+    m[0].errors[KRB5KDC_ERR_PREAUTH_FAILED - KRB5KDC_ERR_NONE] = 1;
+    m[1].errors[KRB5KDC_ERR_PREAUTH_FAILED - KRB5KDC_ERR_NONE] = 2;
+    m[1].errors[KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN - KRB5KDC_ERR_NONE] = 1;
+    m[0].errors[KDC_METRICS_NERRORS - 1] = 4;
+    m[0].queued = 1;
+    m[1].queued = 2;
+
+    as[3] = 1;
+    as[18] = 1;
+    as[19] = 1;
+    tgs[19] = 1;
+    hdb[8] = 1;
+
+    expect("# HELP kdc_requests_total Requests processed.\n"
+	   "# TYPE kdc_requests_total counter\n"
+	   "kdc_requests_total{type=\"AS\"} 3\n"
+	   "kdc_requests_total{type=\"TGS\"} 1\n"
+	   "kdc_requests_total{type=\"DIGEST\"} 0\n"
+	   "kdc_requests_total{type=\"KX509\"} 0\n"
+	   "kdc_requests_total{type=\"OTHER\"} 0\n"
+	   "# HELP kdc_fast_requests_total FAST-armored requests.\n"
+	   "# TYPE kdc_fast_requests_total counter\n"
+	   "kdc_fast_requests_total 3\n"
+	   "# HELP kdc_pkinit_total PKINIT pre-authentications.\n"
+	   "# TYPE kdc_pkinit_total counter\n"
+	   "kdc_pkinit_total 1\n"
+	   "# HELP kdc_errors_total Requests that failed, by Kerberos "
+	   "error code.\n"
+	   "# TYPE kdc_errors_total counter\n"
+	   "kdc_errors_total{code=\"6\"} 1\n"
+	   "kdc_errors_total{code=\"24\",name=\"KRB5KDC_ERR_PREAUTH_FAILED\"} 3\n"
+	   "kdc_errors_total{code=\"other\"} 4\n"
+	   "# HELP kdc_request_duration_seconds Request processing time.\n"
+	   "# TYPE kdc_request_duration_seconds histogram\n");
+    expect_histogram("kdc_request_duration_seconds", "type=\"AS\"",
+		     as, 3, "0.001770");
+    expect_histogram("kdc_request_duration_seconds", "type=\"TGS\"",
+		     tgs, 1, "0.000768");
+    expect_histogram("kdc_request_duration_seconds", "type=\"DIGEST\"",
+		     none, 0, "0.000000");
+    expect_histogram("kdc_request_duration_seconds", "type=\"KX509\"",
+		     none, 0, "0.000000");
+    expect_histogram("kdc_request_duration_seconds", "type=\"OTHER\"",
+		     none, 0, "0.000000");
+    expect("# HELP kdc_hdb_fetch_duration_seconds Time spent fetching "
+	   "entries from the HDB.\n"
+	   "# TYPE kdc_hdb_fetch_duration_seconds histogram\n");
+    expect_histogram("kdc_hdb_fetch_duration_seconds", "", hdb, 2,
+		     "16.777232");
+    expect("# HELP kdc_queue_depth Requests waiting for a request "
+	   "thread.\n"
+	   "# TYPE kdc_queue_depth gauge\n"
+	   "kdc_queue_depth 3\n");
+
+    ret = krb5_kdc_metrics_format(context, m, 2, &data);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kdc_metrics_format");
+    if (data.length != expected_len ||
+	memcmp(data.data, expected, expected_len) != 0) {
+	fprintf(stderr, "expected:\n%s\ngot:\n%.*s\n", expected,
+		(int)data.length, (char *)data.data);
+	errx(1, "krb5_kdc_metrics_format output differs");
+    }
+    krb5_data_free(&data);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+
+    setprogname(argv[0]);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+
+    test_observe();
+    test_format(context);
+
+    krb5_free_context(context);
+    return 0;
+}
@@ -65,12 +65,8 @@ static unsigned long
 data_hash(void *ptr)
 {
     heim_octet_string *os = ptr;
-    const unsigned char *s = os->data;
 
-    if (os->length < 4)
-	return os->length;
-    return s[0] | (s[1] << 8) |
-	(s[os->length - 2] << 16) | (s[os->length - 1] << 24);
+    return _heim_hash_bytes(os->data, os->length);
 }
 
 struct heim_type_data _heim_data_object = {
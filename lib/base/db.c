@@ -341,8 +341,8 @@ heim_db_create(const char *dbtype, const char *dbname,
     if (dbtype == NULL || *dbtype == '\0') {
 	struct dbtype_iter iter_ctx = { NULL, dbname, options, error};
 
-	/* Try all dbtypes */
-	heim_dict_iterate_f(db_plugins, &iter_ctx, dbtype_iter2create_f);
+	/* Try all dbtypes, always in the same order */
+	_heim_dict_iterate_sorted_f(db_plugins, &iter_ctx, dbtype_iter2create_f);
 	heim_release(options);
 	return iter_ctx.db;
     } else if (strstr(dbtype, "json")) {
@@ -582,7 +582,7 @@ heim_db_commit(heim_db_t db, heim_error_t *error)
 
     if (journal_fname != NULL) {
 	heim_array_t a;
-	heim_string_t journal_contents;
+	char *journal_contents = NULL;
 	size_t len, bytes;
 	int save_errno;
 
@@ -601,8 +601,20 @@ heim_db_commit(heim_db_t db, heim_error_t *error)
 	    heim_release(a);
 	    goto err;
 	}
-	journal_contents = heim_json_copy_serialize(a, 0, error);
+	ret = heim_json_serialize_size(a, 0, &len);
+	if (ret == 0) {
+	    journal_contents = malloc(len + 1);
+	    if (journal_contents == NULL)
+		ret = ENOMEM;
+	    else
+		ret = heim_json_serialize_buf(a, 0, journal_contents, len + 1,
+					      &len);
+	}
 	heim_release(a);
+	if (ret) {
+	    free(journal_contents);
+	    goto err;
+	}
 
 	/* Write replay log */
 	if (journal_fname != NULL) {
@@ -610,13 +622,12 @@ heim_db_commit(heim_db_t db, heim_error_t *error)
 
 	    ret = open_file(heim_string_get_utf8(journal_fname), 1, 0, &fd, error);
 	    if (ret) {
-		heim_release(journal_contents);
+		free(journal_contents);
 		goto err;
 	    }
-	    len = strlen(heim_string_get_utf8(journal_contents));
-	    bytes = write(fd, heim_string_get_utf8(journal_contents), len);
+	    bytes = write(fd, journal_contents, len);
 	    save_errno = errno;
-	    heim_release(journal_contents);
+	    free(journal_contents);
 	    ret = close(fd);
 	    if (bytes != len) {
 		/* Truncate replay log */
@@ -1281,7 +1292,7 @@ read_json(const char *dbname, heim_object_t *out, heim_error_t *error)
 	return 0;
     }
 
-    str = malloc(st.st_size + 1);
+    str = malloc(st.st_size);
     if (str == NULL) {
 	 (void) close(fd);
 	return HEIM_ENOMEM(error);
@@ -1297,8 +1308,7 @@ read_json(const char *dbname, heim_object_t *out, heim_error_t *error)
 			  (ret, N_("Could not read JSON DB %s: %s", ""),
 			   dbname, strerror(errno)));
     }
-    str[st.st_size] = '\0';
-    *out = heim_json_create(str, 10, 0, error);
+    *out = heim_json_create_with_bytes(str, st.st_size, 10, 0, error);
     free(str);
     if (*out == NULL)
 	return (error && *error) ? heim_error_get_code(*error) : EINVAL;
@@ -1309,6 +1319,8 @@ typedef struct json_db {
     heim_dict_t dict;
     heim_string_t dbname;
     heim_string_t bkpname;
+    char *buf;			/* serialization buffer, kept across syncs */
+    size_t bufsz;
     int fd;
     time_t last_read_time;
     unsigned int read_only:1;
@@ -1450,6 +1462,7 @@ json_db_close(void *db, heim_error_t *error)
     heim_release(jsondb->dbname);
     heim_release(jsondb->bkpname);
     heim_release(jsondb->dict);
+    free(jsondb->buf);
     heim_release(jsondb);
     return 0;
 }
@@ -1498,9 +1511,6 @@ json_db_sync(void *db, heim_error_t *error)
 {
     json_db_t jsondb = db;
     size_t len, bytes;
-    heim_error_t e;
-    heim_string_t json;
-    const char *json_text = NULL;
     int ret = 0;
     int fd = -1;
 #ifdef WIN32
@@ -1509,17 +1519,23 @@ json_db_sync(void *db, heim_error_t *error)
 
     heim_assert(jsondb->fd > -1, "DB not locked when sync attempted");
 
-    json = heim_json_copy_serialize(jsondb->dict, 0, &e);
-    if (json == NULL) {
-	if (error)
-	    *error = e;
-	else
-	    heim_release(e);
-	return heim_error_get_code(e);
-    }
+    ret = heim_json_serialize_size(jsondb->dict, 0, &len);
+    if (ret == 0 && len + 1 > jsondb->bufsz) {
+	char *buf = realloc(jsondb->buf, len + 1);
 
-    json_text = heim_string_get_utf8(json);
-    len = strlen(json_text);
+	if (buf == NULL) {
+	    ret = ENOMEM;
+	} else {
+	    jsondb->buf = buf;
+	    jsondb->bufsz = len + 1;
+	}
+    }
+    if (ret == 0)
+	ret = heim_json_serialize_buf(jsondb->dict, 0, jsondb->buf,
+				      jsondb->bufsz, &len);
+    if (ret)
+	return HEIM_ERROR(error, ret,
+			  (ret, N_("Could not serialize JSON DB", "")));
     errno = 0;
 
 #ifdef WIN32
@@ -1529,16 +1545,13 @@ json_db_sync(void *db, heim_error_t *error)
 	    break;
 	sleep(1);
     }
-    if (ret) {
-	heim_release(json);
+    if (ret)
 	return ret;
-    }
 #else
     fd = jsondb->fd;
 #endif /* WIN32 */
 
-    bytes = write(fd, json_text, len);
-    heim_release(json);
+    bytes = write(fd, jsondb->buf, len);
     if (bytes != len)
 	return errno ? errno : EIO;
     ret = fsync(fd);
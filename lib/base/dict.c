@@ -35,33 +35,62 @@
 
 #include "baselocl.h"
 
+/*
+ * Open addressing with linear probing over a power-of-two table of
+ * entries.  Deleted entries are left as tombstones (key DICT_DELETED)
+ * so that deleting during heim_dict_iterate_f() is safe; they are
+ * reused by later inserts and dropped when the table is rehashed.
+ *
+ * The table grows when it gets three quarters full.  Growing is
+ * incremental: the old table is kept next to the new one, lookups try
+ * both, and every insert moves a few old slots across until the old
+ * table is empty.  Nothing is moved while an iteration is running.
+ */
+
 struct hashentry {
-    struct hashentry **prev;
-    struct hashentry *next;
     heim_object_t key;
     heim_object_t value;
+    unsigned long hash;
 };
 
 struct heim_dict_data {
-    size_t size;
-    struct hashentry **tab;
+    size_t size;		/* slots in tab, a power of two */
+    size_t count;		/* live entries in tab */
+    size_t used;		/* live entries and tombstones in tab */
+    struct hashentry *tab;
+    struct hashentry *old;	/* table being drained into tab, or NULL */
+    size_t oldsize;
+    size_t oldcount;		/* live entries left in old */
+    size_t rehash;		/* next slot of old to move */
+    unsigned int iterating;
 };
 
+static char dict_deleted;
+#define DICT_DELETED ((heim_object_t)&dict_deleted)
+
+#define DICT_MIN_SIZE		8
+#define DICT_REHASH_STEP	16
+#define DICT_FULL(n, size)	((n) * 4 > (size) * 3)
+
 static void
 dict_dealloc(void *ptr)
 {
     heim_dict_t dict = ptr;
-    struct hashentry **h, *g, *i;
-
-    for (h = dict->tab; h < &dict->tab[dict->size]; ++h) {
-	for (g = h[0]; g; g = i) {
-	    i = g->next;
-	    heim_release(g->key);
-	    heim_release(g->value);
-	    free(g);
+    struct hashentry *tabs[2] = { dict->tab, dict->old };
+    size_t sizes[2] = { dict->size, dict->oldsize };
+    size_t i, t;
+
+    for (t = 0; t < 2; t++) {
+	if (tabs[t] == NULL)
+	    continue;
+	for (i = 0; i < sizes[t]; i++) {
+	    if (tabs[t][i].key == NULL || tabs[t][i].key == DICT_DELETED)
+		continue;
+	    heim_release(tabs[t][i].key);
+	    heim_release(tabs[t][i].value);
 	}
+	free(tabs[t]);
     }
-    free(dict->tab);
 }
 
 struct heim_type_data dict_object = {
@@ -75,32 +104,22 @@ struct heim_type_data dict_object = {
     NULL
 };
 
-static size_t
-isprime(size_t p)
-{
-    size_t q, i;
-
-    for(i = 2 ; i < p; i++) {
-	q = p / i;
-
-	if (i * q == p)
-	    return 0;
-	if (i * i > p)
-	    return 1;
-    }
-    return 1;
-}
+/*
+ * heim_get_hash() of pointers and small numbers has poor low bits;
+ * mix them before masking.
+ */
 
-static size_t
-findprime(size_t p)
+static unsigned long
+dict_hash(heim_object_t key)
 {
-    if (p % 2 == 0)
-	p++;
-
-    while (isprime(p) == 0)
-	p += 2;
-
-    return p;
+    uint64_t h = heim_get_hash(key);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (unsigned long)h;
 }
 
 /**
@@ -113,21 +132,21 @@ heim_dict_t
 heim_dict_create(size_t size)
 {
     heim_dict_t dict;
+    size_t n = DICT_MIN_SIZE;
 
-    dict = _heim_alloc_object(&dict_object, sizeof(*dict));
+    while (DICT_FULL(size, n) && n < ((size_t)-1) / 8)
+	n *= 2;
 
-    dict->size = findprime(size);
-    if (dict->size == 0) {
-	heim_release(dict);
+    dict = _heim_alloc_object(&dict_object, sizeof(*dict));
+    if (dict == NULL)
 	return NULL;
-    }
 
-    dict->tab = calloc(dict->size, sizeof(dict->tab[0]));
+    dict->tab = calloc(n, sizeof(dict->tab[0]));
     if (dict->tab == NULL) {
-	dict->size = 0;
 	heim_release(dict);
 	return NULL;
     }
+    dict->size = n;
 
     return dict;
 }
@@ -144,21 +163,116 @@ heim_dict_get_type_id(void)
     return HEIM_TID_DICT;
 }
 
-/* Intern search function */
+/* Intern search functions */
 
 static struct hashentry *
-_search(heim_dict_t dict, heim_object_t ptr)
+_search_tab(struct hashentry *tab, size_t size, heim_object_t ptr,
+	    unsigned long v)
 {
-    unsigned long v = heim_get_hash(ptr);
+    size_t mask = size - 1, i;
     struct hashentry *p;
 
-    for (p = dict->tab[v % dict->size]; p != NULL; p = p->next)
-	if (heim_cmp(ptr, p->key) == 0)
+    for (i = v & mask; (p = &tab[i])->key != NULL; i = (i + 1) & mask)
+	if (p->key != DICT_DELETED && p->hash == v && heim_cmp(ptr, p->key) == 0)
 	    return p;
 
     return NULL;
 }
 
+static struct hashentry *
+_search(heim_dict_t dict, heim_object_t ptr, unsigned long v, int *inold)
+{
+    struct hashentry *p;
+
+    *inold = 0;
+    p = _search_tab(dict->tab, dict->size, ptr, v);
+    if (p == NULL && dict->old != NULL) {
+	p = _search_tab(dict->old, dict->oldsize, ptr, v);
+	*inold = 1;
+    }
+    return p;
+}
+
+/* Put an entry whose key is known not to be in tab into tab */
+
+static void
+_insert(heim_dict_t dict, heim_object_t key, heim_object_t value,
+	unsigned long v)
+{
+    size_t mask = dict->size - 1, i;
+    struct hashentry *p;
+
+    for (i = v & mask; ; i = (i + 1) & mask) {
+	p = &dict->tab[i];
+	if (p->key == NULL) {
+	    dict->used++;
+	    break;
+	}
+	if (p->key == DICT_DELETED)
+	    break;
+    }
+    p->key = key;
+    p->value = value;
+    p->hash = v;
+    dict->count++;
+}
+
+/* Move up to n slots of the old table over */
+
+static void
+_rehash(heim_dict_t dict, size_t n)
+{
+    struct hashentry *p;
+
+    if (dict->old == NULL || dict->iterating)
+	return;
+
+    while (n-- > 0 && dict->oldcount > 0 && dict->rehash < dict->oldsize) {
+	p = &dict->old[dict->rehash++];
+	if (p->key == NULL || p->key == DICT_DELETED)
+	    continue;
+	_insert(dict, p->key, p->value, p->hash);
+	p->key = DICT_DELETED;
+	dict->oldcount--;
+    }
+    if (dict->oldcount == 0) {
+	free(dict->old);
+	dict->old = NULL;
+	dict->oldsize = 0;
+	dict->rehash = 0;
+    }
+}
+
+static int
+_grow(heim_dict_t dict)
+{
+    struct hashentry *tab;
+    size_t n = dict->size;
+
+    /* Finish any earlier rehash before starting another one */
+    _rehash(dict, (size_t)-1);
+    if (dict->old != NULL)
+	return EBUSY;
+
+    while (DICT_FULL(2 * (dict->count + 1), n))
+	n *= 2;
+
+    tab = calloc(n, sizeof(tab[0]));
+    if (tab == NULL)
+	return ENOMEM;
+
+    dict->old = dict->tab;
+    dict->oldsize = dict->size;
+    dict->oldcount = dict->count;
+    dict->rehash = 0;
+    dict->tab = tab;
+    dict->size = n;
+    dict->count = 0;
+    dict->used = 0;
+
+    return 0;
+}
+
 /**
  * Search for element in hash table
  *
@@ -172,7 +286,9 @@ heim_object_t
 heim_dict_get_value(heim_dict_t dict, heim_object_t key)
 {
     struct hashentry *p;
-    p = _search(dict, key);
+    int inold;
+
+    p = _search(dict, key, dict_hash(key), &inold);
     if (p == NULL)
 	return NULL;
 
@@ -192,7 +308,9 @@ heim_object_t
 heim_dict_copy_value(heim_dict_t dict, heim_object_t key)
 {
     struct hashentry *p;
-    p = _search(dict, key);
+    int inold;
+
+    p = _search(dict, key, dict_hash(key), &inold);
     if (p == NULL)
 	return NULL;
 
@@ -212,32 +330,32 @@ heim_dict_copy_value(heim_dict_t dict, heim_object_t key)
 int
 heim_dict_set_value(heim_dict_t dict, heim_object_t key, heim_object_t value)
 {
-    struct hashentry **tabptr, *h;
+    unsigned long v = dict_hash(key);
+    struct hashentry *h;
+    int inold, ret;
 
-    h = _search(dict, key);
+    h = _search(dict, key, v, &inold);
     if (h) {
-	heim_release(h->value);
-	h->value = heim_retain(value);
-    } else {
-	unsigned long v;
+	heim_object_t old = h->value;
 
-	h = malloc(sizeof(*h));
-	if (h == NULL)
-	    return ENOMEM;
-
-	h->key = heim_retain(key);
 	h->value = heim_retain(value);
+	heim_release(old);
+	return 0;
+    }
 
-	v = heim_get_hash(key);
-
-	tabptr = &dict->tab[v % dict->size];
-	h->next = *tabptr;
-	*tabptr = h;
-	h->prev = tabptr;
-	if (h->next)
-	    h->next->prev = &h->next;
+    if (DICT_FULL(dict->used + dict->oldcount + 1, dict->size)) {
+	if (dict->iterating) {
+	    /* Can't move entries under an iterator; keep a free slot */
+	    if (dict->used + 1 >= dict->size)
+		return EBUSY;
+	} else if ((ret = _grow(dict)) != 0) {
+	    return ret;
+	}
     }
 
+    _insert(dict, heim_retain(key), heim_retain(value), v);
+    _rehash(dict, DICT_REHASH_STEP);
+
     return 0;
 }
 
@@ -251,18 +369,24 @@ heim_dict_set_value(heim_dict_t dict, heim_object_t key, heim_object_t value)
 void
 heim_dict_delete_key(heim_dict_t dict, heim_object_t key)
 {
-    struct hashentry *h = _search(dict, key);
+    struct hashentry *h;
+    int inold;
 
+    h = _search(dict, key, dict_hash(key), &inold);
     if (h == NULL)
 	return;
 
     heim_release(h->key);
     heim_release(h->value);
+    h->key = DICT_DELETED;
+    h->value = NULL;
 
-    if ((*(h->prev) = h->next) != NULL)
-	h->next->prev = h->prev;
-
-    free(h);
+    if (inold) {
+	dict->oldcount--;
+	_rehash(dict, 0);
+    } else {
+	dict->count--;
+    }
 }
 
 /**
@@ -276,11 +400,70 @@ heim_dict_delete_key(heim_dict_t dict, heim_object_t key)
 void
 heim_dict_iterate_f(heim_dict_t dict, void *arg, heim_dict_iterator_f_t func)
 {
-    struct hashentry **h, *g;
+    struct hashentry *p;
+    size_t i;
+
+    dict->iterating++;
+    for (i = 0; i < dict->size; i++) {
+	p = &dict->tab[i];
+	if (p->key != NULL && p->key != DICT_DELETED)
+	    func(p->key, p->value, arg);
+    }
+    for (i = 0; dict->old != NULL && i < dict->oldsize; i++) {
+	p = &dict->old[i];
+	if (p->key != NULL && p->key != DICT_DELETED)
+	    func(p->key, p->value, arg);
+    }
+    dict->iterating--;
+}
 
-    for (h = dict->tab; h < &dict->tab[dict->size]; ++h)
-	for (g = *h; g; g = g->next)
-	    func(g->key, g->value, arg);
+static int
+hashentry_key_cmp(const void *a, const void *b)
+{
+    return heim_cmp(((const struct hashentry *)a)->key,
+		    ((const struct hashentry *)b)->key);
+}
+
+/*
+ * Like heim_dict_iterate_f(), but in heim_cmp() order of the keys.
+ * Keys hash with a per-process random key, so callers whose output or
+ * choices must not change from run to run iterate with this instead.
+ */
+
+void
+_heim_dict_iterate_sorted_f(heim_dict_t dict, void *arg,
+			    heim_dict_iterator_f_t func)
+{
+    struct hashentry *tabs[2] = { dict->tab, dict->old };
+    size_t sizes[2] = { dict->size, dict->old ? dict->oldsize : 0 };
+    struct hashentry *v, *p;
+    size_t i, n, t;
+
+    v = calloc(dict->count + dict->oldcount + 1, sizeof(v[0]));
+    if (v == NULL) {
+	heim_dict_iterate_f(dict, arg, func);
+	return;
+    }
+    for (t = 0, n = 0; t < 2; t++) {
+	for (i = 0; i < sizes[t]; i++) {
+	    p = &tabs[t][i];
+	    if (p->key == NULL || p->key == DICT_DELETED)
+		continue;
+	    v[n].key = heim_retain(p->key);
+	    v[n].value = heim_retain(p->value);
+	    n++;
+	}
+    }
+    qsort(v, n, sizeof(v[0]), hashentry_key_cmp);
+
+    /* func may change the dict, so it gets our references */
+    for (i = 0; i < n; i++)
+	func(v[i].key, v[i].value, arg);
+    for (i = 0; i < n; i++) {
+	heim_release(v[i].key);
+	heim_release(v[i].value);
+    }
+    free(v);
 }
 
 #ifdef __BLOCKS__
@@ -294,10 +477,20 @@ heim_dict_iterate_f(heim_dict_t dict, void *arg, heim_dict_iterator_f_t func)
 void
 heim_dict_iterate(heim_dict_t dict, void (^func)(heim_object_t, heim_object_t))
 {
-    struct hashentry **h, *g;
+    struct hashentry *p;
+    size_t i;
 
-    for (h = dict->tab; h < &dict->tab[dict->size]; ++h)
-	for (g = *h; g; g = g->next)
-	    func(g->key, g->value);
+    dict->iterating++;
+    for (i = 0; i < dict->size; i++) {
+	p = &dict->tab[i];
+	if (p->key != NULL && p->key != DICT_DELETED)
+	    func(p->key, p->value);
+    }
+    for (i = 0; dict->old != NULL && i < dict->oldsize; i++) {
+	p = &dict->old[i];
+	if (p->key != NULL && p->key != DICT_DELETED)
+	    func(p->key, p->value);
+    }
+    dict->iterating--;
 }
 #endif
@@ -219,6 +219,85 @@ heim_get_hash(heim_object_t ptr)
     return (unsigned long)ptr;
 }
 
+/*
+ * Hashing of strings and octet strings for heim_dict: SipHash-2-4 with
+ * a key chosen at random once per process, so that a peer can't pick
+ * keys that all land in the same bucket.
+ */
+
+static uint64_t hash_key[2];
+static heim_base_once_t hash_key_once = HEIM_BASE_ONCE_INIT;
+
+static void
+hash_key_init(void *arg)
+{
+    int ok = 0;
+#ifdef HAVE_ARC4RANDOM
+    hash_key[0] = ((uint64_t)arc4random() << 32) | arc4random();
+    hash_key[1] = ((uint64_t)arc4random() << 32) | arc4random();
+    ok = 1;
+#else
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+	ok = read(fd, hash_key, sizeof(hash_key)) == sizeof(hash_key);
+	close(fd);
+    }
+#endif
+    if (!ok) {
+	hash_key[0] ^= (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	hash_key[1] ^= (uint64_t)(uintptr_t)&ok ^ (uint64_t)(uintptr_t)arg;
+    }
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3)					\
+    do {								\
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+unsigned long
+_heim_hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t v0, v1, v2, v3, m, b = (uint64_t)len << 56;
+    size_t i, left = len & 7;
+
+    heim_base_once_f(&hash_key_once, NULL, hash_key_init);
+
+    v0 = hash_key[0] ^ 0x736f6d6570736575ULL;
+    v1 = hash_key[1] ^ 0x646f72616e646f6dULL;
+    v2 = hash_key[0] ^ 0x6c7967656e657261ULL;
+    v3 = hash_key[1] ^ 0x7465646279746573ULL;
+
+    for (; len >= 8; len -= 8, p += 8) {
+	for (m = 0, i = 0; i < 8; i++)
+	    m |= (uint64_t)p[i] << (8 * i);
+	v3 ^= m;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= m;
+    }
+    for (i = 0; i < left; i++)
+	b |= (uint64_t)p[i] << (8 * i);
+
+    v3 ^= b;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+
+    return (unsigned long)(v0 ^ v1 ^ v2 ^ v3);
+}
+
 /**
  * Compare two objects, returns 0 if equal, can use used for qsort()
  * and friends.
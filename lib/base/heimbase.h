@@ -472,6 +472,24 @@ heim_object_t heim_json_create_with_bytes(const void *, size_t, size_t,
 					  heim_error_t *);
 heim_string_t heim_json_copy_serialize(heim_object_t, heim_json_flags_t,
 				       heim_error_t *);
+int heim_json_serialize_size(heim_object_t, heim_json_flags_t, size_t *);
+int heim_json_serialize_buf(heim_object_t, heim_json_flags_t, char *, size_t,
+			    size_t *);
+
+struct heim_json_sax {
+    int (*begin_dict)(void *);
+    int (*end_dict)(void *);
+    int (*begin_array)(void *);
+    int (*end_array)(void *);
+    int (*key)(void *, const char *, size_t);
+    int (*string)(void *, const char *, size_t);
+    int (*number)(void *, int);
+    int (*boolean)(void *, int);
+    int (*null)(void *);
+};
+
+int heim_json_parse(const void *, size_t, size_t, heim_json_flags_t,
+		    const struct heim_json_sax *, void *, heim_error_t *);
 
 
 /*
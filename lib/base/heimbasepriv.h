@@ -102,6 +102,12 @@ _heim_type_get_tid(heim_type_t type);
 void
 _heim_make_permanent(heim_object_t ptr);
 
+unsigned long
+_heim_hash_bytes(const void *data, size_t len);
+
+void
+_heim_dict_iterate_sorted_f(heim_dict_t, void *, heim_dict_iterator_f_t);
+
 heim_data_t
 _heim_db_get_value(heim_db_t, heim_string_t, heim_data_t, heim_error_t *);
 
@@ -57,14 +57,6 @@ struct twojson {
     int first;
 };
 
-struct heim_strbuf {
-    char *str;
-    size_t len;
-    size_t alloced;
-    int	enomem;
-    heim_json_flags_t flags;
-};
-
 static int
 base2json(heim_object_t, struct twojson *);
 
@@ -157,7 +149,8 @@ base2json(heim_object_t obj, struct twojson *j)
 	j->indent++;
 	first = j->first;
 	j->first = 1;
-	heim_dict_iterate_f(obj, j, dict2json);
+	/* Keys in a stable order, so that output is the same every run */
+	_heim_dict_iterate_sorted_f(obj, j, dict2json);
 	j->indent--;
 	if (!j->first)
 	    j->out(j->ctx, "\n");
@@ -283,12 +276,36 @@ struct parse_ctx {
     heim_error_t error;
     size_t depth;
     heim_json_flags_t flags;
+    const struct heim_json_sax *cb;
+    void *cbctx;
+    char *scratch;		/* unescaped copies of quoted strings */
+    size_t scratchsz;
 };
 
 
-static heim_object_t
+static int
 parse_value(struct parse_ctx *ctx);
 
+/*
+ * Record the failure of a SAX callback, unless it already left a more
+ * specific error behind.
+ */
+static int
+sax_ret(struct parse_ctx *ctx, int ret)
+{
+    if (ret == 0)
+	return 0;
+    if (ctx->error == NULL) {
+	if (ret == ENOMEM)
+	    ctx->error = heim_error_create_enomem();
+	else
+	    ctx->error = heim_error_create(ret, "JSON parse aborted by "
+					   "callback at line %lu",
+					   ctx->lineno);
+    }
+    return -1;
+}
+
 /*
  * This function eats whitespace, but, critically, it also succeeds
  * only if there's anything left to parse.
@@ -306,6 +323,9 @@ white_spaces(struct parse_ctx *ctx)
 	    return 0;
 	(ctx->p)++;
     }
+    if (ctx->error == NULL)
+	ctx->error = heim_error_create(EINVAL, "ran out of JSON at line %lu",
+				       ctx->lineno);
     return -1;
 }
 
@@ -315,17 +335,16 @@ is_number(uint8_t n)
     return ('0' <= n && n <= '9');
 }
 
-static heim_number_t
+static int
 parse_number(struct parse_ctx *ctx)
 {
     int number = 0, neg = 1;
 
-    if (ctx->p >= ctx->pend)
-	return NULL;
-
     if (*ctx->p == '-') {
-	if (ctx->p + 1 >= ctx->pend)
-	    return NULL;
+	if (ctx->p + 1 >= ctx->pend) {
+	    ctx->error = heim_error_create(EINVAL, "ran out of number");
+	    return -1;
+	}
 	neg = -1;
 	ctx->p += 1;
     }
@@ -339,11 +358,18 @@ parse_number(struct parse_ctx *ctx)
 	ctx->p += 1;
     }
 
-    return heim_number_create(number * neg);
+    if (ctx->cb->number == NULL)
+	return 0;
+    return sax_ret(ctx, ctx->cb->number(ctx->cbctx, number * neg));
 }
 
-static heim_string_t
-parse_string(struct parse_ctx *ctx)
+/*
+ * Strings without escapes are handed to the callback straight out of
+ * the input; the rest are unescaped into a scratch buffer that is
+ * reused for the whole parse.
+ */
+static int
+parse_string(struct parse_ctx *ctx, int key)
 {
     const uint8_t *start;
     int quote = 0;
@@ -351,14 +377,14 @@ parse_string(struct parse_ctx *ctx)
     if (ctx->flags & HEIM_JSON_F_STRICT_STRINGS) {
 	ctx->error = heim_error_create(EINVAL, "Strict JSON string encoding "
 				       "not yet supported");
-	return NULL;
+	return -1;
     }
 
     if (*ctx->p != '"') {
 	ctx->error = heim_error_create(EINVAL, "Expected a JSON string but "
 				       "found something else at line %lu",
 				       ctx->lineno);
-	return NULL;
+	return -1;
     }
     start = ++ctx->p;
 
@@ -371,13 +397,22 @@ parse_string(struct parse_ctx *ctx)
 	    ctx->p++;
 	    quote = 1;
 	} else if (*ctx->p == '"') {
-	    heim_object_t o;
+	    const char *s = (const char *)start;
+	    size_t len = ctx->p - start;
 
 	    if (quote) {
-		char *p0, *p;
-		p = p0 = malloc(ctx->p - start);
-		if (p == NULL)
-		    goto out;
+		char *p;
+
+		if (ctx->scratchsz < len + 1) {
+		    p = realloc(ctx->scratch, len + 1);
+		    if (p == NULL) {
+			ctx->error = heim_error_create_enomem();
+			return -1;
+		    }
+		    ctx->scratch = p;
+		    ctx->scratchsz = len + 1;
+		}
+		p = ctx->scratch;
 		while (start < ctx->p) {
 		    if (*start == '\\') {
 			start++;
@@ -385,58 +420,28 @@ parse_string(struct parse_ctx *ctx)
 		    }
 		    *p++ = *start++;
 		}
-		o = heim_string_create_with_bytes(p0, p - p0);
-		free(p0);
-	    } else {
-		o = heim_string_create_with_bytes(start, ctx->p - start);
-		if (o == NULL) {
-		    ctx->error = heim_error_create_enomem();
-		    return NULL;
-		}
-
-		/* If we can decode as base64, then let's */
-		if (ctx->flags & HEIM_JSON_F_TRY_DECODE_DATA) {
-		    void *buf;
-		    size_t len;
-		    const char *s;
-
-		    s = heim_string_get_utf8(o);
-		    len = strlen(s);
-
-		    if (len >= 4 && strspn(s, base64_chars) >= len - 2) {
-			buf = malloc(len);
-			if (buf == NULL) {
-			    heim_release(o);
-			    ctx->error = heim_error_create_enomem();
-			    return NULL;
-			}
-			len = rk_base64_decode(s, buf);
-			if (len == -1) {
-			    free(buf);
-			    return o;
-			}
-			heim_release(o);
-			o = heim_data_ref_create(buf, len, free);
-		    }
-		}
+		*p = '\0';
+		s = ctx->scratch;
+		len = p - ctx->scratch;
 	    }
 	    ctx->p += 1;
 
-	    return o;
+	    if (key && ctx->cb->key != NULL)
+		return sax_ret(ctx, ctx->cb->key(ctx->cbctx, s, len));
+	    if (ctx->cb->string == NULL)
+		return 0;
+	    return sax_ret(ctx, ctx->cb->string(ctx->cbctx, s, len));
 	}
 	ctx->p += 1;
     }
     out:
     ctx->error = heim_error_create(EINVAL, "ran out of string");
-    return NULL;
+    return -1;
 }
 
 static int
-parse_pair(heim_dict_t dict, struct parse_ctx *ctx)
+parse_pair(struct parse_ctx *ctx)
 {
-    heim_string_t key;
-    heim_object_t value;
-
     if (white_spaces(ctx))
 	return -1;
 
@@ -445,44 +450,34 @@ parse_pair(heim_dict_t dict, struct parse_ctx *ctx)
 	return 0;
     }
 
-    if (ctx->flags & HEIM_JSON_F_STRICT_DICT)
+    if (*ctx->p == '"') {
+	if (parse_string(ctx, 1))
+	    return -1;
+    } else if (ctx->flags & HEIM_JSON_F_STRICT_DICT) {
 	/* JSON allows only string keys */
-	key = parse_string(ctx);
-    else
+	(void) parse_string(ctx, 1);
+	return -1;
+    } else if (parse_value(ctx)) {
 	/* heim_dict_t allows any heim_object_t as key */
-	key = parse_value(ctx);
-    if (key == NULL)
-	/* Even heim_dict_t does not allow C NULLs as keys though! */
 	return -1;
+    }
 
-    if (white_spaces(ctx)) {
-	heim_release(key);
+    if (white_spaces(ctx))
 	return -1;
-    }
 
     if (*ctx->p != ':') {
-	heim_release(key);
+	ctx->error = heim_error_create(EINVAL, "Expected ':' at line %lu",
+				       ctx->lineno);
 	return -1;
     }
 
     ctx->p += 1; /* safe because we call white_spaces() next */
 
-    if (white_spaces(ctx)) {
-	heim_release(key);
+    if (white_spaces(ctx))
 	return -1;
-    }
 
-    value = parse_value(ctx);
-    if (value == NULL &&
-	(ctx->error != NULL || (ctx->flags & HEIM_JSON_F_NO_C_NULL))) {
-	if (ctx->error == NULL)
-	    ctx->error = heim_error_create(EINVAL, "Invalid JSON encoding");
-	heim_release(key);
+    if (parse_value(ctx))
 	return -1;
-    }
-    heim_dict_set_value(dict, key, value);
-    heim_release(key);
-    heim_release(value);
 
     if (white_spaces(ctx))
 	return -1;
@@ -497,68 +492,36 @@ parse_pair(heim_dict_t dict, struct parse_ctx *ctx)
 	ctx->p++;
 	return 1;
     }
+    ctx->error = heim_error_create(EINVAL, "Expected ',' or '}' at line %lu",
+				   ctx->lineno);
     return -1;
 }
 
-static heim_dict_t
+static int
 parse_dict(struct parse_ctx *ctx)
 {
-    heim_dict_t dict;
-    size_t count = 0;
     int ret;
 
     heim_assert(*ctx->p == '{', "string doesn't start with {");
 
-    dict = heim_dict_create(11);
-    if (dict == NULL) {
-	ctx->error = heim_error_create_enomem();
-	return NULL;
-    }
+    if (ctx->cb->begin_dict != NULL &&
+	sax_ret(ctx, ctx->cb->begin_dict(ctx->cbctx)))
+	return -1;
 
     ctx->p += 1; /* safe because parse_pair() calls white_spaces() first */
 
-    while ((ret = parse_pair(dict, ctx)) > 0)
-	count++;
-    if (ret < 0) {
-	heim_release(dict);
-	return NULL;
-    }
-    if (count == 1 && !(ctx->flags & HEIM_JSON_F_NO_DATA_DICT)) {
-	heim_object_t v = heim_dict_copy_value(dict, heim_tid_data_uuid_key);
-
-	/*
-	 * Binary data encoded as a dict with a single magic key with
-	 * base64-encoded value?  Decode as heim_data_t.
-	 */
-	if (v != NULL && heim_get_tid(v) == HEIM_TID_STRING) {
-	    void *buf;
-	    size_t len;
-
-	    buf = malloc(strlen(heim_string_get_utf8(v)));
-	    if (buf == NULL) {
-		heim_release(dict);
-		heim_release(v);
-		ctx->error = heim_error_create_enomem();
-		return NULL;
-	    }
-	    len = rk_base64_decode(heim_string_get_utf8(v), buf);
-	    heim_release(v);
-	    if (len == -1) {
-		free(buf);
-		return dict; /* assume aliasing accident */
-	    }
-	    heim_release(dict);
-	    return (heim_dict_t)heim_data_ref_create(buf, len, free);
-	}
-    }
-    return dict;
+    while ((ret = parse_pair(ctx)) > 0)
+	;
+    if (ret < 0)
+	return -1;
+    if (ctx->cb->end_dict == NULL)
+	return 0;
+    return sax_ret(ctx, ctx->cb->end_dict(ctx->cbctx));
 }
 
 static int
-parse_item(heim_array_t array, struct parse_ctx *ctx)
+parse_item(struct parse_ctx *ctx)
 {
-    heim_object_t value;
-
     if (white_spaces(ctx))
 	return -1;
 
@@ -567,14 +530,9 @@ parse_item(heim_array_t array, struct parse_ctx *ctx)
 	return 0;
     }
 
-    value = parse_value(ctx);
-    if (value == NULL &&
-	(ctx->error || (ctx->flags & HEIM_JSON_F_NO_C_NULL)))
+    if (parse_value(ctx))
 	return -1;
 
-    heim_array_append_value(array, value);
-    heim_release(value);
-
     if (white_spaces(ctx))
 	return -1;
 
@@ -585,54 +543,60 @@ parse_item(heim_array_t array, struct parse_ctx *ctx)
 	ctx->p++;
 	return 1;
     }
+    ctx->error = heim_error_create(EINVAL, "Expected ',' or ']' at line %lu",
+				   ctx->lineno);
     return -1;
 }
 
-static heim_array_t
+static int
 parse_array(struct parse_ctx *ctx)
 {
-    heim_array_t array = heim_array_create();
     int ret;
 
     heim_assert(*ctx->p == '[', "array doesn't start with [");
+
+    if (ctx->cb->begin_array != NULL &&
+	sax_ret(ctx, ctx->cb->begin_array(ctx->cbctx)))
+	return -1;
+
     ctx->p += 1;
 
-    while ((ret = parse_item(array, ctx)) > 0)
+    while ((ret = parse_item(ctx)) > 0)
 	;
-    if (ret < 0) {
-	heim_release(array);
-	return NULL;
-    }
-    return array;
+    if (ret < 0)
+	return -1;
+    if (ctx->cb->end_array == NULL)
+	return 0;
+    return sax_ret(ctx, ctx->cb->end_array(ctx->cbctx));
 }
 
-static heim_object_t
+static int
 parse_value(struct parse_ctx *ctx)
 {
     size_t len;
-    heim_object_t o;
+    int ret;
 
     if (white_spaces(ctx))
-	return NULL;
+	return -1;
 
     if (*ctx->p == '"') {
-	return parse_string(ctx);
+	return parse_string(ctx, 0);
     } else if (*ctx->p == '{') {
 	if (ctx->depth-- == 1) {
 	    ctx->error = heim_error_create(EINVAL, "JSON object too deep");
-	    return NULL;
+	    return -1;
 	}
-	o = parse_dict(ctx);
+	ret = parse_dict(ctx);
 	ctx->depth++;
-	return o;
+	return ret;
     } else if (*ctx->p == '[') {
 	if (ctx->depth-- == 1) {
 	    ctx->error = heim_error_create(EINVAL, "JSON object too deep");
-	    return NULL;
+	    return -1;
 	}
-	o = parse_array(ctx);
+	ret = parse_array(ctx);
 	ctx->depth++;
-	return o;
+	return ret;
     } else if (is_number(*ctx->p) || *ctx->p == '-') {
 	return parse_number(ctx);
     }
@@ -642,25 +606,289 @@ parse_value(struct parse_ctx *ctx)
     if ((ctx->flags & HEIM_JSON_F_NO_C_NULL) == 0 &&
 	len >= 6 && memcmp(ctx->p, "<NULL>", 6) == 0) {
 	ctx->p += 6;
-	return heim_null_create();
+	return ctx->cb->null == NULL ? 0 :
+	    sax_ret(ctx, ctx->cb->null(ctx->cbctx));
     } else if (len >= 4 && memcmp(ctx->p, "null", 4) == 0) {
 	ctx->p += 4;
-	return heim_null_create();
+	return ctx->cb->null == NULL ? 0 :
+	    sax_ret(ctx, ctx->cb->null(ctx->cbctx));
     } else if (len >= 4 && strncasecmp((char *)ctx->p, "true", 4) == 0) {
 	ctx->p += 4;
-	return heim_bool_create(1);
+	return ctx->cb->boolean == NULL ? 0 :
+	    sax_ret(ctx, ctx->cb->boolean(ctx->cbctx, 1));
     } else if (len >= 5 && strncasecmp((char *)ctx->p, "false", 5) == 0) {
 	ctx->p += 5;
-	return heim_bool_create(0);
+	return ctx->cb->boolean == NULL ? 0 :
+	    sax_ret(ctx, ctx->cb->boolean(ctx->cbctx, 0));
     }
 
     ctx->error = heim_error_create(EINVAL, "unknown char %c at %lu line %lu",
 				   (char)*ctx->p, 
 				   (unsigned long)(ctx->p - ctx->pstart),
 				   ctx->lineno);
-    return NULL;
+    return -1;
 }
 
+/**
+ * Parse one JSON value, reporting what is found to a set of callbacks
+ * instead of building objects.
+ *
+ * Dicts and arrays are bracketed by begin/end events; dict members
+ * arrive as alternating key and value events.  String keys go to the
+ * key callback when there is one and to the string callback otherwise;
+ * unless HEIM_JSON_F_STRICT_DICT is given keys may be any value, and
+ * other keys are reported with their usual events.  Strings are not
+ * NUL-terminated and are only valid for the duration of the callback.
+ * Callbacks may be NULL, and a callback returning non-zero stops the
+ * parse with that error code.
+ *
+ * @param data JSON text
+ * @param length length of data
+ * @param max_depth maximum nesting of dicts and arrays
+ * @param flags parsing flags
+ * @param cb callbacks
+ * @param cbctx context passed to the callbacks
+ * @param error error object on failure
+ *
+ * @return 0 on success, or an error code
+ *
+ * @addtogroup heimbase
+ */
+int
+heim_json_parse(const void *data, size_t length, size_t max_depth,
+		heim_json_flags_t flags, const struct heim_json_sax *cb,
+		void *cbctx, heim_error_t *error)
+{
+    struct parse_ctx ctx;
+    int ret = 0;
+
+    ctx.lineno = 1;
+    ctx.p = data;
+    ctx.pstart = data;
+    ctx.pend = ((uint8_t *)data) + length;
+    ctx.error = NULL;
+    ctx.flags = flags;
+    ctx.depth = max_depth;
+    ctx.cb = cb;
+    ctx.cbctx = cbctx;
+    ctx.scratch = NULL;
+    ctx.scratchsz = 0;
+
+    if (parse_value(&ctx)) {
+	if (ctx.error == NULL)
+	    ctx.error = heim_error_create(EINVAL, "Invalid JSON encoding");
+	ret = ctx.error ? heim_error_get_code(ctx.error) : EINVAL;
+	if (error)
+	    *error = ctx.error;
+	else
+	    heim_release(ctx.error);
+    }
+    free(ctx.scratch);
+    return ret;
+}
+
+/*
+ * Building objects from the SAX events; one frame per open dict or
+ * array.
+ */
+#define JSON_TREE_FRAMES 16
+
+struct json_frame {
+    heim_object_t obj;
+    heim_object_t key;
+    size_t count;
+};
+
+struct json_tree {
+    heim_json_flags_t flags;
+    heim_object_t result;
+    struct json_frame *stack;
+    size_t nframes;
+    size_t nalloced;
+    struct json_frame frames[JSON_TREE_FRAMES];
+};
+
+/* Takes ownership of o */
+static int
+tree_add(struct json_tree *t, heim_object_t o)
+{
+    struct json_frame *f;
+    int ret = 0;
+
+    if (o == NULL)
+	return ENOMEM;
+    if (t->nframes == 0) {
+	t->result = o;
+	return 0;
+    }
+    f = &t->stack[t->nframes - 1];
+    if (heim_get_tid(f->obj) == HEIM_TID_ARRAY) {
+	ret = heim_array_append_value(f->obj, o);
+    } else if (f->key == NULL) {
+	f->key = o;
+	return 0;
+    } else {
+	ret = heim_dict_set_value(f->obj, f->key, o);
+	heim_release(f->key);
+	f->key = NULL;
+	f->count++;
+    }
+    heim_release(o);
+    return ret;
+}
+
+static int
+tree_push(struct json_tree *t, heim_object_t o)
+{
+    struct json_frame *f;
+
+    if (o == NULL)
+	return ENOMEM;
+    if (t->nframes == t->nalloced) {
+	size_t n = t->nalloced * 2;
+
+	if (t->stack == t->frames) {
+	    f = malloc(n * sizeof (*f));
+	    if (f != NULL)
+		memcpy(f, t->frames, sizeof (t->frames));
+	} else {
+	    f = realloc(t->stack, n * sizeof (*f));
+	}
+	if (f == NULL) {
+	    heim_release(o);
+	    return ENOMEM;
+	}
+	t->stack = f;
+	t->nalloced = n;
+    }
+    f = &t->stack[t->nframes++];
+    f->obj = o;
+    f->key = NULL;
+    f->count = 0;
+    return 0;
+}
+
+static int
+tree_begin_dict(void *ctx)
+{
+    return tree_push(ctx, heim_dict_create(11));
+}
+
+static int
+tree_begin_array(void *ctx)
+{
+    return tree_push(ctx, heim_array_create());
+}
+
+static int
+tree_end_array(void *ctx)
+{
+    struct json_tree *t = ctx;
+
+    return tree_add(t, t->stack[--t->nframes].obj);
+}
+
+static int
+tree_end_dict(void *ctx)
+{
+    struct json_tree *t = ctx;
+    struct json_frame *f = &t->stack[--t->nframes];
+    heim_object_t dict = f->obj;
+
+    if (f->count == 1 && !(t->flags & HEIM_JSON_F_NO_DATA_DICT)) {
+	heim_object_t v = heim_dict_copy_value(dict, heim_tid_data_uuid_key);
+
+	/*
+	 * Binary data encoded as a dict with a single magic key with
+	 * base64-encoded value?  Decode as heim_data_t.
+	 */
+	if (v != NULL && heim_get_tid(v) == HEIM_TID_STRING) {
+	    void *buf;
+	    size_t len;
+
+	    buf = malloc(strlen(heim_string_get_utf8(v)));
+	    if (buf == NULL) {
+		heim_release(dict);
+		heim_release(v);
+		return ENOMEM;
+	    }
+	    len = rk_base64_decode(heim_string_get_utf8(v), buf);
+	    if (len == -1) {
+		free(buf); /* assume aliasing accident */
+	    } else {
+		heim_release(dict);
+		dict = heim_data_ref_create(buf, len, free);
+	    }
+	}
+	heim_release(v);
+    }
+    return tree_add(t, dict);
+}
+
+static int
+tree_string(void *ctx, const char *s, size_t len)
+{
+    struct json_tree *t = ctx;
+    heim_object_t o;
+
+    o = heim_string_create_with_bytes(s, len);
+    if (o == NULL)
+	return ENOMEM;
+
+    /* If we can decode as base64, then let's */
+    if (t->flags & HEIM_JSON_F_TRY_DECODE_DATA) {
+	void *buf;
+
+	s = heim_string_get_utf8(o);
+	len = strlen(s);
+
+	if (len >= 4 && strspn(s, base64_chars) >= len - 2) {
+	    buf = malloc(len);
+	    if (buf == NULL) {
+		heim_release(o);
+		return ENOMEM;
+	    }
+	    len = rk_base64_decode(s, buf);
+	    if (len == -1) {
+		free(buf);
+	    } else {
+		heim_release(o);
+		o = heim_data_ref_create(buf, len, free);
+	    }
+	}
+    }
+    return tree_add(t, o);
+}
+
+static int
+tree_number(void *ctx, int n)
+{
+    return tree_add(ctx, heim_number_create(n));
+}
+
+static int
+tree_boolean(void *ctx, int b)
+{
+    return tree_add(ctx, heim_bool_create(b));
+}
+
+static int
+tree_null(void *ctx)
+{
+    return tree_add(ctx, heim_null_create());
+}
+
+static const struct heim_json_sax tree_sax = {
+    tree_begin_dict,
+    tree_end_dict,
+    tree_begin_array,
+    tree_end_array,
+    NULL,
+    tree_string,
+    tree_number,
+    tree_boolean,
+    tree_null
+};
 
 heim_object_t
 heim_json_create(const char *string, size_t max_depth, heim_json_flags_t flags,
@@ -674,28 +902,31 @@ heim_object_t
 heim_json_create_with_bytes(const void *data, size_t length, size_t max_depth,
 			    heim_json_flags_t flags, heim_error_t *error)
 {
-    struct parse_ctx ctx;
-    heim_object_t o;
+    struct json_tree t;
+    int ret;
 
     heim_base_once_f(&heim_json_once, NULL, json_init_once);
 
-    ctx.lineno = 1;
-    ctx.p = data;
-    ctx.pstart = data;
-    ctx.pend = ((uint8_t *)data) + length;
-    ctx.error = NULL;
-    ctx.flags = flags;
-    ctx.depth = max_depth;
-
-    o = parse_value(&ctx);
-
-    if (o == NULL && error) {
-	*error = ctx.error;
-    } else if (ctx.error) {
-	heim_release(ctx.error);
+    t.flags = flags;
+    t.result = NULL;
+    t.stack = t.frames;
+    t.nframes = 0;
+    t.nalloced = JSON_TREE_FRAMES;
+
+    ret = heim_json_parse(data, length, max_depth, flags, &tree_sax, &t,
+			  error);
+    if (ret) {
+	while (t.nframes > 0) {
+	    t.nframes--;
+	    heim_release(t.stack[t.nframes].obj);
+	    heim_release(t.stack[t.nframes].key);
+	}
+	heim_release(t.result);
+	t.result = NULL;
     }
-
-    return o;
+    if (t.stack != t.frames)
+	free(t.stack);
+    return t.result;
 }
 
 
@@ -720,14 +951,39 @@ heim_show(heim_object_t obj)
     heim_base2json(obj, stderr, HEIM_JSON_F_NO_DATA_DICT, show_printf);
 }
 
-static void
-strbuf_add(void *ctx, const char *str)
-{
-    struct heim_strbuf *strbuf = ctx;
+/*
+ * Output sink for the serializer.  Bytes go into a caller-supplied
+ * buffer for as long as they fit and are counted regardless, so one
+ * pass with no buffer yields the exact size needed by a second pass.
+ *
+ * The serializer sometimes takes back a '\n' it has already emitted,
+ * so we remember the last few bytes even when there's no buffer.
+ */
+#define JSON_SINK_TAIL 8
+
+struct json_sink {
+    char *buf;
+    size_t size;
     size_t len;
+    heim_json_flags_t flags;
+    size_t ntail;
+    char tail[JSON_SINK_TAIL];
+};
 
-    if (strbuf->enomem)
+static void
+sink_unput(struct json_sink *sink)
+{
+    if (sink->ntail == 0 || sink->tail[sink->ntail - 1] != '\n')
 	return;
+    sink->ntail--;
+    sink->len--;
+}
+
+static void
+sink_add(void *ctx, const char *str)
+{
+    struct json_sink *sink = ctx;
+    size_t len, keep;
 
     if (str == NULL) {
 	/*
@@ -735,77 +991,139 @@ strbuf_add(void *ctx, const char *str)
 	 * and array items so that the ',' separating them is never
 	 * preceded by a '\n'.
 	 */
-	if (strbuf->len > 0 && strbuf->str[strbuf->len - 1] == '\n')
-	    strbuf->len--;
+	sink_unput(sink);
 	return;
     }
 
     len = strlen(str);
-    if ((len + 1) > (strbuf->alloced - strbuf->len)) {
-	size_t new_len = strbuf->alloced + (strbuf->alloced >> 2) + len + 1;
-	char *s;
-
-	s = realloc(strbuf->str, new_len);
-	if (s == NULL) {
-	    strbuf->enomem = 1;
-	    return;
-	}
-	strbuf->str = s;
-	strbuf->alloced = new_len;
+    if (len == 0)
+	return;
+    if (sink->buf != NULL && sink->len < sink->size)
+	memcpy(sink->buf + sink->len, str,
+	       min(len, sink->size - sink->len));
+    sink->len += len;
+
+    keep = min(len, JSON_SINK_TAIL);
+    if (sink->ntail + keep > JSON_SINK_TAIL) {
+	size_t drop = sink->ntail + keep - JSON_SINK_TAIL;
+
+	memmove(sink->tail, sink->tail + drop, sink->ntail - drop);
+	sink->ntail -= drop;
     }
-    /* +1 so we copy the NUL */
-    (void) memcpy(strbuf->str + strbuf->len, str, len + 1);
-    strbuf->len += len;
-    if (strbuf->str[strbuf->len - 1] == '\n' && 
-	strbuf->flags & HEIM_JSON_F_ONE_LINE)
-	strbuf->len--;
+    memcpy(sink->tail + sink->ntail, str + len - keep, keep);
+    sink->ntail += keep;
+
+    if (sink->flags & HEIM_JSON_F_ONE_LINE)
+	sink_unput(sink);
 }
 
-#define STRBUF_INIT_SZ 64
+static int
+json_serialize(heim_object_t obj, heim_json_flags_t flags, char *buf,
+	       size_t size, size_t *len)
+{
+    struct json_sink sink;
+    int ret;
+
+    memset(&sink, 0, sizeof (sink));
+    sink.buf = buf;
+    sink.size = size;
+    sink.flags = flags;
+
+    ret = heim_base2json(obj, &sink, flags, sink_add);
+    if (ret)
+	return ret;
+    if (flags & HEIM_JSON_F_ONE_LINE) {
+	sink.flags &= ~HEIM_JSON_F_ONE_LINE;
+	sink_add(&sink, "\n");
+    }
+    *len = sink.len;
+    if (buf == NULL)
+	return 0;
+    if (sink.len >= size)
+	return ERANGE;
+    buf[sink.len] = '\0';
+    return 0;
+}
+
+/**
+ * Compute the length of the JSON encoding of an object, not counting
+ * the terminating NUL.
+ *
+ * @param obj object to encode
+ * @param flags encoding flags, as for heim_json_copy_serialize()
+ * @param len the length of the encoding
+ *
+ * @return 0 on success, or an error code
+ *
+ * @addtogroup heimbase
+ */
+int
+heim_json_serialize_size(heim_object_t obj, heim_json_flags_t flags,
+			 size_t *len)
+{
+    *len = 0;
+    return json_serialize(obj, flags, NULL, 0, len);
+}
+
+/**
+ * Encode an object as JSON into a caller-supplied buffer.
+ *
+ * @param obj object to encode
+ * @param flags encoding flags, as for heim_json_copy_serialize()
+ * @param buf buffer to write the NUL-terminated encoding to
+ * @param size size of buf
+ * @param len the length of the encoding, not counting the NUL; set
+ *        even when buf is too small
+ *
+ * @return 0 on success, ERANGE if buf is too small, or an error code
+ *
+ * @addtogroup heimbase
+ */
+int
+heim_json_serialize_buf(heim_object_t obj, heim_json_flags_t flags,
+			char *buf, size_t size, size_t *len)
+{
+    *len = 0;
+    if (buf == NULL)
+	return EINVAL;
+    return json_serialize(obj, flags, buf, size, len);
+}
 
 heim_string_t
 heim_json_copy_serialize(heim_object_t obj, heim_json_flags_t flags, heim_error_t *error)
 {
     heim_string_t str;
-    struct heim_strbuf strbuf;
+    size_t len, len2;
+    char *buf;
     int ret;
 
     if (error)
 	*error = NULL;
 
-    memset(&strbuf, 0, sizeof (strbuf));
-    strbuf.str = malloc(STRBUF_INIT_SZ);
-    if (strbuf.str == NULL) {
-	if (error)
-	    *error = heim_error_create_enomem();
-	return NULL;
+    ret = heim_json_serialize_size(obj, flags, &len);
+    if (ret == 0) {
+	buf = malloc(len + 1);
+	if (buf == NULL)
+	    ret = ENOMEM;
+	else if ((ret = heim_json_serialize_buf(obj, flags, buf, len + 1,
+						&len2)) != 0)
+	    free(buf);
     }
-    strbuf.len = 0;
-    strbuf.alloced = STRBUF_INIT_SZ;
-    strbuf.str[0] = '\0';
-    strbuf.flags = flags;
-
-    ret = heim_base2json(obj, &strbuf, flags, strbuf_add);
-    if (ret || strbuf.enomem) {
+    if (ret) {
 	if (error) {
-	    if (strbuf.enomem || ret == ENOMEM)
+	    if (ret == ENOMEM)
 		*error = heim_error_create_enomem();
 	    else
 		*error = heim_error_create(1, "Impossible to JSON-encode "
 					   "object");
 	}
-	free(strbuf.str);
 	return NULL;
     }
-    if (flags & HEIM_JSON_F_ONE_LINE) {
-	strbuf.flags &= ~HEIM_JSON_F_ONE_LINE;
-	strbuf_add(&strbuf, "\n");
-    }
-    str = heim_string_ref_create(strbuf.str, free);
+    str = heim_string_ref_create(buf, free);
     if (str == NULL) {
 	if (error)
 	    *error = heim_error_create_enomem();
-	free(strbuf.str);
+	free(buf);
     }
     return str;
 }
@@ -46,6 +46,9 @@ struct heim_log_facility_internal {
     int max;
     heim_log_log_func_t log_func;
     heim_log_close_func_t close_func;
+    void (*flush_func)(void *);
+    void (*audit_func)(heim_svc_req_desc, heim_error_code, const char *,
+                       void *);
     void *data;
 };
 
@@ -175,6 +178,8 @@ heim_addlog_func(heim_context context,
     fp->max = max;
     fp->log_func = log_func;
     fp->close_func = close_func;
+    fp->flush_func = NULL;
+    fp->audit_func = NULL;
     fp->data = data;
     return 0;
 }
@@ -344,6 +349,710 @@ open_file(heim_context context, heim_log_facility *fac, int min, int max,
     return ret;
 }
 
+/*
+ * Buffered file destination: the file stays open, lines are scrubbed
+ * straight into a buffer and written out in batches, when the buffer
+ * is full or when a second has passed since the last write.  There is
+ * no flusher thread (daemons fork after opening their logs), so idle
+ * programs should call heim_log_flush() now and then.  As with stdio,
+ * flush before fork() or the child will write the parent's lines too.
+ *
+ * heim_log_reopen() may be called from a signal handler; the file is
+ * then reopened on the next write, for log rotation.
+ *
+ * In the lossy variant the file is opened non-blocking, and a batch
+ * that can't be written at once (a full pipe, say) is dropped and
+ * counted rather than stalling the caller.
+ */
+#define BFILE_BUFSZ		(32 * 1024)
+#define BFILE_FLUSH_SECS	1
+
+static volatile sig_atomic_t log_reopen_gen;
+
+struct bfile_data {
+    char *filename;
+    HEIMDAL_MUTEX mutex;
+    int fd;
+    int lossy;
+    sig_atomic_t gen;
+    time_t last_flush;
+    unsigned long dropped;
+    size_t len;
+    char buf[BFILE_BUFSZ];
+};
+
+static void
+bfile_open(struct bfile_data *b)
+{
+    int flags = O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC;
+
+#ifdef O_NONBLOCK
+    if (b->lossy)
+        flags |= O_NONBLOCK;
+#endif
+    if (b->fd != -1)
+        close(b->fd);
+    b->gen = log_reopen_gen;
+    b->fd = open(b->filename, flags, 0666); /* umask best be set */
+    if (b->fd != -1)
+        rk_cloexec(b->fd);
+}
+
+/* Returns the number of bytes written */
+static size_t
+bfile_write(struct bfile_data *b, const char *p, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = write(b->fd, p + done, len - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static void
+bfile_flush(struct bfile_data *b)
+{
+    size_t i, done = 0;
+
+    b->last_flush = time(NULL);
+    if (b->fd == -1 || b->gen != log_reopen_gen)
+        bfile_open(b);
+    if (b->len == 0 && b->dropped == 0)
+        return;
+
+    if (b->fd != -1 && b->dropped) {
+        char msg[64];
+        int n;
+
+        n = snprintf(msg, sizeof(msg), "%lu log messages dropped\n",
+                     b->dropped);
+        if (n > 0 && (size_t)n < sizeof(msg) &&
+            bfile_write(b, msg, n) == (size_t)n)
+            b->dropped = 0;
+    }
+    if (b->fd != -1)
+        done = bfile_write(b, b->buf, b->len);
+    for (i = done; i < b->len; i++)
+        if (b->buf[i] == '\n')
+            b->dropped++;
+    b->len = 0;
+}
+
+static void
+bfile_add(struct bfile_data *b, const char *s, int scrub)
+{
+    for (; *s; s++) {
+        /* See log_file() on why we eat the special characters */
+        if (scrub && *s < 32 && *s != '\t')
+            continue;
+        if (b->len == sizeof(b->buf))
+            bfile_flush(b);
+        b->buf[b->len++] = *s;
+    }
+}
+
+static void
+log_bfile(heim_context context, const char *timestr, const char *msg,
+          void *data)
+{
+    struct bfile_data *b = data;
+    size_t need;
+
+    if (msg == NULL)
+        return;
+    if (timestr == NULL)
+        timestr = "";
+
+    HEIMDAL_MUTEX_lock(&b->mutex);
+    need = strlen(timestr) + strlen(msg) + 2;
+    if (b->gen != log_reopen_gen || need > sizeof(b->buf) - b->len)
+        bfile_flush(b);
+    bfile_add(b, timestr, 0);
+    bfile_add(b, " ", 0);
+    bfile_add(b, msg, 1);
+    bfile_add(b, "\n", 0);
+    if (time(NULL) - b->last_flush >= BFILE_FLUSH_SECS)
+        bfile_flush(b);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
+}
+
+static void
+flush_bfile(void *data)
+{
+    struct bfile_data *b = data;
+
+    HEIMDAL_MUTEX_lock(&b->mutex);
+    bfile_flush(b);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
+}
+
+static void HEIM_CALLCONV
+close_bfile(void *data)
+{
+    struct bfile_data *b = data;
+
+    flush_bfile(b);
+    if (b->fd != -1)
+        close(b->fd);
+    HEIMDAL_MUTEX_destroy(&b->mutex);
+    free(b->filename);
+    free(b);
+}
+
+static heim_error_code
+open_bfile(heim_context context, heim_log_facility *fac, int min, int max,
+           const char *filename, int lossy)
+{
+    heim_error_code ret;
+    struct bfile_data *b;
+
+    if ((b = calloc(1, sizeof(*b))) == NULL)
+        return heim_enomem(context);
+
+    b->fd = -1;
+    b->lossy = lossy;
+    HEIMDAL_MUTEX_init(&b->mutex);
+    ret = heim_expand_path_tokens(context, filename, 1, &b->filename, NULL);
+    if (ret == 0)
+        ret = heim_addlog_func(context, fac, min, max, log_bfile,
+                               close_bfile, b);
+    if (ret) {
+        HEIMDAL_MUTEX_destroy(&b->mutex);
+        free(b->filename);
+        free(b);
+        return ret;
+    }
+    fac->val[fac->len - 1].flush_func = flush_bfile;
+    /* Open now, before the program drops privileges or chroots */
+    bfile_open(b);
+    b->last_flush = time(NULL);
+    return 0;
+}
+
+/**
+ * Write out messages held by buffered destinations of a log facility.
+ *
+ * @param fac log facility
+ *
+ * @addtogroup heimbase
+ */
+void
+heim_log_flush(heim_log_facility *fac)
+{
+    size_t i;
+
+    for (i = 0; fac && i < fac->len; i++)
+        if (fac->val[i].flush_func)
+            (*fac->val[i].flush_func)(fac->val[i].data);
+}
+
+/**
+ * Ask buffered log destinations to reopen their files before their
+ * next write, as after log rotation.  Async-signal-safe.
+ *
+ * @addtogroup heimbase
+ */
+void
+heim_log_reopen(void)
+{
+    log_reopen_gen++;
+}
+
+/*
+ * Structured audit trail destinations.  AUDIT-JSON= writes one JSON
+ * object per request per line, AUDIT-BIN= length-prefixed records:
+ *
+ *   record := u32 length-of-rest | u16 npairs | pair...
+ *   pair   := u16 klen | key | u16 vlen | value
+ *
+ * with integers in network byte order.  Records are built straight from
+ * the request and its kv pairs, into a buffer private to the calling
+ * thread, so request threads don't contend with each other.  Buffers
+ * are written out in batches as for BFILE=, and on heim_log_flush().
+ *
+ * A thread's buffers hang off a thread key, and also off their sink so
+ * that they can be flushed from other threads.  When a thread exits its
+ * buffers are flushed and left for reuse; when a sink is closed while a
+ * thread still holds one of its buffers, that thread frees it instead.
+ * Locks are taken in the order sink list, buffer, sink fd.
+ */
+#define AUDIT_BUFSZ		(32 * 1024)
+#define AUDIT_MAXFIELD		0xffff
+
+struct audit_sink;
+
+struct audit_buf {
+    struct audit_buf *next;
+    struct audit_sink *sink;	/* NULL once the sink is closed */
+    HEIMDAL_MUTEX mutex;
+    int in_use;			/* held by some thread's key */
+    int err;
+    time_t last_flush;
+    size_t len;
+    size_t size;
+    unsigned char *buf;
+};
+
+struct audit_sink {
+    char *filename;
+    HEIMDAL_MUTEX list_mutex;
+    HEIMDAL_MUTEX fd_mutex;
+    struct audit_buf *bufs;
+    int binary;
+    int fd;
+    sig_atomic_t gen;
+};
+
+struct audit_tls {
+    size_t len;
+    struct audit_buf **val;
+};
+
+static int audit_key_created = 0;
+static HEIMDAL_thread_key audit_key;
+
+static void
+audit_sink_open(struct audit_sink *s)
+{
+    if (s->fd != -1)
+        close(s->fd);
+    s->gen = log_reopen_gen;
+    s->fd = open(s->filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                 0600);
+    if (s->fd != -1)
+        rk_cloexec(s->fd);
+}
+
+/* Called with b->mutex held */
+static void
+audit_buf_flush(struct audit_buf *b)
+{
+    struct audit_sink *s = b->sink;
+    size_t done = 0;
+    ssize_t n;
+
+    b->last_flush = time(NULL);
+    if (s == NULL || b->len == 0)
+        return;
+
+    HEIMDAL_MUTEX_lock(&s->fd_mutex);
+    if (s->fd == -1 || s->gen != log_reopen_gen)
+        audit_sink_open(s);
+    while (s->fd != -1 && done < b->len) {
+        n = write(s->fd, b->buf + done, b->len - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    HEIMDAL_MUTEX_unlock(&s->fd_mutex);
+    b->len = 0;
+}
+
+static void
+audit_buf_free(struct audit_buf *b)
+{
+    HEIMDAL_MUTEX_destroy(&b->mutex);
+    free(b->buf);
+    free(b);
+}
+
+static void
+audit_tls_delete(void *ptr)
+{
+    struct audit_tls *tls = ptr;
+    struct audit_buf *b;
+    size_t i;
+    int closed;
+
+    if (tls == NULL)
+        return;
+    for (i = 0; i < tls->len; i++) {
+        b = tls->val[i];
+        HEIMDAL_MUTEX_lock(&b->mutex);
+        audit_buf_flush(b);
+        b->in_use = 0;
+        closed = b->sink == NULL;
+        HEIMDAL_MUTEX_unlock(&b->mutex);
+        if (closed)
+            audit_buf_free(b);
+    }
+    free(tls->val);
+    free(tls);
+}
+
+static void
+init_audit_tls(void *ptr)
+{
+    int ret;
+    HEIMDAL_key_create(&audit_key, audit_tls_delete, ret);
+    if (ret == 0)
+        audit_key_created = 1;
+}
+
+/* Find or make the calling thread's buffer for `s' */
+static struct audit_buf *
+audit_get_buf(struct audit_sink *s)
+{
+    static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
+    struct audit_tls *tls;
+    struct audit_buf **val;
+    struct audit_buf *b;
+    size_t i, j;
+    int ret;
+
+    heim_base_once_f(&once, NULL, init_audit_tls);
+    if (!audit_key_created)
+        return NULL;
+
+    tls = HEIMDAL_getspecific(audit_key);
+    if (tls == NULL) {
+        if ((tls = calloc(1, sizeof(*tls))) == NULL)
+            return NULL;
+        HEIMDAL_setspecific(audit_key, tls, ret);
+        if (ret) {
+            free(tls);
+            return NULL;
+        }
+    }
+    for (i = 0; i < tls->len; i++)
+        if (tls->val[i]->sink == s)
+            return tls->val[i];
+
+    /* Drop buffers of closed sinks while we're here */
+    for (i = j = 0; i < tls->len; i++) {
+        b = tls->val[i];
+        HEIMDAL_MUTEX_lock(&b->mutex);
+        if (b->sink == NULL) {
+            HEIMDAL_MUTEX_unlock(&b->mutex);
+            audit_buf_free(b);
+            continue;
+        }
+        HEIMDAL_MUTEX_unlock(&b->mutex);
+        tls->val[j++] = b;
+    }
+    tls->len = j;
+
+    val = realloc(tls->val, (tls->len + 1) * sizeof(tls->val[0]));
+    if (val == NULL)
+        return NULL;
+    tls->val = val;
+
+    HEIMDAL_MUTEX_lock(&s->list_mutex);
+    for (b = s->bufs; b; b = b->next)
+        if (!b->in_use)
+            break;
+    if (b == NULL && (b = calloc(1, sizeof(*b))) != NULL) {
+        HEIMDAL_MUTEX_init(&b->mutex);
+        b->sink = s;
+        b->last_flush = time(NULL);
+        b->next = s->bufs;
+        s->bufs = b;
+    }
+    if (b)
+        b->in_use = 1;
+    HEIMDAL_MUTEX_unlock(&s->list_mutex);
+
+    if (b)
+        tls->val[tls->len++] = b;
+    return b;
+}
+
+static void
+audit_put(struct audit_buf *b, const void *p, size_t len)
+{
+    unsigned char *nb;
+    size_t size;
+
+    if (b->err)
+        return;
+    if (b->size - b->len < len) {
+        size = b->size ? b->size : AUDIT_BUFSZ;
+        while (size - b->len < len)
+            size *= 2;
+        if ((nb = realloc(b->buf, size)) == NULL) {
+            b->err = 1;
+            return;
+        }
+        b->buf = nb;
+        b->size = size;
+    }
+    memcpy(b->buf + b->len, p, len);
+    b->len += len;
+}
+
+static void
+audit_put16(struct audit_buf *b, size_t n)
+{
+    unsigned char c[2];
+
+    c[0] = (n >> 8) & 0xff;
+    c[1] = n & 0xff;
+    audit_put(b, c, sizeof(c));
+}
+
+static void
+audit_put_json(struct audit_buf *b, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+    const char *e = s + len;
+    char esc[6];
+
+    audit_put(b, "\"", 1);
+    for (; s < e; s++) {
+        unsigned char c = *s;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        audit_put(b, run, s - run);
+        run = s + 1;
+        esc[0] = '\\';
+        if (c == '"' || c == '\\') {
+            esc[1] = c;
+            audit_put(b, esc, 2);
+        } else {
+            esc[1] = 'u';
+            esc[2] = esc[3] = '0';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            audit_put(b, esc, 6);
+        }
+    }
+    audit_put(b, run, e - run);
+    audit_put(b, "\"", 1);
+}
+
+struct audit_rec {
+    struct audit_buf *b;
+    int binary;
+    size_t npairs;
+    size_t nkv;
+};
+
+/*
+ * Add a pair.  In JSON the request's kv pairs go into a "kv" array of
+ * [key, value] arrays, as keys may repeat; in binary records all pairs
+ * are at the same level.
+ */
+static void
+audit_pair(struct audit_rec *rec, int kv, const char *k, size_t klen,
+           const char *v, size_t vlen)
+{
+    struct audit_buf *b = rec->b;
+
+    if (rec->binary) {
+        klen = klen > AUDIT_MAXFIELD ? AUDIT_MAXFIELD : klen;
+        vlen = vlen > AUDIT_MAXFIELD ? AUDIT_MAXFIELD : vlen;
+        audit_put16(b, klen);
+        audit_put(b, k, klen);
+        audit_put16(b, vlen);
+        audit_put(b, v, vlen);
+        rec->npairs++;
+        return;
+    }
+
+    if (kv) {
+        if (rec->nkv++ == 0) {
+            if (rec->npairs++)
+                audit_put(b, ",", 1);
+            audit_put(b, "\"kv\":[", sizeof("\"kv\":[") - 1);
+        } else {
+            audit_put(b, ",", 1);
+        }
+        audit_put(b, "[", 1);
+        audit_put_json(b, k, klen);
+        audit_put(b, ",", 1);
+        audit_put_json(b, v, vlen);
+        audit_put(b, "]", 1);
+    } else {
+        if (rec->nkv) {
+            audit_put(b, "]", 1);
+            rec->nkv = 0;
+        }
+        if (rec->npairs++)
+            audit_put(b, ",", 1);
+        audit_put_json(b, k, klen);
+        audit_put(b, ":", 1);
+        audit_put_json(b, v, vlen);
+    }
+}
+
+static void
+audit_str(struct audit_rec *rec, const char *k, const char *v)
+{
+    if (v)
+        audit_pair(rec, 0, k, strlen(k), v, strlen(v));
+}
+
+static void
+log_audit(heim_svc_req_desc r, heim_error_code ret, const char *retval,
+          void *data)
+{
+    struct audit_sink *s = data;
+    struct audit_rec rec;
+    struct audit_buf *b;
+    size_t start, nelem, i;
+    char num[64];
+    int n;
+
+    if ((b = audit_get_buf(s)) == NULL)
+        return;
+
+    HEIMDAL_MUTEX_lock(&b->mutex);
+    start = b->len;
+    rec.b = b;
+    rec.binary = s->binary;
+    rec.npairs = rec.nkv = 0;
+    if (rec.binary)
+        audit_put(b, "\0\0\0\0\0\0", 6); /* length, npairs */
+    else
+        audit_put(b, "{", 1);
+
+    n = snprintf(num, sizeof(num), "%lld.%06ld",
+                 (long long)r->tv_end.tv_sec, (long)r->tv_end.tv_usec);
+    if (n > 0 && (size_t)n < sizeof(num))
+        audit_pair(&rec, 0, "time", sizeof("time") - 1, num, n);
+    audit_str(&rec, "type", r->reqtype);
+    audit_str(&rec, "result", retval);
+    n = snprintf(num, sizeof(num), "%d", (int)ret);
+    if (n > 0 && (size_t)n < sizeof(num))
+        audit_pair(&rec, 0, "code", sizeof("code") - 1, num, n);
+    audit_str(&rec, "from", r->from);
+    audit_str(&rec, "cname", r->cname);
+    audit_str(&rec, "sname", r->sname);
+
+    nelem = r->kv ? heim_array_get_length(r->kv) : 0;
+    for (i = 0; i < nelem; i++) {
+        const char *kvpair, *eq;
+
+        /* We know these are "k=v" strings... */
+        kvpair = heim_string_get_utf8(heim_array_get_value(r->kv, i));
+        if ((eq = strchr(kvpair, '=')) == NULL)
+            eq = kvpair + strlen(kvpair);
+        audit_pair(&rec, 1, kvpair, eq - kvpair, *eq ? eq + 1 : eq,
+                   *eq ? strlen(eq + 1) : 0);
+    }
+    if (r->reason) {
+        const char *reason = heim_string_get_utf8(r->reason);
+
+        /* fmtkv() made this "reason=..." */
+        if (strncmp(reason, "reason=", sizeof("reason=") - 1) == 0)
+            reason += sizeof("reason=") - 1;
+        audit_str(&rec, "reason", reason);
+    }
+
+    if (rec.binary) {
+        size_t len = b->len - start - 4;
+
+        if (!b->err && len <= 0xffffffffUL && rec.npairs <= 0xffff) {
+            b->buf[start + 0] = (len >> 24) & 0xff;
+            b->buf[start + 1] = (len >> 16) & 0xff;
+            b->buf[start + 2] = (len >> 8) & 0xff;
+            b->buf[start + 3] = len & 0xff;
+            b->buf[start + 4] = (rec.npairs >> 8) & 0xff;
+            b->buf[start + 5] = rec.npairs & 0xff;
+        } else {
+            b->err = 1;
+        }
+    } else {
+        audit_put(b, rec.nkv ? "]}\n" : "}\n", rec.nkv ? 3 : 2);
+    }
+
+    if (b->err) {
+        /* Out of memory; lose this record, not the ones before it */
+        b->len = start;
+        b->err = 0;
+    }
+    if (b->len >= AUDIT_BUFSZ ||
+        time(NULL) - b->last_flush >= BFILE_FLUSH_SECS)
+        audit_buf_flush(b);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
+}
+
+static void
+flush_audit(void *data)
+{
+    struct audit_sink *s = data;
+    struct audit_buf *b;
+
+    HEIMDAL_MUTEX_lock(&s->list_mutex);
+    for (b = s->bufs; b; b = b->next) {
+        HEIMDAL_MUTEX_lock(&b->mutex);
+        audit_buf_flush(b);
+        HEIMDAL_MUTEX_unlock(&b->mutex);
+    }
+    HEIMDAL_MUTEX_unlock(&s->list_mutex);
+}
+
+static void HEIM_CALLCONV
+close_audit(void *data)
+{
+    struct audit_sink *s = data;
+    struct audit_buf *b, *next;
+    int in_use;
+
+    HEIMDAL_MUTEX_lock(&s->list_mutex);
+    b = s->bufs;
+    s->bufs = NULL;
+    HEIMDAL_MUTEX_unlock(&s->list_mutex);
+
+    for (; b; b = next) {
+        next = b->next;
+        HEIMDAL_MUTEX_lock(&b->mutex);
+        audit_buf_flush(b);
+        b->sink = NULL;
+        in_use = b->in_use;
+        HEIMDAL_MUTEX_unlock(&b->mutex);
+        if (!in_use)
+            audit_buf_free(b);
+    }
+    if (s->fd != -1)
+        close(s->fd);
+    HEIMDAL_MUTEX_destroy(&s->list_mutex);
+    HEIMDAL_MUTEX_destroy(&s->fd_mutex);
+    free(s->filename);
+    free(s);
+}
+
+static heim_error_code
+open_audit(heim_context context, heim_log_facility *fac, int min, int max,
+           const char *filename, int binary)
+{
+    heim_error_code ret;
+    struct audit_sink *s;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        return heim_enomem(context);
+
+    s->fd = -1;
+    s->binary = binary;
+    HEIMDAL_MUTEX_init(&s->list_mutex);
+    HEIMDAL_MUTEX_init(&s->fd_mutex);
+    ret = heim_expand_path_tokens(context, filename, 1, &s->filename, NULL);
+    if (ret == 0)
+        ret = heim_addlog_func(context, fac, min, max, NULL, close_audit, s);
+    if (ret) {
+        HEIMDAL_MUTEX_destroy(&s->list_mutex);
+        HEIMDAL_MUTEX_destroy(&s->fd_mutex);
+        free(s->filename);
+        free(s);
+        return ret;
+    }
+    fac->val[fac->len - 1].flush_func = flush_audit;
+    fac->val[fac->len - 1].audit_func = log_audit;
+    audit_sink_open(s);
+    return 0;
+}
+
 heim_error_code
 heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
 {
@@ -402,6 +1111,16 @@ heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
     } else if (strncmp(p, "FILE=", sizeof("FILE=") - 1) == 0) {
         ret = open_file(context, f, min, max, p + sizeof("FILE=") - 1, "a",
                         NULL, FILEDISP_KEEPOPEN, 1);
+    } else if (strncmp(p, "BFILE=", sizeof("BFILE=") - 1) == 0) {
+        ret = open_bfile(context, f, min, max, p + sizeof("BFILE=") - 1, 0);
+    } else if (strncmp(p, "LFILE=", sizeof("LFILE=") - 1) == 0) {
+        ret = open_bfile(context, f, min, max, p + sizeof("LFILE=") - 1, 1);
+    } else if (strncmp(p, "AUDIT-JSON=", sizeof("AUDIT-JSON=") - 1) == 0) {
+        ret = open_audit(context, f, min, max,
+                         p + sizeof("AUDIT-JSON=") - 1, 0);
+    } else if (strncmp(p, "AUDIT-BIN=", sizeof("AUDIT-BIN=") - 1) == 0) {
+        ret = open_audit(context, f, min, max,
+                         p + sizeof("AUDIT-BIN=") - 1, 1);
     } else if (strncmp(p, "DEVICE:", sizeof("DEVICE:") - 1) == 0) {
         ret = open_file(context, f, min, max, p + sizeof("DEVICE:") - 1, "a",
                         NULL, FILEDISP_REOPEN, 0);
@@ -501,7 +1220,7 @@ __attribute__ ((__format__ (__printf__, 5, 0)))
     if (!fac)
         fac = context->log_dest;
     for (i = 0; fac && i < fac->len; i++)
-        if (fac->val[i].min <= level &&
+        if (fac->val[i].log_func != NULL && fac->val[i].min <= level &&
             (fac->val[i].max < 0 || fac->val[i].max >= level)) {
             if (t == 0) {
                 t = time(NULL);
@@ -659,28 +1378,48 @@ static heim_string_t
 fmtkv(int flags, const char *k, const char *fmt, va_list ap)
         __attribute__ ((__format__ (__printf__, 3, 0)))
 {
-    heim_string_t str;
-    size_t i;
-    ssize_t j;
-    char *buf1;
-    char *buf2;
-    char *buf3;
-    int ret = vasprintf(&buf1, fmt, ap);
-    if (ret < 0 || !buf1)
-	return NULL;;
-
-    j = asprintf(&buf2, "%s=%s", k, buf1);
-    free(buf1);
-    if (j < 0 || !buf2)
-	return NULL;;
+    heim_string_t str = NULL;
+    size_t klen = strlen(k);
+    size_t i, j;
+    va_list ap2;
+    char buf[512];
+    char visbuf[sizeof(buf) * 4 + 1];
+    char *kv = buf;
+    char *vis = NULL;
+    int n;
+
+    /* Format "k=v" on the stack when it fits, which it nearly always does */
+    if (klen + 1 < sizeof(buf)) {
+        memcpy(buf, k, klen);
+        buf[klen] = '=';
+        va_copy(ap2, ap);
+        n = vsnprintf(buf + klen + 1, sizeof(buf) - klen - 1, fmt, ap2);
+        va_end(ap2);
+        if (n < 0)
+            return NULL;
+        j = klen + 1 + n;
+    } else {
+        j = sizeof(buf);
+    }
+    if (j >= sizeof(buf)) {
+        char *v;
+
+        if (vasprintf(&v, fmt, ap) < 0 || v == NULL)
+            return NULL;
+        n = asprintf(&kv, "%s=%s", k, v);
+        free(v);
+        if (n < 0 || kv == NULL)
+            return NULL;
+        j = n;
+    }
 
     /* We optionally eat the whitespace. */
 
     if (flags & HEIM_SVC_AUDIT_EATWHITE) {
-	for (i=0, j=0; buf2[i]; i++)
-	    if (buf2[i] != ' ' && buf2[i] != '\t')
-		buf2[j++] = buf2[i];
-	buf2[j] = '\0';
+        for (i=0, j=0; kv[i]; i++)
+            if (kv[i] != ' ' && kv[i] != '\t')
+                kv[j++] = kv[i];
+        kv[j] = '\0';
     }
 
     if (flags & (HEIM_SVC_AUDIT_VIS | HEIM_SVC_AUDIT_VISLAST)) {
@@ -688,14 +1427,20 @@ fmtkv(int flags, const char *k, const char *fmt, va_list ap)
 
         if (flags & HEIM_SVC_AUDIT_VIS)
             vis_flags |= VIS_WHITE;
-	buf3 = malloc((j + 1) * 4 + 1);
-	strvisx(buf3, buf2, j, vis_flags);
-	free(buf2);
-    } else
-	buf3 = buf2;
-
-    str = heim_string_create(buf3);
-    free(buf3);
+        if (j < sizeof(buf))
+            vis = visbuf;
+        else if ((vis = malloc((j + 1) * 4 + 1)) == NULL)
+            goto out;
+        j = strvisx(vis, kv, j, vis_flags);
+    }
+
+    str = heim_string_create_with_bytes(vis ? vis : kv, j);
+
+out:
+    if (vis != visbuf)
+        free(vis);
+    if (kv != buf)
+        free(kv);
     return str;
 }
 
@@ -812,8 +1557,10 @@ heim_audit_trail(heim_svc_req_desc r, heim_error_code ret, const char *retname)
     const char *retval;
     char kvbuf[1024];
     char retvalbuf[30]; /* Enough for UNKNOWN-%d */
+    heim_log_facility *fac;
     size_t nelem;
     size_t i, j;
+    int text;
 
 #define CASE(x)	case x : retval = #x; break
     if (retname) {
@@ -836,6 +1583,22 @@ heim_audit_trail(heim_svc_req_desc r, heim_error_code ret, const char *retname)
     if (r->e_text && r->kv)
 	heim_audit_addkv(r, HEIM_SVC_AUDIT_VIS, "e-text", "%s", r->e_text);
 
+    /* Structured destinations get the kv pairs as they are */
+    fac = r->logf;
+    if (fac == NULL && r->hcontext)
+        fac = r->hcontext->log_dest;
+    for (i = 0, text = 0; fac && i < fac->len; i++) {
+        if (fac->val[i].min > 3 ||
+            (fac->val[i].max >= 0 && fac->val[i].max < 3))
+            continue;
+        if (fac->val[i].audit_func)
+            (*fac->val[i].audit_func)(r, ret, retval, fac->val[i].data);
+        else
+            text = 1;
+    }
+    if (!text)
+        return;
+
     nelem = r->kv ? heim_array_get_length(r->kv) : 0;
     for (i=0, j=0; i < nelem; i++) {
 	heim_string_t s;
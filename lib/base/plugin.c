@@ -761,9 +761,13 @@ heim_plugin_run_f(heim_context context,
     modules = copy_modules();
     dict = heim_dict_copy_value(modules, m);
 
-    /* Add loaded plugins to s.result array */
+    /*
+     * Add loaded plugins to s.result array.  The first plugin to handle
+     * a call wins, so search the DSOs in an order that doesn't change
+     * from process to process.
+     */
     if (dict)
-        heim_dict_iterate_f(dict, &s, search_modules);
+        _heim_dict_iterate_sorted_f(dict, &s, search_modules);
 
     /* We don't need to hold modules_mutex during plugin invocation */
     HEIMDAL_MUTEX_unlock(&modules_mutex);
@@ -77,11 +77,14 @@ static unsigned long
 string_hash(void *ptr)
 {
     const char *s = ptr;
-    unsigned long n;
 
-    for (n = 0; *s; ++s)
-	n += *s;
-    return n;
+    if (*s == '\0') {
+	char **strp = _heim_get_isaextra(ptr, 1);
+
+	if (*strp != NULL)
+	    s = *strp; /* hash string refs like string_cmp() sees them */
+    }
+    return _heim_hash_bytes(s, strlen(s));
 }
 
 struct heim_type_data _heim_string_object = {
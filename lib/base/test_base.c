@@ -167,6 +167,94 @@ test_dict(void)
     return 0;
 }
 
+static void
+dict_count_f(heim_object_t key, heim_object_t value, void *arg)
+{
+    size_t *n = arg;
+
+    (*n)++;
+}
+
+static void
+dict_delete_f(heim_object_t key, heim_object_t value, void *arg)
+{
+    heim_dict_delete_key(arg, key);
+}
+
+/*
+ * Grow a dict well past its initial size, with deletes and overwrites
+ * mixed in, and make sure every key is still found while the table is
+ * being rehashed.
+ */
+
+static int
+test_dict_grow(void)
+{
+    heim_dict_t dict;
+    heim_object_t k, v;
+    char buf[32];
+    size_t i, n, nkeys = 20000;
+
+    dict = heim_dict_create(3);
+    heim_assert(dict != NULL, "dict");
+
+    for (i = 0; i < nkeys; i++) {
+	snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+	k = (i & 1) ? (heim_object_t)heim_string_create(buf)
+		    : (heim_object_t)heim_number_create(i);
+	v = heim_number_create(i);
+	heim_assert(heim_dict_set_value(dict, k, v) == 0, "dict set");
+	heim_release(k);
+	heim_release(v);
+
+	if (i % 3 == 0 && i > 0) {
+	    /* delete the previous key, overwrite the one before it */
+	    snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)(i - 1));
+	    k = ((i - 1) & 1) ? (heim_object_t)heim_string_create(buf)
+			      : (heim_object_t)heim_number_create(i - 1);
+	    heim_dict_delete_key(dict, k);
+	    heim_assert(heim_dict_get_value(dict, k) == NULL, "dict delete");
+	    heim_release(k);
+
+	    snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)(i - 2));
+	    k = ((i - 2) & 1) ? (heim_object_t)heim_string_create(buf)
+			      : (heim_object_t)heim_number_create(i - 2);
+	    v = heim_number_create(i - 2);
+	    heim_assert(heim_dict_set_value(dict, k, v) == 0, "dict reset");
+	    heim_release(k);
+	    heim_release(v);
+	}
+    }
+
+    for (i = 0, n = 0; i < nkeys; i++) {
+	snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+	k = (i & 1) ? (heim_object_t)heim_string_create(buf)
+		    : (heim_object_t)heim_number_create(i);
+	v = heim_dict_get_value(dict, k);
+	if (i % 3 == 2 && i + 1 < nkeys) {
+	    heim_assert(v == NULL, "dict deleted key found");
+	} else {
+	    heim_assert(v != NULL, "dict key lost");
+	    heim_assert(heim_number_get_int(v) == (int)i, "dict value");
+	    n++;
+	}
+	heim_release(k);
+    }
+
+    i = 0;
+    heim_dict_iterate_f(dict, &i, dict_count_f);
+    heim_assert(i == n, "dict iterate count");
+
+    /* deleting from inside an iteration is allowed */
+    heim_dict_iterate_f(dict, dict, dict_delete_f);
+    i = 0;
+    heim_dict_iterate_f(dict, &i, dict_count_f);
+    heim_assert(i == 0, "dict not empty");
+
+    heim_release(dict);
+    return 0;
+}
+
 static int
 test_auto_release(void)
 {
@@ -366,6 +454,208 @@ test_json(void)
     return 0;
 }
 
+struct sax_counts {
+    int dicts, arrays, keys, strings, numbers, bools, nulls;
+    int sum, depth, escaped;
+};
+
+static int
+sax_begin(void *ctx)
+{
+    struct sax_counts *c = ctx;
+    c->depth++;
+    return 0;
+}
+
+static int
+sax_end_dict(void *ctx)
+{
+    struct sax_counts *c = ctx;
+    c->dicts++;
+    c->depth--;
+    return 0;
+}
+
+static int
+sax_end_array(void *ctx)
+{
+    struct sax_counts *c = ctx;
+    c->arrays++;
+    c->depth--;
+    return 0;
+}
+
+static int
+sax_key(void *ctx, const char *s, size_t len)
+{
+    struct sax_counts *c = ctx;
+    c->keys++;
+    if (len == 3 && memcmp(s, "k\"2", 3) == 0)
+	c->escaped++;
+    return 0;
+}
+
+static int
+sax_string(void *ctx, const char *s, size_t len)
+{
+    struct sax_counts *c = ctx;
+    if (len == 4 && memcmp(s, "stop", 4) == 0)
+	return ERANGE;
+    c->strings++;
+    if (len == 3 && memcmp(s, "v\"4", 3) == 0)
+	c->escaped++;
+    return 0;
+}
+
+static int
+sax_number(void *ctx, int n)
+{
+    struct sax_counts *c = ctx;
+    c->numbers++;
+    c->sum += n;
+    return 0;
+}
+
+static int
+sax_bool(void *ctx, int b)
+{
+    struct sax_counts *c = ctx;
+    c->bools++;
+    return 0;
+}
+
+static int
+sax_null(void *ctx)
+{
+    struct sax_counts *c = ctx;
+    c->nulls++;
+    return 0;
+}
+
+static int
+test_json_sax(void)
+{
+    static const struct heim_json_sax cb = {
+	sax_begin, sax_end_dict, sax_begin, sax_end_array,
+	sax_key, sax_string, sax_number, sax_bool, sax_null
+    };
+    static const struct heim_json_sax nocb;
+    const char *j = "{ \"k1\" : [1, 2, -3, true, false, null], "
+	"\"k\\\"2\" : { \"k3\" : \"v\\\"4\" }, \"k5\" : \"\" }";
+    const char *stop = "[ \"a\", \"stop\", \"c\" ]";
+    struct sax_counts c;
+    heim_error_t e = NULL;
+    size_t k;
+    int ret;
+
+    memset(&c, 0, sizeof (c));
+    ret = heim_json_parse(j, strlen(j), 10, 0, &cb, &c, NULL);
+    heim_assert(ret == 0, "sax parse");
+    heim_assert(c.dicts == 2 && c.arrays == 1 && c.depth == 0, "sax nesting");
+    heim_assert(c.keys == 4 && c.strings == 2, "sax strings");
+    heim_assert(c.numbers == 3 && c.sum == 0, "sax numbers");
+    heim_assert(c.bools == 2 && c.nulls == 1, "sax literals");
+    heim_assert(c.escaped == 2, "sax escapes");
+
+    ret = heim_json_parse(j, strlen(j), 10, 0, &nocb, NULL, NULL);
+    heim_assert(ret == 0, "sax parse without callbacks");
+
+    ret = heim_json_parse(j, strlen(j), 2, 0, &nocb, NULL, NULL);
+    heim_assert(ret != 0, "sax depth");
+
+    for (k = strlen(j) - 1; k > 0; k--) {
+	ret = heim_json_parse(j, k, 10, 0, &nocb, NULL, NULL);
+	heim_assert(ret != 0, "sax parse of truncated JSON");
+    }
+
+    memset(&c, 0, sizeof (c));
+    ret = heim_json_parse(stop, strlen(stop), 10, 0, &cb, &c, &e);
+    heim_assert(ret == ERANGE && heim_error_get_code(e) == ERANGE,
+		"sax callback error");
+    heim_assert(c.strings == 1, "sax parse not stopped");
+    heim_release(e);
+
+    return 0;
+}
+
+static int
+test_json_serialize(void)
+{
+    static const struct {
+	heim_json_flags_t flags;
+	const char *expected;
+    } t[] = {
+	{ 0, "[\n\t1,\n\t\"a\",\n\t{\n\t\t\"k\" : \n\t\t\ttrue\n\t}\n\n]\n" },
+	{ HEIM_JSON_F_ONE_LINE, "[1,\"a\",{\"k\" : true}]\n" },
+    };
+    heim_object_t o;
+    heim_string_t str;
+    char buf[64];
+    size_t i, len, len2;
+    int ret;
+
+    o = heim_json_create("[ 1, \"a\", { \"k\" : true } ]", 10, 0, NULL);
+    heim_assert(o != NULL, "json");
+
+    for (i = 0; i < sizeof (t) / sizeof (t[0]); i++) {
+	ret = heim_json_serialize_size(o, t[i].flags, &len);
+	heim_assert(ret == 0 && len == strlen(t[i].expected), "json size");
+
+	ret = heim_json_serialize_buf(o, t[i].flags, buf, len, &len2);
+	heim_assert(ret == ERANGE && len2 == len, "json short buffer");
+
+	ret = heim_json_serialize_buf(o, t[i].flags, buf, len + 1, &len2);
+	heim_assert(ret == 0 && len2 == len, "json buffer");
+	heim_assert(strcmp(buf, t[i].expected) == 0, "json encoding");
+
+	str = heim_json_copy_serialize(o, t[i].flags, NULL);
+	heim_assert(str != NULL, "json copy");
+	heim_assert(strcmp(heim_string_get_utf8(str), t[i].expected) == 0,
+		    "json copy encoding");
+	heim_release(str);
+    }
+    heim_release(o);
+
+    return 0;
+}
+
+static int
+test_json_dict_order(void)
+{
+    static const char *keys[] = {
+	"kvno", "etypes", "principal", "attributes", "max-life", "a", "z"
+    };
+    static const char expected[] =
+	"{\"a\" : 5,\"attributes\" : 3,\"etypes\" : 1,\"kvno\" : 0,"
+	"\"max-life\" : 4,\"principal\" : 2,\"z\" : 6}\n";
+    heim_dict_t dict;
+    heim_string_t str, k;
+    heim_number_t n;
+    size_t i;
+    int ret;
+
+    /* Enough keys to grow the dict, to get them out of insertion order */
+    dict = heim_dict_create(1);
+    heim_assert(dict != NULL, "dict");
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+	k = heim_string_create(keys[i]);
+	n = heim_number_create(i);
+	ret = heim_dict_set_value(dict, k, n);
+	heim_assert(ret == 0, "dict set");
+	heim_release(k);
+	heim_release(n);
+    }
+
+    str = heim_json_copy_serialize(dict, HEIM_JSON_F_ONE_LINE, NULL);
+    heim_assert(str != NULL, "json copy");
+    heim_assert(strcmp(heim_string_get_utf8(str), expected) == 0,
+		"json dict keys not sorted");
+    heim_release(str);
+    heim_release(dict);
+
+    return 0;
+}
+
 static int
 test_path(void)
 {
@@ -948,10 +1238,14 @@ main(int argc, char **argv)
     res |= test_mutex();
     res |= test_rwlock();
     res |= test_dict();
+    res |= test_dict_grow();
     res |= test_auto_release();
     res |= test_string();
     res |= test_error();
     res |= test_json();
+    res |= test_json_sax();
+    res |= test_json_serialize();
+    res |= test_json_dict_order();
     res |= test_path();
     res |= test_db(NULL, NULL);
     res |= test_db("json", argc > 1 ? argv[1] : "test_db.json");
@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests of the buffered and audit trail log destinations in log.c.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "baselocl.h"
+#include "heimbase-svc.h"
+
+typedef struct heim_pcontext_s *heim_pcontext;
+typedef struct heim_pconfig *heim_pconfig;
+struct heim_svc_req_desc_common_s {
+    HEIM_SVC_REQUEST_DESC_COMMON_ELEMENTS;
+};
+
+#define BFILE_BUFSZ	(32 * 1024)	/* as in log.c */
+#define BFILE_NAME	"test_log.bfile"
+#define BFILE_OLD	"test_log.bfile.old"
+#define AUDIT_JSON_NAME	"test_log.json"
+#define AUDIT_BIN_NAME	"test_log.bin"
+
+/* Read a whole file into a NUL-terminated buffer, or NULL if none */
+static char *
+read_file(const char *fn, size_t *lenp)
+{
+    char *buf = NULL;
+    char *nb;
+    size_t len = 0, n;
+    FILE *f;
+
+    if (lenp)
+	*lenp = 0;
+    if ((f = fopen(fn, "rb")) == NULL)
+	return NULL;
+    do {
+	if ((nb = realloc(buf, len + 4096 + 1)) == NULL) {
+	    free(buf);
+	    fclose(f);
+	    return NULL;
+	}
+	buf = nb;
+	n = fread(buf + len, 1, 4096, f);
+	len += n;
+    } while (n > 0);
+    fclose(f);
+    buf[len] = '\0';
+    if (lenp)
+	*lenp = len;
+    return buf;
+}
+
+static int
+file_has(const char *fn, const char *s)
+{
+    char *buf = read_file(fn, NULL);
+    int found;
+
+    found = buf != NULL && strstr(buf, s) != NULL;
+    free(buf);
+    return found;
+}
+
+static size_t
+file_size(const char *fn)
+{
+    struct stat st;
+
+    if (stat(fn, &st) == -1)
+	return 0;
+    return st.st_size;
+}
+
+static int
+test_bfile(void)
+{
+    heim_context context;
+    heim_log_facility *fac;
+    heim_error_code ret;
+    char line[512];
+    char first[64];
+    size_t i, logged;
+    time_t t;
+    int found;
+
+    (void) unlink(BFILE_NAME);
+    (void) unlink(BFILE_OLD);
+
+    context = heim_context_init();
+    heim_assert(context != NULL, "context");
+    ret = heim_initlog(context, "test_log", &fac);
+    heim_assert(ret == 0, "initlog");
+    ret = heim_addlog_dest(context, fac, "BFILE=" BFILE_NAME);
+    heim_assert(ret == 0, "addlog BFILE");
+
+    /*
+     * Lines stay in the buffer until flushed.  A line logged in a later
+     * second than the last flush is written out right away, so only a
+     * flush and line in the same second tell us anything; retry until
+     * we get one.
+     */
+    for (i = 0; ; i++) {
+	heim_assert(i < 10, "bfile: no flush and log in the same second");
+	snprintf(first, sizeof(first), "first line %lu", (unsigned long)i);
+	t = time(NULL);
+	heim_log_flush(fac);
+	heim_log(context, fac, 0, "%s", first);
+	found = file_has(BFILE_NAME, first);
+	if (time(NULL) == t)
+	    break;
+    }
+    heim_assert(!found, "bfile not buffered");
+    heim_log_flush(fac);
+    heim_assert(file_has(BFILE_NAME, first), "bfile flush");
+
+    /* Messages above the destination's level are not logged */
+    heim_log(context, fac, 5, "debug line");
+    heim_log_flush(fac);
+    heim_assert(!file_has(BFILE_NAME, "debug line"), "bfile level");
+
+    /*
+     * A full buffer is written out without a flush: once more than a
+     * buffer's worth has been logged, something must have been written.
+     */
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    i = file_size(BFILE_NAME);
+    for (logged = 0; file_size(BFILE_NAME) == i; logged += sizeof(line)) {
+	heim_assert(logged <= BFILE_BUFSZ, "bfile size flush");
+	heim_log(context, fac, 0, "%s", line);
+    }
+
+    /* So is an old one, on the next line logged */
+    heim_log_flush(fac);
+    heim_log(context, fac, 0, "before sleep");
+    sleep(2);
+    heim_log(context, fac, 0, "after sleep");
+    heim_assert(file_has(BFILE_NAME, "before sleep") &&
+		file_has(BFILE_NAME, "after sleep"), "bfile time flush");
+
+#ifndef WIN32
+    /* After rotation new lines go to the new file */
+    heim_log(context, fac, 0, "before rename");
+    heim_log_flush(fac);
+    ret = rename(BFILE_NAME, BFILE_OLD);
+    heim_assert(ret == 0, "rename");
+    heim_log_reopen();
+    heim_log(context, fac, 0, "after reopen");
+    heim_log_flush(fac);
+    heim_assert(file_has(BFILE_OLD, "before rename"), "bfile old file");
+    heim_assert(!file_has(BFILE_OLD, "after reopen"), "bfile reopen old");
+    heim_assert(file_has(BFILE_NAME, "after reopen"), "bfile reopen new");
+    heim_assert(!file_has(BFILE_NAME, "before rename"), "bfile reopen");
+#endif
+
+    heim_closelog(context, fac);
+    heim_context_free(&context);
+    (void) unlink(BFILE_NAME);
+    (void) unlink(BFILE_OLD);
+
+    return 0;
+}
+
+static void HEIM_CALLCONV
+count_lines(heim_context context, const char *timestr, const char *msg,
+	    void *data)
+{
+    (*(int *)data)++;
+}
+
+static void HEIM_CALLCONV
+close_count(void *data)
+{
+}
+
+/* Fill in a request as a service would, and emit its audit trail */
+static void
+audit_trail(heim_context context, heim_log_facility *fac)
+{
+    struct heim_svc_req_desc_common_s r;
+
+    memset(&r, 0, sizeof(r));
+    r.hcontext = context;
+    r.logf = fac;
+    r.reqtype = "AS-REQ";
+    r.from = "127.0.0.1";
+    r.cname = "user@TEST.H5L.SE";
+    r.sname = "krbtgt/TEST.H5L.SE@TEST.H5L.SE";
+    r.kv = heim_array_create();
+    heim_assert(r.kv != NULL, "kv");
+    gettimeofday(&r.tv_start, NULL);
+    r.tv_end = r.tv_start;
+
+    heim_audit_addkv(&r, 0, "foo", "%s", "bar");
+    heim_audit_addkv(&r, 0, "quote", "%s", "a\"b\\c");
+    heim_audit_trail(&r, 0, NULL);
+
+    heim_release(r.kv);
+}
+
+static const char *
+json_str(heim_dict_t d, heim_string_t k)
+{
+    heim_object_t v = heim_dict_get_value(d, k);
+
+    if (v == NULL || heim_get_tid(v) != HEIM_TID_STRING)
+	return NULL;
+    return heim_string_get_utf8(v);
+}
+
+/* Value of the first [key, value] pair in a record's "kv" array */
+static const char *
+json_kv(heim_dict_t d, const char *key)
+{
+    heim_array_t kv = heim_dict_get_value(d, HSTR("kv"));
+    heim_array_t pair;
+    heim_object_t k, v;
+    size_t i;
+
+    if (kv == NULL || heim_get_tid(kv) != HEIM_TID_ARRAY)
+	return NULL;
+    for (i = 0; i < heim_array_get_length(kv); i++) {
+	pair = heim_array_get_value(kv, i);
+	if (heim_get_tid(pair) != HEIM_TID_ARRAY ||
+	    heim_array_get_length(pair) != 2)
+	    return NULL;
+	k = heim_array_get_value(pair, 0);
+	v = heim_array_get_value(pair, 1);
+	if (heim_get_tid(k) != HEIM_TID_STRING ||
+	    heim_get_tid(v) != HEIM_TID_STRING)
+	    return NULL;
+	if (strcmp(heim_string_get_utf8(k), key) == 0)
+	    return heim_string_get_utf8(v);
+    }
+    return NULL;
+}
+
+static int
+test_audit_json(void)
+{
+    heim_context context;
+    heim_log_facility *fac;
+    heim_error_code ret;
+    heim_dict_t d;
+    const char *s;
+    char *buf, *nl;
+    int lines = 0;
+
+    (void) unlink(AUDIT_JSON_NAME);
+
+    context = heim_context_init();
+    heim_assert(context != NULL, "context");
+    ret = heim_initlog(context, "test_log", &fac);
+    heim_assert(ret == 0, "initlog");
+    ret = heim_addlog_dest(context, fac, "AUDIT-JSON=" AUDIT_JSON_NAME);
+    heim_assert(ret == 0, "addlog AUDIT-JSON");
+    /* A text destination that doesn't take the audit trail's level */
+    ret = heim_addlog_func(context, fac, 0, 2, count_lines, close_count, &lines);
+    heim_assert(ret == 0, "addlog func");
+
+    audit_trail(context, fac);
+    heim_log_flush(fac);
+
+    /* Only audit sinks wanted the trail, so no text line was made */
+    heim_assert(lines == 0, "audit text line not skipped");
+
+    buf = read_file(AUDIT_JSON_NAME, NULL);
+    heim_assert(buf != NULL, "audit json file");
+    nl = strchr(buf, '\n');
+    heim_assert(nl != NULL && nl[1] == '\0', "audit json one line");
+    *nl = '\0';
+
+    d = heim_json_create(buf, 10, 0, NULL);
+    heim_assert(d != NULL && heim_get_tid(d) == HEIM_TID_DICT,
+		"audit json parse");
+    s = json_str(d, HSTR("time"));
+    heim_assert(s != NULL && strchr(s, '.') != NULL, "audit json time");
+    s = json_str(d, HSTR("type"));
+    heim_assert(s != NULL && strcmp(s, "AS-REQ") == 0, "audit json type");
+    s = json_str(d, HSTR("result"));
+    heim_assert(s != NULL && strcmp(s, "SUCCESS") == 0, "audit json result");
+    s = json_str(d, HSTR("code"));
+    heim_assert(s != NULL && strcmp(s, "0") == 0, "audit json code");
+    s = json_str(d, HSTR("from"));
+    heim_assert(s != NULL && strcmp(s, "127.0.0.1") == 0, "audit json from");
+    s = json_str(d, HSTR("cname"));
+    heim_assert(s != NULL && strcmp(s, "user@TEST.H5L.SE") == 0,
+		"audit json cname");
+    s = json_str(d, HSTR("sname"));
+    heim_assert(s != NULL && strcmp(s, "krbtgt/TEST.H5L.SE@TEST.H5L.SE") == 0,
+		"audit json sname");
+    s = json_kv(d, "foo");
+    heim_assert(s != NULL && strcmp(s, "bar") == 0, "audit json kv");
+    s = json_kv(d, "quote");
+    heim_assert(s != NULL && strcmp(s, "a\"b\\c") == 0,
+		"audit json kv escaping");
+    heim_assert(json_kv(d, "elapsed") != NULL, "audit json elapsed");
+    heim_release(d);
+    free(buf);
+
+    /* With a text destination at the trail's level the line is made */
+    ret = heim_addlog_func(context, fac, 0, 3, count_lines, close_count, &lines);
+    heim_assert(ret == 0, "addlog func");
+    audit_trail(context, fac);
+    heim_assert(lines == 1, "audit text line");
+
+    heim_closelog(context, fac);
+    heim_context_free(&context);
+    (void) unlink(AUDIT_JSON_NAME);
+
+    return 0;
+}
+
+static unsigned long
+get_be(const unsigned char *p, size_t n)
+{
+    unsigned long v = 0;
+
+    while (n--)
+	v = (v << 8) | *p++;
+    return v;
+}
+
+static int
+test_audit_bin(void)
+{
+    heim_context context;
+    heim_log_facility *fac;
+    heim_error_code ret;
+    unsigned char *buf, *p, *end;
+    size_t len, klen, vlen, npairs, i;
+    int found = 0;
+
+    (void) unlink(AUDIT_BIN_NAME);
+
+    context = heim_context_init();
+    heim_assert(context != NULL, "context");
+    ret = heim_initlog(context, "test_log", &fac);
+    heim_assert(ret == 0, "initlog");
+    ret = heim_addlog_dest(context, fac, "AUDIT-BIN=" AUDIT_BIN_NAME);
+    heim_assert(ret == 0, "addlog AUDIT-BIN");
+
+    audit_trail(context, fac);
+    heim_log_flush(fac);
+
+    buf = (unsigned char *)read_file(AUDIT_BIN_NAME, &len);
+    heim_assert(buf != NULL && len >= 6, "audit bin file");
+
+    /* One record: length of the rest, number of pairs, then the pairs */
+    heim_assert(get_be(buf, 4) == len - 4, "audit bin record length");
+    npairs = get_be(buf + 4, 2);
+    p = buf + 6;
+    end = buf + len;
+    for (i = 0; i < npairs; i++) {
+	const char *k, *v;
+
+	heim_assert(end - p >= 2, "audit bin key length");
+	klen = get_be(p, 2);
+	heim_assert((size_t)(end - p) >= 2 + klen + 2, "audit bin key");
+	k = (const char *)p + 2;
+	p += 2 + klen;
+	vlen = get_be(p, 2);
+	heim_assert((size_t)(end - p) >= 2 + vlen, "audit bin value");
+	v = (const char *)p + 2;
+	p += 2 + vlen;
+
+#define PAIR_IS(pk, pv)	\
+	(klen == strlen(pk) && memcmp(k, pk, klen) == 0 && \
+	 vlen == strlen(pv) && memcmp(v, pv, vlen) == 0)
+	if (PAIR_IS("type", "AS-REQ"))
+	    found |= 1;
+	else if (PAIR_IS("cname", "user@TEST.H5L.SE"))
+	    found |= 2;
+	else if (PAIR_IS("foo", "bar"))
+	    found |= 4;
+	else if (PAIR_IS("quote", "a\"b\\c"))
+	    found |= 8;
+#undef PAIR_IS
+    }
+    heim_assert(p == end, "audit bin trailing bytes");
+    heim_assert(found == 15, "audit bin pairs");
+    free(buf);
+
+    heim_closelog(context, fac);
+    heim_context_free(&context);
+    (void) unlink(AUDIT_BIN_NAME);
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int res = 0;
+
+    res |= test_bfile();
+    res |= test_audit_json();
+    res |= test_audit_bin();
+
+    return res ? 1 : 0;
+}
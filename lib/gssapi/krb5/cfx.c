@@ -40,6 +40,9 @@
 #define CFXSealed		(1 << 1)
 #define CFXAcceptorSubkey	(1 << 2)
 
+/* Messages with up to this many krb5 iovecs need no allocation */
+#define CFX_IOV_STACK		16
+
 krb5_error_code
 _gsskrb5cfx_wrap_length_cfx(krb5_context context,
 			    krb5_crypto crypto,
@@ -158,6 +161,24 @@ _gssapi_wrap_size_cfx(OM_uint32 *minor_status,
     return 0;
 }
 
+/*
+ * Reverse len bytes in place
+ */
+
+static void
+reverse_bytes(u_char *p, size_t len)
+{
+    u_char *q, c;
+
+    if (len < 2)
+	return;
+    for (q = p + len - 1; p < q; p++, q--) {
+	c = *p;
+	*p = *q;
+	*q = c;
+    }
+}
+
 /*
  * Rotate "rrc" bytes to the front or back
  */
@@ -165,7 +186,7 @@ _gssapi_wrap_size_cfx(OM_uint32 *minor_status,
 static krb5_error_code
 rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 {
-    u_char *tmp, buf[256];
+    u_char *p = data, buf[256];
     size_t left;
 
     if (len == 0)
@@ -178,27 +199,29 @@ rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 
     left = len - rrc;
 
-    if (rrc <= sizeof(buf)) {
-	tmp = buf;
-    } else {
-	tmp = malloc(rrc);
-	if (tmp == NULL)
-	    return ENOMEM;
+    if (rrc > sizeof(buf)) {
+	/* Too big for the stack; rotate by reversals instead */
+	if (unrotate) {
+	    reverse_bytes(p, rrc);
+	    reverse_bytes(p + rrc, left);
+	} else {
+	    reverse_bytes(p, left);
+	    reverse_bytes(p + left, rrc);
+	}
+	reverse_bytes(p, len);
+	return 0;
     }
 
     if (unrotate) {
-	memcpy(tmp, data, rrc);
-	memmove(data, (u_char *)data + rrc, left);
-	memcpy((u_char *)data + left, tmp, rrc);
+	memcpy(buf, p, rrc);
+	memmove(p, p + rrc, left);
+	memcpy(p + left, buf, rrc);
     } else {
-	memcpy(tmp, (u_char *)data + left, rrc);
-	memmove((u_char *)data + rrc, data, left);
-	memcpy(data, tmp, rrc);
+	memcpy(buf, p + left, rrc);
+	memmove(p + rrc, p, left);
+	memcpy(p, buf, rrc);
     }
 
-    if (rrc > sizeof(buf))
-	free(tmp);
-
     return 0;
 }
 
@@ -242,8 +265,11 @@ OM_uint32
 _gk_allocate_buffer(OM_uint32 *minor_status, gss_iov_buffer_desc *buffer, size_t size)
 {
     if (buffer->type & GSS_IOV_BUFFER_FLAG_ALLOCATED) {
-	if (buffer->buffer.length == size)
+	/* Reuse a buffer left from an earlier call when it is big enough */
+	if (buffer->buffer.length >= size) {
+	    buffer->buffer.length = size;
 	    return GSS_S_COMPLETE;
+	}
 	free(buffer->buffer.value);
     }
 
@@ -321,6 +347,7 @@ _gssapi_wrap_cfx_iov(OM_uint32 *minor_status,
     int32_t seq_number;
     unsigned usage;
     krb5_crypto_iov *data = NULL;
+    krb5_crypto_iov stack_data[CFX_IOV_STACK];
 
     header = _gk_find_buffer(iov, iov_count, GSS_IOV_BUFFER_TYPE_HEADER);
     if (header == NULL) {
@@ -512,7 +539,10 @@ _gssapi_wrap_cfx_iov(OM_uint32 *minor_status,
 				    ++seq_number);
     HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
-    data = calloc(iov_count + 3, sizeof(data[0]));
+    if (iov_count + 3 <= CFX_IOV_STACK)
+	data = stack_data;
+    else
+	data = calloc(iov_count + 3, sizeof(data[0]));
     if (data == NULL) {
 	*minor_status = ENOMEM;
 	major_status = GSS_S_FAILURE;
@@ -653,13 +683,14 @@ _gssapi_wrap_cfx_iov(OM_uint32 *minor_status,
     if (conf_state != NULL)
 	*conf_state = conf_req_flag;
 
-    free(data);
+    if (data != stack_data)
+	free(data);
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
 
  failure:
-    if (data)
+    if (data != stack_data)
 	free(data);
 
     gss_release_iov_buffer(&junk, iov, iov_count);
@@ -667,74 +698,145 @@ _gssapi_wrap_cfx_iov(OM_uint32 *minor_status,
     return major_status;
 }
 
-/* This is slowpath */
-static OM_uint32
-unrotate_iov(OM_uint32 *minor_status, size_t rrc, gss_iov_buffer_desc *iov, int iov_count)
+/*
+ * The buffers that the RRC rotates over, viewed as one byte string
+ */
+
+static int
+rotate_iov_p(const gss_iov_buffer_desc *iov)
 {
-    uint8_t *p, *q;
-    size_t len = 0, skip;
-    int i;
+    switch (GSS_IOV_BUFFER_TYPE(iov->type)) {
+    case GSS_IOV_BUFFER_TYPE_DATA:
+    case GSS_IOV_BUFFER_TYPE_PADDING:
+    case GSS_IOV_BUFFER_TYPE_TRAILER:
+	return 1;
+    default:
+	return 0;
+    }
+}
 
-    for (i = 0; i < iov_count; i++)
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	    len += iov[i].buffer.length;
+struct iov_pos {
+    gss_iov_buffer_desc *iov;
+    int iov_count;
+    int i;
+    size_t off;
+};
 
-    p = malloc(len);
-    if (p == NULL) {
-	*minor_status = ENOMEM;
-	return GSS_S_FAILURE;
+static void
+iov_pos_seek(struct iov_pos *pos, size_t n)
+{
+    for (pos->i = 0; pos->i < pos->iov_count; pos->i++) {
+	if (!rotate_iov_p(&pos->iov[pos->i]))
+	    continue;
+	if (n < pos->iov[pos->i].buffer.length)
+	    break;
+	n -= pos->iov[pos->i].buffer.length;
     }
-    q = p;
+    pos->off = n;
+}
 
-    /* copy up */
+static u_char *
+iov_pos_ptr(struct iov_pos *pos)
+{
+    return (u_char *)pos->iov[pos->i].buffer.value + pos->off;
+}
 
-    for (i = 0; i < iov_count; i++) {
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	{
-	    memcpy(q, iov[i].buffer.value, iov[i].buffer.length);
-	    q += iov[i].buffer.length;
-	}
+static void
+iov_pos_next(struct iov_pos *pos)
+{
+    if (++pos->off < pos->iov[pos->i].buffer.length)
+	return;
+    pos->off = 0;
+    while (++pos->i < pos->iov_count &&
+	   (!rotate_iov_p(&pos->iov[pos->i]) ||
+	    pos->iov[pos->i].buffer.length == 0))
+	;
+}
+
+static void
+iov_pos_prev(struct iov_pos *pos)
+{
+    if (pos->off > 0) {
+	pos->off--;
+	return;
+    }
+    while (--pos->i >= 0 &&
+	   (!rotate_iov_p(&pos->iov[pos->i]) ||
+	    pos->iov[pos->i].buffer.length == 0))
+	;
+    if (pos->i >= 0)
+	pos->off = pos->iov[pos->i].buffer.length - 1;
+}
+
+/*
+ * Reverse the bytes [start, end) of the rotated buffers
+ */
+
+static void
+reverse_iov(gss_iov_buffer_desc *iov, int iov_count, size_t start, size_t end)
+{
+    struct iov_pos front, back;
+    u_char *p, *q, c;
+
+    if (end - start < 2)
+	return;
+
+    front.iov = back.iov = iov;
+    front.iov_count = back.iov_count = iov_count;
+    iov_pos_seek(&front, start);
+    iov_pos_seek(&back, end - 1);
+
+    for (; start < --end; start++) {
+	p = iov_pos_ptr(&front);
+	q = iov_pos_ptr(&back);
+	c = *p;
+	*p = *q;
+	*q = c;
+	iov_pos_next(&front);
+	iov_pos_prev(&back);
     }
-    assert((size_t)(q - p) == len);
+}
+
+/*
+ * Undo the RRC rotation in place.  When the buffers are adjacent in
+ * memory, as when the caller split up a single token, this is a plain
+ * rrc_rotate(); otherwise reverse across the buffers.
+ */
+
+static OM_uint32
+unrotate_iov(OM_uint32 *minor_status, size_t rrc, gss_iov_buffer_desc *iov, int iov_count)
+{
+    u_char *start = NULL, *end = NULL;
+    size_t len = 0;
+    int i, contiguous = 1;
 
-    /* unrotate first part */
-    q = p + rrc;
-    skip = rrc;
     for (i = 0; i < iov_count; i++) {
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	{
-	    if (iov[i].buffer.length <= skip) {
-		skip -= iov[i].buffer.length;
-	    } else {
-                /* copy back to original buffer */
-		memcpy(((uint8_t *)iov[i].buffer.value) + skip, q, iov[i].buffer.length - skip);
-		q += iov[i].buffer.length - skip;
-		skip = 0;
-	    }
-	}
+	if (!rotate_iov_p(&iov[i]) || iov[i].buffer.length == 0)
+	    continue;
+	if (start == NULL)
+	    start = iov[i].buffer.value;
+	else if (iov[i].buffer.value != end)
+	    contiguous = 0;
+	end = (u_char *)iov[i].buffer.value + iov[i].buffer.length;
+	len += iov[i].buffer.length;
     }
-    /* copy trailer */
-    q = p;
-    skip = rrc;
-    for (i = 0; i < iov_count; i++) {
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	{
-	    memcpy(iov[i].buffer.value, q, min(iov[i].buffer.length, skip));
-	    if (iov[i].buffer.length > skip)
-		break;
-	    skip -= iov[i].buffer.length;
-	    q += iov[i].buffer.length;
-	}
+
+    if (len == 0)
+	return GSS_S_COMPLETE;
+
+    rrc %= len;
+    if (rrc == 0)
+	return GSS_S_COMPLETE;
+
+    if (contiguous) {
+	*minor_status = rrc_rotate(start, len, rrc, TRUE);
+	return *minor_status ? GSS_S_FAILURE : GSS_S_COMPLETE;
     }
-    free(p);
+
+    reverse_iov(iov, iov_count, 0, rrc);
+    reverse_iov(iov, iov_count, rrc, len);
+    reverse_iov(iov, iov_count, 0, len);
+
     return GSS_S_COMPLETE;
 }
 
@@ -756,6 +858,7 @@ _gssapi_unwrap_cfx_iov(OM_uint32 *minor_status,
     unsigned usage;
     uint16_t ec, rrc;
     krb5_crypto_iov *data = NULL;
+    krb5_crypto_iov stack_data[CFX_IOV_STACK];
     int i, j;
 
     *minor_status = 0;
@@ -844,7 +947,10 @@ _gssapi_unwrap_cfx_iov(OM_uint32 *minor_status,
 	usage = KRB5_KU_USAGE_INITIATOR_SEAL;
     }
 
-    data = calloc(iov_count + 3, sizeof(data[0]));
+    if (iov_count + 3 <= CFX_IOV_STACK)
+	data = stack_data;
+    else
+	data = calloc(iov_count + 3, sizeof(data[0]));
     if (data == NULL) {
 	*minor_status = ENOMEM;
 	major_status = GSS_S_FAILURE;
@@ -1026,13 +1132,14 @@ _gssapi_unwrap_cfx_iov(OM_uint32 *minor_status,
 	*qop_state = GSS_C_QOP_DEFAULT;
     }
 
-    free(data);
+    if (data != stack_data)
+	free(data);
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
 
  failure:
-    if (data)
+    if (data != stack_data)
 	free(data);
 
     gss_release_iov_buffer(&junk, iov, iov_count);
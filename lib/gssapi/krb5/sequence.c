@@ -34,6 +34,20 @@
 #include "gsskrb5_locl.h"
 
 #define DEFAULT_JITTER_WINDOW 20
+#define MAX_JITTER_WINDOW (1 << 20)
+
+/*
+ * Replay and sequence state is an RFC 4303 style sliding window: `top'
+ * is the highest sequence number seen and bit (seq % nbits) of `bits'
+ * records whether seq, for seq within jitter_window of top, has been
+ * seen.  The bitmap is a ring of nwords 64-bit words, a power of two
+ * so that it stays continuous when the sequence number wraps, with at
+ * least one spare word so that moving top only has to clear the words
+ * it enters.  Checking and recording a sequence number is O(1).
+ *
+ * `length' counts the recorded sequence numbers (at most
+ * jitter_window); it is zero until the first token arrives.
+ */
 
 struct gss_msg_order {
     OM_uint32 flags;
@@ -41,9 +55,13 @@ struct gss_msg_order {
     OM_uint32 length;
     OM_uint32 jitter_window;
     OM_uint32 first_seq;
-    OM_uint32 elem[1];
+    OM_uint32 top;
+    OM_uint32 nwords;
+    uint64_t bits[1];
 };
 
+#define BIT_WORD(o, seq)	(((seq) >> 6) & ((o)->nwords - 1))
+#define BIT_MASK(seq)		((uint64_t)1 << ((seq) & 63))
 
 /*
  *
@@ -54,17 +72,22 @@ msg_order_alloc(OM_uint32 *minor_status,
 		struct gss_msg_order **o,
 		OM_uint32 jitter_window)
 {
+    OM_uint32 nwords = 1;
     size_t len;
 
-    len = jitter_window * sizeof((*o)->elem[0]);
+    while (nwords * 64 < jitter_window + 64)
+	nwords <<= 1;
+
+    len = nwords * sizeof((*o)->bits[0]);
     len += sizeof(**o);
-    len -= sizeof((*o)->elem[0]);
+    len -= sizeof((*o)->bits[0]);
 
     *o = calloc(1, len);
     if (*o == NULL) {
 	*minor_status = ENOMEM;
 	return GSS_S_FAILURE;
     }
+    (*o)->nwords = nwords;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
@@ -86,6 +109,10 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
 
     if (jitter_window == 0)
 	jitter_window = DEFAULT_JITTER_WINDOW;
+    if (jitter_window > MAX_JITTER_WINDOW) {
+	*minor_status = EINVAL;
+	return GSS_S_FAILURE;
+    }
 
     ret = msg_order_alloc(minor_status, o, jitter_window);
     if(ret != GSS_S_COMPLETE)
@@ -95,7 +122,7 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
     (*o)->length = 0;
     (*o)->first_seq = seq_num;
     (*o)->jitter_window = jitter_window;
-    (*o)->elem[0] = seq_num - 1;
+    (*o)->top = seq_num - 1;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
@@ -109,39 +136,52 @@ _gssapi_msg_order_destroy(struct gss_msg_order **m)
     return GSS_S_COMPLETE;
 }
 
-static void
-elem_set(struct gss_msg_order *o, unsigned int slot, OM_uint32 val)
+static int
+seen_p(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    o->elem[slot % o->jitter_window] = val;
+    return (o->bits[BIT_WORD(o, seq_num)] & BIT_MASK(seq_num)) != 0;
 }
 
 static void
-elem_insert(struct gss_msg_order *o,
-	    unsigned int after_slot,
-	    OM_uint32 seq_num)
+mark_seen(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    assert(o->jitter_window > after_slot);
+    if (seen_p(o, seq_num))
+	return;
+    o->bits[BIT_WORD(o, seq_num)] |= BIT_MASK(seq_num);
+    if (o->length < o->jitter_window)
+	o->length++;
+}
 
-    if (o->length > after_slot)
-	memmove(&o->elem[after_slot + 1], &o->elem[after_slot],
-		(o->length - after_slot - 1) * sizeof(o->elem[0]));
+/*
+ * Make seq_num the new top of the window, clearing the words that
+ * the window slides into.
+ */
 
-    elem_set(o, after_slot, seq_num);
+static void
+window_advance(struct gss_msg_order *o, OM_uint32 seq_num)
+{
+    OM_uint32 words = ((seq_num >> 6) - (o->top >> 6)) & (0xffffffffU >> 6);
+    OM_uint32 i;
 
-    if (o->length < o->jitter_window)
-	o->length++;
+    if (o->length == 0 || words >= o->nwords || seq_num - o->top > 0x7fffffffU) {
+	memset(o->bits, 0, o->nwords * sizeof(o->bits[0]));
+    } else {
+	for (i = 1; i <= words; i++)
+	    o->bits[((o->top >> 6) + i) & (o->nwords - 1)] = 0;
+    }
+    o->top = seq_num;
+    mark_seen(o, seq_num);
 }
 
 /* rule 1: expected sequence number */
 /* rule 2: > expected sequence number */
-/* rule 3: seqnum < seqnum(first) */
-/* rule 4+5: seqnum in [seqnum(first),seqnum(last)]  */
+/* rule 3: seqnum older than the window */
+/* rule 4+5: seqnum in the window, seen or not */
 
 OM_uint32
 _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    OM_uint32 r;
-    size_t i;
+    OM_uint32 r, diff;
 
     if (o == NULL)
 	return GSS_S_COMPLETE;
@@ -149,21 +189,20 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
     if ((o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG)) == 0)
 	return GSS_S_COMPLETE;
 
+    diff = seq_num - o->top;
+
     /* check if the packet is the next in order */
-    if (o->elem[0] == seq_num - 1) {
-	elem_insert(o, 0, seq_num);
+    if (diff == 1) {
+	window_advance(o, seq_num);
 	return GSS_S_COMPLETE;
     }
 
     r = (o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG))==GSS_C_REPLAY_FLAG;
 
-    /* sequence number larger then largest sequence number
-     * or smaller then the first sequence number */
-    if (seq_num > o->elem[0]
-	|| seq_num < o->first_seq
-	|| o->length == 0)
-    {
-	elem_insert(o, 0, seq_num);
+    /* sequence number larger then largest sequence number,
+     * or the first token */
+    if ((diff != 0 && diff <= 0x7fffffffU) || o->length == 0) {
+	window_advance(o, seq_num);
 	if (r) {
 	    return GSS_S_COMPLETE;
 	} else {
@@ -171,33 +210,22 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 	}
     }
 
-    assert(o->length > 0);
-
-    /* sequence number smaller the first sequence number */
-    if (seq_num < o->elem[o->length - 1]) {
+    /* sequence number older than the window */
+    if (o->top - seq_num >= o->jitter_window) {
 	if (r)
 	    return(GSS_S_OLD_TOKEN);
 	else
 	    return(GSS_S_UNSEQ_TOKEN);
     }
 
-    if (seq_num == o->elem[o->length - 1]) {
+    if (seen_p(o, seq_num))
 	return GSS_S_DUPLICATE_TOKEN;
-    }
-
-    for (i = 0; i < o->length - 1; i++) {
-	if (o->elem[i] == seq_num)
-	    return GSS_S_DUPLICATE_TOKEN;
-	if (o->elem[i + 1] < seq_num && o->elem[i] < seq_num) {
-	    elem_insert(o, i, seq_num);
-	    if (r)
-		return GSS_S_COMPLETE;
-	    else
-		return GSS_S_UNSEQ_TOKEN;
-	}
-    }
 
-    return GSS_S_FAILURE;
+    mark_seen(o, seq_num);
+    if (r)
+	return GSS_S_COMPLETE;
+    else
+	return GSS_S_UNSEQ_TOKEN;
 }
 
 OM_uint32
@@ -208,13 +236,24 @@ _gssapi_msg_order_f(OM_uint32 flags)
 
 /*
  * Translate `o` into inter-process format and export in to `sp'.
+ *
+ * The format predates the bitmap: after the header come jitter_window
+ * sequence numbers, the `length' recorded ones newest first (or just
+ * top when nothing has been recorded), padded with zeros.
  */
 
 krb5_error_code
 _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
 {
     krb5_error_code kret;
-    OM_uint32 i;
+    OM_uint32 i, n, length = 0;
+
+    /* Only the sequence numbers still inside the window are exported */
+    if (o->length) {
+	for (i = 0; i < o->jitter_window; i++)
+	    if (seen_p(o, o->top - i))
+		length++;
+    }
 
     kret = krb5_store_int32(sp, o->flags);
     if (kret)
@@ -222,7 +261,7 @@ _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
     kret = krb5_store_int32(sp, o->start);
     if (kret)
         return kret;
-    kret = krb5_store_int32(sp, o->length);
+    kret = krb5_store_int32(sp, length);
     if (kret)
         return kret;
     kret = krb5_store_int32(sp, o->jitter_window);
@@ -232,8 +271,24 @@ _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
     if (kret)
         return kret;
 
-    for (i = 0; i < o->jitter_window; i++) {
-        kret = krb5_store_int32(sp, o->elem[i]);
+    n = 0;
+    if (length == 0) {
+	kret = krb5_store_int32(sp, o->top);
+	if (kret)
+	    return kret;
+	n++;
+    } else {
+	for (i = 0; i < o->jitter_window; i++) {
+	    if (!seen_p(o, o->top - i))
+		continue;
+	    kret = krb5_store_int32(sp, o->top - i);
+	    if (kret)
+		return kret;
+	    n++;
+	}
+    }
+    for (; n < o->jitter_window; n++) {
+        kret = krb5_store_int32(sp, 0);
 	if (kret)
 	    return kret;
     }
@@ -248,7 +303,9 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
 {
     OM_uint32 ret;
     krb5_error_code kret;
-    int32_t i, flags, start, length, jitter_window, first_seq;
+    int32_t i, flags, start, length, jitter_window, first_seq, seq;
+
+    *o = NULL;
 
     kret = krb5_ret_int32(sp, &flags);
     if (kret)
@@ -266,20 +323,29 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
     if (kret)
 	goto failed;
 
+    if (jitter_window <= 0 || jitter_window > MAX_JITTER_WINDOW ||
+	length < 0 || length > jitter_window) {
+	kret = EINVAL;
+	goto failed;
+    }
+
     ret = msg_order_alloc(minor_status, o, jitter_window);
     if (ret != GSS_S_COMPLETE)
         return ret;
 
     (*o)->flags = flags;
     (*o)->start = start;
-    (*o)->length = length;
     (*o)->jitter_window = jitter_window;
     (*o)->first_seq = first_seq;
 
     for( i = 0; i < jitter_window; i++ ) {
-        kret = krb5_ret_int32(sp, (int32_t*)&((*o)->elem[i]));
+        kret = krb5_ret_int32(sp, &seq);
 	if (kret)
 	    goto failed;
+	if (i == 0)
+	    (*o)->top = seq;
+	if (i < length && (*o)->top - (OM_uint32)seq < (OM_uint32)jitter_window)
+	    mark_seen(*o, seq);
     }
 
     *minor_status = 0;
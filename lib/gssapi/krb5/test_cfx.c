@@ -132,7 +132,235 @@ test_special(krb5_context context, krb5_crypto crypto,
 }
 
 
+/*
+ * Wrap and unwrap through the iov interface with caller owned header
+ * and trailer storage.  "rotate" moves the trailer to the front of the
+ * data the way a peer using RRC would, and "split" spreads the data
+ * over two buffers that are not adjacent in memory.
+ */
+
+static void
+init_ctx(krb5_context context, krb5_crypto crypto, struct gsskrb5_ctx *ctx,
+	 int local)
+{
+    OM_uint32 minor;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->crypto = crypto;
+    ctx->more_flags = IS_CFX | (local ? LOCAL : 0);
+    HEIMDAL_MUTEX_init(&ctx->ctx_id_mutex);
+    if (krb5_auth_con_init(context, &ctx->auth_context))
+	krb5_errx(context, 1, "krb5_auth_con_init");
+    if (_gssapi_msg_order_create(&minor, &ctx->order, 0, 0, 0, 0))
+	krb5_errx(context, 1, "_gssapi_msg_order_create");
+}
+
+static void
+free_ctx(krb5_context context, struct gsskrb5_ctx *ctx)
+{
+    krb5_auth_con_free(context, ctx->auth_context);
+    _gssapi_msg_order_destroy(&ctx->order);
+    HEIMDAL_MUTEX_destroy(&ctx->ctx_id_mutex);
+}
+
+static void
+rotate_stream(gss_iov_buffer_desc *iov, int iov_count, size_t rrc)
+{
+    unsigned char *p, *q;
+    size_t len = 0;
+    int i;
 
+    for (i = 0; i < iov_count; i++)
+	if (GSS_IOV_BUFFER_TYPE(iov[i].type) != GSS_IOV_BUFFER_TYPE_HEADER)
+	    len += iov[i].buffer.length;
+    p = malloc(len);
+    q = malloc(len);
+    if (p == NULL || q == NULL)
+	errx(1, "malloc");
+    len = 0;
+    for (i = 0; i < iov_count; i++) {
+	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_HEADER)
+	    continue;
+	memcpy(p + len, iov[i].buffer.value, iov[i].buffer.length);
+	len += iov[i].buffer.length;
+    }
+    rrc %= len;
+    memcpy(q, p + len - rrc, rrc);
+    memcpy(q + rrc, p, len - rrc);
+    len = 0;
+    for (i = 0; i < iov_count; i++) {
+	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_HEADER)
+	    continue;
+	memcpy(iov[i].buffer.value, q + len, iov[i].buffer.length);
+	len += iov[i].buffer.length;
+    }
+    free(p);
+    free(q);
+}
+
+static void
+test_iov(krb5_context context, struct gsskrb5_ctx *ictx,
+	 struct gsskrb5_ctx *actx, int conf, int trailer, size_t rotate,
+	 int split, size_t size)
+{
+    unsigned char header[128], *msg, *copy, *data2;
+    gss_iov_buffer_desc iov[4];
+    OM_uint32 major, minor;
+    gss_cfx_wrap_token token;
+    size_t half = size / 2;
+    int conf_state, n = 0, t;
+
+    msg = malloc(size + 128);
+    copy = malloc(size);
+    data2 = malloc(size);
+    if (msg == NULL || copy == NULL || data2 == NULL)
+	errx(1, "malloc");
+    krb5_generate_random_block(copy, size);
+    memcpy(msg, copy, size);
+
+    iov[n].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[n].buffer.value = header;
+    iov[n].buffer.length = sizeof(header);
+    n++;
+    iov[n].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[n].buffer.value = msg;
+    iov[n].buffer.length = split ? half : size;
+    n++;
+    if (split) {
+	memcpy(data2, msg + half, size - half);
+	iov[n].type = GSS_IOV_BUFFER_TYPE_DATA;
+	iov[n].buffer.value = data2;
+	iov[n].buffer.length = size - half;
+	n++;
+    }
+    t = n;
+    if (trailer) {
+	/* Trailer storage right behind the data, as in a single token */
+	iov[n].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+	iov[n].buffer.value = msg + size;
+	iov[n].buffer.length = 128;
+	n++;
+    }
+
+    major = _gssapi_wrap_cfx_iov(&minor, ictx, context, conf, &conf_state,
+				 iov, n);
+    if (major)
+	krb5_errx(context, 1, "_gssapi_wrap_cfx_iov: %d/%d",
+		  (int)major, (int)minor);
+    if (trailer && iov[t].buffer.value != msg + size)
+	krb5_errx(context, 1, "trailer storage not used in place");
+
+    if (rotate) {
+	token = (gss_cfx_wrap_token)header;
+	rotate_stream(iov, n, rotate);
+	token->RRC[0] = (rotate >> 8) & 0xFF;
+	token->RRC[1] = (rotate >> 0) & 0xFF;
+    }
+
+    major = _gssapi_unwrap_cfx_iov(&minor, actx, context, &conf_state, NULL,
+				   iov, n);
+    if (major)
+	krb5_errx(context, 1, "_gssapi_unwrap_cfx_iov: %d/%d "
+		  "(conf %d trailer %d rotate %d split %d size %d)",
+		  (int)major, (int)minor, conf, trailer, (int)rotate,
+		  split, (int)size);
+    if (conf_state != conf)
+	krb5_errx(context, 1, "conf_state");
+
+    if (split)
+	memcpy(msg + half, data2, size - half);
+    if (memcmp(msg, copy, size) != 0)
+	krb5_errx(context, 1, "unwrapped data differs "
+		  "(conf %d trailer %d rotate %d split %d size %d)",
+		  conf, trailer, (int)rotate, split, (int)size);
+
+    free(msg);
+    free(copy);
+    free(data2);
+}
+
+static void
+test_wrap_iov(krb5_context context, krb5_crypto crypto)
+{
+    struct gsskrb5_ctx ictx, actx;
+    size_t sizes[] = { 1, 15, 16, 17, 100, 300, 1000, 4096, 70000 };
+    size_t rotations[] = { 1, 28, 60, 255, 256, 257, 1000, 65535 };
+    size_t i, j;
+
+    init_ctx(context, crypto, &ictx, 1);
+    init_ctx(context, crypto, &actx, 0);
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+	test_iov(context, &ictx, &actx, 1, 1, 0, 0, sizes[i]);
+	test_iov(context, &ictx, &actx, 1, 0, 0, 0, sizes[i]);
+	test_iov(context, &ictx, &actx, 0, 1, 0, 0, sizes[i]);
+	test_iov(context, &ictx, &actx, 0, 0, 0, 0, sizes[i]);
+	test_iov(context, &ictx, &actx, 1, 1, 0, 1, sizes[i]);
+	for (j = 0; j < sizeof(rotations)/sizeof(rotations[0]); j++) {
+	    test_iov(context, &ictx, &actx, 1, 1, rotations[j], 0, sizes[i]);
+	    test_iov(context, &ictx, &actx, 1, 1, rotations[j], 1, sizes[i]);
+	}
+    }
+
+    free_ctx(context, &ictx);
+    free_ctx(context, &actx);
+}
+
+/*
+ * With --bench, time in-place iov wrap and unwrap with caller owned
+ * header and trailer buffers.
+ */
+
+static double
+elapsed(const struct timeval *a, const struct timeval *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void
+bench_iov(krb5_context context, krb5_crypto crypto, size_t size,
+	  size_t count)
+{
+    struct gsskrb5_ctx ictx, actx;
+    unsigned char header[128], trailer[128], *msg;
+    gss_iov_buffer_desc iov[3];
+    struct timeval t0, t1;
+    OM_uint32 major, minor;
+    size_t i;
+
+    init_ctx(context, crypto, &ictx, 1);
+    init_ctx(context, crypto, &actx, 0);
+    msg = calloc(1, size);
+    if (msg == NULL)
+	errx(1, "malloc");
+
+    iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[0].buffer.value = header;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[1].buffer.value = msg;
+    iov[1].buffer.length = size;
+    iov[2].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    iov[2].buffer.value = trailer;
+
+    gettimeofday(&t0, NULL);
+    for (i = 0; i < count; i++) {
+	iov[0].buffer.length = sizeof(header);
+	iov[2].buffer.length = sizeof(trailer);
+	major = _gssapi_wrap_cfx_iov(&minor, &ictx, context, 1, NULL, iov, 3);
+	if (major == GSS_S_COMPLETE)
+	    major = _gssapi_unwrap_cfx_iov(&minor, &actx, context, NULL, NULL,
+					   iov, 3);
+	if (major)
+	    krb5_errx(context, 1, "bench: %d/%d", (int)major, (int)minor);
+    }
+    gettimeofday(&t1, NULL);
+    printf("wrap+unwrap %6lu bytes x %7lu: %8.3f s\n",
+	   (unsigned long)size, (unsigned long)count, elapsed(&t0, &t1));
+
+    free(msg);
+    free_ctx(context, &ictx);
+    free_ctx(context, &actx);
+}
 
 int
 main(int argc, char **argv)
@@ -157,6 +385,13 @@ main(int argc, char **argv)
     if (ret)
 	krb5_err(context, 1, ret, "krb5_crypto_init");
 
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+	bench_iov(context, crypto, 64, 200000);
+	bench_iov(context, crypto, 1024, 200000);
+	bench_iov(context, crypto, 32768, 20000);
+	goto out;
+    }
+
     test_special(context, crypto, 1, 60);
     test_special(context, crypto, 0, 60);
 
@@ -165,6 +400,9 @@ main(int argc, char **argv)
 	test_range(&tests[i], 0, context, crypto);
     }
 
+    test_wrap_iov(context, crypto);
+
+ out:
     krb5_free_keyblock_contents(context, &keyblock);
     krb5_crypto_destroy(context, crypto);
     krb5_free_context(context);
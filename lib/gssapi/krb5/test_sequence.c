@@ -347,6 +347,203 @@ struct {
     }
 };
 
+/*
+ * Replay shuffled streams with duplicates and late tokens, checking
+ * each verdict against a simple model of the window, and move the
+ * state through export/import along the way.
+ */
+
+struct model {
+    unsigned char *seen;
+    long top;
+    int have;
+};
+
+static OM_uint32
+model_check(struct model *m, OM_uint32 flags, long idx, long window)
+{
+    int r = (flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG)) == GSS_C_REPLAY_FLAG;
+
+    if (idx == m->top + 1) {
+	m->seen[idx] = 1;
+	m->top = idx;
+	m->have = 1;
+	return GSS_S_COMPLETE;
+    }
+    if (idx > m->top || !m->have) {
+	m->seen[idx] = 1;
+	m->top = idx;
+	m->have = 1;
+	return r ? GSS_S_COMPLETE : GSS_S_GAP_TOKEN;
+    }
+    if (m->top - idx >= window)
+	return r ? GSS_S_OLD_TOKEN : GSS_S_UNSEQ_TOKEN;
+    if (m->seen[idx])
+	return GSS_S_DUPLICATE_TOKEN;
+    m->seen[idx] = 1;
+    return r ? GSS_S_COMPLETE : GSS_S_UNSEQ_TOKEN;
+}
+
+static int
+stress_seq(OM_uint32 flags, OM_uint32 start_seq, OM_uint32 window,
+	   long count, long jitter)
+{
+    struct gss_msg_order *o;
+    OM_uint32 maj_stat, min_stat, expected;
+    struct model m;
+    krb5_storage *sp;
+    long *stream, i, j, n, t;
+
+    stream = malloc((2 * count + 2) * sizeof(stream[0]));
+    m.seen = calloc(count, 1);
+    if (stream == NULL || m.seen == NULL)
+	errx(1, "malloc");
+    m.top = -1;
+    m.have = 0;
+
+    /* an in-order stream, locally shuffled, with some replays mixed in */
+    for (i = 0; i < count; i++)
+	stream[i] = i;
+    for (i = 0; i < count; i++) {
+	j = i + rand() % (jitter + 1);
+	if (j >= count)
+	    continue;
+	t = stream[i];
+	stream[i] = stream[j];
+	stream[j] = t;
+    }
+    for (i = 0, n = 0; i < count; i++) {
+	stream[count + n] = stream[i];
+	n++;
+	if (rand() % 8 == 0)
+	    stream[count + n++] = stream[rand() % (i + 1)];
+	if (n >= count)
+	    break;
+    }
+    memmove(stream, stream + count, n * sizeof(stream[0]));
+
+    maj_stat = _gssapi_msg_order_create(&min_stat, &o, flags, start_seq,
+					window, 0);
+    if (maj_stat)
+	errx(1, "create: %d %d", maj_stat, min_stat);
+
+    for (i = 0; i < n; i++) {
+	if (i % 997 == 0) {
+	    sp = krb5_storage_emem();
+	    if (sp == NULL)
+		errx(1, "krb5_storage_emem");
+	    if (_gssapi_msg_order_export(sp, o))
+		errx(1, "export");
+	    _gssapi_msg_order_destroy(&o);
+	    krb5_storage_seek(sp, 0, SEEK_SET);
+	    maj_stat = _gssapi_msg_order_import(&min_stat, sp, &o);
+	    if (maj_stat)
+		errx(1, "import: %d %d", maj_stat, min_stat);
+	    krb5_storage_free(sp);
+	}
+	expected = model_check(&m, flags, stream[i], window);
+	maj_stat = _gssapi_msg_order_check(o, start_seq + (OM_uint32)stream[i]);
+	if (maj_stat != expected) {
+	    printf("stress flags %d start %u window %u: token %ld "
+		   "(#%ld) gave %d (should have been %d)\n",
+		   (int)flags, (unsigned)start_seq, (unsigned)window,
+		   stream[i], i, (int)maj_stat, (int)expected);
+	    break;
+	}
+    }
+
+    _gssapi_msg_order_destroy(&o);
+    free(stream);
+    free(m.seen);
+    return i < n;
+}
+
+/*
+ * The export format predates the bitmap window; make sure a blob laid
+ * out the old way still imports, and that a fresh state still exports
+ * the same bytes.
+ */
+
+static int
+test_compat(void)
+{
+    OM_uint32 maj_stat, min_stat;
+    struct gss_msg_order *o;
+    krb5_storage *sp;
+    krb5_data d;
+    int32_t v;
+    int i, failed = 0;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	errx(1, "krb5_storage_emem");
+    krb5_store_int32(sp, GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG);
+    krb5_store_int32(sp, 0);
+    krb5_store_int32(sp, 3);
+    krb5_store_int32(sp, 20);
+    krb5_store_int32(sp, 0);
+    krb5_store_int32(sp, 5);
+    krb5_store_int32(sp, 4);
+    krb5_store_int32(sp, 2);
+    for (i = 3; i < 20; i++)
+	krb5_store_int32(sp, 0);
+    krb5_storage_seek(sp, 0, SEEK_SET);
+    maj_stat = _gssapi_msg_order_import(&min_stat, sp, &o);
+    krb5_storage_free(sp);
+    if (maj_stat)
+	errx(1, "import: %d %d", maj_stat, min_stat);
+
+    if (_gssapi_msg_order_check(o, 4) != GSS_S_DUPLICATE_TOKEN ||
+	_gssapi_msg_order_check(o, 3) != GSS_S_UNSEQ_TOKEN ||
+	_gssapi_msg_order_check(o, 3) != GSS_S_DUPLICATE_TOKEN ||
+	_gssapi_msg_order_check(o, 0) != GSS_S_UNSEQ_TOKEN ||
+	_gssapi_msg_order_check(o, 6) != GSS_S_COMPLETE) {
+	printf("old format import failed\n");
+	failed++;
+    }
+    _gssapi_msg_order_destroy(&o);
+
+    maj_stat = _gssapi_msg_order_create(&min_stat, &o,
+					GSS_C_REPLAY_FLAG, 7, 20, 0);
+    if (maj_stat)
+	errx(1, "create: %d %d", maj_stat, min_stat);
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	errx(1, "krb5_storage_emem");
+    _gssapi_msg_order_export(sp, o);
+    krb5_storage_to_data(sp, &d);
+    krb5_storage_free(sp);
+    _gssapi_msg_order_destroy(&o);
+
+    sp = krb5_storage_from_data(&d);
+    if (sp == NULL)
+	errx(1, "krb5_storage_from_data");
+    for (i = 0; i < 25; i++) {
+	int32_t want;
+
+	switch (i) {
+	case 0: want = GSS_C_REPLAY_FLAG; break;
+	case 3: want = 20; break;
+	case 4: want = 7; break;
+	case 5: want = 6; break;
+	default: want = 0; break;
+	}
+	if (krb5_ret_int32(sp, &v) || v != want) {
+	    printf("export of a fresh state differs at word %d\n", i);
+	    failed++;
+	    break;
+	}
+    }
+    if (d.length != 25 * 4) {
+	printf("export of a fresh state has the wrong length\n");
+	failed++;
+    }
+    krb5_storage_free(sp);
+    krb5_data_free(&d);
+
+    return failed;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -361,6 +558,22 @@ main(int argc, char **argv)
 		     pl[i].error_code))
 	    failed++;
     }
+    failed += test_compat();
+
+    srand(4711);
+    for (i = 0; i < 3; i++) {
+	OM_uint32 flags[] = {
+	    GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG,
+	    GSS_C_REPLAY_FLAG,
+	    GSS_C_SEQUENCE_FLAG
+	};
+
+	failed += stress_seq(flags[i], 0, 20, 100000, 8);
+	failed += stress_seq(flags[i], 0, 20, 100000, 40);
+	failed += stress_seq(flags[i], 4294967295U - 5000, 64, 100000, 60);
+	failed += stress_seq(flags[i], 12345, 1000, 100000, 1500);
+    }
+
     if (failed)
 	printf("FAILED %d tests\n", failed);
     return failed != 0;
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <roken.h>
+
+#ifdef KRB5
+#include <krb5-types.h>
+#endif
+
+#include "aes.h"
+#include "aes-ni.h"
+
+#ifdef HAVE_AESNI
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI __attribute__((target("aes,sse2")))
+
+/*
+ * The round keys are kept in AES_KEY as the raw 16-byte blocks the
+ * instructions use, rounds + 1 of them, decryption keys already
+ * reversed and passed through InvMixColumns.
+ */
+
+#define RK(k, i) ((__m128i *)(void *)(k)->key + (i))
+
+int
+_hc_aesni_available(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) == 0)
+	return 0;
+    return (c & bit_AES) != 0 && (d & bit_SSE2) != 0;
+}
+
+static AESNI __m128i
+expand_128(__m128i k, __m128i t)
+{
+    t = _mm_shuffle_epi32(t, 0xff);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+static AESNI void
+expand_192(__m128i *k1, __m128i *t, __m128i *k3)
+{
+    __m128i x;
+
+    *t = _mm_shuffle_epi32(*t, 0x55);
+    x = _mm_slli_si128(*k1, 4);
+    *k1 = _mm_xor_si128(*k1, x);
+    x = _mm_slli_si128(x, 4);
+    *k1 = _mm_xor_si128(*k1, x);
+    x = _mm_slli_si128(x, 4);
+    *k1 = _mm_xor_si128(*k1, x);
+    *k1 = _mm_xor_si128(*k1, *t);
+    *t = _mm_shuffle_epi32(*k1, 0xff);
+    x = _mm_slli_si128(*k3, 4);
+    *k3 = _mm_xor_si128(*k3, x);
+    *k3 = _mm_xor_si128(*k3, *t);
+}
+
+static AESNI __m128i
+expand_256_b(__m128i k1, __m128i k3)
+{
+    __m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k1, 0), 0xaa);
+
+    k3 = _mm_xor_si128(k3, _mm_slli_si128(k3, 4));
+    k3 = _mm_xor_si128(k3, _mm_slli_si128(k3, 4));
+    k3 = _mm_xor_si128(k3, _mm_slli_si128(k3, 4));
+    return _mm_xor_si128(k3, t);
+}
+
+/* Join the low halves of two blocks */
+#define LO_LO(a, b) \
+    _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 0))
+/* The high half of the first block, the low half of the second */
+#define HI_LO(a, b) \
+    _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 1))
+
+int AESNI
+_hc_aesni_set_encrypt_key(const unsigned char *userkey, int bits, AES_KEY *key)
+{
+    __m128i k1, k3, t, h;
+
+    switch (bits) {
+    case 128:
+	k1 = _mm_loadu_si128((const __m128i *)userkey);
+	_mm_storeu_si128(RK(key, 0), k1);
+#define R128(i, rcon)							\
+	k1 = expand_128(k1, _mm_aeskeygenassist_si128(k1, rcon));	\
+	_mm_storeu_si128(RK(key, i), k1)
+	R128(1, 0x01); R128(2, 0x02); R128(3, 0x04); R128(4, 0x08);
+	R128(5, 0x10); R128(6, 0x20); R128(7, 0x40); R128(8, 0x80);
+	R128(9, 0x1b); R128(10, 0x36);
+#undef R128
+	key->rounds = 10;
+	break;
+    case 192:
+	k1 = _mm_loadu_si128((const __m128i *)userkey);
+	k3 = _mm_loadl_epi64((const __m128i *)(userkey + 16));
+	_mm_storeu_si128(RK(key, 0), k1);
+#define R192(rcon)							\
+	t = _mm_aeskeygenassist_si128(k3, rcon);			\
+	expand_192(&k1, &t, &k3)
+	/* Six 64-bit halves are produced for every three round keys */
+	h = k3;
+	R192(0x01);
+	_mm_storeu_si128(RK(key, 1), LO_LO(h, k1));
+	_mm_storeu_si128(RK(key, 2), HI_LO(k1, k3));
+	R192(0x02);
+	_mm_storeu_si128(RK(key, 3), k1);
+	h = k3;
+	R192(0x04);
+	_mm_storeu_si128(RK(key, 4), LO_LO(h, k1));
+	_mm_storeu_si128(RK(key, 5), HI_LO(k1, k3));
+	R192(0x08);
+	_mm_storeu_si128(RK(key, 6), k1);
+	h = k3;
+	R192(0x10);
+	_mm_storeu_si128(RK(key, 7), LO_LO(h, k1));
+	_mm_storeu_si128(RK(key, 8), HI_LO(k1, k3));
+	R192(0x20);
+	_mm_storeu_si128(RK(key, 9), k1);
+	h = k3;
+	R192(0x40);
+	_mm_storeu_si128(RK(key, 10), LO_LO(h, k1));
+	_mm_storeu_si128(RK(key, 11), HI_LO(k1, k3));
+	R192(0x80);
+	_mm_storeu_si128(RK(key, 12), k1);
+#undef R192
+	key->rounds = 12;
+	break;
+    case 256:
+	k1 = _mm_loadu_si128((const __m128i *)userkey);
+	k3 = _mm_loadu_si128((const __m128i *)(userkey + 16));
+	_mm_storeu_si128(RK(key, 0), k1);
+	_mm_storeu_si128(RK(key, 1), k3);
+#define R256(i, rcon)							\
+	k1 = expand_128(k1, _mm_aeskeygenassist_si128(k3, rcon));	\
+	_mm_storeu_si128(RK(key, i), k1);				\
+	if (i < 14) {							\
+	    k3 = expand_256_b(k1, k3);					\
+	    _mm_storeu_si128(RK(key, i + 1), k3);			\
+	}
+	R256(2, 0x01); R256(4, 0x02); R256(6, 0x04); R256(8, 0x08);
+	R256(10, 0x10); R256(12, 0x20); R256(14, 0x40);
+#undef R256
+	key->rounds = 14;
+	break;
+    default:
+	key->rounds = 0;
+	return -1;
+    }
+    return 0;
+}
+
+int AESNI
+_hc_aesni_set_decrypt_key(const unsigned char *userkey, int bits, AES_KEY *key)
+{
+    AES_KEY ek;
+    int i, nr;
+
+    if (_hc_aesni_set_encrypt_key(userkey, bits, &ek) != 0) {
+	key->rounds = 0;
+	return -1;
+    }
+    nr = ek.rounds;
+    _mm_storeu_si128(RK(key, 0), _mm_loadu_si128(RK(&ek, nr)));
+    for (i = 1; i < nr; i++)
+	_mm_storeu_si128(RK(key, i),
+			 _mm_aesimc_si128(_mm_loadu_si128(RK(&ek, nr - i))));
+    _mm_storeu_si128(RK(key, nr), _mm_loadu_si128(RK(&ek, 0)));
+    key->rounds = nr;
+    memset_s(&ek, sizeof(ek), 0, sizeof(ek));
+    return 0;
+}
+
+static AESNI __m128i
+encrypt_block(__m128i b, const AES_KEY *key)
+{
+    int i;
+
+    b = _mm_xor_si128(b, _mm_loadu_si128(RK(key, 0)));
+    for (i = 1; i < key->rounds; i++)
+	b = _mm_aesenc_si128(b, _mm_loadu_si128(RK(key, i)));
+    return _mm_aesenclast_si128(b, _mm_loadu_si128(RK(key, i)));
+}
+
+static AESNI __m128i
+decrypt_block(__m128i b, const AES_KEY *key)
+{
+    int i;
+
+    b = _mm_xor_si128(b, _mm_loadu_si128(RK(key, 0)));
+    for (i = 1; i < key->rounds; i++)
+	b = _mm_aesdec_si128(b, _mm_loadu_si128(RK(key, i)));
+    return _mm_aesdeclast_si128(b, _mm_loadu_si128(RK(key, i)));
+}
+
+void AESNI
+_hc_aesni_encrypt(const unsigned char *in, unsigned char *out,
+		  const AES_KEY *key)
+{
+    _mm_storeu_si128((__m128i *)out,
+		     encrypt_block(_mm_loadu_si128((const __m128i *)in), key));
+}
+
+void AESNI
+_hc_aesni_decrypt(const unsigned char *in, unsigned char *out,
+		  const AES_KEY *key)
+{
+    _mm_storeu_si128((__m128i *)out,
+		     decrypt_block(_mm_loadu_si128((const __m128i *)in), key));
+}
+
+/*
+ * CBC over whole blocks only; size must be a multiple of the block
+ * size.  Decryption has no chaining dependency, so four blocks are
+ * kept in flight to hide the latency of AESDEC.
+ */
+
+void AESNI
+_hc_aesni_cbc_encrypt(const unsigned char *in, unsigned char *out,
+		      unsigned long size, const AES_KEY *key,
+		      unsigned char *iv, int forward_encrypt)
+{
+    __m128i ivec = _mm_loadu_si128((const __m128i *)iv);
+    __m128i b0, b1, b2, b3, c0, c1, c2, c3, rk;
+    int i;
+
+    if (forward_encrypt) {
+	for (; size >= AES_BLOCK_SIZE; size -= AES_BLOCK_SIZE) {
+	    b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), ivec);
+	    ivec = encrypt_block(b0, key);
+	    _mm_storeu_si128((__m128i *)out, ivec);
+	    in += AES_BLOCK_SIZE;
+	    out += AES_BLOCK_SIZE;
+	}
+	_mm_storeu_si128((__m128i *)iv, ivec);
+	return;
+    }
+
+    for (; size >= 4 * AES_BLOCK_SIZE; size -= 4 * AES_BLOCK_SIZE) {
+	c0 = _mm_loadu_si128((const __m128i *)in);
+	c1 = _mm_loadu_si128((const __m128i *)in + 1);
+	c2 = _mm_loadu_si128((const __m128i *)in + 2);
+	c3 = _mm_loadu_si128((const __m128i *)in + 3);
+	rk = _mm_loadu_si128(RK(key, 0));
+	b0 = _mm_xor_si128(c0, rk);
+	b1 = _mm_xor_si128(c1, rk);
+	b2 = _mm_xor_si128(c2, rk);
+	b3 = _mm_xor_si128(c3, rk);
+	for (i = 1; i < key->rounds; i++) {
+	    rk = _mm_loadu_si128(RK(key, i));
+	    b0 = _mm_aesdec_si128(b0, rk);
+	    b1 = _mm_aesdec_si128(b1, rk);
+	    b2 = _mm_aesdec_si128(b2, rk);
+	    b3 = _mm_aesdec_si128(b3, rk);
+	}
+	rk = _mm_loadu_si128(RK(key, i));
+	b0 = _mm_aesdeclast_si128(b0, rk);
+	b1 = _mm_aesdeclast_si128(b1, rk);
+	b2 = _mm_aesdeclast_si128(b2, rk);
+	b3 = _mm_aesdeclast_si128(b3, rk);
+	_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, ivec));
+	_mm_storeu_si128((__m128i *)out + 1, _mm_xor_si128(b1, c0));
+	_mm_storeu_si128((__m128i *)out + 2, _mm_xor_si128(b2, c1));
+	_mm_storeu_si128((__m128i *)out + 3, _mm_xor_si128(b3, c2));
+	ivec = c3;
+	in += 4 * AES_BLOCK_SIZE;
+	out += 4 * AES_BLOCK_SIZE;
+    }
+    for (; size >= AES_BLOCK_SIZE; size -= AES_BLOCK_SIZE) {
+	c0 = _mm_loadu_si128((const __m128i *)in);
+	_mm_storeu_si128((__m128i *)out,
+			 _mm_xor_si128(decrypt_block(c0, key), ivec));
+	ivec = c0;
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)iv, ivec);
+}
+
+#endif /* HAVE_AESNI */
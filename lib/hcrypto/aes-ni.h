@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HEIM_AES_NI_H
+#define HEIM_AES_NI_H 1
+
+/*
+ * AES using the x86 AES-NI instructions.  The functions are compiled
+ * with per-function target attributes, so the rest of the library
+ * does not need to be built for a CPU that has them; callers must
+ * check _hc_aesni_available() first.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    defined(HAVE_CPUID_H) && defined(HAVE_WMMINTRIN_H)
+#define HAVE_AESNI 1
+
+int  _hc_aesni_available(void);
+int  _hc_aesni_set_encrypt_key(const unsigned char *, int, AES_KEY *);
+int  _hc_aesni_set_decrypt_key(const unsigned char *, int, AES_KEY *);
+void _hc_aesni_encrypt(const unsigned char *, unsigned char *, const AES_KEY *);
+void _hc_aesni_decrypt(const unsigned char *, unsigned char *, const AES_KEY *);
+void _hc_aesni_cbc_encrypt(const unsigned char *, unsigned char *,
+			   unsigned long, const AES_KEY *,
+			   unsigned char *, int);
+
+#endif
+
+#endif /* HEIM_AES_NI_H */
@@ -40,10 +40,35 @@
 
 #include "rijndael-alg-fst.h"
 #include "aes.h"
+#include "aes-ni.h"
+
+/*
+ * Use the AES instructions when the CPU has them, unless
+ * HCRYPTO_NO_HWACCEL is set in the environment (for comparing with
+ * the table based code).  The choice is made once per process, so
+ * keys are always used by the implementation that scheduled them.
+ */
+
+#ifdef HAVE_AESNI
+static int
+aes_hwaccel(void)
+{
+    static int hwaccel = -1;
+
+    if (hwaccel == -1)
+	hwaccel = secure_getenv("HCRYPTO_NO_HWACCEL") == NULL &&
+	    _hc_aesni_available();
+    return hwaccel;
+}
+#endif
 
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef HAVE_AESNI
+    if (aes_hwaccel())
+	return _hc_aesni_set_encrypt_key(userkey, bits, key);
+#endif
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -53,6 +78,10 @@ AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 int
 AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef HAVE_AESNI
+    if (aes_hwaccel())
+	return _hc_aesni_set_decrypt_key(userkey, bits, key);
+#endif
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -62,12 +91,24 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AESNI
+    if (aes_hwaccel()) {
+	_hc_aesni_encrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AESNI
+    if (aes_hwaccel()) {
+	_hc_aesni_decrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -79,6 +120,17 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef HAVE_AESNI
+    if (aes_hwaccel()) {
+	unsigned long n = size & ~(unsigned long)(AES_BLOCK_SIZE - 1);
+
+	_hc_aesni_cbc_encrypt(in, out, n, key, iv, forward_encrypt);
+	in += n;
+	out += n;
+	size -= n;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
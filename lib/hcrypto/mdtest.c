@@ -334,9 +334,128 @@ hash_test (struct hash_foo *hash, struct test *tests)
     return 0;
 }
 
+/*
+ * SHA256_Multi() must agree with hashing each message on its own, for
+ * every tail length and for both odd and even message counts.
+ */
+
+static int
+multi_test (void)
+{
+    unsigned char buf[300], *res, one[SHA256_DIGEST_LENGTH];
+    const void *data[sizeof(buf) + 1];
+    size_t len[sizeof(buf) + 1];
+    size_t i, n;
+
+    printf ("SHA-256 multi-buffer... ");
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = i * 7 + 3;
+    res = malloc(SHA256_DIGEST_LENGTH * (sizeof(buf) + 1));
+    if (res == NULL)
+	return 1;
+
+    for (n = sizeof(buf); n <= sizeof(buf) + 1; n++) {
+	for (i = 0; i < n; i++) {
+	    data[i] = buf + (i % 5);
+	    len[i] = (i * 37) % (sizeof(buf) - 4);
+	}
+	SHA256_Multi(n, data, len, res);
+	for (i = 0; i < n; i++) {
+	    SHA256_CTX ctx;
+
+	    SHA256_Init(&ctx);
+	    SHA256_Update(&ctx, data[i], len[i]);
+	    SHA256_Final(one, &ctx);
+	    if (memcmp(one, res + SHA256_DIGEST_LENGTH * i, sizeof(one)) != 0) {
+		printf ("message %lu of %lu (length %lu) failed\n",
+			(unsigned long)i, (unsigned long)n,
+			(unsigned long)len[i]);
+		free(res);
+		return 1;
+	    }
+	}
+    }
+    free(res);
+    printf ("success\n");
+    return 0;
+}
+
+/*
+ * With --bench, time the hash functions on large and on short inputs.
+ * Run with HCRYPTO_NO_HWACCEL set to compare against the portable code.
+ */
+
+static double
+elapsed(const struct timeval *a, const struct timeval *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void
+bench_hash (struct hash_foo *hash, const unsigned char *buf, size_t len,
+	    size_t count)
+{
+    struct timeval t0, t1;
+    void *ctx = malloc(hash->psize);
+    unsigned char res[64];
+    size_t i;
+
+    gettimeofday(&t0, NULL);
+    for (i = 0; i < count; i++) {
+	(*hash->init)(ctx);
+	(*hash->update)(ctx, buf, len);
+	(*hash->final)(res, ctx);
+    }
+    gettimeofday(&t1, NULL);
+    printf ("%-8s %6lu bytes x %7lu: %8.3f s\n", hash->name,
+	    (unsigned long)len, (unsigned long)count, elapsed(&t0, &t1));
+    free(ctx);
+}
+
+static void
+bench_multi (const unsigned char *buf, size_t len, size_t count)
+{
+    struct timeval t0, t1;
+    unsigned char res[8 * SHA256_DIGEST_LENGTH];
+    const void *data[8];
+    size_t lens[8];
+    size_t i;
+
+    for (i = 0; i < 8; i++) {
+	data[i] = buf + i;
+	lens[i] = len;
+    }
+    gettimeofday(&t0, NULL);
+    for (i = 0; i < count; i += 8)
+	SHA256_Multi(8, data, lens, res);
+    gettimeofday(&t1, NULL);
+    printf ("%-8s %6lu bytes x %7lu: %8.3f s\n", "SHA-256*8",
+	    (unsigned long)len, (unsigned long)count, elapsed(&t0, &t1));
+}
+
+static int
+bench (void)
+{
+    static unsigned char buf[1024 * 1024];
+    struct hash_foo *h[] = { &md5, &sha1, &sha256, &sha512 };
+    size_t i;
+
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = i;
+    for (i = 0; i < sizeof(h) / sizeof(h[0]); i++) {
+	bench_hash(h[i], buf, sizeof(buf), 100);
+	bench_hash(h[i], buf, 64, 1000000);
+    }
+    bench_multi(buf, 64, 1000000);
+    return 0;
+}
+
 int
-main (void)
+main (int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+	return bench();
+
     return
 	hash_test(&md2, md2_tests) +
 	hash_test(&md4, md4_tests) +
@@ -344,5 +463,6 @@ main (void)
 	hash_test(&sha1, sha1_tests) +
 	hash_test(&sha256, sha256_tests) +
 	hash_test(&sha384, sha384_tests) +
-	hash_test(&sha512, sha512_tests);
+	hash_test(&sha512, sha512_tests) +
+	multi_test();
 }
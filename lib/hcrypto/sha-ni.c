@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+#include <roken.h>
+
+#ifdef KRB5
+#include <krb5-types.h>
+#endif
+
+#include "sha-ni.h"
+
+#ifdef HAVE_SHANI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI __attribute__((target("sha,sse4.1,ssse3")))
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+/*
+ * Use the SHA extensions when the CPU has them, unless
+ * HCRYPTO_NO_HWACCEL is set in the environment (see aes.c).
+ */
+
+int
+_hc_shani_enabled(void)
+{
+    static int enabled = -1;
+    unsigned int a, b, c, d;
+
+    if (enabled != -1)
+	return enabled;
+
+    enabled = 0;
+    if (secure_getenv("HCRYPTO_NO_HWACCEL") != NULL)
+	return enabled;
+    if (__get_cpuid(1, &a, &b, &c, &d) == 0 ||
+	(c & bit_SSSE3) == 0 || (c & bit_SSE4_1) == 0)
+	return enabled;
+    if (__get_cpuid_max(0, NULL) < 7)
+	return enabled;
+    __cpuid_count(7, 0, a, b, c, d);
+    enabled = (b & bit_SHA) != 0;
+    return enabled;
+}
+
+/*
+ * SHA-1.  Each step does four rounds; the message schedule is kept in
+ * four registers, w[g % 4] holding words 4g .. 4g + 3.
+ */
+
+#define SHA1_SCHEDULE(g)						\
+	w[(g) & 3] = _mm_sha1msg2_epu32(				\
+	    _mm_xor_si128(_mm_sha1msg1_epu32(w[(g) & 3], w[((g) + 1) & 3]), \
+			  w[((g) + 2) & 3]),				\
+	    w[((g) + 3) & 3])
+
+#define SHA1_STEP(g, f)							\
+	t = _mm_sha1nexte_epu32(e, w[(g) & 3]);				\
+	e = abcd;							\
+	abcd = _mm_sha1rnds4_epu32(abcd, t, f)
+
+#define SHA1_STEP_S(g, f)						\
+	SHA1_SCHEDULE(g);						\
+	SHA1_STEP(g, f)
+
+void SHANI
+_hc_shani_sha1_blocks(uint32_t *state, const unsigned char *p, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+					0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e, e_save, t, w[4];
+    int i;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    e = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+	abcd_save = abcd;
+	e_save = e;
+
+	for (i = 0; i < 4; i++)
+	    w[i] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+
+	t = _mm_add_epi32(e, w[0]);
+	e = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, t, 0);
+	SHA1_STEP(1, 0);
+	SHA1_STEP(2, 0);
+	SHA1_STEP(3, 0);
+	SHA1_STEP_S(4, 0);
+	SHA1_STEP_S(5, 1);
+	SHA1_STEP_S(6, 1);
+	SHA1_STEP_S(7, 1);
+	SHA1_STEP_S(8, 1);
+	SHA1_STEP_S(9, 1);
+	SHA1_STEP_S(10, 2);
+	SHA1_STEP_S(11, 2);
+	SHA1_STEP_S(12, 2);
+	SHA1_STEP_S(13, 2);
+	SHA1_STEP_S(14, 2);
+	SHA1_STEP_S(15, 3);
+	SHA1_STEP_S(16, 3);
+	SHA1_STEP_S(17, 3);
+	SHA1_STEP_S(18, 3);
+	SHA1_STEP_S(19, 3);
+
+	e = _mm_sha1nexte_epu32(e, e_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e, 3);
+}
+
+/*
+ * SHA-256.  The instructions want the state as ABEF and CDGH.
+ */
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_MASK \
+    _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL)
+
+static SHANI void
+sha256_load_state(const uint32_t *state, __m128i *s0, __m128i *s1)
+{
+    __m128i t;
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xb1);
+    *s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)),
+			    0x1b);
+    *s0 = _mm_alignr_epi8(t, *s1, 8);
+    *s1 = _mm_blend_epi16(*s1, t, 0xf0);
+}
+
+static SHANI void
+sha256_store_state(uint32_t *state, __m128i s0, __m128i s1)
+{
+    __m128i t;
+
+    t = _mm_shuffle_epi32(s0, 0x1b);
+    s1 = _mm_shuffle_epi32(s1, 0xb1);
+    _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(t, s1, 0xf0));
+    _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(s1, t, 8));
+}
+
+#define SHA256_SCHEDULE(w, g)						\
+	w[(g) & 3] = _mm_sha256msg2_epu32(				\
+	    _mm_add_epi32(_mm_sha256msg1_epu32(w[(g) & 3], w[((g) + 1) & 3]), \
+			  _mm_alignr_epi8(w[((g) + 3) & 3], w[((g) + 2) & 3], 4)), \
+	    w[((g) + 3) & 3])
+
+#define SHA256_STEP(s0, s1, w, g)					\
+	do {								\
+	    __m128i m_ = _mm_add_epi32(w[(g) & 3],			\
+		_mm_loadu_si128((const __m128i *)&K256[4 * (g)]));	\
+	    s1 = _mm_sha256rnds2_epu32(s1, s0, m_);			\
+	    s0 = _mm_sha256rnds2_epu32(s0, s1,				\
+				       _mm_shuffle_epi32(m_, 0x0e));	\
+	} while (0)
+
+void SHANI
+_hc_shani_sha256_blocks(uint32_t *state, const unsigned char *p,
+			size_t nblocks)
+{
+    const __m128i mask = SHA256_MASK;
+    __m128i s0, s1, s0_save, s1_save, w[4];
+    int g;
+
+    sha256_load_state(state, &s0, &s1);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+	s0_save = s0;
+	s1_save = s1;
+
+	for (g = 0; g < 4; g++) {
+	    w[g] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(p + 16 * g)), mask);
+	    SHA256_STEP(s0, s1, w, g);
+	}
+	for (g = 4; g < 16; g++) {
+	    SHA256_SCHEDULE(w, g);
+	    SHA256_STEP(s0, s1, w, g);
+	}
+
+	s0 = _mm_add_epi32(s0, s0_save);
+	s1 = _mm_add_epi32(s1, s1_save);
+    }
+
+    sha256_store_state(state, s0, s1);
+}
+
+/*
+ * One block each of two independent messages.  The round instructions
+ * have a long latency, so interleaving two dependency chains keeps the
+ * unit busy; this is what SHA256_Multi() uses.
+ */
+
+void SHANI
+_hc_shani_sha256_blocks_x2(uint32_t *state_a, const unsigned char *a,
+			   uint32_t *state_b, const unsigned char *b)
+{
+    const __m128i mask = SHA256_MASK;
+    __m128i a0, a1, b0, b1, a0_save, a1_save, b0_save, b1_save;
+    __m128i wa[4], wb[4];
+    int g;
+
+    sha256_load_state(state_a, &a0, &a1);
+    sha256_load_state(state_b, &b0, &b1);
+    a0_save = a0;
+    a1_save = a1;
+    b0_save = b0;
+    b1_save = b1;
+
+    for (g = 0; g < 4; g++) {
+	wa[g] = _mm_shuffle_epi8(
+	    _mm_loadu_si128((const __m128i *)(a + 16 * g)), mask);
+	wb[g] = _mm_shuffle_epi8(
+	    _mm_loadu_si128((const __m128i *)(b + 16 * g)), mask);
+	SHA256_STEP(a0, a1, wa, g);
+	SHA256_STEP(b0, b1, wb, g);
+    }
+    for (g = 4; g < 16; g++) {
+	SHA256_SCHEDULE(wa, g);
+	SHA256_SCHEDULE(wb, g);
+	SHA256_STEP(a0, a1, wa, g);
+	SHA256_STEP(b0, b1, wb, g);
+    }
+
+    sha256_store_state(state_a, _mm_add_epi32(a0, a0_save),
+		       _mm_add_epi32(a1, a1_save));
+    sha256_store_state(state_b, _mm_add_epi32(b0, b0_save),
+		       _mm_add_epi32(b1, b1_save));
+}
+
+#endif /* HAVE_SHANI */
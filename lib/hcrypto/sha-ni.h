@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HEIM_SHA_NI_H
+#define HEIM_SHA_NI_H 1
+
+/*
+ * SHA-1 and SHA-256 compression functions using the x86 SHA
+ * extensions.  Like aes-ni.c they are built with per-function target
+ * attributes; callers must check _hc_shani_enabled() first.  The
+ * block functions take the message as bytes and do their own
+ * byte-swapping.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    defined(HAVE_CPUID_H) && defined(HAVE_IMMINTRIN_H)
+#define HAVE_SHANI 1
+
+int  _hc_shani_enabled(void);
+void _hc_shani_sha1_blocks(uint32_t *, const unsigned char *, size_t);
+void _hc_shani_sha256_blocks(uint32_t *, const unsigned char *, size_t);
+void _hc_shani_sha256_blocks_x2(uint32_t *, const unsigned char *,
+				uint32_t *, const unsigned char *);
+
+#endif
+
+#endif /* HEIM_SHA_NI_H */
@@ -36,6 +36,7 @@
 
 #include "hash.h"
 #include "sha.h"
+#include "sha-ni.h"
 
 #define A m->counter[0]
 #define B m->counter[1]
@@ -234,11 +235,28 @@ SHA1_Update (struct sha *m, const void *v, size_t len)
       ++m->sz[1];
   offset = (old_sz / 8)  % 64;
   while(len > 0){
-    size_t l = min(len, 64 - offset);
+    size_t l;
+#ifdef HAVE_SHANI
+    if (offset == 0 && len >= 64 && _hc_shani_enabled()) {
+      size_t n = len / 64;
+      _hc_shani_sha1_blocks(m->counter, p, n);
+      p += n * 64;
+      len -= n * 64;
+      continue;
+    }
+#endif
+    l = min(len, 64 - offset);
     memcpy(m->save + offset, p, l);
     offset += l;
     p += l;
     len -= l;
+#ifdef HAVE_SHANI
+    if (offset == 64 && _hc_shani_enabled()) {
+      _hc_shani_sha1_blocks(m->counter, m->save, 1);
+      offset = 0;
+      continue;
+    }
+#endif
     if(offset == 64){
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
       int i;
@@ -43,6 +43,7 @@
 #define SHA256_Init hc_SHA256_Init
 #define SHA256_Update hc_SHA256_Update
 #define SHA256_Final hc_SHA256_Final
+#define SHA256_Multi hc_SHA256_Multi
 #define SHA384_Init hc_SHA384_Init
 #define SHA384_Update hc_SHA384_Update
 #define SHA384_Final hc_SHA384_Final
@@ -85,6 +86,7 @@ typedef struct hc_sha256state SHA256_CTX;
 int SHA256_Init (SHA256_CTX *);
 int SHA256_Update (SHA256_CTX *, const void *, size_t);
 int SHA256_Final (void *, SHA256_CTX *);
+int SHA256_Multi (size_t, const void * const *, const size_t *, void *);
 
 /*
  * SHA-2 512
@@ -36,6 +36,7 @@
 
 #include "hash.h"
 #include "sha.h"
+#include "sha-ni.h"
 
 #define Ch(x,y,z) (((x) & (y)) ^ ((~(x)) & (z)))
 #define Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
@@ -176,11 +177,28 @@ SHA256_Update (SHA256_CTX *m, const void *v, size_t len)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
     while(len > 0){
-	size_t l = min(len, 64 - offset);
+	size_t l;
+#ifdef HAVE_SHANI
+	if (offset == 0 && len >= 64 && _hc_shani_enabled()) {
+	    size_t n = len / 64;
+	    _hc_shani_sha256_blocks(m->counter, p, n);
+	    p += n * 64;
+	    len -= n * 64;
+	    continue;
+	}
+#endif
+	l = min(len, 64 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
+#ifdef HAVE_SHANI
+	if (offset == 64 && _hc_shani_enabled()) {
+	    _hc_shani_sha256_blocks(m->counter, m->save, 1);
+	    offset = 0;
+	    continue;
+	}
+#endif
 	if(offset == 64){
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
 	    int i;
@@ -231,3 +249,111 @@ SHA256_Final (void *res, SHA256_CTX *m)
     }
     return 1;
 }
+
+/*
+ * Hash n independent messages, writing n digests of
+ * SHA256_DIGEST_LENGTH bytes each to res.  Short messages such as
+ * checksummed headers are dominated by per-block latency, so with the
+ * SHA extensions two messages are compressed side by side.
+ */
+
+struct sha256_mb {
+    SHA256_CTX ctx;
+    const unsigned char *p;
+    size_t full;
+    size_t nblocks;
+    unsigned char tail[128];
+};
+
+static void
+sha256_mb_init(struct sha256_mb *m, const void *data, size_t len)
+{
+    uint64_t bits = (uint64_t)len * 8;
+    size_t rem = len % 64;
+    size_t tlen = rem + 9 <= 64 ? 64 : 128;
+    int i;
+
+    SHA256_Init(&m->ctx);
+    m->p = data;
+    m->full = len / 64;
+    m->nblocks = m->full + tlen / 64;
+    memset(m->tail, 0, tlen);
+    if (rem)
+	memcpy(m->tail, m->p + m->full * 64, rem);
+    m->tail[rem] = 0x80;
+    for (i = 0; i < 8; i++)
+	m->tail[tlen - 1 - i] = (bits >> (8 * i)) & 0xff;
+}
+
+static const unsigned char *
+sha256_mb_block(struct sha256_mb *m, size_t k)
+{
+    if (k < m->full)
+	return m->p + 64 * k;
+    return m->tail + 64 * (k - m->full);
+}
+
+static void
+sha256_mb_final(struct sha256_mb *m, unsigned char *r)
+{
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+	r[4*i+3] = m->ctx.counter[i] & 0xFF;
+	r[4*i+2] = (m->ctx.counter[i] >> 8) & 0xFF;
+	r[4*i+1] = (m->ctx.counter[i] >> 16) & 0xFF;
+	r[4*i]   = (m->ctx.counter[i] >> 24) & 0xFF;
+    }
+    memset_s(m, sizeof(*m), 0, sizeof(*m));
+}
+
+int
+SHA256_Multi (size_t n, const void * const *data, const size_t *len,
+	      void *res)
+{
+    unsigned char *r = res;
+    size_t i;
+
+#ifdef HAVE_SHANI
+    if (_hc_shani_enabled()) {
+	struct sha256_mb a, b;
+	size_t k;
+
+	for (i = 0; i + 1 < n; i += 2) {
+	    sha256_mb_init(&a, data[i], len[i]);
+	    sha256_mb_init(&b, data[i + 1], len[i + 1]);
+	    for (k = 0; k < a.nblocks && k < b.nblocks; k++)
+		_hc_shani_sha256_blocks_x2(a.ctx.counter,
+					   sha256_mb_block(&a, k),
+					   b.ctx.counter,
+					   sha256_mb_block(&b, k));
+	    for (; k < a.nblocks; k++)
+		_hc_shani_sha256_blocks(a.ctx.counter,
+					sha256_mb_block(&a, k), 1);
+	    for (; k < b.nblocks; k++)
+		_hc_shani_sha256_blocks(b.ctx.counter,
+					sha256_mb_block(&b, k), 1);
+	    sha256_mb_final(&a, r + SHA256_DIGEST_LENGTH * i);
+	    sha256_mb_final(&b, r + SHA256_DIGEST_LENGTH * (i + 1));
+	}
+	if (i < n) {
+	    sha256_mb_init(&a, data[i], len[i]);
+	    for (k = 0; k < a.nblocks; k++)
+		_hc_shani_sha256_blocks(a.ctx.counter,
+					sha256_mb_block(&a, k), 1);
+	    sha256_mb_final(&a, r + SHA256_DIGEST_LENGTH * i);
+	}
+	return 1;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+	SHA256_CTX ctx;
+
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, data[i], len[i]);
+	SHA256_Final(r + SHA256_DIGEST_LENGTH * i, &ctx);
+	memset_s(&ctx, sizeof(ctx), 0, sizeof(ctx));
+    }
+    return 1;
+}
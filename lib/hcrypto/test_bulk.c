@@ -75,6 +75,7 @@
 
 static int version_flag;
 static int help_flag;
+static int no_hwaccel_flag;
 static int len = 1;
 static int loops = 20;
 static char *provider = "hcrypto";
@@ -97,6 +98,8 @@ static struct getargs args[] = {
       "number of loops", 	"loops" },
     { "size",	0,	arg_integer,	&len,
       "size (KB)", NULL },
+    { "no-hwaccel",	0,	arg_flag,	&no_hwaccel_flag,
+      "don't use CPU instructions for AES", NULL },
     { "version",	0,	arg_flag,	&version_flag,
       "print version", NULL },
     { "help",		0,	arg_flag,	&help_flag,
@@ -196,6 +199,7 @@ test_bulk_digest(const char *cname, const EVP_MD *md)
 static void
 test_bulk_provider_hcrypto(void)
 {
+    test_bulk_cipher("hcrypto_aes_128_cbc",	EVP_hcrypto_aes_128_cbc());
     test_bulk_cipher("hcrypto_aes_256_cbc",	EVP_hcrypto_aes_256_cbc());
 #if 0
     test_bulk_cipher("hcrypto_aes_256_cfb8",	EVP_hcrypto_aes_256_cfb8());
@@ -287,6 +291,10 @@ main(int argc, char **argv)
 
     len *= 1024;
 
+    /* Run with and without to compare */
+    if (no_hwaccel_flag)
+	setenv("HCRYPTO_NO_HWACCEL", "1", 1);
+
     d = emalloc(len);
     for (i = 0; i < len; i++)
         d[i] = i & 0xff;
@@ -533,6 +533,56 @@ _hdb_store(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
     return code;
 }
 
+/**
+ * Store an entry given in the encoded form that hdb_entry2value()
+ * makes, as found in a dump of another HDB.  If this HDB has no master
+ * key and the entry already lists its etypes, backends that keep
+ * entries in that form get it as is, without re-encoding it or bumping
+ * its generation; the entry's aliases are then added but, unlike with
+ * hdb_store, not checked against existing entries, so this is meant for
+ * loading a new HDB in bulk.  Otherwise the entry goes through
+ * hdb_store, which seals its keys with the master key.
+ *
+ * @param context Context
+ * @param db HDB
+ * @param flags HDB_F_REPLACE to replace an existing entry
+ * @param value The encoded entry
+ *
+ * @return Zero on success, an error code otherwise
+ */
+
+krb5_error_code
+hdb_store_value(krb5_context context, HDB *db, unsigned flags,
+                krb5_data *value)
+{
+    hdb_entry_ex entry;
+    krb5_data key;
+    krb5_error_code code;
+
+    memset(&entry, 0, sizeof(entry));
+    code = hdb_value2entry(context, value, &entry.entry);
+    if (code)
+        return code;
+
+    if (db->hdb_store != _hdb_store || db->hdb__put == NULL ||
+        db->hdb_master_key_set ||
+        entry.entry.etypes == NULL || entry.entry.etypes->len == 0) {
+        code = db->hdb_store(context, db, flags, &entry);
+        hdb_free_entry(context, &entry);
+        return code;
+    }
+
+    code = hdb_principal2key(context, entry.entry.principal, &key);
+    if (code == 0) {
+        code = db->hdb__put(context, db, flags & HDB_F_REPLACE, key, *value);
+        krb5_data_free(&key);
+    }
+    if (code == 0)
+        code = hdb_add_aliases(context, db, flags, &entry);
+    hdb_free_entry(context, &entry);
+    return code;
+}
+
 krb5_error_code
 _hdb_remove(krb5_context context, HDB *db,
             unsigned flags, krb5_const_principal principal)
@@ -90,6 +90,7 @@ mdb2krb5_code(krb5_context context, int code)
 typedef struct mdb_info {
     MDB_env *e;
     MDB_txn *t;
+    MDB_txn *w;         /* write transaction, if in_tx */
     MDB_dbi d;
     MDB_cursor *c;
     int oflags;
@@ -330,12 +331,16 @@ DB_close(krb5_context context, HDB *db)
 {
     mdb_info *mi = (mdb_info *)db->hdb_db;
 
+    if (mi->in_tx)
+        mdb_txn_abort(mi->w);
     mdb_cursor_close(mi->c);
     mdb_txn_abort(mi->t);
     my_mdb_env_close(context, db->hdb_name, &mi->e);
     mi->c = 0;
     mi->t = 0;
+    mi->w = 0;
     mi->e = 0;
+    mi->in_tx = 0;
     return 0;
 }
 
@@ -506,6 +511,13 @@ DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    if (mi->in_tx) {
+        code = mdb_get(mi->w, mi->d, &k, &v);
+        if (code == 0)
+            code = krb5_data_copy(reply, v.mv_data, v.mv_size);
+        return mdb2krb5_code(context, code);
+    }
+
     do {
         if (txn) {
             mdb_txn_abort(txn);
@@ -543,6 +555,12 @@ DB__put(krb5_context context, HDB *db, int replace,
     v.mv_data = value.data;
     v.mv_size = value.length;
 
+    /* In a transaction the caller must abort it if this fails */
+    if (mi->in_tx) {
+        code = mdb_put(mi->w, mi->d, &k, &v, replace ? 0 : MDB_NOOVERWRITE);
+        return mdb2krb5_code(context, code);
+    }
+
     do {
         if (txn) {
             mdb_txn_abort(txn);
@@ -580,6 +598,11 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    if (mi->in_tx) {
+        code = mdb_del(mi->w, mi->d, &k, NULL);
+        return mdb2krb5_code(context, code);
+    }
+
     do {
         if (txn) {
             mdb_txn_abort(txn);
@@ -606,6 +629,43 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     return mdb2krb5_code(context, code);
 }
 
+/*
+ * Bulk loads go much faster with many writes per LMDB transaction.
+ * There is no retrying when the map fills up in one; the caller gets
+ * the error, aborts the transaction and can redo the writes outside one.
+ */
+static krb5_error_code
+DB_begin_txn(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    int code;
+
+    if (mi->in_tx)
+        return HDB_ERR_MISUSE;
+    code = mdb_txn_begin(mi->e, NULL, 0, &mi->w);
+    if (code)
+        return mdb2krb5_code(context, code);
+    mi->in_tx = 1;
+    return 0;
+}
+
+static krb5_error_code
+DB_end_txn(krb5_context context, HDB *db, int commit)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    int code = 0;
+
+    if (!mi->in_tx)
+        return HDB_ERR_MISUSE;
+    if (commit)
+        code = mdb_txn_commit(mi->w);
+    else
+        mdb_txn_abort(mi->w);
+    mi->w = NULL;
+    mi->in_tx = 0;
+    return mdb2krb5_code(context, code);
+}
+
 static krb5_error_code
 DB_open(krb5_context context, HDB *db, int oflags, mode_t mode)
 {
@@ -671,7 +731,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+        HDB_CAP_F_TRANSACTIONS;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
     (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
@@ -687,6 +748,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     (*db)->hdb__del = DB__del;
     (*db)->hdb_destroy = DB_destroy;
     (*db)->hdb_set_sync = DB_set_sync;
+    (*db)->hdb_begin_txn = DB_begin_txn;
+    (*db)->hdb_end_txn = DB_end_txn;
     return 0;
 }
 #endif /* HAVE_LMDB */
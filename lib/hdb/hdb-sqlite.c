@@ -40,6 +40,8 @@ typedef struct hdb_sqlite_db {
     double version;
     sqlite3 *db;
     char *db_file;
+    dev_t db_dev;		/* of the file db has open */
+    ino_t db_ino;
 
     sqlite3_stmt *connect;
     sqlite3_stmt *get_version;
@@ -419,6 +421,7 @@ hdb_sqlite_make_database(krb5_context context, HDB *db, const char *filename)
     int ret;
     int created_file = 0;
     hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    struct stat st;
 
     hsdb->db_file = strdup(filename);
     if(hsdb->db_file == NULL)
@@ -446,6 +449,11 @@ hdb_sqlite_make_database(krb5_context context, HDB *db, const char *filename)
         if (ret) goto out;
     }
 
+    if (stat(hsdb->db_file, &st) == 0) {
+        hsdb->db_dev = st.st_dev;
+        hsdb->db_ino = st.st_ino;
+    }
+
     ret = prep_stmts(context, hsdb);
     if (ret) goto out;
 
@@ -782,19 +790,36 @@ hdb_sqlite_close(krb5_context context, HDB *db)
 /**
  * The opposite of hdb_sqlite_close. Since SQLite accepts
  * many open handles to the database file the handle does not
- * need to be closed, or reopened.
+ * need to be closed, or reopened, unless the file has been
+ * replaced since it was opened (as ipropd-slave does with
+ * hdb_rename() on a full resync).  The old file's handle would
+ * otherwise go on using the -wal and -shm files that now belong
+ * to the new one, and corrupt it.
  *
  * @param context The current krb5 context
  * @param db      Heimdal database handle
  * @param flags
  * @param mode_t
  *
- * @return        Always returns 0
+ * @return        0 on success, an error code if not
  */
 static krb5_error_code
 hdb_sqlite_open(krb5_context context, HDB *db, int flags, mode_t mode)
 {
-    return 0;
+    krb5_error_code ret, ret2;
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    struct stat st;
+    char *filename;
+
+    if (stat(hsdb->db_file, &st) == -1 ||
+        (st.st_dev == hsdb->db_dev && st.st_ino == hsdb->db_ino))
+        return 0;
+
+    filename = hsdb->db_file;
+    ret = hdb_sqlite_close_database(context, db);
+    ret2 = hdb_sqlite_make_database(context, db, filename);
+    free(filename);
+    return ret ? ret : ret2;
 }
 
 /**
@@ -877,6 +902,11 @@ hdb_sqlite_nextkey(krb5_context context, HDB *db, unsigned flags,
         value.data = (void *) sqlite3_column_blob(hsdb->get_all_entries, 0);
         memset(entry, 0, sizeof(*entry));
         ret = hdb_value2entry(context, &value, &entry->entry);
+        if (ret == 0 && db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
+            ret = hdb_unseal_keys(context, db, &entry->entry);
+            if (ret)
+                hdb_free_entry(context, entry);
+        }
     }
     else if(sqlite_error == SQLITE_DONE) {
 	/* No more entries */
@@ -76,6 +76,7 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
 #define HDB_CAP_F_SHARED_DIRECTORY      8
+#define HDB_CAP_F_TRANSACTIONS          16
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
@@ -301,6 +302,20 @@ typedef struct HDB {
      * sync and does an fsync().
      */
     krb5_error_code (*hdb_set_sync)(krb5_context, struct HDB *, int);
+    /**
+     * Begin a write transaction
+     *
+     * Only backends that set HDB_CAP_F_TRANSACTIONS in
+     * hdb_capability_flags have this and hdb_end_txn, so check for
+     * that first.  Writes made until hdb_end_txn() is called are
+     * committed or aborted together.
+     */
+    krb5_error_code (*hdb_begin_txn)(krb5_context, struct HDB *);
+    /**
+     * Commit (if the last argument is non-zero) or abort a write
+     * transaction.  After a write in it fails it must be aborted.
+     */
+    krb5_error_code (*hdb_end_txn)(krb5_context, struct HDB *, int);
 }HDB;
 
 #define HDB_INTERFACE_VERSION	11
@@ -110,11 +110,20 @@ append_hex(krb5_context context, krb5_storage *sp,
     return sz;
 }
 
+/* Entries may be formatted by several threads at once (kadmin dump) */
 static char *
-time2str(time_t t)
+time2str(time_t t, char *buf, size_t len)
 {
-    static char buf[128];
-    strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", gmtime(&t));
+    struct tm tm;
+
+#ifdef WIN32
+    if (gmtime_s(&tm, &t) != 0)
+	memset(&tm, 0, sizeof(tm));
+#else
+    if (gmtime_r(&t, &tm) == NULL)
+	memset(&tm, 0, sizeof(tm));
+#endif
+    strftime(buf, len, "%Y%m%d%H%M%S", &tm);
     return buf;
 }
 
@@ -124,13 +133,15 @@ append_event(krb5_context context, krb5_storage *sp, Event *ev)
     krb5_error_code ret;
     ssize_t sz;
     char *pr = NULL;
+    char tbuf[32];
     if(ev == NULL)
 	return append_string(context, sp, "- ");
     if (ev->principal != NULL) {
        ret = krb5_unparse_name(context, ev->principal, &pr);
        if (ret) return -1; /* krb5_unparse_name() sets error info */
     }
-    sz = append_string(context, sp, "%s:%s ", time2str(ev->time),
+    sz = append_string(context, sp, "%s:%s ",
+                       time2str(ev->time, tbuf, sizeof(tbuf)),
                        pr ? pr : "UNKNOWN");
     free(pr);
     return sz;
@@ -216,6 +227,7 @@ append_mit_key(krb5_context context, krb5_storage *sp,
 static krb5_error_code
 entry2string_int (krb5_context context, krb5_storage *sp, hdb_entry *ent)
 {
+    char tbuf[32];
     char *p;
     size_t i;
     krb5_error_code ret;
@@ -256,19 +268,22 @@ entry2string_int (krb5_context context, krb5_storage *sp, hdb_entry *ent)
 
     /* --- valid start */
     if(ent->valid_start)
-	append_string(context, sp, "%s ", time2str(*ent->valid_start));
+	append_string(context, sp, "%s ",
+		      time2str(*ent->valid_start, tbuf, sizeof(tbuf)));
     else
 	append_string(context, sp, "- ");
 
     /* --- valid end */
     if(ent->valid_end)
-	append_string(context, sp, "%s ", time2str(*ent->valid_end));
+	append_string(context, sp, "%s ",
+		      time2str(*ent->valid_end, tbuf, sizeof(tbuf)));
     else
 	append_string(context, sp, "- ");
 
     /* --- password ends */
     if(ent->pw_end)
-	append_string(context, sp, "%s ", time2str(*ent->pw_end));
+	append_string(context, sp, "%s ",
+		      time2str(*ent->pw_end, tbuf, sizeof(tbuf)));
     else
 	append_string(context, sp, "- ");
 
@@ -289,7 +304,8 @@ entry2string_int (krb5_context context, krb5_storage *sp, hdb_entry *ent)
 
     /* --- generation number */
     if(ent->generation) {
-	append_string(context, sp, "%s:%d:%d ", time2str(ent->generation->time),
+	append_string(context, sp, "%s:%d:%d ",
+		      time2str(ent->generation->time, tbuf, sizeof(tbuf)),
 		      ent->generation->usec,
 		      ent->generation->gen);
     } else
@@ -553,6 +569,32 @@ hdb_entry2string(krb5_context context, hdb_entry *ent, char **str)
     return 0;
 }
 
+/* append a hdb_entry, as a line of a dump in format `fmt', to sp */
+
+krb5_error_code
+hdb_entry2dump(krb5_context context, krb5_storage *sp,
+               hdb_dump_format_t fmt, hdb_entry *ent)
+{
+    krb5_error_code ret;
+
+    switch (fmt) {
+    case HDB_DUMP_HEIMDAL:
+        ret = entry2string_int(context, sp, ent);
+        break;
+    case HDB_DUMP_MIT:
+        ret = entry2mit_string_int(context, sp, ent);
+        break;
+    default:
+        heim_abort("Only two dump formats supported: Heimdal and MIT");
+    }
+    if (ret)
+	return ret;
+
+    if (krb5_storage_write(sp, "\n", 1) != 1)
+	return krb5_enomem(context);
+    return 0;
+}
+
 /* print a hdb_entry to (FILE*)data; suitable for hdb_foreach */
 
 krb5_error_code
@@ -562,30 +604,25 @@ hdb_print_entry(krb5_context context, HDB *db, hdb_entry_ex *entry,
     struct hdb_print_entry_arg *parg = data;
     krb5_error_code ret;
     krb5_storage *sp;
+    krb5_data line;
 
-    fflush(parg->out);
-    sp = krb5_storage_from_fd(fileno(parg->out));
+    /* Format the entry in memory and write it out in one go */
+    sp = krb5_storage_emem();
     if (sp == NULL) {
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
 
-    switch (parg->fmt) {
-    case HDB_DUMP_HEIMDAL:
-        ret = entry2string_int(context, sp, &entry->entry);
-        break;
-    case HDB_DUMP_MIT:
-        ret = entry2mit_string_int(context, sp, &entry->entry);
-        break;
-    default:
-        heim_abort("Only two dump formats supported: Heimdal and MIT");
-    }
-    if (ret) {
-	krb5_storage_free(sp);
+    ret = hdb_entry2dump(context, sp, parg->fmt, &entry->entry);
+    if (ret == 0)
+	ret = krb5_storage_to_data(sp, &line);
+    krb5_storage_free(sp);
+    if (ret)
 	return ret;
-    }
 
-    krb5_storage_write(sp, "\n", 1);
-    krb5_storage_free(sp);
-    return 0;
+    errno = 0;
+    if (fwrite(line.data, line.length, 1, parg->out) != 1)
+	ret = errno ? errno : EIO;
+    krb5_data_free(&line);
+    return ret;
 }
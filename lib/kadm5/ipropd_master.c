@@ -34,6 +34,10 @@
 #include "iprop.h"
 #include <rtbl.h>
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
 static krb5_log_facility *log_facility;
 
 static int verbose;
@@ -137,6 +141,9 @@ struct slave {
 #define SLAVE_F_DEAD	0x1
 #define SLAVE_F_AYT	0x2
 #define SLAVE_F_READY   0x4
+#define SLAVE_F_DUMP    0x8		/* waiting for a new dump */
+    uint32_t caps;			/* IPROP_CAP_* from I_HAVE */
+    int widx;				/* index in the waitset */
     /*
      * We'll use non-blocking I/O so no slave can hold us back.
      *
@@ -175,6 +182,19 @@ struct slave {
 
 typedef struct slave slave;
 
+/*
+ * The process writing a new dump in the background, if any, and what
+ * it must not hold on to.
+ */
+static struct {
+    pid_t pid;				/* -1 if none */
+    int fd;				/* read end of a pipe to it */
+    slave **slaves;
+    krb5_socket_t signal_fd;
+    krb5_socket_t listen_fd;
+    int restarter_fd;			/* -1 if none */
+} dumper = { -1, -1, NULL, rk_INVALID_SOCKET, rk_INVALID_SOCKET, -1 };
+
 static int
 check_acl (krb5_context context, const char *name)
 {
@@ -244,6 +264,18 @@ slave_dead(krb5_context context, slave *s)
     }
     s->flags |= SLAVE_F_DEAD;
     slave_seen(s);
+
+    /* Don't hold on to buffers for slaves that may never come back */
+    krb5_data_free(&s->input.packet);
+    s->input.offset = 0;
+    s->input.hlen = 0;
+    krb5_data_free(&s->tail.packet);
+    s->tail.packet_off = 0;
+    s->tail.header.length = 0;
+    krb5_storage_free(s->tail.dump);
+    s->tail.dump = NULL;
+    s->next_diff.more = 0;
+    s->flags &= ~SLAVE_F_DUMP;
 }
 
 static void
@@ -287,6 +319,7 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
 	krb5_warnx (context, "add_slave: no memory");
 	return;
     }
+    s->widx = -1;
     s->name = NULL;
     s->ac = NULL;
     s->input.packet.data = NULL;
@@ -391,31 +424,65 @@ error:
     remove_slave(context, s, root);
 }
 
+/*
+ * Records are collected in a reusable memory buffer and written to the
+ * dump file in batches, instead of issuing a write(2) for each field
+ * of each principal.
+ */
+#define DUMP_BATCH_SZ (64 * 1024)
+
+struct dump_batch {
+    krb5_storage *dump;
+    krb5_storage *batch;
+};
+
+static int
+flush_dump_batch(krb5_context context, struct dump_batch *b)
+{
+    krb5_error_code ret;
+    krb5_ssize_t bytes;
+    krb5_data data;
+
+    if (krb5_storage_seek(b->batch, 0, SEEK_CUR) == 0)
+        return 0;
+    ret = krb5_storage_to_data(b->batch, &data);
+    if (ret)
+        return ret;
+    bytes = krb5_storage_write(b->dump, data.data, data.length);
+    if (bytes != (krb5_ssize_t)data.length)
+        ret = bytes == -1 ? errno : EIO;
+    krb5_data_free(&data);
+    if (ret == 0)
+        ret = krb5_storage_emem_reset(b->batch);
+    return ret;
+}
+
 static int
 dump_one (krb5_context context, HDB *db, hdb_entry_ex *entry, void *v)
 {
     krb5_error_code ret;
-    krb5_storage *dump = (krb5_storage *)v;
-    krb5_storage *sp;
+    struct dump_batch *b = v;
+    krb5_ssize_t bytes;
     krb5_data data;
 
     ret = hdb_entry2value (context, &entry->entry, &data);
     if (ret)
 	return ret;
-    ret = krb5_data_realloc (&data, data.length + 4);
-    if (ret)
-	goto done;
-    memmove ((char *)data.data + 4, data.data, data.length - 4);
-    sp = krb5_storage_from_data(&data);
-    if (sp == NULL) {
-	ret = krb5_enomem(context);
-	goto done;
+    if (data.length > INT32_MAX - 4) {
+        ret = E2BIG;
+        goto done;
     }
-    ret = krb5_store_uint32(sp, ONE_PRINC);
-    krb5_storage_free(sp);
-
+    ret = krb5_store_uint32(b->batch, data.length + 4);
     if (ret == 0)
-        ret = krb5_store_data(dump, data);
+        ret = krb5_store_uint32(b->batch, ONE_PRINC);
+    if (ret == 0) {
+        bytes = krb5_storage_write(b->batch, data.data, data.length);
+        if (bytes != (krb5_ssize_t)data.length)
+            ret = krb5_enomem(context);
+    }
+    if (ret == 0 &&
+        krb5_storage_seek(b->batch, 0, SEEK_CUR) >= DUMP_BATCH_SZ)
+        ret = flush_dump_batch(context, b);
 
 done:
     krb5_data_free (&data);
@@ -428,6 +495,7 @@ write_dump (krb5_context context, krb5_storage *dump,
 {
     krb5_error_code ret;
     krb5_storage *sp;
+    struct dump_batch batch;
     HDB *db;
     krb5_data data;
     char buf[8];
@@ -473,7 +541,14 @@ write_dump (krb5_context context, krb5_storage *dump,
 	return ret;
     }
 
-    ret = hdb_foreach (context, db, HDB_F_ADMIN_DATA, dump_one, dump);
+    batch.dump = dump;
+    batch.batch = krb5_storage_emem_capacity(DUMP_BATCH_SZ + 4096);
+    if (batch.batch == NULL)
+        return krb5_enomem(context);
+    ret = hdb_foreach (context, db, HDB_F_ADMIN_DATA, dump_one, &batch);
+    if (ret == 0)
+        ret = flush_dump_batch(context, &batch);
+    krb5_storage_free(batch.batch);
     if (ret) {
 	krb5_warn (context, ret, "write_dump: hdb_foreach");
 	return ret;
@@ -560,6 +635,81 @@ more_diffs(slave *s)
 
 #define SEND_COMPLETE_MAX_RECORDS 50
 #define SEND_DIFFS_MAX_RECORDS 50
+#define SEND_DIFFS_MAX_BYTES (256 * 1024)
+#define MANY_PRINCS_MAX_BYTES (256 * 1024)
+
+static int
+is_one_princ(const krb5_data *data)
+{
+    unsigned long op;
+
+    if (data->length < 4)
+        return 0;
+    _krb5_get_int(data->data, &op, 4);
+    return op == ONE_PRINC;
+}
+
+/*
+ * Read the next message to send from the dump.  Slaves that can take
+ * them get ONE_PRINC records packed into MANY_PRINCS messages of up to
+ * about MANY_PRINCS_MAX_BYTES, saving a KRB-PRIV per entry on both ends.
+ */
+static int
+read_dump_msg(krb5_context context, slave *s, krb5_data *out)
+{
+    krb5_storage *sp;
+    krb5_ssize_t bytes;
+    off_t off;
+    int ret;
+
+    ret = krb5_ret_data(s->tail.dump, out);
+    if (ret || !(s->caps & IPROP_CAP_MANY_PRINCS) || !is_one_princ(out))
+        return ret;
+
+    sp = krb5_storage_emem_capacity(MANY_PRINCS_MAX_BYTES + 4096);
+    if (sp == NULL) {
+        krb5_data_free(out);
+        return krb5_enomem(context);
+    }
+    ret = krb5_store_uint32(sp, MANY_PRINCS);
+    while (ret == 0) {
+        /* The entry's length and the entry, without the ONE_PRINC */
+        ret = krb5_store_uint32(sp, out->length - 4);
+        if (ret == 0) {
+            bytes = krb5_storage_write(sp, (char *)out->data + 4,
+                                       out->length - 4);
+            if (bytes != (krb5_ssize_t)out->length - 4)
+                ret = krb5_enomem(context);
+        }
+        krb5_data_free(out);
+        if (ret ||
+            krb5_storage_seek(sp, 0, SEEK_CUR) >= MANY_PRINCS_MAX_BYTES)
+            break;
+
+        off = krb5_storage_seek(s->tail.dump, 0, SEEK_CUR);
+        if (off == -1) {
+            ret = errno;
+            break;
+        }
+        ret = krb5_ret_data(s->tail.dump, out);
+        if (ret == HEIM_ERR_EOF) {
+            /* Send what we have, the next read will hit EOF again */
+            ret = 0;
+            break;
+        }
+        if (ret == 0 && !is_one_princ(out)) {
+            /* Leave it (NOW_YOU_HAVE) to be sent by itself */
+            krb5_data_free(out);
+            if (krb5_storage_seek(s->tail.dump, off, SEEK_SET) != off)
+                ret = errno;
+            break;
+        }
+    }
+    if (ret == 0)
+        ret = krb5_storage_to_data(sp, out);
+    krb5_storage_free(sp);
+    return ret;
+}
 
 static int
 send_tail(krb5_context context, slave *s)
@@ -621,7 +771,7 @@ send_tail(krb5_context context, slave *s)
          * We're in the middle of a send_complete() that was interrupted by
          * EWOULDBLOCK.  Continue the sending of the dump.
          */
-        ret = krb5_ret_data(s->tail.dump, &data);
+        ret = read_dump_msg(context, s, &data);
         if (ret == HEIM_ERR_EOF) {
             krb5_storage_free(s->tail.dump);
             s->tail.dump = NULL;
@@ -662,151 +812,210 @@ ewouldblock:
     return EWOULDBLOCK;
 }
 
+/*
+ * Write a new dump to a temporary file and rename it into place.  Dumps
+ * are never rewritten in place, so slaves still being sent the previous
+ * one are not disturbed and no locking is needed to read them.  The
+ * temporary file's name is unique, as another ipropd-master (say, one
+ * serving a slave's HDB for hierarchical iprop) may share our db-dir.
+ */
 static int
-send_complete(krb5_context context, slave *s, const char *database,
-	      uint32_t current_version, uint32_t oldest_version,
-              uint32_t initial_log_tstamp)
+write_dump_file(krb5_context context, const char *database,
+                uint32_t current_version)
 {
     krb5_error_code ret;
-    krb5_storage *dump = NULL;
-    uint32_t vno = 0;
-    int fd = -1;
-    struct stat st;
-    char *dfn;
-
-    ret = asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context));
-    if (ret == -1 || !dfn)
-	return krb5_enomem(context);
+    krb5_storage *dump;
+    char *dfn = NULL;
+    char *tmp = NULL;
+    int fd;
+
+    if (asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context)) == -1 ||
+        dfn == NULL)
+        return krb5_enomem(context);
+    if (asprintf(&tmp, "%s.XXXXXX", dfn) == -1 || tmp == NULL) {
+        free(dfn);
+        return krb5_enomem(context);
+    }
 
-    fd = open(dfn, O_CREAT|O_RDWR, 0600);
+    fd = mkstemp(tmp);
     if (fd == -1) {
 	ret = errno;
-	krb5_warn(context, ret, "Cannot open/create iprop dumpfile %s", dfn);
-	free(dfn);
-        return ret;
+	krb5_warn(context, ret, "Cannot create iprop dumpfile %s", tmp);
+        goto out;
     }
-    free(dfn);
 
     dump = krb5_storage_from_fd(fd);
-    if (!dump) {
-	ret = errno;
-	krb5_warn(context, ret, "krb5_storage_from_fd");
-	goto done;
+    (void) close(fd);
+    if (dump == NULL) {
+        ret = krb5_enomem(context);
+    } else {
+        ret = write_dump(context, dump, database, current_version);
+        krb5_storage_free(dump);
     }
 
-    for (;;) {
-	ret = flock(fd, LOCK_SH);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "flock(fd, LOCK_SH)");
-	    goto done;
-	}
+    if (ret == 0 && rk_rename(tmp, dfn) == -1) {
+        ret = errno;
+        krb5_warn(context, ret, "Cannot rename %s to %s", tmp, dfn);
+    }
+    if (ret)
+        (void) unlink(tmp);
 
-	if (krb5_storage_seek(dump, 0, SEEK_SET) == (off_t)-1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
-	    goto done;
-	}
+out:
+    free(tmp);
+    free(dfn);
+    return ret;
+}
 
-	vno = 0;
-	ret = krb5_ret_uint32(dump, &vno);
-	if (ret && ret != HEIM_ERR_EOF) {
-	    krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
-	    goto done;
-	}
+/*
+ * Start making a new dump.  Where we can fork, a child process writes
+ * it so that we go on serving other slaves meanwhile, and the slaves
+ * that need it wait with SLAVE_F_DUMP set (see dumper_done()).  Only
+ * one dump is made at a time, however many slaves are waiting for it.
+ */
+static int
+make_dump(krb5_context context, const char *database,
+          uint32_t current_version)
+{
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+    int fds[2];
+    slave *p;
 
-        if (fstat(fd, &st) == -1) {
-            ret = errno;
-            krb5_warn(context, ret, "send_complete: could not stat dump file");
-            goto done;
+    if (dumper.pid != -1)
+        return 0;
+
+    if (pipe(fds) == -1) {
+        krb5_warn(context, errno, "pipe");
+        return write_dump_file(context, database, current_version);
+    }
+
+    krb5_log_flush(context, log_facility);
+    dumper.pid = fork();
+    if (dumper.pid == -1) {
+        krb5_warn(context, errno, "fork");
+        (void) close(fds[0]);
+        (void) close(fds[1]);
+        return write_dump_file(context, database, current_version);
+    }
+
+    if (dumper.pid == 0) {
+        /*
+         * The parent sees EOF on the pipe when we exit.  We _exit() so
+         * that the parent's stdio and atexit() state isn't run twice.
+         */
+        (void) close(fds[0]);
+        for (p = *dumper.slaves; p != NULL; p = p->next) {
+            if (!rk_IS_BAD_SOCKET(p->fd))
+                rk_closesocket(p->fd);
         }
+        rk_closesocket(dumper.signal_fd);
+        rk_closesocket(dumper.listen_fd);
+        if (dumper.restarter_fd > -1)
+            (void) close(dumper.restarter_fd);
+        if (write_dump_file(context, database, current_version)) {
+            krb5_log_flush(context, log_facility);
+            _exit(1);
+        }
+        krb5_log_flush(context, log_facility);
+        _exit(0);
+    }
 
-	/*
-	 * If the current dump has an appropriate version, then we can
-	 * break out of the loop and send the file below.
-	 */
-	if (ret == 0 && vno != 0 && st.st_mtime > initial_log_tstamp &&
-            vno >= oldest_version && vno <= current_version)
-	    break;
+    (void) close(fds[1]);
+    dumper.fd = fds[0];
+    return 0;
+#else
+    return write_dump_file(context, database, current_version);
+#endif
+}
 
-        if (verbose)
-            krb5_warnx(context, "send_complete: dumping HDB");
+/*
+ * Open the dump if it is one we can send, leaving it positioned right
+ * after the version number at its front.
+ */
+static krb5_storage *
+open_dump(krb5_context context, uint32_t current_version,
+          uint32_t oldest_version, uint32_t initial_log_tstamp,
+          uint32_t *vno)
+{
+    krb5_storage *dump;
+    struct stat st;
+    char *dfn;
+    int fd;
 
-	/*
-	 * Otherwise, we may need to write a new dump file.  We
-	 * obtain an exclusive lock on the fd.  Because this is
-	 * not guaranteed to be an upgrade of our existing shared
-	 * lock, someone else may have written a new dumpfile while
-	 * we were waiting and so we must first check the vno of
-	 * the dump to see if that happened.  If it did, we need
-	 * to go back to the top of the loop so that we can downgrade
-	 * our lock to a shared one.
-	 */
-
-	ret = flock(fd, LOCK_EX);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "flock(fd, LOCK_EX)");
-	    goto done;
-	}
+    if (asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context)) == -1 ||
+        dfn == NULL) {
+        (void) krb5_enomem(context);
+        return NULL;
+    }
 
-	ret = krb5_storage_seek(dump, 0, SEEK_SET);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
-	    goto done;
-	}
+    fd = open(dfn, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            krb5_warn(context, errno, "Cannot open iprop dumpfile %s", dfn);
+        free(dfn);
+        return NULL;
+    }
+    free(dfn);
 
-	vno = 0;
-	ret = krb5_ret_uint32(dump, &vno);
-	if (ret && ret != HEIM_ERR_EOF) {
-	    krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
-	    goto done;
-	}
+    if (fstat(fd, &st) == -1) {
+        krb5_warn(context, errno, "send_complete: could not stat dump file");
+        (void) close(fd);
+        return NULL;
+    }
 
-        if (fstat(fd, &st) == -1) {
-            ret = errno;
-            krb5_warn(context, ret, "send_complete: could not stat dump file");
-            goto done;
-        }
+    /* Note: krb5_storage_from_fd() dup()'s the fd */
+    dump = krb5_storage_from_fd(fd);
+    (void) close(fd);
+    if (dump == NULL) {
+        (void) krb5_enomem(context);
+        return NULL;
+    }
 
-	/* check if someone wrote a better version for us */
-        if (ret == 0 && vno != 0 && st.st_mtime > initial_log_tstamp &&
-            vno >= oldest_version && vno <= current_version)
-	    continue;
+    *vno = 0;
+    if (krb5_ret_uint32(dump, vno) == 0 && *vno != 0 &&
+        st.st_mtime > initial_log_tstamp &&
+        *vno >= oldest_version && *vno <= current_version)
+        return dump;
+
+    krb5_storage_free(dump);
+    return NULL;
+}
+
+static int
+send_complete(krb5_context context, slave *s, const char *database,
+	      uint32_t current_version, uint32_t oldest_version,
+              uint32_t initial_log_tstamp)
+{
+    krb5_error_code ret;
+    krb5_storage *dump;
+    uint32_t vno = 0;
 
-	/* Now, we know that we must write a new dump file.  */
+    dump = open_dump(context, current_version, oldest_version,
+                     initial_log_tstamp, &vno);
+    if (dump == NULL) {
+        if (verbose)
+            krb5_warnx(context, "send_complete: dumping HDB");
 
-	ret = write_dump(context, dump, database, current_version);
-	if (ret)
-	    goto done;
+        ret = make_dump(context, database, current_version);
+        if (ret)
+            return ret;
 
-	/*
-	 * And we must continue to the top of the loop so that we can
-	 * downgrade to a shared lock.
-	 */
-    }
+        if (dumper.pid != -1) {
+            if (verbose)
+                krb5_warnx(context, "slave %s waits for the new dump",
+                           s->name);
+            s->flags |= SLAVE_F_DUMP;
+            return 0;
+        }
 
-    /*
-     * Leaving the above loop, dump should have a ptr right after the initial
-     * 4 byte DB version number and we should have a shared lock on the file
-     * (which we may have just created), so we are reading to start sending
-     * the data down the wire.
-     *
-     * Note: (krb5_storage_from_fd() dup()'s the fd)
-     */
+        dump = open_dump(context, current_version, oldest_version,
+                         initial_log_tstamp, &vno);
+        if (dump == NULL)
+            return EAGAIN;
+    }
 
     s->tail.dump = dump;
     s->tail.vno = vno;
-    dump = NULL;
-    ret = send_tail(context, s);
-
-done:
-    if (fd != -1)
-	close(fd);
-    if (dump)
-	krb5_storage_free(dump);
-    return ret;
+    return send_tail(context, s);
 }
 
 static int
@@ -1012,6 +1221,16 @@ get_left(kadm5_server_context *server_context, slave *s, krb5_storage *sp,
                 return left;
         }
 
+        /* Next, look the slave's successor version up in the log's index */
+        ret = kadm5_log_goto_version(server_context, sp, s->version + 1);
+        if (ret == 0) {
+            left = krb5_storage_seek(sp, 0, SEEK_CUR);
+            if (left > 0 && left < pos)
+                return left;
+        } else if (ret != HEIM_ERR_EOF && verbose) {
+            krb5_warn(context, ret, "iprop log index lookup failed");
+        }
+
         if (krb5_storage_seek(sp, pos, SEEK_SET) != pos)
             goto err;
 
@@ -1088,18 +1307,22 @@ get_right(krb5_context context, int log_fd, krb5_storage *sp,
         return -1;
     }
 
-    /* The "lastver" bound should preclude us reaching EOF */
-    for (; ret == 0 && i < SEND_DIFFS_MAX_RECORDS && ver < lastver; ++i) {
+    /*
+     * The "lastver" bound should preclude us reaching EOF.  The byte bound
+     * keeps what we hold for each slave small however far behind it is.
+     */
+    for (; ret == 0 && i < SEND_DIFFS_MAX_RECORDS && ver < lastver &&
+         right - left < SEND_DIFFS_MAX_BYTES; ++i) {
         uint32_t logver;
 
         ret = kadm5_log_next(context, sp, &logver, NULL, NULL, NULL);
         if (logver != ++ver)
             ret = KADM5_LOG_CORRUPT;
+        if (ret == 0)
+            right = krb5_storage_seek(sp, 0, SEEK_CUR);
     }
 
-    if (ret == 0)
-        right = krb5_storage_seek(sp, 0, SEEK_CUR);
-    else
+    if (ret)
         right = -1;
     if (right <= 0) {
         flock(log_fd, LOCK_UN);
@@ -1166,15 +1389,6 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
         return;
     }
 
-    if (krb5_storage_seek(sp, left, SEEK_SET) != left) {
-        ret = errno ? errno : EIO;
-        flock(log_fd, LOCK_UN);
-        krb5_warn(context, ret, "send_diffs: krb5_storage_seek");
-        krb5_storage_free(sp);
-        slave_dead(context, s);
-        return;
-    }
-
     ret = krb5_data_alloc(&data, right - left + 4);
     if (ret) {
         flock(log_fd, LOCK_UN);
@@ -1184,7 +1398,15 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
         return;
     }
 
-    bytes = krb5_storage_read(sp, (char *)data.data + 4, data.length - 4);
+    /* Read the records straight into the message, after its FOR_YOU */
+#ifdef HAVE_PREAD
+    bytes = pread(log_fd, (char *)data.data + 4, data.length - 4, left);
+#else
+    if (lseek(log_fd, left, SEEK_SET) == left)
+        bytes = read(log_fd, (char *)data.data + 4, data.length - 4);
+    else
+        bytes = -1;
+#endif
     flock(log_fd, LOCK_UN);
     krb5_storage_free(sp);
     if (bytes != data.length - 4)
@@ -1226,6 +1448,45 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
     return;
 }
 
+/*
+ * The dump writer exited (we saw EOF on its pipe): reap it and start
+ * sending the new dump to the slaves that were waiting for it.
+ */
+static void
+dumper_done(kadm5_server_context *server_context, slave *slaves, int log_fd,
+            const char *database, uint32_t current_version)
+{
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+    krb5_context context = server_context->context;
+    int status = 0;
+    int failed;
+    slave *p;
+
+    (void) close(dumper.fd);
+    dumper.fd = -1;
+    while (waitpid(dumper.pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    dumper.pid = -1;
+
+    failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    if (failed)
+        krb5_warnx(context, "failed to write new dumpfile");
+
+    for (p = slaves; p != NULL; p = p->next) {
+        if (!(p->flags & SLAVE_F_DUMP))
+            continue;
+        p->flags &= ~SLAVE_F_DUMP;
+        if (p->flags & SLAVE_F_DEAD)
+            continue;
+        /* Rather than retry right away, let them reconnect */
+        if (failed)
+            slave_dead(context, p);
+        else
+            send_diffs(server_context, p, log_fd, database, current_version);
+    }
+#endif
+}
+
 /* Sensible bound on slave message size */
 #define SLAVE_MSG_MAX 65536
 
@@ -1331,6 +1592,9 @@ process_msg(kadm5_server_context *server_context, slave *s, int log_fd,
 	    krb5_warnx(context, "process_msg: client send too little I_HAVE data");
 	    break;
 	}
+        /* Older slaves don't send their capabilities */
+        if (krb5_ret_uint32(sp, &s->caps) != 0)
+            s->caps = 0;
         /*
          * XXX Make the slave send the timestamp as well, and try to get it
          * here, and pass it to send_diffs().
@@ -1507,6 +1771,105 @@ write_stats(krb5_context context, slave *slaves, uint32_t current_version)
 }
 
 
+/*
+ * The descriptors the main loop waits on.  With poll(2) there is no
+ * FD_SETSIZE limit on how many slaves we can serve; each registered
+ * descriptor gets an index to look up its events by.
+ */
+#if defined(HAVE_POLL) && defined(HAVE_POLL_H)
+#define USE_POLL 1
+#endif
+
+struct waitset {
+#ifdef USE_POLL
+    struct pollfd *fds;
+    size_t nfds;
+    size_t sfds;
+#else
+    fd_set readset;
+    fd_set writeset;
+    int max_fd;
+#endif
+};
+
+static void
+waitset_init(struct waitset *w)
+{
+#ifdef USE_POLL
+    w->nfds = 0;
+#else
+    FD_ZERO(&w->readset);
+    FD_ZERO(&w->writeset);
+    w->max_fd = 0;
+#endif
+}
+
+/* Wait for `fd' to be readable, and writable if `out' */
+static int
+waitset_add(krb5_context context, struct waitset *w, krb5_socket_t fd,
+            int out)
+{
+#ifdef USE_POLL
+    if (w->nfds == w->sfds) {
+        size_t n = w->sfds ? 2 * w->sfds : 16;
+        struct pollfd *fds = realloc(w->fds, n * sizeof(fds[0]));
+
+        if (fds == NULL)
+            krb5_errx(context, IPROPD_RESTART, "out of memory");
+        w->fds = fds;
+        w->sfds = n;
+    }
+    w->fds[w->nfds].fd = fd;
+    w->fds[w->nfds].events = POLLIN | (out ? POLLOUT : 0);
+    w->fds[w->nfds].revents = 0;
+    return w->nfds++;
+#else
+#ifndef NO_LIMIT_FD_SETSIZE
+    if (fd >= FD_SETSIZE)
+        krb5_errx(context, IPROPD_RESTART, "fd too large");
+#endif
+    FD_SET(fd, &w->readset);
+    if (out)
+        FD_SET(fd, &w->writeset);
+    w->max_fd = max(w->max_fd, fd);
+    return fd;
+#endif
+}
+
+static int
+waitset_wait(struct waitset *w, int sec)
+{
+#ifdef USE_POLL
+    return poll(w->fds, w->nfds, sec * 1000);
+#else
+    struct timeval to;
+
+    to.tv_sec = sec;
+    to.tv_usec = 0;
+    return select(w->max_fd + 1, &w->readset, &w->writeset, NULL, &to);
+#endif
+}
+
+static int
+waitset_readable(struct waitset *w, int idx)
+{
+#ifdef USE_POLL
+    return idx >= 0 && (w->fds[idx].revents & (POLLIN | POLLHUP | POLLERR));
+#else
+    return idx >= 0 && FD_ISSET(idx, &w->readset);
+#endif
+}
+
+static int
+waitset_writable(struct waitset *w, int idx)
+{
+#ifdef USE_POLL
+    return idx >= 0 && (w->fds[idx].revents & (POLLOUT | POLLERR));
+#else
+    return idx >= 0 && FD_ISSET(idx, &w->writeset);
+#endif
+}
+
 static char sHDB[] = "HDBGET:";
 static char *realm;
 static int version_flag;
@@ -1563,6 +1926,8 @@ main(int argc, char **argv)
     int aret;
     int optidx = 0;
     int restarter_fd = -1;
+    struct waitset ws;
+    int nready;
     struct stat st;
 
     setprogname(argv[0]);
@@ -1664,46 +2029,41 @@ main(int argc, char **argv)
     roken_detach_finish(NULL, daemon_child);
     restarter_fd = restarter(context, NULL);
 
+    dumper.slaves = &slaves;
+    dumper.signal_fd = signal_fd;
+    dumper.listen_fd = listen_fd;
+    dumper.restarter_fd = restarter_fd;
+
+    memset(&ws, 0, sizeof(ws));
     while (exit_flag == 0){
 	slave *p;
-	fd_set readset, writeset;
-	int max_fd = 0;
-	struct timeval to = {30, 0};
+	int signal_idx, listen_idx, restarter_idx = -1, dumper_idx = -1;
 	uint32_t vers;
         struct stat st2;;
 
-#ifndef NO_LIMIT_FD_SETSIZE
-	if (signal_fd >= FD_SETSIZE || listen_fd >= FD_SETSIZE ||
-            restarter_fd >= FD_SETSIZE)
-	    krb5_errx (context, IPROPD_RESTART, "fd too large");
-#endif
-
-	FD_ZERO(&readset);
-	FD_ZERO(&writeset);
-	FD_SET(signal_fd, &readset);
-	max_fd = max(max_fd, signal_fd);
-	FD_SET(listen_fd, &readset);
-	max_fd = max(max_fd, listen_fd);
-        if (restarter_fd > -1) {
-            FD_SET(restarter_fd, &readset);
-            max_fd = max(max_fd, restarter_fd);
-        }
+	waitset_init(&ws);
+	signal_idx = waitset_add(context, &ws, signal_fd, 0);
+	listen_idx = waitset_add(context, &ws, listen_fd, 0);
+        if (restarter_fd > -1)
+            restarter_idx = waitset_add(context, &ws, restarter_fd, 0);
+        if (dumper.fd > -1)
+            dumper_idx = waitset_add(context, &ws, dumper.fd, 0);
 
+	/* Only wait to write to slaves we have something for */
 	for (p = slaves; p != NULL; p = p->next) {
+	    p->widx = -1;
 	    if (p->flags & SLAVE_F_DEAD)
 		continue;
-	    FD_SET(p->fd, &readset);
-            if (have_tail(p) || more_diffs(p))
-                FD_SET(p->fd, &writeset);
-	    max_fd = max(max_fd, p->fd);
+	    p->widx = waitset_add(context, &ws, p->fd,
+                                  have_tail(p) || more_diffs(p));
 	}
 
-	ret = select(max_fd + 1, &readset, &writeset, NULL, &to);
-	if (ret < 0) {
+	nready = waitset_wait(&ws, 30);
+	if (nready < 0) {
 	    if (errno == EINTR)
 		continue;
 	    else
-		krb5_err (context, IPROPD_RESTART, errno, "select");
+		krb5_err (context, IPROPD_RESTART, errno, "waitset_wait");
 	}
 
         if (stat(server_context->log_context.log_file, &st2) == -1) {
@@ -1729,9 +2089,30 @@ main(int argc, char **argv)
             kadm5_log_get_version_fd(server_context, log_fd, LOG_VERSION_LAST,
                                      &current_version, NULL);
             flock(log_fd, LOCK_UN);
+
+            /*
+             * A new log (say, one a slave of ours reinitialized on a full
+             * resync) may be several versions along by the time we see
+             * it, and the signal that follows will then find no change,
+             * so update the slaves now.
+             */
+            if (current_version != old_version) {
+                if (verbose)
+                    krb5_warnx(context,
+                               "Log replaced, updating slaves %lu to %lu",
+                               (unsigned long)old_version,
+                               (unsigned long)current_version);
+		for (p = slaves; p != NULL; p = p->next) {
+		    if (p->flags & SLAVE_F_DEAD)
+			continue;
+		    send_diffs(server_context, p, log_fd, database,
+                               current_version);
+		}
+                old_version = current_version;
+            }
         }
 
-	if (ret == 0) {
+	if (nready == 0) {
             /* Recover from failed transactions */
             if (kadm5_log_init_nb(server_context) == 0)
                 kadm5_log_end(server_context);
@@ -1759,12 +2140,19 @@ main(int argc, char **argv)
 	    }
 	}
 
-        if (ret && FD_ISSET(restarter_fd, &readset)) {
+        if (nready && waitset_readable(&ws, restarter_idx)) {
             exit_flag = SIGTERM;
             break;
         }
 
-	if (ret && FD_ISSET(signal_fd, &readset)) {
+        if (nready && waitset_readable(&ws, dumper_idx)) {
+            dumper_done(server_context, slaves, log_fd, database,
+                        current_version);
+            --nready;
+            assert(nready >= 0);
+        }
+
+	if (nready && waitset_readable(&ws, signal_idx)) {
 #ifndef NO_UNIX_SOCKETS
 	    struct sockaddr_un peer_addr;
 #else
@@ -1777,8 +2165,8 @@ main(int argc, char **argv)
 		krb5_warn (context, errno, "recvfrom");
 		continue;
 	    }
-	    --ret;
-	    assert(ret >= 0);
+	    --nready;
+	    assert(nready >= 0);
 	    old_version = current_version;
 	    if (flock(log_fd, LOCK_SH) == -1)
                 krb5_err(context, IPROPD_RESTART, errno, "shared flock %s",
@@ -1820,7 +2208,7 @@ main(int argc, char **argv)
 
 	for (p = slaves; p != NULL; p = p->next) {
             if (!(p->flags & SLAVE_F_DEAD) &&
-                FD_ISSET(p->fd, &writeset) &&
+                waitset_writable(&ws, p->widx) &&
                 ((have_tail(p) && send_tail(context, p) == 0) ||
                  (!have_tail(p) && more_diffs(p)))) {
                 send_diffs(server_context, p, log_fd, database,
@@ -1831,9 +2219,9 @@ main(int argc, char **argv)
 	for(p = slaves; p != NULL; p = p->next) {
 	    if (p->flags & SLAVE_F_DEAD)
 	        continue;
-	    if (ret && FD_ISSET(p->fd, &readset)) {
-		--ret;
-		assert(ret >= 0);
+	    if (nready && waitset_readable(&ws, p->widx)) {
+		--nready;
+		assert(nready >= 0);
                 ret = process_msg(server_context, p, log_fd, database,
                                   current_version);
                 if (ret && ret != EWOULDBLOCK)
@@ -1844,10 +2232,10 @@ main(int argc, char **argv)
 		send_are_you_there (context, p);
 	}
 
-	if (ret && FD_ISSET(listen_fd, &readset)) {
+	if (nready && waitset_readable(&ws, listen_idx)) {
 	    add_slave (context, keytab, &slaves, listen_fd);
-	    --ret;
-	    assert(ret >= 0);
+	    --nready;
+	    assert(nready >= 0);
 	}
 	write_stats(context, slaves, current_version);
     }
@@ -179,16 +179,18 @@ ihave(krb5_context context, krb5_auth_context auth_context,
       int fd, uint32_t version)
 {
     int ret;
-    u_char buf[8];
+    u_char buf[12];
     krb5_storage *sp;
     krb5_data data;
 
-    sp = krb5_storage_from_mem(buf, 8);
+    sp = krb5_storage_from_mem(buf, 12);
     ret = krb5_store_uint32(sp, I_HAVE);
     if (ret == 0)
         ret = krb5_store_uint32(sp, version);
+    if (ret == 0)
+        ret = krb5_store_uint32(sp, IPROP_CAP_MANY_PRINCS);
     krb5_storage_free(sp);
-    data.length = 8;
+    data.length = 12;
     data.data   = buf;
 
     if (ret == 0) {
@@ -506,6 +508,57 @@ reinit_log(krb5_context context,
         krb5_warnx(context, "downgraded iprop log lock to shared");
 }
 
+/*
+ * Store the entries of a MANY_PRINCS message, each a 4-byte length and
+ * an encoded entry.
+ */
+static krb5_error_code
+store_many(krb5_context context, HDB *db, krb5_data *data)
+{
+    krb5_error_code ret = 0;
+    unsigned char *p = (unsigned char *)data->data + 4;
+    size_t len = data->length - 4;
+    unsigned long elen;
+    krb5_data value;
+
+    while (ret == 0 && len > 0) {
+        if (len < 4)
+            return HEIM_ERR_EOF;
+        _krb5_get_int(p, &elen, 4);
+        if (elen > len - 4)
+            return HEIM_ERR_EOF;
+        value.data = p + 4;
+        value.length = elen;
+        ret = hdb_store_value(context, db, 0, &value);
+        p += 4 + elen;
+        len -= 4 + elen;
+    }
+    return ret;
+}
+
+/*
+ * Store a MANY_PRINCS message's entries in one transaction if the HDB
+ * has them.  If that fails, say because an LMDB map filled up, the
+ * transaction is aborted and the entries stored one by one instead.
+ */
+static krb5_error_code
+store_many_txn(krb5_context context, HDB *db, krb5_data *data)
+{
+    krb5_error_code ret;
+
+    if (!(db->hdb_capability_flags & HDB_CAP_F_TRANSACTIONS) ||
+        db->hdb_begin_txn(context, db) != 0)
+        return store_many(context, db, data);
+
+    ret = store_many(context, db, data);
+    if (ret == 0)
+        ret = db->hdb_end_txn(context, db, 1);
+    else
+        (void) db->hdb_end_txn(context, db, 0);
+    if (ret)
+        ret = store_many(context, db, data);
+    return ret;
+}
 
 static krb5_error_code
 receive_everything(krb5_context context, int fd,
@@ -571,31 +624,30 @@ receive_everything(krb5_context context, int fd,
 	krb5_ret_uint32(sp, &opcode);
 	if (opcode == ONE_PRINC) {
 	    krb5_data fake_data;
-	    hdb_entry_ex entry;
 
 	    krb5_storage_free(sp);
 
 	    fake_data.data   = (char *)data.data + 4;
 	    fake_data.length = data.length - 4;
 
-	    memset(&entry, 0, sizeof(entry));
-
-	    ret = hdb_value2entry(context, &fake_data, &entry.entry);
+	    ret = hdb_store_value(context, mydb, 0, &fake_data);
 	    if (ret)
-		krb5_err(context, IPROPD_RESTART, ret, "hdb_value2entry");
-	    ret = mydb->hdb_store(server_context->context,
-				  mydb,
-				  0, &entry);
+		krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_store");
+
+	    krb5_data_free(&data);
+	} else if (opcode == MANY_PRINCS) {
+	    krb5_storage_free(sp);
+
+	    ret = store_many_txn(context, mydb, &data);
 	    if (ret)
 		krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_store");
 
-	    hdb_free_entry(context, &entry);
 	    krb5_data_free(&data);
 	} else if (opcode == NOW_YOU_HAVE)
 	    ;
 	else
 	    krb5_errx(context, 1, "strange opcode %d", opcode);
-    } while (opcode == ONE_PRINC);
+    } while (opcode == ONE_PRINC || opcode == MANY_PRINCS);
 
     if (opcode != NOW_YOU_HAVE)
         krb5_errx(context, IPROPD_RESTART_SLOW,
@@ -1112,6 +1164,7 @@ main(int argc, char **argv)
 	    case NOW_YOU_HAVE :
 	    case I_HAVE :
 	    case ONE_PRINC :
+	    case MANY_PRINCS :
 	    case I_AM_HERE :
 	    default :
 		krb5_warnx (context, "Ignoring command %d", tmp);
@@ -463,6 +463,169 @@ get_max_log_size(krb5_context context)
     return 0;
 }
 
+/*
+ * The log index is a sidecar file, <log>.idx, with an entry of this
+ * form for each record after the uber record, in log order:
+ *
+ * version number		4 bytes
+ * offset of record		8 bytes
+ *
+ * This lets readers find a version's record by binary search instead
+ * of traversing the log backwards record by record.  It is only a hint:
+ * lookups check the record they find, and writers (which hold the log's
+ * exclusive lock) extend it from the last record it correctly describes
+ * or, failing that, rebuild it from the start of the log.
+ */
+#define LOG_INDEX_ENTRY_SZ ((off_t)(sizeof(uint32_t) + sizeof(uint64_t)))
+
+static char *
+log_index_file(kadm5_log_context *log_context)
+{
+    char *fn;
+
+    if (asprintf(&fn, "%s.idx", log_context->log_file) == -1)
+        return NULL;
+    return fn;
+}
+
+/* Discard the index, e.g., when the log is rewritten */
+static void
+log_index_reset(kadm5_log_context *log_context)
+{
+    char *fn = log_index_file(log_context);
+
+    if (fn != NULL)
+        (void) unlink(fn);
+    free(fn);
+}
+
+/*
+ * Add the records written since the last update to the index, or
+ * rebuild it if it doesn't match the log.
+ */
+static kadm5_ret_t
+log_index_update(kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    krb5_storage *sp = NULL;
+    krb5_storage *isp = NULL;
+    krb5_storage *mem_sp = NULL;
+    kadm5_ret_t ret = 0;
+    krb5_data data;
+    krb5_ssize_t bytes;
+    uint32_t ver, iver;
+    uint64_t ioff;
+    off_t start, off, next, isz, iend;
+    char *fn;
+    int fd;
+
+    if (strcmp(log_context->log_file, "/dev/null") == 0 ||
+        log_context->read_only)
+        return 0;
+
+    /* Our storage shares the log fd's offset, which we must preserve */
+    start = lseek(log_context->log_fd, 0, SEEK_CUR);
+    if (start == -1)
+        return errno;
+
+    krb5_data_zero(&data);
+
+    fn = log_index_file(log_context);
+    if (fn == NULL)
+        return krb5_enomem(context->context);
+    fd = open(fn, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        ret = errno;
+        krb5_set_error_message(context->context, ret,
+                               "log_index_update: open %s", fn);
+        free(fn);
+        return ret;
+    }
+    free(fn);
+
+    isp = krb5_storage_from_fd(fd);
+    (void) close(fd);
+    sp = krb5_storage_from_fd(log_context->log_fd);
+    mem_sp = krb5_storage_emem();
+    if (isp == NULL || sp == NULL || mem_sp == NULL) {
+        ret = krb5_enomem(context->context);
+        goto out;
+    }
+
+    /* Pick up after the last record indexed, if it's still there */
+    iend = krb5_storage_seek(isp, 0, SEEK_END);
+    if (iend == -1) {
+        ret = errno;
+        goto out;
+    }
+    isz = iend - iend % LOG_INDEX_ENTRY_SZ;
+    off = -1;
+    if (isz > 0 &&
+        krb5_storage_seek(isp, isz - LOG_INDEX_ENTRY_SZ, SEEK_SET) != -1 &&
+        krb5_ret_uint32(isp, &iver) == 0 &&
+        krb5_ret_uint64(isp, &ioff) == 0 &&
+        (off_t)ioff >= LOG_UBER_SZ &&
+        krb5_storage_seek(sp, ioff, SEEK_SET) == (off_t)ioff &&
+        get_header(sp, LOG_DOPEEK, &ver, NULL, NULL, NULL) == 0 &&
+        ver == iver)
+        off = seek_next(sp);
+
+    if (off == -1) {
+        isz = 0;
+        ret = kadm5_log_goto_first(context, sp);
+        if (ret == HEIM_ERR_EOF) {
+            ret = 0;            /* empty log */
+            goto write;
+        }
+        if (ret)
+            goto out;
+        off = krb5_storage_seek(sp, 0, SEEK_CUR);
+    }
+
+    /*
+     * Index the records that follow, stopping short of any partial
+     * record (recovery will deal with that).
+     */
+    for (;;) {
+        if (get_header(sp, LOG_DOPEEK, &ver, NULL, NULL, NULL) != 0 ||
+            (next = seek_next(sp)) == -1)
+            break;
+        ret = krb5_store_uint32(mem_sp, ver);
+        if (ret == 0)
+            ret = krb5_store_uint64(mem_sp, off);
+        if (ret)
+            goto out;
+        off = next;
+    }
+
+write:
+    ret = krb5_storage_to_data(mem_sp, &data);
+    if (ret == 0 && isz != iend)
+        ret = krb5_storage_truncate(isp, isz);
+    if (ret == 0 && data.length > 0) {
+        if (krb5_storage_seek(isp, isz, SEEK_SET) != isz) {
+            ret = errno;
+        } else {
+            bytes = krb5_storage_write(isp, data.data, data.length);
+            if (bytes != (krb5_ssize_t)data.length)
+                ret = bytes == -1 ? errno : EIO;
+        }
+    }
+
+    /* We don't fsync() the index; lookups check what they find anyway */
+
+out:
+    if (ret)
+        krb5_warn(context->context, ret, "could not update iprop log index");
+    krb5_data_free(&data);
+    krb5_storage_free(mem_sp);
+    krb5_storage_free(sp);
+    krb5_storage_free(isp);
+    if (lseek(log_context->log_fd, start, SEEK_SET) == -1)
+        ret = ret ? ret : errno;
+    return ret;
+}
+
 static kadm5_ret_t truncate_if_needed(kadm5_server_context *);
 
 /*
@@ -761,6 +924,7 @@ kadm5_log_reinit(kadm5_server_context *server_context, uint32_t vno)
     }
 
     /* Write uber entry and truncation nop with version `vno` */
+    log_index_reset(log_context);
     log_context->version = vno;
     return kadm5_log_nop(server_context, kadm_nop_plain);
 }
@@ -961,6 +1125,9 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
     /* Retain the nominal database version when flushing the uber record */
     if (new_ver != 0)
         log_context->version = new_ver;
+
+    /* The record is safely written; failing to index it is not an error */
+    (void) log_index_update(context);
     return 0;
 }
 
@@ -1018,7 +1185,7 @@ kadm5_log_create(kadm5_server_context *context, hdb_entry *entry)
         ret = hdb_entry2value(context->context, entry, &value);
     if (ret)
         return ret;
-    sp = krb5_storage_emem();
+    sp = krb5_storage_emem_capacity(value.length + LOG_WRAPPER_SZ);
     if (sp == NULL)
 	ret = krb5_enomem(context->context);
     if (ret == 0)
@@ -1381,12 +1548,15 @@ kadm5_log_modify(kadm5_server_context *context,
     if (ret)
         return ret;
 
-    sp = krb5_storage_emem();
+    sp = NULL;
     krb5_data_zero(&value);
-    if (sp == NULL)
-	ret = krb5_enomem(context->context);
-    if (ret == 0)
-        ret = hdb_entry2value(context->context, entry, &value);
+    ret = hdb_entry2value(context->context, entry, &value);
+    if (ret == 0) {
+        sp = krb5_storage_emem_capacity(value.length + sizeof(mask) +
+                                        LOG_WRAPPER_SZ);
+        if (sp == NULL)
+            ret = krb5_enomem(context->context);
+    }
     if (ret) {
         krb5_data_free(&value);
         krb5_storage_free(sp);
@@ -1909,6 +2079,10 @@ kadm5_log_recover(kadm5_server_context *context, enum kadm_recover_mode mode)
     if (ret == 0 && mode == kadm_recover_commit && replay_data.count != 1)
         ret = KADM5_LOG_CORRUPT;
     krb5_storage_free(sp);
+
+    /* Index records appended by others (e.g., ipropd-slave), or rebuild */
+    if (ret == 0 && mode == kadm_recover_replay)
+        (void) log_index_update(context);
     return ret;
 }
 
@@ -2216,6 +2390,86 @@ truncate:
     return ret;
 }
 
+/*
+ * Go to the start of the record with version `ver', found by binary
+ * search in the log's index.  The caller must hold a lock on the log.
+ *
+ * Returns HEIM_ERR_EOF if the index doesn't have the record, and
+ * KADM5_LOG_CORRUPT if it doesn't match the log; either way the caller
+ * can still look for the record by traversing the log.
+ */
+kadm5_ret_t
+kadm5_log_goto_version(kadm5_server_context *server_context,
+                       krb5_storage *sp, uint32_t ver)
+{
+    kadm5_ret_t ret;
+    krb5_storage *isp;
+    uint32_t iver, rver;
+    uint64_t ioff = 0;
+    off_t lo, hi, mid;
+    char *fn;
+    int fd;
+
+    fn = log_index_file(&server_context->log_context);
+    if (fn == NULL)
+        return krb5_enomem(server_context->context);
+    fd = open(fn, O_RDONLY);
+    free(fn);
+    if (fd == -1)
+        return errno == ENOENT ? HEIM_ERR_EOF : errno;
+    isp = krb5_storage_from_fd(fd);
+    (void) close(fd);
+    if (isp == NULL)
+        return krb5_enomem(server_context->context);
+
+    hi = krb5_storage_seek(isp, 0, SEEK_END);
+    if (hi == -1) {
+        ret = errno;
+        krb5_storage_free(isp);
+        return ret;
+    }
+    hi /= LOG_INDEX_ENTRY_SZ;
+    lo = 0;
+
+    ret = HEIM_ERR_EOF;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (krb5_storage_seek(isp, mid * LOG_INDEX_ENTRY_SZ,
+                              SEEK_SET) != mid * LOG_INDEX_ENTRY_SZ) {
+            ret = KADM5_LOG_CORRUPT;
+            break;
+        }
+        ret = krb5_ret_uint32(isp, &iver);
+        if (ret == 0)
+            ret = krb5_ret_uint64(isp, &ioff);
+        if (ret) {
+            ret = KADM5_LOG_CORRUPT;
+            break;
+        }
+        if (iver == ver)
+            break;
+        if (iver < ver)
+            lo = mid + 1;
+        else
+            hi = mid;
+        ret = HEIM_ERR_EOF;
+    }
+    krb5_storage_free(isp);
+    if (ret)
+        return ret;
+
+    /* Check that the index is right about this record */
+    if ((off_t)ioff < LOG_UBER_SZ ||
+        krb5_storage_seek(sp, ioff, SEEK_SET) != (off_t)ioff)
+        return KADM5_LOG_CORRUPT;
+    ret = kadm5_log_next(server_context->context, sp, &rver, NULL, NULL, NULL);
+    if (ret == 0 && rver != ver)
+        ret = KADM5_LOG_CORRUPT;
+    if (ret == 0 && krb5_storage_seek(sp, ioff, SEEK_SET) != (off_t)ioff)
+        ret = errno;
+    return ret;
+}
+
 /*
  * Return the next log entry.
  *
@@ -2556,6 +2810,7 @@ kadm5_log_truncate(kadm5_server_context *context, size_t keep, size_t maxbytes)
     }
 
     /* Truncate to zero size and seek to zero offset */
+    log_index_reset(&context->log_context);
     if (ftruncate(context->log_context.log_fd, 0) < 0 ||
         lseek(context->log_context.log_fd, 0, SEEK_SET) < 0) {
         krb5_data_free(&entries);
@@ -2647,6 +2902,8 @@ kadm5_log_truncate(kadm5_server_context *context, size_t keep, size_t maxbytes)
             context->log_context.last_time = last_tstamp;
     }
     krb5_storage_free(sp);
+    if (ret == 0)
+        (void) log_index_update(context);
     return ret;
 }
 
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Checks that kadm5_log_goto_version() finds every record in the iprop
+ * log through the log's index, and that when the index is missing,
+ * stale or damaged it fails with HEIM_ERR_EOF or KADM5_LOG_CORRUPT
+ * rather than landing on the wrong record.  Only nop records are
+ * written, so the HDB stays empty.
+ */
+
+#include "kadm5_locl.h"
+
+#define DB_FILE		"log-index-test"
+#define LOG_FILE	DB_FILE ".log"
+#define IDX_FILE	LOG_FILE ".idx"
+#define IDX_ENTRY_SZ	(4 + 8)		/* as in log.c */
+
+static krb5_context context;
+static kadm5_server_context *server_context;
+
+static void
+append(int n)
+{
+    kadm5_ret_t ret;
+
+    /* Records are written at the log's offset, which check() moves */
+    if (lseek(server_context->log_context.log_fd, 0, SEEK_END) == -1)
+        krb5_err(context, 1, errno, "lseek %s", LOG_FILE);
+    while (n-- > 0) {
+        ret = kadm5_log_nop(server_context, kadm_nop_plain);
+        if (ret)
+            krb5_err(context, 1, ret, "kadm5_log_nop");
+    }
+}
+
+/*
+ * Look up every version up to `last' + 1, where the log holds `first'
+ * through `last'.  Those in the log must be found if `exact', and may
+ * otherwise be missed, but any lookup that succeeds must land on the
+ * record asked for.
+ */
+static void
+check(const char *what, uint32_t first, uint32_t last, int exact)
+{
+    krb5_storage *sp;
+    kadm5_ret_t ret;
+    uint32_t ver, rver;
+    off_t off;
+
+    sp = krb5_storage_from_fd(server_context->log_context.log_fd);
+    if (sp == NULL)
+        krb5_errx(context, 1, "out of memory");
+
+    for (ver = 0; ver <= last + 1; ver++) {
+        ret = kadm5_log_goto_version(server_context, sp, ver);
+        if (ret == 0) {
+            off = krb5_storage_seek(sp, 0, SEEK_CUR);
+            ret = kadm5_log_next(context, sp, &rver, NULL, NULL, NULL);
+            if (ret)
+                krb5_err(context, 1, ret, "%s: version %lu: "
+                         "kadm5_log_next at %lld", what,
+                         (unsigned long)ver, (long long)off);
+            if (rver != ver)
+                krb5_errx(context, 1, "%s: version %lu: "
+                          "found version %lu instead", what,
+                          (unsigned long)ver, (unsigned long)rver);
+            if (ver < first || ver > last)
+                krb5_errx(context, 1, "%s: version %lu: "
+                          "found but not in the log", what,
+                          (unsigned long)ver);
+        } else if (ret == HEIM_ERR_EOF || ret == KADM5_LOG_CORRUPT) {
+            if (exact && ver >= first && ver <= last)
+                krb5_err(context, 1, ret, "%s: version %lu: "
+                         "not found", what, (unsigned long)ver);
+        } else {
+            krb5_err(context, 1, ret, "%s: version %lu", what,
+                     (unsigned long)ver);
+        }
+    }
+    krb5_storage_free(sp);
+}
+
+static void
+read_file(const char *fn, krb5_data *data)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(fn, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        krb5_err(context, 1, errno, "%s", fn);
+    if (krb5_data_alloc(data, st.st_size))
+        krb5_errx(context, 1, "out of memory");
+    if (net_read(fd, data->data, data->length) != (ssize_t)data->length)
+        krb5_err(context, 1, errno, "read %s", fn);
+    (void) close(fd);
+}
+
+static void
+write_file(const char *fn, const krb5_data *data)
+{
+    int fd;
+
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        krb5_err(context, 1, errno, "%s", fn);
+    if (net_write(fd, data->data, data->length) != (ssize_t)data->length)
+        krb5_err(context, 1, errno, "write %s", fn);
+    (void) close(fd);
+}
+
+/* Point every entry in the index at the first one's record */
+static void
+misdirect_index(void)
+{
+    krb5_data idx;
+    unsigned char *p;
+    size_t i;
+
+    read_file(IDX_FILE, &idx);
+    if (idx.length < 2 * IDX_ENTRY_SZ)
+        krb5_errx(context, 1, "index too short to misdirect");
+    p = idx.data;
+    for (i = IDX_ENTRY_SZ; i + IDX_ENTRY_SZ <= idx.length; i += IDX_ENTRY_SZ)
+        memcpy(p + i + 4, p + 4, 8);
+    write_file(IDX_FILE, &idx);
+    krb5_data_free(&idx);
+}
+
+static void
+truncate_index(off_t len)
+{
+    if (truncate(IDX_FILE, len) == -1)
+        krb5_err(context, 1, errno, "truncate %s", IDX_FILE);
+}
+
+int
+main(int argc, char **argv)
+{
+    kadm5_config_params conf;
+    krb5_data stale;
+    kadm5_ret_t ret;
+    void *handle;
+
+    setprogname(argv[0]);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+        errx(1, "krb5_init_context failed: %d", ret);
+    ret = krb5_set_default_realm(context, "TEST.H5L.SE");
+    if (ret)
+        krb5_err(context, 1, ret, "krb5_set_default_realm");
+
+    memset(&conf, 0, sizeof(conf));
+    conf.mask = KADM5_CONFIG_REALM | KADM5_CONFIG_DBNAME |
+        KADM5_CONFIG_STASH_FILE;
+    conf.realm = "TEST.H5L.SE";
+    conf.dbname = "./" DB_FILE;
+    conf.stash_file = DB_FILE ".mkey";
+    ret = kadm5_s_init_with_password_ctx(context, KADM5_ADMIN_SERVICE,
+                                         NULL, KADM5_ADMIN_SERVICE,
+                                         &conf, 0, 0, &handle);
+    if (ret)
+        krb5_err(context, 1, ret, "kadm5_s_init_with_password_ctx");
+    server_context = handle;
+
+    free(server_context->log_context.log_file);
+    server_context->log_context.log_file = strdup(LOG_FILE);
+    if (server_context->log_context.log_file == NULL)
+        krb5_errx(context, 1, "out of memory");
+    (void) unlink(LOG_FILE);
+    (void) unlink(IDX_FILE);
+
+    ret = kadm5_log_init(server_context);
+    if (ret)
+        krb5_err(context, 1, ret, "kadm5_log_init");
+
+    /* An empty log has nothing to find */
+    check("empty log", 1, 0, 1);
+
+    append(20);
+    check("appended", 1, 20, 1);
+
+    ret = kadm5_log_truncate(server_context, 5, 0);
+    if (ret)
+        krb5_err(context, 1, ret, "kadm5_log_truncate");
+    check("truncated", 16, 20, 1);
+    append(5);
+    check("appended after truncation", 16, 25, 1);
+
+    /* Keep this index to put back after reinitializing the log */
+    read_file(IDX_FILE, &stale);
+
+    ret = kadm5_log_reinit(server_context, 100);
+    if (ret)
+        krb5_err(context, 1, ret, "kadm5_log_reinit");
+    check("reinitialized", 101, 100, 1);
+    append(10);
+    check("appended after reinitialization", 101, 110, 1);
+
+    write_file(IDX_FILE, &stale);
+    krb5_data_free(&stale);
+    check("stale index", 101, 110, 0);
+    append(1);
+    check("rebuilt stale index", 101, 111, 1);
+
+    if (unlink(IDX_FILE) == -1)
+        krb5_err(context, 1, errno, "unlink %s", IDX_FILE);
+    check("deleted index", 101, 111, 0);
+    append(1);
+    check("rebuilt deleted index", 101, 112, 1);
+
+    misdirect_index();
+    check("misdirected index", 101, 112, 0);
+    append(1);
+    check("rebuilt misdirected index", 101, 113, 1);
+
+    truncate_index(5 * IDX_ENTRY_SZ + IDX_ENTRY_SZ / 2);
+    check("truncated index", 101, 113, 0);
+    append(1);
+    check("extended truncated index", 101, 114, 1);
+
+    ret = kadm5_log_end(server_context);
+    if (ret)
+        krb5_err(context, 1, ret, "kadm5_log_end");
+    kadm5_destroy(server_context);
+    krb5_free_context(context);
+
+    (void) unlink(LOG_FILE);
+    (void) unlink(IDX_FILE);
+    (void) unlink(DB_FILE);
+    return 0;
+}
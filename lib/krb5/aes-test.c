@@ -980,6 +980,219 @@ iov_test(krb5_context context, krb5_enctype enctype)
 }
 
 
+/*
+ * The AES enctypes encrypt and checksum in one pass when they can
+ * (encrypt_mac_iov).  Check that this agrees with the general code,
+ * which a copy of the enctype without the hook falls back to.
+ */
+
+#define FUSED_NIOV 6
+
+static void
+fused_iov_alloc(krb5_context context, krb5_crypto crypto,
+		krb5_crypto_iov *iov, size_t len, krb5_data *signonly)
+{
+    krb5_error_code ret;
+    unsigned char *p;
+    size_t i;
+
+    memset(iov, 0, FUSED_NIOV * sizeof(iov[0]));
+    iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+    iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+    iov[1].data.length = len / 2;
+    iov[2].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+    iov[2].data = *signonly;
+    iov[3].flags = KRB5_CRYPTO_TYPE_DATA;
+    iov[3].data.length = len - len / 2;
+    iov[4].flags = KRB5_CRYPTO_TYPE_PADDING;
+    iov[5].flags = KRB5_CRYPTO_TYPE_TRAILER;
+
+    ret = krb5_crypto_length_iov(context, crypto, iov, FUSED_NIOV);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_length_iov");
+
+    for (i = 0; i < FUSED_NIOV; i++) {
+	if (iov[i].flags == KRB5_CRYPTO_TYPE_SIGN_ONLY)
+	    continue;
+	iov[i].data.data = p = emalloc(iov[i].data.length + 1);
+	if (iov[i].flags == KRB5_CRYPTO_TYPE_DATA) {
+	    size_t j;
+
+	    for (j = 0; j < iov[i].data.length; j++)
+		p[j] = (unsigned char)(i + j);
+	}
+    }
+}
+
+static void
+fused_iov_copy(krb5_crypto_iov *dst, const krb5_crypto_iov *src)
+{
+    size_t i;
+
+    for (i = 0; i < FUSED_NIOV; i++) {
+	dst[i] = src[i];
+	if (src[i].flags == KRB5_CRYPTO_TYPE_SIGN_ONLY)
+	    continue;
+	dst[i].data.data = emalloc(src[i].data.length + 1);
+	memcpy(dst[i].data.data, src[i].data.data, src[i].data.length);
+    }
+}
+
+static void
+fused_iov_free(krb5_crypto_iov *iov)
+{
+    size_t i;
+
+    for (i = 0; i < FUSED_NIOV; i++) {
+	if (iov[i].flags != KRB5_CRYPTO_TYPE_SIGN_ONLY)
+	    free(iov[i].data.data);
+    }
+}
+
+static int
+fused_iov_cmp(const krb5_crypto_iov *a, const krb5_crypto_iov *b)
+{
+    size_t i;
+
+    for (i = 0; i < FUSED_NIOV; i++) {
+	if (a[i].flags == KRB5_CRYPTO_TYPE_SIGN_ONLY)
+	    continue;
+	if (krb5_data_cmp(&a[i].data, &b[i].data) != 0)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Encrypt with `enc', then decrypt what it produced with both `enc'
+ * and `other': the buffers and ivec must come out the same, and both
+ * must reject the message once its checksum has been tampered with.
+ */
+static void
+fused_iov_check(krb5_context context, const char *name, size_t len,
+		krb5_crypto enc, krb5_crypto other, krb5_data *signonly)
+{
+    krb5_error_code ret, ret2;
+    krb5_crypto_iov clear[FUSED_NIOV], iov[FUSED_NIOV];
+    krb5_crypto_iov iov1[FUSED_NIOV], iov2[FUSED_NIOV];
+    unsigned char ivec[EVP_MAX_IV_LENGTH], ivec1[EVP_MAX_IV_LENGTH];
+    unsigned char ivec2[EVP_MAX_IV_LENGTH];
+    int tamper;
+
+    fused_iov_alloc(context, enc, clear, len, signonly);
+    fused_iov_copy(iov, clear);
+
+    memset(ivec, 0, sizeof(ivec));
+    ret = krb5_encrypt_iov_ivec(context, enc, 7, iov, FUSED_NIOV, ivec);
+    if (ret)
+	krb5_err(context, 1, ret, "%s length %lu: krb5_encrypt_iov_ivec",
+		 name, (unsigned long)len);
+
+    for (tamper = 0; tamper < 2; tamper++) {
+	if (tamper)
+	    ((unsigned char *)iov[5].data.data)[0] ^= 1;
+	fused_iov_copy(iov1, iov);
+	fused_iov_copy(iov2, iov);
+	memset(ivec1, 0, sizeof(ivec1));
+	memset(ivec2, 0, sizeof(ivec2));
+	ret = krb5_decrypt_iov_ivec(context, enc, 7, iov1, FUSED_NIOV, ivec1);
+	ret2 = krb5_decrypt_iov_ivec(context, other, 7, iov2, FUSED_NIOV,
+				     ivec2);
+	if (ret != (tamper ? KRB5KRB_AP_ERR_BAD_INTEGRITY : 0) || ret2 != ret)
+	    krb5_errx(context, 1, "%s length %lu%s: decrypt returned %d "
+		      "and %d", name, (unsigned long)len,
+		      tamper ? " (tampered)" : "", ret, ret2);
+	if (!tamper) {
+	    if (krb5_data_cmp(&iov1[1].data, &clear[1].data) != 0 ||
+		krb5_data_cmp(&iov1[3].data, &clear[3].data) != 0)
+		krb5_errx(context, 1, "%s length %lu: decrypted data "
+			  "not same", name, (unsigned long)len);
+	    if (fused_iov_cmp(iov1, iov2) != 0)
+		krb5_errx(context, 1, "%s length %lu: the two decryptions "
+			  "differ", name, (unsigned long)len);
+	    if (memcmp(ivec, ivec1, sizeof(ivec)) != 0 ||
+		memcmp(ivec, ivec2, sizeof(ivec)) != 0)
+		krb5_errx(context, 1, "%s length %lu: ivec not same",
+			  name, (unsigned long)len);
+	}
+	fused_iov_free(iov1);
+	fused_iov_free(iov2);
+    }
+
+    fused_iov_free(iov);
+    fused_iov_free(clear);
+}
+
+static int
+fused_iov_test(krb5_context context, krb5_enctype enctype)
+{
+    static const size_t lens[] = {
+	0, 1, 15, 16, 17, 31, 32, 33, 47, 100, 4095, 4096, 4097, 9000
+    };
+    struct _krb5_encryption_type et;
+    krb5_error_code ret;
+    krb5_crypto fused, general;
+    krb5_keyblock key;
+    krb5_data signonly, cipher, plain;
+    unsigned char *buf;
+    char *name;
+    size_t i, j;
+
+    ret = krb5_enctype_to_string(context, enctype, &name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_enctype_to_string");
+    ret = krb5_generate_random_keyblock(context, enctype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+
+    ret = krb5_crypto_init(context, &key, 0, &fused);
+    if (ret == 0)
+	ret = krb5_crypto_init(context, &key, 0, &general);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    if (fused == general || fused->et->encrypt_mac_iov == NULL)
+	krb5_errx(context, 1, "%s: no one-pass encryption to test", name);
+    et = *general->et;
+    et.encrypt_mac_iov = NULL;
+    general->et = &et;
+
+    signonly.data = "This should be signed";
+    signonly.length = strlen(signonly.data);
+
+    for (i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+	fused_iov_check(context, name, lens[i], fused, general, &signonly);
+	fused_iov_check(context, name, lens[i], general, fused, &signonly);
+
+	buf = emalloc(lens[i] + 1);
+	for (j = 0; j < lens[i]; j++)
+	    buf[j] = (unsigned char)j;
+	for (j = 0; j < 4; j++) {
+	    ret = krb5_encrypt(context, j & 1 ? general : fused, 7,
+			       buf, lens[i], &cipher);
+	    if (ret == 0)
+		ret = krb5_decrypt(context, j & 2 ? general : fused, 7,
+				   cipher.data, cipher.length, &plain);
+	    if (ret)
+		krb5_err(context, 1, ret, "%s length %lu: "
+			 "krb5_encrypt/krb5_decrypt", name,
+			 (unsigned long)lens[i]);
+	    if (plain.length != lens[i] ||
+		memcmp(plain.data, buf, lens[i]) != 0)
+		krb5_errx(context, 1, "%s length %lu: krb5_decrypt "
+			  "data not same", name, (unsigned long)lens[i]);
+	    krb5_data_free(&plain);
+	    krb5_data_free(&cipher);
+	}
+	free(buf);
+    }
+
+    krb5_crypto_destroy(context, fused);
+    krb5_crypto_destroy(context, general);
+    krb5_free_keyblock_contents(context, &key);
+    free(name);
+    return 0;
+}
+
 
 static int
 random_to_key(krb5_context context)
@@ -1034,6 +1247,10 @@ main(int argc, char **argv)
     val |= iov_test(context, KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96);
     val |= iov_test(context, KRB5_ENCTYPE_AES128_CTS_HMAC_SHA256_128);
     val |= iov_test(context, KRB5_ENCTYPE_AES256_CTS_HMAC_SHA384_192);
+    val |= fused_iov_test(context, KRB5_ENCTYPE_AES128_CTS_HMAC_SHA1_96);
+    val |= fused_iov_test(context, KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96);
+    val |= fused_iov_test(context, KRB5_ENCTYPE_AES128_CTS_HMAC_SHA256_128);
+    val |= fused_iov_test(context, KRB5_ENCTYPE_AES256_CTS_HMAC_SHA384_192);
 
     if (verbose && val == 0)
 	printf("all ok\n");
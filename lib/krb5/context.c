@@ -112,6 +112,7 @@ init_context_from_config_file(krb5_context context)
     INIT_FIELD(context, time, kdc_timeout, 30, "kdc_timeout");
     INIT_FIELD(context, time, host_timeout, 3, "host_timeout");
     INIT_FIELD(context, int, max_retries, 3, "max_retries");
+    INIT_FIELD(context, int, crypto_cache_size, 0, "crypto_cache_size");
 
     INIT_FIELD(context, string, http_proxy, NULL, "http_proxy");
 
@@ -240,6 +241,7 @@ init_context_from_config_file(krb5_context context)
     INIT_FLAG(context, flags, KRB5_CTX_F_DNS_CANONICALIZE_HOSTNAME, TRUE, "dns_canonicalize_hostname");
     INIT_FLAG(context, flags, KRB5_CTX_F_CHECK_PAC, TRUE, "check_pac");
     INIT_FLAG(context, flags, KRB5_CTX_F_ENFORCE_OK_AS_DELEGATE, FALSE, "enforce_ok_as_delegate");
+    INIT_FLAG(context, flags, KRB5_CTX_F_KEYTAB_INDEX, FALSE, "keytab_index");
 
     if (context->default_cc_name)
 	free(context->default_cc_name);
@@ -555,6 +557,7 @@ krb5_copy_context(krb5_context context, krb5_context *out)
     }
 
     heim_context_set_log_utc(p->hcontext, context->log_utc);
+    p->crypto_cache_size = context->crypto_cache_size;
 
     if (context->default_cc_name &&
 	(p->default_cc_name = strdup(context->default_cc_name)) == NULL) {
@@ -640,6 +643,8 @@ krb5_copy_context(krb5_context context, krb5_context *out)
 KRB5_LIB_FUNCTION void KRB5_LIB_CALL
 krb5_free_context(krb5_context context)
 {
+    _krb5_crypto_cache_free(context);
+    _krb5_fkt_index_free(context);
     _krb5_free_name_canon_rules(context, context->name_canon_rules);
     if (context->default_cc_name)
 	free(context->default_cc_name);
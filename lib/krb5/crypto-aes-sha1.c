@@ -142,6 +142,23 @@ AES_SHA1_PRF(krb5_context context,
     return ret;
 }
 
+static krb5_error_code
+AES_SHA1_encrypt_mac_iov(krb5_context context,
+			 krb5_crypto crypto,
+			 struct _krb5_key_data *key,
+			 struct _krb5_key_data *mackey,
+			 krb5_crypto_iov *iov,
+			 int niov,
+			 krb5_boolean encryptp,
+			 void *ivec,
+			 void *mac,
+			 unsigned int *maclen)
+{
+    return _krb5_evp_encrypt_iov_cts_hmac(context, crypto, key, mackey,
+					  EVP_sha1(), FALSE, iov, niov,
+					  encryptp, ivec, mac, maclen);
+}
+
 struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha1 = {
     ETYPE_AES128_CTS_HMAC_SHA1_96,
     "aes128-cts-hmac-sha1-96",
@@ -156,7 +173,8 @@ struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha1 = {
     _krb5_evp_encrypt_cts,
     _krb5_evp_encrypt_iov_cts,
     16,
-    AES_SHA1_PRF
+    AES_SHA1_PRF,
+    AES_SHA1_encrypt_mac_iov
 };
 
 struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha1 = {
@@ -173,5 +191,6 @@ struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha1 = {
     _krb5_evp_encrypt_cts,
     _krb5_evp_encrypt_iov_cts,
     16,
-    AES_SHA1_PRF
+    AES_SHA1_PRF,
+    AES_SHA1_encrypt_mac_iov
 };
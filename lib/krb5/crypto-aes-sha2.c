@@ -164,6 +164,30 @@ AES_SHA2_PRF(krb5_context context,
     return ret;
 }
 
+static krb5_error_code
+AES_SHA2_encrypt_mac_iov(krb5_context context,
+			 krb5_crypto crypto,
+			 struct _krb5_key_data *key,
+			 struct _krb5_key_data *mackey,
+			 krb5_crypto_iov *iov,
+			 int niov,
+			 krb5_boolean encryptp,
+			 void *ivec,
+			 void *mac,
+			 unsigned int *maclen)
+{
+    krb5_error_code ret;
+    const EVP_MD *md = NULL;
+
+    ret = _krb5_aes_sha2_md_for_enctype(context, crypto->et->type, &md);
+    if (ret)
+	return ret;
+
+    return _krb5_evp_encrypt_iov_cts_hmac(context, crypto, key, mackey,
+					  md, TRUE, iov, niov,
+					  encryptp, ivec, mac, maclen);
+}
+
 struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha256_128 = {
     ETYPE_AES128_CTS_HMAC_SHA256_128,
     "aes128-cts-hmac-sha256-128",
@@ -178,7 +202,8 @@ struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha256_128 = {
     _krb5_evp_encrypt_cts,
     NULL,
     16,
-    AES_SHA2_PRF
+    AES_SHA2_PRF,
+    AES_SHA2_encrypt_mac_iov
 };
 
 struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha384_192 = {
@@ -195,5 +220,6 @@ struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha384_192 = {
     _krb5_evp_encrypt_cts,
     NULL,
     16,
-    AES_SHA2_PRF
+    AES_SHA2_PRF,
+    AES_SHA2_encrypt_mac_iov
 };
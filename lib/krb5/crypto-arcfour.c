@@ -364,5 +364,6 @@ struct _krb5_encryption_type _krb5_enctype_arcfour_hmac_md5 = {
     ARCFOUR_encrypt,
     NULL,
     0,
-    ARCFOUR_prf
+    ARCFOUR_prf,
+    NULL
 };
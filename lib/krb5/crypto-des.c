@@ -313,6 +313,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_crc = {
     evp_des_encrypt_key_ivec,
     NULL,
     0,
+    NULL,
     NULL
 };
 
@@ -330,6 +331,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_md4 = {
     evp_des_encrypt_null_ivec,
     NULL,
     0,
+    NULL,
     NULL
 };
 
@@ -347,6 +349,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_md5 = {
     evp_des_encrypt_null_ivec,
     NULL,
     0,
+    NULL,
     NULL
 };
 
@@ -364,6 +367,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_none = {
     evp_des_encrypt_null_ivec,
     NULL,
     0,
+    NULL,
     NULL
 };
 
@@ -381,6 +385,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cfb64_none = {
     DES_CFB64_encrypt_null_ivec,
     NULL,
     0,
+    NULL,
     NULL
 };
 
@@ -398,6 +403,7 @@ struct _krb5_encryption_type _krb5_enctype_des_pcbc_none = {
     DES_PCBC_encrypt_key_ivec,
     NULL,
     0,
+    NULL,
     NULL
 };
 #endif /* HEIM_WEAK_CRYPTO */
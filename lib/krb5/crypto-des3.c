@@ -200,6 +200,7 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_md5 = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     0,
+    NULL,
     NULL
 };
 #endif
@@ -218,7 +219,8 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_sha1 = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     16,
-    DES3_prf
+    DES3_prf,
+    NULL
 };
 
 #ifdef DES3_OLD_ENCTYPE
@@ -236,6 +238,7 @@ struct _krb5_encryption_type _krb5_enctype_old_des3_cbc_sha1 = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     0,
+    NULL,
     NULL
 };
 #endif
@@ -254,6 +257,7 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_none = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     0,
+    NULL,
     NULL
 };
 
@@ -381,7 +381,7 @@ _krb5_evp_encrypt_iov(krb5_context context,
     while (!_krb5_evp_iov_cursor_done(&cursor)) {
 
 	/* Number of bytes of data in this iovec that are in whole blocks */
-        wholeblocks = cursor.current.length & ~blockmask;
+        wholeblocks = cursor.current.length & blockmask;
 
         if (wholeblocks != 0) {
             EVP_Cipher(c, cursor.current.data,
@@ -407,17 +407,137 @@ _krb5_evp_encrypt_iov(krb5_context context,
     return 0;
 }
 
-int
-_krb5_evp_encrypt_iov_cts(krb5_context context,
-			  struct _krb5_key_data *key,
-			  struct krb5_crypto_iov *iov,
-			  int niov,
-			  krb5_boolean encryptp,
-			  int usage,
-			  void *ivec)
+/*
+ * State for computing an HMAC while _krb5_evp_encrypt_iov_cts() walks
+ * the iovecs.  The MAC runs over the signed iovecs in order; `pos' is
+ * how far into the encrypted stream it has got.  When the MAC is over
+ * the input of the cipher (`leading') each chunk is hashed before it
+ * is transformed, otherwise after, so that every chunk is only brought
+ * into cache once.
+ */
+
+struct _krb5_evp_iov_mac {
+    HMAC_CTX *ctx;
+    int leading;
+    const struct krb5_crypto_iov *iov;
+    int niov;
+    int idx;
+    size_t off;
+    size_t pos;
+};
+
+#define EVP_IOV_MAC_CHUNK 4096
+
+/*
+ * Feed the MAC everything up to `limit' bytes into the encrypted
+ * stream, together with any sign-only iovecs that come before that
+ * point.
+ */
+static void
+_krb5_evp_iov_mac_advance(struct _krb5_evp_iov_mac *mac, size_t limit)
+{
+    while (mac->idx < mac->niov) {
+	const struct krb5_crypto_iov *v = &mac->iov[mac->idx];
+	size_t n;
+
+	if (!_krb5_crypto_iov_should_sign(v)) {
+	    mac->idx++;
+	    continue;
+	}
+	if (v->flags == KRB5_CRYPTO_TYPE_SIGN_ONLY) {
+	    if (v->data.length)
+		HMAC_Update(mac->ctx, v->data.data, v->data.length);
+	    mac->idx++;
+	    continue;
+	}
+	n = v->data.length - mac->off;
+	if (n > limit - mac->pos)
+	    n = limit - mac->pos;
+	if (n) {
+	    HMAC_Update(mac->ctx, (unsigned char *)v->data.data + mac->off, n);
+	    mac->off += n;
+	    mac->pos += n;
+	}
+	if (mac->off < v->data.length)
+	    return;
+	mac->idx++;
+	mac->off = 0;
+    }
+}
+
+/*
+ * CBC `remaining' bytes (a multiple of the block size) starting at the
+ * cursor.  When encrypting, the last ciphertext block and its location
+ * are saved in ivec2 and lastpos for the CTS swap.
+ */
+static void
+_krb5_evp_iov_cbc(EVP_CIPHER_CTX *c,
+		  struct _krb5_evp_iov_cursor *cursor,
+		  size_t remaining,
+		  size_t blocksize,
+		  krb5_boolean encryptp,
+		  struct _krb5_evp_iov_cursor *lastpos,
+		  unsigned char *ivec2)
 {
-    size_t blocksize, blockmask, wholeblocks, length;
-    size_t remaining, partiallen;
+    size_t blockmask = ~(blocksize - 1);
+    size_t wholeblocks;
+
+    while (remaining > 0) {
+	/* If the iovec has more data than we need, just use it */
+	if (cursor->current.length >= remaining) {
+	    EVP_Cipher(c, cursor->current.data, cursor->current.data,
+		       remaining);
+
+	    if (encryptp) {
+	        /* We've just encrypted the last block of data. Make a copy
+	         * of it (and its location) for the CTS dance, below */
+	        *lastpos = *cursor;
+	        _krb5_evp_iov_cursor_advance(lastpos, remaining - blocksize);
+	        memcpy(ivec2, lastpos->current.data, blocksize);
+	    }
+
+	    _krb5_evp_iov_cursor_advance(cursor, remaining);
+	    remaining = 0;
+	} else {
+	    /* Use as much as we can, firstly all of the whole blocks */
+	    wholeblocks = cursor->current.length & blockmask;
+
+	    if (wholeblocks > 0) {
+		EVP_Cipher(c, cursor->current.data, cursor->current.data,
+		           wholeblocks);
+		_krb5_evp_iov_cursor_advance(cursor, wholeblocks);
+		remaining -= wholeblocks;
+	    }
+
+	    /* Then, if we have partial data left, steal enough from subsequent
+	     * iovecs to make a whole block */
+	    if (cursor->current.length > 0 &&
+		cursor->current.length < blocksize) {
+		if (encryptp && remaining == blocksize)
+		    *lastpos = *cursor;
+
+		_krb5_evp_iov_cursor_fillbuf(cursor, ivec2, blocksize, NULL);
+		EVP_Cipher(c, ivec2, ivec2, blocksize);
+		_krb5_evp_iov_cursor_fillvec(cursor, ivec2, blocksize);
+
+		remaining -= blocksize;
+            }
+        }
+    }
+}
+
+static int
+_krb5_evp_cts_iov(krb5_context context,
+		  struct _krb5_key_data *key,
+		  struct krb5_crypto_iov *iov,
+		  int niov,
+		  krb5_boolean encryptp,
+		  int usage,
+		  void *ivec,
+		  struct _krb5_evp_iov_mac *mac)
+{
+    size_t blocksize, blockmask, length;
+    size_t remaining, partiallen, done, chunk;
     struct _krb5_evp_iov_cursor cursor, lastpos;
     struct _krb5_evp_schedule *ctx = key->schedule->data;
     unsigned char tmp[EVP_MAX_BLOCK_LENGTH], tmp2[EVP_MAX_BLOCK_LENGTH];
@@ -438,9 +558,14 @@ _krb5_evp_encrypt_iov_cts(krb5_context context,
 	return EINVAL;
     }
 
-    if (length == blocksize)
-	return _krb5_evp_encrypt_iov(context, key, iov, niov,
-	                             encryptp, usage, ivec);
+    if (length == blocksize) {
+	if (mac != NULL && mac->leading)
+	    _krb5_evp_iov_mac_advance(mac, length);
+	_krb5_evp_encrypt_iov(context, key, iov, niov, encryptp, usage, ivec);
+	if (mac != NULL)
+	    _krb5_evp_iov_mac_advance(mac, length);
+	return 0;
+    }
 
     if (ivec)
 	EVP_CipherInit_ex(c, NULL, NULL, NULL, ivec, -1);
@@ -467,47 +592,25 @@ _krb5_evp_encrypt_iov_cts(krb5_context context,
     }
 
     _krb5_evp_iov_cursor_init(&cursor, iov, niov);
-    while (remaining > 0) {
-	/* If the iovec has more data than we need, just use it */
-	if (cursor.current.length >= remaining) {
-	    EVP_Cipher(c, cursor.current.data, cursor.current.data, remaining);
-
-	    if (encryptp) {
-	        /* We've just encrypted the last block of data. Make a copy
-	         * of it (and its location) for the CTS dance, below */
-	        lastpos = cursor;
-	        _krb5_evp_iov_cursor_advance(&lastpos, remaining - blocksize);
-	        memcpy(ivec2, lastpos.current.data, blocksize);
-	    }
-
-	    _krb5_evp_iov_cursor_advance(&cursor, remaining);
-	    remaining = 0;
-	} else {
-	    /* Use as much as we can, firstly all of the whole blocks */
-	    wholeblocks = cursor.current.length & blockmask;
-
-	    if (wholeblocks > 0) {
-		EVP_Cipher(c, cursor.current.data, cursor.current.data,
-		           wholeblocks);
-		_krb5_evp_iov_cursor_advance(&cursor, wholeblocks);
-		remaining -= wholeblocks;
-	    }
-
-	    /* Then, if we have partial data left, steal enough from subsequent
-	     * iovecs to make a whole block */
-	    if (cursor.current.length > 0 && cursor.current.length < blocksize) {
-		if (encryptp && remaining == blocksize)
-		    lastpos = cursor;
-
-		_krb5_evp_iov_cursor_fillbuf(&cursor, ivec2, blocksize, NULL);
-		EVP_Cipher(c, ivec2, ivec2, blocksize);
-		_krb5_evp_iov_cursor_fillvec(&cursor, ivec2, blocksize);
-
-		remaining -= blocksize;
-            }
-        }
+    for (done = 0; done < remaining; done += chunk) {
+	chunk = remaining - done;
+	if (mac != NULL && chunk > EVP_IOV_MAC_CHUNK)
+	    chunk = EVP_IOV_MAC_CHUNK;
+	if (mac != NULL && mac->leading)
+	    _krb5_evp_iov_mac_advance(mac, done + chunk);
+	_krb5_evp_iov_cbc(c, &cursor, chunk, blocksize, encryptp,
+			  &lastpos, ivec2);
+	/* The last encrypted block moves in the CTS swap, so hold it back */
+	if (mac != NULL && !mac->leading)
+	    _krb5_evp_iov_mac_advance(mac, done + chunk -
+				      (encryptp && done + chunk == remaining ?
+				       blocksize : 0));
     }
 
+    /* The MAC has to see the rest of the input before the CTS steps */
+    if (mac != NULL && mac->leading)
+	_krb5_evp_iov_mac_advance(mac, length);
+
     /* Encryption */
     if (encryptp) {
 	/* Copy the partial block into tmp */
@@ -528,6 +631,9 @@ _krb5_evp_encrypt_iov_cts(krb5_context context,
         if (ivec)
 	    memcpy(ivec, tmp, blocksize);
 
+	if (mac != NULL)
+	    _krb5_evp_iov_mac_advance(mac, length);
+
         return 0;
     }
 
@@ -570,9 +676,87 @@ _krb5_evp_encrypt_iov_cts(krb5_context context,
     if (ivec)
 	memcpy(ivec, tmp, blocksize);
 
+    if (mac != NULL)
+	_krb5_evp_iov_mac_advance(mac, length);
+
     return 0;
 }
 
+int
+_krb5_evp_encrypt_iov_cts(krb5_context context,
+			  struct _krb5_key_data *key,
+			  struct krb5_crypto_iov *iov,
+			  int niov,
+			  krb5_boolean encryptp,
+			  int usage,
+			  void *ivec)
+{
+    return _krb5_evp_cts_iov(context, key, iov, niov, encryptp, usage, ivec,
+			     NULL);
+}
+
+/*
+ * CTS encrypt or decrypt the iovecs and compute an HMAC with `mackey'
+ * in the same pass.  The MAC covers the signed iovecs in order, over
+ * the plaintext, or over the initial ivec and the ciphertext when
+ * mac_ciphertext is set (RFC 8009).
+ */
+
+krb5_error_code
+_krb5_evp_encrypt_iov_cts_hmac(krb5_context context,
+			       krb5_crypto crypto,
+			       struct _krb5_key_data *key,
+			       struct _krb5_key_data *mackey,
+			       const EVP_MD *md,
+			       krb5_boolean mac_ciphertext,
+			       struct krb5_crypto_iov *iov,
+			       int niov,
+			       krb5_boolean encryptp,
+			       void *ivec,
+			       void *hmac,
+			       unsigned int *hmaclen)
+{
+    struct _krb5_evp_iov_mac mac;
+    size_t blocksize;
+    int ret;
+
+    if (crypto != NULL) {
+	if (crypto->hmacctx == NULL)
+	    crypto->hmacctx = HMAC_CTX_new();
+	mac.ctx = crypto->hmacctx;
+    } else {
+	mac.ctx = HMAC_CTX_new();
+    }
+    if (mac.ctx == NULL)
+	return krb5_enomem(context);
+
+    HMAC_Init_ex(mac.ctx, mackey->key->keyvalue.data,
+		 mackey->key->keyvalue.length, md, NULL);
+
+    if (mac_ciphertext) {
+	struct _krb5_evp_schedule *ctx = key->schedule->data;
+
+	blocksize = EVP_CIPHER_CTX_block_size(&ctx->ectx);
+	HMAC_Update(mac.ctx, ivec ? ivec : zero_ivec, blocksize);
+    }
+
+    mac.leading = encryptp != mac_ciphertext;
+    mac.iov = iov;
+    mac.niov = niov;
+    mac.idx = 0;
+    mac.off = 0;
+    mac.pos = 0;
+
+    ret = _krb5_evp_cts_iov(context, key, iov, niov, encryptp, 0, ivec, &mac);
+    if (ret == 0)
+	HMAC_Final(mac.ctx, hmac, hmaclen);
+
+    if (crypto == NULL)
+	HMAC_CTX_free(mac.ctx);
+
+    return ret;
+}
+
 krb5_error_code
 _krb5_evp_encrypt_cts(krb5_context context,
 		      struct _krb5_key_data *key,
@@ -99,5 +99,6 @@ struct _krb5_encryption_type _krb5_enctype_null = {
     NULL_encrypt,
     NULL,
     0,
+    NULL,
     NULL
 };
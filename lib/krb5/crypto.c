@@ -51,6 +51,12 @@ static void free_key_schedule(krb5_context,
 			      struct _krb5_key_data *,
 			      struct _krb5_encryption_type *);
 
+static krb5_boolean iov_encrypt_mac_p(const struct _krb5_encryption_type *,
+				      krb5_crypto_iov *, int);
+static krb5_error_code iov_encrypt_mac(krb5_context, krb5_crypto, unsigned,
+				       krb5_crypto_iov *, int, krb5_boolean,
+				       krb5_crypto_iov *, void *);
+
 /* 
  * Converts etype to a user readable string and sets as a side effect
  * the krb5_error_message containing this string. Returns
@@ -909,6 +915,28 @@ derived_crypto(krb5_context context,
 #define CHECKSUMSIZE(C) ((C)->checksumsize)
 #define CHECKSUMTYPE(C) ((C)->type)
 
+/*
+ * Describe a contiguous confounder | data | checksum message as
+ * iovecs, so that it can take the one-pass encrypt_mac_iov path.
+ */
+static void
+iov_contiguous(krb5_crypto_iov iov[3],
+	       const struct _krb5_encryption_type *et,
+	       unsigned char *p,
+	       size_t block_sz,
+	       size_t checksum_sz)
+{
+    iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+    iov[0].data.data = p;
+    iov[0].data.length = et->confoundersize;
+    iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+    iov[1].data.data = p + et->confoundersize;
+    iov[1].data.length = block_sz - et->confoundersize;
+    iov[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+    iov[2].data.data = p + block_sz;
+    iov[2].data.length = checksum_sz;
+}
+
 static krb5_error_code
 encrypt_internal_derived(krb5_context context,
 			 krb5_crypto crypto,
@@ -924,6 +952,7 @@ encrypt_internal_derived(krb5_context context,
     krb5_error_code ret;
     struct _krb5_key_data *dkey;
     const struct _krb5_encryption_type *et = crypto->et;
+    krb5_crypto_iov iov[3];
 
     checksum_sz = CHECKSUMSIZE(et->keyed_checksum);
 
@@ -939,6 +968,17 @@ encrypt_internal_derived(krb5_context context,
     q += et->confoundersize;
     memcpy(q, data, len);
 
+    iov_contiguous(iov, et, p, block_sz, checksum_sz);
+    if (iov_encrypt_mac_p(et, iov, 3)) {
+	ret = iov_encrypt_mac(context, crypto, usage, iov, 3, TRUE,
+			      &iov[2], ivec);
+	if (ret)
+	    goto fail;
+	result->data = p;
+	result->length = total_sz;
+	return 0;
+    }
+
     ret = create_checksum(context,
 			  et->keyed_checksum,
 			  crypto,
@@ -988,6 +1028,7 @@ encrypt_internal_enc_then_cksum(krb5_context context,
     krb5_error_code ret;
     struct _krb5_key_data *dkey;
     const struct _krb5_encryption_type *et = crypto->et;
+    krb5_crypto_iov iov[3];
 
     checksum_sz = CHECKSUMSIZE(et->keyed_checksum);
 
@@ -1003,6 +1044,17 @@ encrypt_internal_enc_then_cksum(krb5_context context,
     q += et->confoundersize;
     memcpy(q, data, len);
 
+    iov_contiguous(iov, et, p, block_sz, checksum_sz);
+    if (iov_encrypt_mac_p(et, iov, 3)) {
+	ret = iov_encrypt_mac(context, crypto, usage, iov, 3, TRUE,
+			      &iov[2], ivec);
+	if (ret)
+	    goto fail;
+	result->data = p;
+	result->length = total_sz;
+	return 0;
+    }
+
     ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
     if(ret)
 	goto fail;
@@ -1167,6 +1219,7 @@ decrypt_internal_derived(krb5_context context,
     struct _krb5_key_data *dkey;
     struct _krb5_encryption_type *et = crypto->et;
     unsigned long l;
+    krb5_crypto_iov iov[3];
 
     checksum_sz = CHECKSUMSIZE(et->keyed_checksum);
     if (len < checksum_sz + et->confoundersize) {
@@ -1188,6 +1241,17 @@ decrypt_internal_derived(krb5_context context,
 
     len -= checksum_sz;
 
+    iov_contiguous(iov, et, p, len, checksum_sz);
+    if (iov_encrypt_mac_p(et, iov, 3)) {
+	ret = iov_encrypt_mac(context, crypto, usage, iov, 3, FALSE,
+			      &iov[2], ivec);
+	if (ret) {
+	    free(p);
+	    return ret;
+	}
+	goto strip;
+    }
+
     ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
     if(ret) {
 	free(p);
@@ -1218,6 +1282,7 @@ decrypt_internal_derived(krb5_context context,
 	free(p);
 	return ret;
     }
+ strip:
     l = len - et->confoundersize;
     memmove(p, p + et->confoundersize, l);
     result->data = realloc(p, l);
@@ -1245,6 +1310,7 @@ decrypt_internal_enc_then_cksum(krb5_context context,
     struct _krb5_key_data *dkey;
     struct _krb5_encryption_type *et = crypto->et;
     unsigned long l;
+    krb5_crypto_iov iov[3];
 
     checksum_sz = CHECKSUMSIZE(et->keyed_checksum);
     if (len < checksum_sz + et->confoundersize) {
@@ -1271,6 +1337,18 @@ decrypt_internal_enc_then_cksum(krb5_context context,
 	memset(p, 0, et->blocksize);
     memcpy(&p[et->blocksize], data, len);
 
+    iov_contiguous(iov, et, &p[et->blocksize], len, checksum_sz);
+    iov[2].data.data = (unsigned char *)data + len;
+    if (iov_encrypt_mac_p(et, iov, 3)) {
+	ret = iov_encrypt_mac(context, crypto, usage, iov, 3, FALSE,
+			      &iov[2], ivec);
+	if (ret) {
+	    free(p);
+	    return ret;
+	}
+	goto strip;
+    }
+
     cksum.checksum.data   = (unsigned char *)data + len;
     cksum.checksum.length = checksum_sz;
     cksum.cksumtype       = CHECKSUMTYPE(et->keyed_checksum);
@@ -1302,6 +1380,7 @@ decrypt_internal_enc_then_cksum(krb5_context context,
 	return ret;
     }
 
+ strip:
     l = len - et->confoundersize;
     memmove(p, p + et->blocksize + et->confoundersize, l);
     result->data = realloc(p, l);
@@ -1584,6 +1663,114 @@ iov_pad_validate(const struct _krb5_encryption_type *et,
     return 0;
 }
 
+/*
+ * The one-pass encrypt_mac_iov hook walks the buffers in order.  For
+ * the encrypt-then-checksum enctypes that only matches iov_coalesce()
+ * when the buffers are laid out as documented below: the header ahead
+ * of all data and sign-only buffers and the padding behind them.
+ * Single block messages are left to the general code too.
+ */
+static krb5_boolean
+iov_encrypt_mac_p(const struct _krb5_encryption_type *et,
+		  krb5_crypto_iov *data,
+		  int num_data)
+{
+    int i, header = 0, body = 0, padding = 0;
+
+    if (et->encrypt_mac_iov == NULL)
+	return FALSE;
+    if (et->confoundersize + iov_enc_data_len(data, num_data) <= et->blocksize)
+	return FALSE;
+    if ((et->flags & F_ENC_THEN_CKSUM) == 0)
+	return TRUE;
+
+    for (i = 0; i < num_data; i++) {
+	switch (data[i].flags) {
+	case KRB5_CRYPTO_TYPE_HEADER:
+	    if (header++ || body || padding)
+		return FALSE;
+	    break;
+	case KRB5_CRYPTO_TYPE_DATA:
+	case KRB5_CRYPTO_TYPE_SIGN_ONLY:
+	    if (!header || padding)
+		return FALSE;
+	    body = 1;
+	    break;
+	case KRB5_CRYPTO_TYPE_PADDING:
+	    if (padding++)
+		return FALSE;
+	    break;
+	}
+    }
+    return TRUE;
+}
+
+/*
+ * Encrypt and checksum, or decrypt and verify, in a single pass over
+ * the buffers.  The checksum goes to or is compared with `tiv'.  On a
+ * failed verification the decrypted buffers are cleared.
+ */
+static krb5_error_code
+iov_encrypt_mac(krb5_context context,
+		krb5_crypto crypto,
+		unsigned usage,
+		krb5_crypto_iov *data,
+		int num_data,
+		krb5_boolean encryptp,
+		krb5_crypto_iov *tiv,
+		void *ivec)
+{
+    const struct _krb5_encryption_type *et = crypto->et;
+    struct _krb5_key_data *dkey, *ikey;
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int maclen = sizeof(mac);
+    krb5_error_code ret;
+    int i;
+
+    /*
+     * _get_derived_key() may realloc the derived key space, so look
+     * the integrity key up again once the encryption key exists.
+     */
+    ret = _get_derived_key(context, crypto, INTEGRITY_USAGE(usage), &ikey);
+    if (ret == 0)
+	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+    if (ret == 0)
+	ret = _get_derived_key(context, crypto, INTEGRITY_USAGE(usage), &ikey);
+    if (ret == 0)
+	ret = _key_schedule(context, dkey);
+    if (ret)
+	return ret;
+
+    ret = (*et->encrypt_mac_iov)(context, crypto, dkey, ikey, data, num_data,
+				 encryptp, ivec, mac, &maclen);
+    if (ret == 0 && maclen < tiv->data.length) {
+	krb5_clear_error_message(context);
+	ret = KRB5_CRYPTO_INTERNAL;
+    }
+    if (ret == 0) {
+	if (encryptp) {
+	    memcpy(tiv->data.data, mac, tiv->data.length);
+	} else if (ct_memcmp(mac, tiv->data.data, tiv->data.length) != 0) {
+	    ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+	    krb5_set_error_message(context, ret,
+				   N_("Decrypt integrity check failed for checksum "
+				      "type %s, key type %s", ""),
+				   et->keyed_checksum->name, et->name);
+	}
+    }
+    if (ret && !encryptp) {
+	for (i = 0; i < num_data; i++) {
+	    if (data[i].flags == KRB5_CRYPTO_TYPE_HEADER ||
+		data[i].flags == KRB5_CRYPTO_TYPE_DATA ||
+		data[i].flags == KRB5_CRYPTO_TYPE_PADDING)
+		memset_s(data[i].data.data, data[i].data.length, 0,
+			 data[i].data.length);
+	}
+    }
+    memset_s(mac, sizeof(mac), 0, sizeof(mac));
+    return ret;
+}
+
 /**
  * Inline encrypt a kerberos message
  *
@@ -1658,6 +1845,12 @@ krb5_encrypt_iov_ivec(krb5_context context,
 	goto cleanup;
     }
 
+    if (iov_encrypt_mac_p(et, data, num_data)) {
+	ret = iov_encrypt_mac(context, crypto, usage, data, num_data, TRUE,
+			      tiv, ivec);
+	goto cleanup;
+    }
+
     if (et->flags & F_ENC_THEN_CKSUM) {
 	unsigned char old_ivec[EVP_MAX_IV_LENGTH];
 	krb5_data ivec_data;
@@ -1837,6 +2030,10 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	return KRB5_BAD_MSIZE;
     }
 
+    if (iov_encrypt_mac_p(et, data, num_data))
+	return iov_encrypt_mac(context, crypto, usage, data, num_data, FALSE,
+			       tiv, ivec);
+
     krb5_data_zero(&enc_data);
     krb5_data_zero(&sign_data);
 
@@ -2535,9 +2732,209 @@ krb5_crypto_init(krb5_context context,
     (*crypto)->key.schedule = NULL;
     (*crypto)->num_key_usage = 0;
     (*crypto)->key_usage = NULL;
+    (*crypto)->refcount = 1;
+    return 0;
+}
+
+/*
+ * Per-context cache of crypto contexts for long-lived keys (service
+ * and krbtgt keys), so that the key schedule and the derived keys
+ * for each usage are computed once rather than on every request.
+ * Entries are kept in most-recently-used order.
+ */
+
+struct _krb5_crypto_cache_entry {
+    struct _krb5_crypto_cache_entry *prev, *next;
+    uint32_t hash;
+    krb5_enctype etype;
+    krb5_crypto crypto;
+};
+
+struct _krb5_crypto_cache {
+    struct _krb5_crypto_cache_entry *head, *tail;
+    int nentries;
+};
+
+static uint32_t
+crypto_cache_hash(krb5_enctype etype, const krb5_keyblock *key)
+{
+    const unsigned char *p = key->keyvalue.data;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    h = (h ^ (uint32_t)etype) * 16777619U;
+    for (i = 0; i < key->keyvalue.length; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static void
+crypto_cache_unlink(struct _krb5_crypto_cache *cache,
+		    struct _krb5_crypto_cache_entry *e)
+{
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	cache->head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	cache->tail = e->prev;
+    e->prev = e->next = NULL;
+    cache->nentries--;
+}
+
+static void
+crypto_cache_push(struct _krb5_crypto_cache *cache,
+		  struct _krb5_crypto_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+	cache->head->prev = e;
+    else
+	cache->tail = e;
+    cache->head = e;
+    cache->nentries++;
+}
+
+/*
+ * Drop the cache's reference; the key material is zeroized once the
+ * last borrower calls krb5_crypto_destroy().
+ */
+
+static void
+crypto_cache_evict(krb5_context context,
+		   struct _krb5_crypto_cache *cache,
+		   struct _krb5_crypto_cache_entry *e)
+{
+    crypto_cache_unlink(cache, e);
+    krb5_crypto_destroy(context, e->crypto);
+    memset_s(e, sizeof(*e), 0, sizeof(*e));
+    free(e);
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_crypto_cache_free(krb5_context context)
+{
+    struct _krb5_crypto_cache *cache = context->crypto_cache;
+
+    if (cache == NULL)
+	return;
+    while (cache->head)
+	crypto_cache_evict(context, cache, cache->head);
+    free(cache);
+    context->crypto_cache = NULL;
+}
+
+/**
+ * Like krb5_crypto_init(), but the crypto context may be shared with
+ * other callers that use the same key and encryption type on this
+ * Kerberos context, so that the key schedule and derived keys are
+ * only computed once.  Meant for long-lived keys such as service
+ * and krbtgt keys.  The size of the cache is set by
+ * [libdefaults] crypto_cache_size; 0 disables it.
+ *
+ * The returned crypto context must be freed with
+ * krb5_crypto_destroy() and, like the Kerberos context, must not be
+ * used by more than one thread at a time.
+ *
+ * @param context Kerberos context
+ * @param key the key block information with all key data
+ * @param etype the encryption type
+ * @param crypto the resulting crypto context
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_init_cached(krb5_context context,
+			const krb5_keyblock *key,
+			krb5_enctype etype,
+			krb5_crypto *crypto)
+{
+    struct _krb5_crypto_cache *cache = context->crypto_cache;
+    struct _krb5_crypto_cache_entry *e;
+    krb5_error_code ret;
+    uint32_t hash;
+
+    if (context->crypto_cache_size <= 0)
+	return krb5_crypto_init(context, key, etype, crypto);
+
+    if (etype == (krb5_enctype)ETYPE_NULL)
+	etype = key->keytype;
+    hash = crypto_cache_hash(etype, key);
+
+    for (e = cache ? cache->head : NULL; e != NULL; e = e->next) {
+	krb5_keyblock *k = e->crypto->key.key;
+
+	if (e->hash != hash || e->etype != etype ||
+	    k->keytype != key->keytype ||
+	    k->keyvalue.length != key->keyvalue.length ||
+	    ct_memcmp(k->keyvalue.data, key->keyvalue.data,
+		      key->keyvalue.length) != 0)
+	    continue;
+	if (e != cache->head) {
+	    crypto_cache_unlink(cache, e);
+	    crypto_cache_push(cache, e);
+	}
+	e->crypto->refcount++;
+	*crypto = e->crypto;
+	return 0;
+    }
+
+    ret = krb5_crypto_init(context, key, etype, crypto);
+    if (ret)
+	return ret;
+
+    /* Failing to cache is not an error, the caller just gets its own */
+    if (cache == NULL) {
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+	    return 0;
+	context->crypto_cache = cache;
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+	return 0;
+    e->hash = hash;
+    e->etype = etype;
+    e->crypto = *crypto;
+    e->crypto->refcount++;
+    crypto_cache_push(cache, e);
+    while (cache->nentries > context->crypto_cache_size)
+	crypto_cache_evict(context, cache, cache->tail);
     return 0;
 }
 
+/**
+ * Set the number of crypto contexts krb5_crypto_init_cached() keeps
+ * on a Kerberos context, overriding [libdefaults] crypto_cache_size.
+ * Cached contexts beyond the new size are released; 0 disables the
+ * cache.
+ *
+ * @param context Kerberos context
+ * @param size number of crypto contexts to cache
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+krb5_set_crypto_cache_size(krb5_context context, int size)
+{
+    struct _krb5_crypto_cache *cache = context->crypto_cache;
+
+    context->crypto_cache_size = size < 0 ? 0 : size;
+    if (context->crypto_cache_size == 0) {
+	_krb5_crypto_cache_free(context);
+	return;
+    }
+    while (cache && cache->nentries > context->crypto_cache_size)
+	crypto_cache_evict(context, cache, cache->tail);
+}
+
 static void
 free_key_schedule(krb5_context context,
 		  struct _krb5_key_data *key,
@@ -2584,6 +2981,11 @@ krb5_crypto_destroy(krb5_context context,
 {
     int i;
 
+    if (crypto->refcount > 1) {
+	crypto->refcount--;
+	return 0;
+    }
+
     for(i = 0; i < crypto->num_key_usage; i++)
 	free_key_usage(context, &crypto->key_usage[i], crypto->et);
     free(crypto->key_usage);
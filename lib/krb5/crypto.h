@@ -129,6 +129,15 @@ struct _krb5_encryption_type {
     size_t prf_length;
     krb5_error_code (*prf)(krb5_context,
 			   krb5_crypto, const krb5_data *, krb5_data *);
+    /* encrypt_iov and keyed checksum in one pass, optional */
+    krb5_error_code (*encrypt_mac_iov)(krb5_context context,
+				       krb5_crypto crypto,
+				       struct _krb5_key_data *key,
+				       struct _krb5_key_data *mackey,
+				       krb5_crypto_iov *iov, int niov,
+				       krb5_boolean encryptp,
+				       void *ivec,
+				       void *mac, unsigned int *maclen);
 };
 
 #define ENCRYPTION_USAGE(U) (((U) << 8) | 0xAA)
@@ -216,6 +225,7 @@ struct krb5_crypto_data {
     HMAC_CTX *hmacctx;
     int num_key_usage;
     struct _krb5_key_usage *key_usage;
+    unsigned int refcount;	/* > 1 when shared via the crypto cache */
 };
 
 #endif
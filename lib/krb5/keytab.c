@@ -605,21 +605,24 @@ _krb5_kt_principal_not_found(krb5_context context,
     return ret;
 }
 
-static krb5_error_code
-krb5_kt_get_entry_wrapped(krb5_context context,
-			  krb5_keytab id,
-			  krb5_const_principal principal,
-			  krb5_kvno kvno,
-			  krb5_enctype enctype,
-			  krb5_keytab_entry *entry)
+/*
+ * Find an entry by walking the whole keytab; used for keytab types
+ * without a get method of their own, and by those that fall back to
+ * it.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_kt_get_entry_seq(krb5_context context,
+		       krb5_keytab id,
+		       krb5_const_principal principal,
+		       krb5_kvno kvno,
+		       krb5_enctype enctype,
+		       krb5_keytab_entry *entry)
 {
     krb5_keytab_entry tmp;
     krb5_error_code ret;
     krb5_kt_cursor cursor;
 
-    if(id->get)
-	return (*id->get)(context, id, principal, kvno, enctype, entry);
-
     ret = krb5_kt_start_seq_get (context, id, &cursor);
     if (ret) {
 	/* This is needed for krb5_verify_init_creds, but keep error
@@ -654,6 +657,20 @@ krb5_kt_get_entry_wrapped(krb5_context context,
     return 0;
 }
 
+static krb5_error_code
+krb5_kt_get_entry_wrapped(krb5_context context,
+			  krb5_keytab id,
+			  krb5_const_principal principal,
+			  krb5_kvno kvno,
+			  krb5_enctype enctype,
+			  krb5_keytab_entry *entry)
+{
+    if(id->get)
+	return (*id->get)(context, id, principal, kvno, enctype, entry);
+    return _krb5_kt_get_entry_seq(context, id, principal, kvno, enctype,
+				  entry);
+}
+
 /**
  * Retrieve the keytab entry for `principal, kvno, enctype' into `entry'
  * from the keytab `id'. Matching is done like krb5_kt_compare().
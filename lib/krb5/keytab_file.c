@@ -806,13 +806,324 @@ fkt_remove_entry(krb5_context context,
     return ret;
 }
 
+/*
+ * In-memory index of a keytab file, so that krb5_kt_get_entry() does
+ * not have to parse every record on every call.  Indexes are kept on
+ * the krb5_context, one per file, and hold the principal, kvno and
+ * enctype of each record with its offset, but no key material: the
+ * chosen record is re-read from the file.  An index is rebuilt when
+ * the file's identity, size or modification time changes.
+ */
+
+struct fkt_index_rec {
+    krb5_principal principal;
+    krb5_kvno vno;
+    krb5_enctype enctype;
+    off_t offset;
+    uint32_t hash;
+    size_t next;			/* next record in the same bucket */
+};
+
+#define FKT_INDEX_END ((size_t)-1)
+
+struct _krb5_fkt_index {
+    struct _krb5_fkt_index *next;
+    char *filename;
+    int flags;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    struct fkt_index_rec *recs;
+    size_t nrecs;
+    size_t *buckets;
+    size_t nbuckets;
+};
+
+/* Realm is left out as the referral realm matches any realm */
+static uint32_t
+fkt_index_hash(krb5_const_principal p)
+{
+    uint32_t h = 2166136261U;
+    const unsigned char *c;
+    size_t i;
+
+    for (i = 0; i < p->name.name_string.len; i++) {
+	for (c = (const unsigned char *)p->name.name_string.val[i]; *c; c++)
+	    h = (h ^ *c) * 16777619U;
+	h = (h ^ '/') * 16777619U;
+    }
+    return h;
+}
+
+static void
+fkt_index_stamp(const struct stat *sb, struct _krb5_fkt_index *ix)
+{
+    ix->dev = sb->st_dev;
+    ix->ino = sb->st_ino;
+    ix->size = sb->st_size;
+    ix->mtime = sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    ix->mtime_nsec = sb->st_mtim.tv_nsec;
+#else
+    ix->mtime_nsec = 0;
+#endif
+}
+
+static int
+fkt_index_current(const struct stat *sb, const struct _krb5_fkt_index *ix)
+{
+    struct _krb5_fkt_index now;
+
+    fkt_index_stamp(sb, &now);
+    return now.dev == ix->dev && now.ino == ix->ino &&
+	now.size == ix->size && now.mtime == ix->mtime &&
+	now.mtime_nsec == ix->mtime_nsec;
+}
+
+static void
+fkt_index_free(krb5_context context, struct _krb5_fkt_index *ix)
+{
+    size_t i;
+
+    for (i = 0; i < ix->nrecs; i++)
+	krb5_free_principal(context, ix->recs[i].principal);
+    free(ix->recs);
+    free(ix->buckets);
+    free(ix->filename);
+    free(ix);
+}
+
+static void
+fkt_index_drop(krb5_context context, struct _krb5_fkt_index *ix)
+{
+    struct _krb5_fkt_index **p;
+
+    for (p = &context->fkt_index; *p != NULL; p = &(*p)->next) {
+	if (*p == ix) {
+	    *p = ix->next;
+	    fkt_index_free(context, ix);
+	    return;
+	}
+    }
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_fkt_index_free(krb5_context context)
+{
+    while (context->fkt_index)
+	fkt_index_drop(context, context->fkt_index);
+}
+
+static krb5_error_code
+fkt_index_build(krb5_context context,
+		krb5_keytab id,
+		struct _krb5_fkt_index **out)
+{
+    struct fkt_data *d = id->data;
+    struct _krb5_fkt_index *ix;
+    struct fkt_index_rec *r;
+    krb5_keytab_entry entry;
+    krb5_kt_cursor cursor;
+    krb5_error_code ret;
+    struct stat sb;
+    size_t alloced = 0, i, b;
+    off_t start;
+
+    *out = NULL;
+
+    ix = calloc(1, sizeof(*ix));
+    if (ix == NULL)
+	return krb5_enomem(context);
+    ix->filename = strdup(d->filename);
+    if (ix->filename == NULL) {
+	free(ix);
+	return krb5_enomem(context);
+    }
+    ix->flags = d->flags;
+
+    ret = fkt_start_seq_get_int(context, id, O_RDONLY | O_BINARY | O_CLOEXEC,
+				0, &cursor);
+    if (ret) {
+	fkt_index_free(context, ix);
+	return ret;
+    }
+    if (fstat(cursor.fd, &sb) < 0) {
+	ret = errno;
+	goto out;
+    }
+    fkt_index_stamp(&sb, ix);
+
+    while ((ret = fkt_next_entry_int(context, id, &entry, &cursor,
+				     &start, NULL)) == 0) {
+	if (ix->nrecs == alloced) {
+	    size_t n = alloced ? alloced * 2 : 16;
+
+	    r = realloc(ix->recs, n * sizeof(ix->recs[0]));
+	    if (r == NULL) {
+		krb5_kt_free_entry(context, &entry);
+		ret = krb5_enomem(context);
+		goto out;
+	    }
+	    ix->recs = r;
+	    alloced = n;
+	}
+	r = &ix->recs[ix->nrecs++];
+	r->principal = entry.principal;
+	r->vno = entry.vno;
+	r->enctype = entry.keyblock.keytype;
+	r->offset = start;
+	r->hash = fkt_index_hash(entry.principal);
+	entry.principal = NULL;
+	krb5_kt_free_entry(context, &entry);
+    }
+    if (ret != KRB5_KT_END)
+	goto out;
+
+    for (ix->nbuckets = 16; ix->nbuckets < ix->nrecs; ix->nbuckets *= 2)
+	;
+    ix->buckets = malloc(ix->nbuckets * sizeof(ix->buckets[0]));
+    if (ix->buckets == NULL) {
+	ret = krb5_enomem(context);
+	goto out;
+    }
+    for (b = 0; b < ix->nbuckets; b++)
+	ix->buckets[b] = FKT_INDEX_END;
+    /* Chain backwards so that each bucket is walked in file order */
+    for (i = ix->nrecs; i > 0; i--) {
+	b = ix->recs[i - 1].hash & (ix->nbuckets - 1);
+	ix->recs[i - 1].next = ix->buckets[b];
+	ix->buckets[b] = i - 1;
+    }
+    ret = 0;
+
+ out:
+    fkt_end_seq_get(context, id, &cursor);
+    if (ret) {
+	fkt_index_free(context, ix);
+	return ret;
+    }
+    *out = ix;
+    return 0;
+}
+
+/*
+ * Read the record at `offset', checking that it is still the one the
+ * index describes.
+ */
+
+static krb5_error_code
+fkt_index_read(krb5_context context,
+	       krb5_keytab id,
+	       const struct fkt_index_rec *r,
+	       krb5_keytab_entry *entry)
+{
+    krb5_kt_cursor cursor;
+    krb5_error_code ret;
+    off_t start;
+
+    ret = fkt_start_seq_get_int(context, id, O_RDONLY | O_BINARY | O_CLOEXEC,
+				0, &cursor);
+    if (ret)
+	return ret;
+    if (krb5_storage_seek(cursor.sp, r->offset, SEEK_SET) != r->offset) {
+	fkt_end_seq_get(context, id, &cursor);
+	return KRB5_KT_END;
+    }
+    ret = fkt_next_entry_int(context, id, entry, &cursor, &start, NULL);
+    fkt_end_seq_get(context, id, &cursor);
+    if (ret)
+	return ret;
+    if (start != r->offset || entry->vno != r->vno ||
+	entry->keyblock.keytype != r->enctype ||
+	!krb5_principal_compare(context, entry->principal, r->principal)) {
+	krb5_kt_free_entry(context, entry);
+	return KRB5_KT_END;
+    }
+    return 0;
+}
+
+static krb5_error_code KRB5_CALLCONV
+fkt_get_entry(krb5_context context,
+	      krb5_keytab id,
+	      krb5_const_principal principal,
+	      krb5_kvno kvno,
+	      krb5_enctype enctype,
+	      krb5_keytab_entry *entry)
+{
+    struct fkt_data *d = id->data;
+    struct _krb5_fkt_index *ix;
+    const struct fkt_index_rec *r, *found = NULL;
+    krb5_keytab_entry tmp;
+    krb5_kvno best = 0;
+    krb5_error_code ret;
+    struct stat sb;
+    uint32_t hash;
+    size_t i;
+
+    if (!(context->flags & KRB5_CTX_F_KEYTAB_INDEX) || principal == NULL ||
+	stat(d->filename, &sb) < 0)
+	return _krb5_kt_get_entry_seq(context, id, principal, kvno, enctype,
+				      entry);
+
+    for (ix = context->fkt_index; ix != NULL; ix = ix->next)
+	if (ix->flags == d->flags && strcmp(ix->filename, d->filename) == 0)
+	    break;
+    if (ix != NULL && !fkt_index_current(&sb, ix)) {
+	fkt_index_drop(context, ix);
+	ix = NULL;
+    }
+    if (ix == NULL) {
+	if (fkt_index_build(context, id, &ix) != 0)
+	    return _krb5_kt_get_entry_seq(context, id, principal, kvno,
+					  enctype, entry);
+	ix->next = context->fkt_index;
+	context->fkt_index = ix;
+    }
+
+    /* Same selection rules as _krb5_kt_get_entry_seq() */
+    memset(&tmp, 0, sizeof(tmp));
+    hash = fkt_index_hash(principal);
+    for (i = ix->buckets[hash & (ix->nbuckets - 1)]; i != FKT_INDEX_END;
+	 i = r->next) {
+	r = &ix->recs[i];
+	if (r->hash != hash)
+	    continue;
+	tmp.principal = r->principal;
+	tmp.vno = r->vno;
+	tmp.keyblock.keytype = r->enctype;
+	if (!krb5_kt_compare(context, &tmp, principal, 0, enctype))
+	    continue;
+	if (kvno == r->vno || (r->vno < 256 && kvno % 256 == r->vno)) {
+	    found = r;
+	    break;
+	} else if (kvno == 0 && r->vno > best) {
+	    found = r;
+	    best = r->vno;
+	}
+    }
+    if (found == NULL)
+	return _krb5_kt_principal_not_found(context, KRB5_KT_NOTFOUND,
+					    id, principal, enctype, kvno);
+
+    ret = fkt_index_read(context, id, found, entry);
+    if (ret) {
+	/* Changed under us without the stamp showing it */
+	fkt_index_drop(context, ix);
+	return _krb5_kt_get_entry_seq(context, id, principal, kvno, enctype,
+				      entry);
+    }
+    return 0;
+}
+
 const krb5_kt_ops krb5_fkt_ops = {
     "FILE",
     fkt_resolve,
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get_entry,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
@@ -828,7 +1139,7 @@ const krb5_kt_ops krb5_wrfkt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get_entry,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
@@ -844,7 +1155,7 @@ const krb5_kt_ops krb5_javakt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get_entry,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
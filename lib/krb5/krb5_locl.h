@@ -284,6 +284,7 @@ typedef struct krb5_context_data {
 #define KRB5_CTX_F_RD_REQ_IGNORE		16
 #define KRB5_CTX_F_FCACHE_STRICT_CHECKING	32
 #define KRB5_CTX_F_ENFORCE_OK_AS_DELEGATE	64
+#define KRB5_CTX_F_KEYTAB_INDEX			128
     struct send_to_kdc *send_to_kdc;
 #ifdef PKINIT
     hx509_context hx509ctx;
@@ -292,6 +293,9 @@ typedef struct krb5_context_data {
     krb5_name_canon_rule name_canon_rules;
     size_t config_include_depth;
     krb5_boolean no_ticket_store;       /* Don't store service tickets */
+    int crypto_cache_size;		/* # of cached krb5_crypto contexts */
+    struct _krb5_crypto_cache *crypto_cache;
+    struct _krb5_fkt_index *fkt_index;	/* FILE keytab indexes */
 } krb5_context_data;
 
 #define KRB5_DEFAULT_CCNAME_FILE "FILE:%{TEMP}/krb5cc_%{uid}"
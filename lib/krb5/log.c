@@ -89,6 +89,18 @@ krb5_closelog(krb5_context context,
     return 0;
 }
 
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+krb5_log_flush(krb5_context context, krb5_log_facility *fac)
+{
+    heim_log_flush(fac);
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+krb5_log_reopen(void)
+{
+    heim_log_reopen();
+}
+
 #undef __attribute__
 #define __attribute__(X)
 
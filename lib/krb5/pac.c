@@ -511,7 +511,7 @@ verify_checksum(krb5_context context,
    } else {
 	krb5_crypto crypto = NULL;
 
-	ret = krb5_crypto_init(context, key, 0, &crypto);
+	ret = krb5_crypto_init_cached(context, key, 0, &crypto);
 	if (ret)
 		goto out;
 
@@ -558,7 +558,7 @@ create_checksum(krb5_context context,
         if (ret)
             return ret;
     } else {
-	ret = krb5_crypto_init(context, key, 0, &crypto);
+	ret = krb5_crypto_init_cached(context, key, 0, &crypto);
 	if (ret)
 	    return ret;
 
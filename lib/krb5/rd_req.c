@@ -45,7 +45,7 @@ decrypt_tkt_enc_part (krb5_context context,
     size_t len;
     krb5_crypto crypto;
 
-    ret = krb5_crypto_init(context, key, 0, &crypto);
+    ret = krb5_crypto_init_cached(context, key, 0, &crypto);
     if (ret)
 	return ret;
     ret = krb5_decrypt_EncryptedData (context,
@@ -34,8 +34,43 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+/*
+ * Two replay cache types are supported:
+ *
+ * FILE: a flat file of (timestamp, digest) records that is scanned
+ * linearly on every store.
+ *
+ * SHM: a file mapped shared into every process using it, laid out as
+ * a ring of time buckets, each an open-addressing hash table of
+ * digests.  Stores are O(1) and expiry is done a whole bucket at a
+ * time, when the bucket is reused for a later time slot.
+ */
+
+#define RC_TYPE_FILE	0
+#define RC_TYPE_SHM	1
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(NO_MMAP)
+#define RC_HAVE_SHM 1
+#endif
+
+struct rc_shm_header;
+
 struct krb5_rcache_data {
     char *name;
+    int type;
+    int fd;
+    struct rc_shm_header *shm;
+    size_t shmlen;
+};
+
+static const struct {
+    const char *prefix;
+    int type;
+} rc_types[] = {
+    { "FILE", RC_TYPE_FILE },
+#ifdef RC_HAVE_SHM
+    { "SHM", RC_TYPE_SHM },
+#endif
 };
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -57,8 +92,13 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    size_t i;
+
     *id = NULL;
-    if(strcmp(type, "FILE")) {
+    for (i = 0; i < sizeof(rc_types) / sizeof(rc_types[0]); i++)
+	if (strcmp(type, rc_types[i].prefix) == 0)
+	    break;
+    if (i == sizeof(rc_types) / sizeof(rc_types[0])) {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +110,8 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->type = rc_types[i].type;
+    (*id)->fd = -1;
     return 0;
 }
 
@@ -79,19 +121,29 @@ krb5_rc_resolve_full(krb5_context context,
 		     const char *string_name)
 {
     krb5_error_code ret;
+    const char *residual;
+    char *type;
 
     *id = NULL;
 
-    if(strncmp(string_name, "FILE:", 5)) {
+    residual = strchr(string_name, ':');
+    if (residual == NULL) {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
+    type = strndup(string_name, residual - string_name);
+    if (type == NULL) {
+	krb5_set_error_message(context, KRB5_RC_MALLOC,
+			       N_("malloc: out of memory", ""));
+	return KRB5_RC_MALLOC;
+    }
+    ret = krb5_rc_resolve_type(context, id, type);
+    free(type);
     if(ret)
 	return ret;
-    ret = krb5_rc_resolve(context, *id, string_name + 5);
+    ret = krb5_rc_resolve(context, *id, residual + 1);
     if (ret) {
 	krb5_rc_close(context, *id);
 	*id = NULL;
@@ -123,15 +175,243 @@ struct rc_entry{
     unsigned char data[16];
 };
 
+#ifdef RC_HAVE_SHM
+
+#define RC_SHM_MAGIC	0x52435348	/* "RCSH" */
+#define RC_SHM_VERSION	1
+#define RC_SHM_NBUCKETS	16
+#define RC_SHM_NSLOTS	65536		/* per bucket, a power of two */
+
+struct rc_shm_slot {
+    int64_t stamp;			/* 0 for an empty slot */
+    unsigned char data[16];
+};
+
+struct rc_shm_bucket {
+    int64_t epoch;			/* time slot, stamp / width */
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct rc_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    int64_t lifespan;
+    int64_t width;			/* seconds covered by a bucket */
+    uint32_t nbuckets;
+    uint32_t nslots;
+    struct rc_shm_bucket buckets[RC_SHM_NBUCKETS];
+};
+
+static HEIMDAL_MUTEX rc_shm_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+#define RC_SHM_SIZE \
+    (sizeof(struct rc_shm_header) + \
+     (size_t)RC_SHM_NBUCKETS * RC_SHM_NSLOTS * sizeof(struct rc_shm_slot))
+
+static struct rc_shm_slot *
+rc_shm_slots(struct rc_shm_header *h, unsigned bucket)
+{
+    return (struct rc_shm_slot *)(h + 1) + (size_t)bucket * h->nslots;
+}
+
+/*
+ * Reset the table.  A bucket spans enough time that an entry has
+ * always outlived the lifespan by the time its bucket comes around
+ * the ring again.
+ */
+
+static void
+rc_shm_reset(struct rc_shm_header *h, krb5_deltat lifespan)
+{
+    memset(h, 0, RC_SHM_SIZE);
+    h->magic = RC_SHM_MAGIC;
+    h->version = RC_SHM_VERSION;
+    h->lifespan = lifespan;
+    h->width = lifespan / (RC_SHM_NBUCKETS - 2) + 1;
+    h->nbuckets = RC_SHM_NBUCKETS;
+    h->nslots = RC_SHM_NSLOTS;
+}
+
+static krb5_error_code
+rc_shm_error(krb5_context context, krb5_rcache id, const char *op)
+{
+    krb5_error_code ret = errno;
+    char buf[128];
+
+    rk_strerror_r(ret, buf, sizeof(buf));
+    krb5_set_error_message(context, ret, "%s(%s): %s", op, id->name, buf);
+    return ret;
+}
+
+/*
+ * Map the cache file, creating and initializing it when it is new or
+ * not in the expected format.  Called with the file locked.
+ */
+
+static krb5_error_code
+rc_shm_map(krb5_context context, krb5_rcache id)
+{
+    struct rc_shm_header *h;
+    struct stat sb;
+    void *p;
+
+    if (id->shm != NULL)
+	return 0;
+
+    if (fstat(id->fd, &sb) < 0)
+	return rc_shm_error(context, id, "fstat");
+    if ((size_t)sb.st_size != RC_SHM_SIZE &&
+	ftruncate(id->fd, RC_SHM_SIZE) < 0)
+	return rc_shm_error(context, id, "ftruncate");
+
+    p = mmap(NULL, RC_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+	     id->fd, 0);
+    if (p == MAP_FAILED)
+	return rc_shm_error(context, id, "mmap");
+    h = p;
+    if (h->magic != RC_SHM_MAGIC || h->version != RC_SHM_VERSION ||
+	h->nbuckets != RC_SHM_NBUCKETS || h->nslots != RC_SHM_NSLOTS ||
+	h->width <= 0)
+	rc_shm_reset(h, context->max_skew);
+    id->shm = h;
+    id->shmlen = RC_SHM_SIZE;
+    return 0;
+}
+
+/*
+ * Open and lock the cache file; on success the caller must call
+ * rc_shm_unlock().  The process-wide mutex covers threads, which
+ * share fcntl locks.
+ */
+
+static krb5_error_code
+rc_shm_lock(krb5_context context, krb5_rcache id)
+{
+    krb5_error_code ret;
+
+    HEIMDAL_MUTEX_lock(&rc_shm_mutex);
+    if (id->fd == -1) {
+	id->fd = open(id->name, O_RDWR | O_CREAT | O_BINARY | O_CLOEXEC | O_NOFOLLOW,
+		      0600);
+	if (id->fd < 0) {
+	    ret = rc_shm_error(context, id, "open");
+	    id->fd = -1;
+	    HEIMDAL_MUTEX_unlock(&rc_shm_mutex);
+	    return ret;
+	}
+	rk_cloexec(id->fd);
+    }
+    ret = _krb5_xlock(context, id->fd, TRUE, id->name);
+    if (ret == 0) {
+	ret = rc_shm_map(context, id);
+	if (ret)
+	    _krb5_xunlock(context, id->fd);
+    }
+    if (ret)
+	HEIMDAL_MUTEX_unlock(&rc_shm_mutex);
+    return ret;
+}
+
+static void
+rc_shm_unlock(krb5_context context, krb5_rcache id)
+{
+    _krb5_xunlock(context, id->fd);
+    HEIMDAL_MUTEX_unlock(&rc_shm_mutex);
+}
+
+static void
+rc_shm_close(krb5_rcache id)
+{
+    if (id->shm != NULL)
+	munmap((void *)id->shm, id->shmlen);
+    if (id->fd != -1)
+	close(id->fd);
+    id->shm = NULL;
+    id->fd = -1;
+}
+
+static krb5_error_code
+rc_shm_store(krb5_context context, krb5_rcache id, struct rc_entry *ent)
+{
+    struct rc_shm_header *h;
+    struct rc_shm_bucket *b;
+    struct rc_shm_slot *slots;
+    krb5_error_code ret;
+    int64_t now = ent->stamp, oldest, e, cur;
+    uint32_t mask, start, i;
+
+    ret = rc_shm_lock(context, id);
+    if (ret)
+	return ret;
+    h = id->shm;
+    mask = h->nslots - 1;
+    memcpy(&start, ent->data, sizeof(start));
+    start &= mask;
+
+    /* Look for the digest in every bucket still within the lifespan */
+    oldest = now - h->lifespan;
+    cur = now / h->width;
+    for (e = oldest / h->width; e <= cur; e++) {
+	b = &h->buckets[e % h->nbuckets];
+	if (b->epoch != e)
+	    continue;
+	slots = rc_shm_slots(h, e % h->nbuckets);
+	for (i = start; slots[i].stamp != 0; i = (i + 1) & mask) {
+	    if (slots[i].stamp >= oldest &&
+		memcmp(slots[i].data, ent->data, sizeof(ent->data)) == 0) {
+		rc_shm_unlock(context, id);
+		krb5_clear_error_message(context);
+		return KRB5_RC_REPLAY;
+	    }
+	}
+    }
+
+    /* Insert into the current bucket, recycling it if it is stale */
+    b = &h->buckets[cur % h->nbuckets];
+    slots = rc_shm_slots(h, cur % h->nbuckets);
+    if (b->epoch != cur) {
+	memset(slots, 0, h->nslots * sizeof(slots[0]));
+	b->epoch = cur;
+	b->count = 0;
+    }
+    if (b->count >= h->nslots - h->nslots / 4) {
+	rc_shm_unlock(context, id);
+	krb5_set_error_message(context, KRB5_RC_IO_SPACE,
+			       N_("replay cache %s is full", ""), id->name);
+	return KRB5_RC_IO_SPACE;
+    }
+    for (i = start; slots[i].stamp != 0; i = (i + 1) & mask)
+	;
+    slots[i].stamp = now;
+    memcpy(slots[i].data, ent->data, sizeof(slots[i].data));
+    b->count++;
+    rc_shm_unlock(context, id);
+    return 0;
+}
+
+#endif /* RC_HAVE_SHM */
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_initialize(krb5_context context,
 		   krb5_rcache id,
 		   krb5_deltat auth_lifespan)
 {
-    FILE *f = fopen(id->name, "w");
+    FILE *f;
     struct rc_entry tmp;
     int ret;
 
+#ifdef RC_HAVE_SHM
+    if (id->type == RC_TYPE_SHM) {
+	ret = rc_shm_lock(context, id);
+	if (ret)
+	    return ret;
+	rc_shm_reset(id->shm, auth_lifespan);
+	rc_shm_unlock(context, id);
+	return 0;
+    }
+#endif
+    f = fopen(id->name, "w");
     if(f == NULL) {
 	char buf[128];
 	ret = errno;
@@ -159,6 +439,9 @@ krb5_rc_destroy(krb5_context context,
 {
     int ret;
 
+#ifdef RC_HAVE_SHM
+    rc_shm_close(id);
+#endif
     if(remove(id->name) < 0) {
 	char buf[128];
 	ret = errno;
@@ -173,6 +456,9 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_close(krb5_context context,
 	      krb5_rcache id)
 {
+#ifdef RC_HAVE_SHM
+    rc_shm_close(id);
+#endif
     free(id->name);
     free(id);
     return 0;
@@ -210,6 +496,10 @@ krb5_rc_store(krb5_context context,
 
     ent.stamp = time(NULL);
     checksum_authenticator(rep, ent.data);
+#ifdef RC_HAVE_SHM
+    if (id->type == RC_TYPE_SHM)
+	return rc_shm_store(context, id, &ent);
+#endif
     f = fopen(id->name, "r");
     if(f == NULL) {
 	char buf[128];
@@ -267,9 +557,25 @@ krb5_rc_get_lifespan(krb5_context context,
 		     krb5_rcache id,
 		     krb5_deltat *auth_lifespan)
 {
-    FILE *f = fopen(id->name, "r");
+    FILE *f;
     int r;
     struct rc_entry ent;
+
+#ifdef RC_HAVE_SHM
+    if (id->type == RC_TYPE_SHM) {
+	krb5_error_code ret = rc_shm_lock(context, id);
+	if (ret)
+	    return ret;
+	*auth_lifespan = id->shm->lifespan;
+	rc_shm_unlock(context, id);
+	return 0;
+    }
+#endif
+    f = fopen(id->name, "r");
+    if (f == NULL) {
+	krb5_clear_error_message (context);
+	return KRB5_RC_IO_UNKNOWN;
+    }
     r = fread(&ent, sizeof(ent), 1, f);
     fclose(f);
     if(r){
@@ -291,6 +597,11 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
+    size_t i;
+
+    for (i = 0; i < sizeof(rc_types) / sizeof(rc_types[0]); i++)
+	if (rc_types[i].type == id->type)
+	    return rc_types[i].prefix;
     return "FILE";
 }
 
@@ -39,8 +39,16 @@ typedef struct emem_storage{
     size_t size;
     size_t len;
     unsigned char *ptr;
+    size_t initial;
 }emem_storage;
 
+/*
+ * Buffers that grew beyond this are shrunk back to their initial
+ * capacity by krb5_storage_emem_reset(), so that one large message
+ * does not pin memory for the lifetime of a reused storage.
+ */
+#define EMEM_RESET_KEEP_MAX (1024 * 1024)
+
 static ssize_t
 emem_fetch(krb5_storage *sp, void *data, size_t size)
 {
@@ -52,23 +60,57 @@ emem_fetch(krb5_storage *sp, void *data, size_t size)
     return size;
 }
 
+/*
+ * Grow the buffer so that it can hold at least `need' bytes.  The
+ * capacity is doubled rather than grown to fit so that a long series
+ * of small stores costs amortized O(1) copies.  The old buffer may
+ * hold key material, so it is cleared before it is released instead
+ * of being handed to realloc().
+ */
+static int
+emem_grow(emem_storage *s, size_t need)
+{
+    unsigned char *base;
+    size_t sz, off;
+
+    sz = s->size ? s->size : (s->initial ? s->initial : 1024);
+    while (sz < need) {
+	if (sz > ((size_t)-1) / 2) {
+	    sz = need;
+	    break;
+	}
+	sz *= 2;
+    }
+    base = malloc(sz);
+    if (base == NULL)
+	return ENOMEM;
+    off = s->ptr - s->base;
+    if (s->base) {
+	memcpy(base, s->base, s->len);
+	memset_s(s->base, s->size, 0, s->size);
+	free(s->base);
+    }
+    memset(base + s->len, 0, sz - s->len);
+    s->size = sz;
+    s->base = base;
+    s->ptr = base + off;
+    return 0;
+}
+
 static ssize_t
 emem_store(krb5_storage *sp, const void *data, size_t size)
 {
     emem_storage *s = (emem_storage*)sp->data;
     if(size > (size_t)(s->base + s->size - s->ptr)){
-	void *base;
-	size_t sz, off;
-	off = s->ptr - s->base;
-	sz = off + size;
-	if (sz < 4096)
-	    sz *= 2;
-	base = realloc(s->base, sz);
-	if(base == NULL)
+	size_t off = s->ptr - s->base;
+	if (off + size < off) {
+	    errno = ENOMEM;
 	    return -1;
-	s->size = sz;
-	s->base = base;
-	s->ptr = (unsigned char*)base + off;
+	}
+	if (emem_grow(s, off + size) != 0) {
+	    errno = ENOMEM;
+	    return -1;
+	}
     }
     memmove(s->ptr, data, size);
     sp->seek(sp, size, SEEK_CUR);
@@ -144,27 +186,30 @@ emem_free(krb5_storage *sp)
 }
 
 /**
- * Create a elastic (allocating) memory storage backend. Memory is
- * allocated on demand. Free returned krb5_storage with
+ * Create a elastic (allocating) memory storage backend with room for
+ * at least capacity bytes before the first reallocation.  The buffer
+ * grows geometrically as needed.  Free returned krb5_storage with
  * krb5_storage_free().
  *
+ * @param capacity initial size of the buffer, 0 for the default.
+ *
  * @return A krb5_storage on success, or NULL on out of memory error.
  *
  * @ingroup krb5_storage
  *
- * @sa krb5_storage_from_mem()
- * @sa krb5_storage_from_readonly_mem()
- * @sa krb5_storage_from_fd()
- * @sa krb5_storage_from_data()
- * @sa krb5_storage_from_socket()
+ * @sa krb5_storage_emem()
+ * @sa krb5_storage_emem_reset()
  */
 
 KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
-krb5_storage_emem(void)
+krb5_storage_emem_capacity(size_t capacity)
 {
     krb5_storage *sp;
     emem_storage *s;
 
+    if (capacity == 0)
+	capacity = 1024;
+
     sp = malloc(sizeof(krb5_storage));
     if (sp == NULL)
 	return NULL;
@@ -177,7 +222,8 @@ krb5_storage_emem(void)
     sp->data = s;
     sp->flags = 0;
     sp->eof_code = HEIM_ERR_EOF;
-    s->size = 1024;
+    s->size = capacity;
+    s->initial = capacity;
     s->base = malloc(s->size);
     if (s->base == NULL) {
 	free(sp);
@@ -195,3 +241,66 @@ krb5_storage_emem(void)
     sp->max_alloc = UINT_MAX/8;
     return sp;
 }
+
+/**
+ * Create a elastic (allocating) memory storage backend. Memory is
+ * allocated on demand. Free returned krb5_storage with
+ * krb5_storage_free().
+ *
+ * @return A krb5_storage on success, or NULL on out of memory error.
+ *
+ * @ingroup krb5_storage
+ *
+ * @sa krb5_storage_from_mem()
+ * @sa krb5_storage_from_readonly_mem()
+ * @sa krb5_storage_from_fd()
+ * @sa krb5_storage_from_data()
+ * @sa krb5_storage_from_socket()
+ * @sa krb5_storage_emem_capacity()
+ */
+
+KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
+krb5_storage_emem(void)
+{
+    return krb5_storage_emem_capacity(1024);
+}
+
+/**
+ * Empty an elastic memory storage so that it can be reused for the
+ * next message without freeing and reallocating it.  The previous
+ * content is cleared.  A buffer that grew very large is shrunk back
+ * to the capacity it was created with.
+ *
+ * @param sp storage created with krb5_storage_emem() or
+ * krb5_storage_emem_capacity().
+ *
+ * @return 0 on success, EINVAL if sp is not an elastic memory storage.
+ *
+ * @ingroup krb5_storage
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_storage_emem_reset(krb5_storage *sp)
+{
+    emem_storage *s;
+
+    if (sp == NULL || sp->store != emem_store)
+	return EINVAL;
+    s = sp->data;
+
+    if (s->base)
+	memset_s(s->base, s->len, 0, s->len);
+    if (s->size > EMEM_RESET_KEEP_MAX && s->size > s->initial) {
+	unsigned char *base = malloc(s->initial);
+
+	if (base != NULL) {
+	    memset_s(s->base, s->size, 0, s->size);
+	    free(s->base);
+	    s->base = base;
+	    s->size = s->initial;
+	}
+    }
+    s->len = 0;
+    s->ptr = s->base;
+    return 0;
+}
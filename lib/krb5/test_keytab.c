@@ -170,6 +170,86 @@ test_memory_keytab(krb5_context context, const char *keytab, const char *keytab2
     krb5_free_keyblock_contents(context, &entry3.keyblock);
 }
 
+static void
+test_file_index(krb5_context context, const char *keytab)
+{
+    krb5_error_code ret;
+    krb5_keytab id;
+    krb5_keytab_entry entry, entry2;
+    krb5_principal other;
+    int vno;
+
+    context->flags |= KRB5_CTX_F_KEYTAB_INDEX;
+
+    ret = krb5_kt_resolve(context, keytab, &id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_resolve");
+
+    memset(&entry, 0, sizeof(entry));
+    ret = krb5_parse_name(context, "lha@SU.SE", &entry.principal);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    ret = krb5_parse_name(context, "host/lha@SU.SE", &other);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+
+    for (vno = 1; vno <= 3; vno++) {
+	entry.vno = vno;
+	ret = krb5_generate_random_keyblock(context,
+					    ETYPE_AES256_CTS_HMAC_SHA1_96,
+					    &entry.keyblock);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+	ret = krb5_kt_add_entry(context, id, &entry);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kt_add_entry");
+	if (vno != 3)
+	    krb5_free_keyblock_contents(context, &entry.keyblock);
+    }
+
+    ret = krb5_kt_get_entry(context, id, entry.principal, 0,
+			    ETYPE_AES256_CTS_HMAC_SHA1_96, &entry2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_get_entry");
+    if (entry2.vno != 3 ||
+	krb5_data_cmp(&entry.keyblock.keyvalue, &entry2.keyblock.keyvalue))
+	krb5_errx(context, 1, "indexed lookup returned the wrong entry");
+    krb5_kt_free_entry(context, &entry2);
+
+    ret = krb5_kt_get_entry(context, id, entry.principal, 2,
+			    ETYPE_AES256_CTS_HMAC_SHA1_96, &entry2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_get_entry");
+    if (entry2.vno != 2)
+	krb5_errx(context, 1, "indexed lookup returned kvno %d", entry2.vno);
+    krb5_kt_free_entry(context, &entry2);
+
+    ret = krb5_kt_get_entry(context, id, other, 0, 0, &entry2);
+    if (ret == 0)
+	krb5_errx(context, 1, "krb5_kt_get_entry when if should fail");
+
+    /* The index must notice the removal */
+    ret = krb5_kt_remove_entry(context, id, &entry);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_remove_entry");
+    ret = krb5_kt_get_entry(context, id, entry.principal, 0,
+			    ETYPE_AES256_CTS_HMAC_SHA1_96, &entry2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_get_entry");
+    if (entry2.vno != 2)
+	krb5_errx(context, 1, "stale index returned kvno %d", entry2.vno);
+    krb5_kt_free_entry(context, &entry2);
+
+    ret = krb5_kt_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_destroy");
+
+    krb5_kt_free_entry(context, &entry);
+    krb5_free_principal(context, other);
+
+    context->flags &= ~KRB5_CTX_F_KEYTAB_INDEX;
+}
+
 static void
 perf_add(krb5_context context, krb5_keytab id, int times)
 {
@@ -283,6 +363,8 @@ main(int argc, char **argv)
 
 	test_memory_keytab(context, "MEMORY:foo", "MEMORY:foo2");
 
+	test_file_index(context, "FILE:test_keytab_index");
+
     }
 
     krb5_free_context(context);
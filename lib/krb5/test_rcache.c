@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of KTH nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY KTH AND ITS CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL KTH OR ITS CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+
+static void
+make_authenticator(Authenticator *auth, char *name, int cusec)
+{
+    static char *comps[1];
+
+    memset(auth, 0, sizeof(*auth));
+    comps[0] = name;
+    auth->crealm = "TEST.H5L.SE";
+    auth->cname.name_type = KRB5_NT_PRINCIPAL;
+    auth->cname.name_string.len = 1;
+    auth->cname.name_string.val = comps;
+    auth->ctime = 1000000;
+    auth->cusec = cusec;
+}
+
+static void
+check_rcache(krb5_context context, const char *type)
+{
+    krb5_error_code ret;
+    krb5_rcache id;
+    krb5_deltat lifespan;
+    Authenticator a, b;
+    char *name;
+
+    if (asprintf(&name, "%s:test_rcache_%lu", type,
+		 (unsigned long)getpid()) < 0 || name == NULL)
+	errx(1, "out of memory");
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    if (strcmp(krb5_rc_get_type(context, id), type) != 0)
+	krb5_errx(context, 1, "%s: wrong type %s", name,
+		  krb5_rc_get_type(context, id));
+
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize");
+    ret = krb5_rc_get_lifespan(context, id, &lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_get_lifespan");
+    if (lifespan != 300)
+	krb5_errx(context, 1, "%s: lifespan %d", name, (int)lifespan);
+
+    make_authenticator(&a, "lha", 1);
+    make_authenticator(&b, "lha", 2);
+
+    ret = krb5_rc_store(context, id, &a);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store");
+    ret = krb5_rc_store(context, id, &b);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store");
+    ret = krb5_rc_store(context, id, &a);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay not detected (%d)", name, ret);
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy");
+    free(name);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+
+    check_rcache(context, "FILE");
+#if defined(HAVE_SYS_MMAN_H) && !defined(NO_MMAP)
+    check_rcache(context, "SHM");
+#endif
+
+    krb5_free_context(context);
+
+    return 0;
+}
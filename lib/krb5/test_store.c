@@ -262,6 +262,51 @@ check_too_large(krb5_context context, krb5_storage *sp)
     }
 }
 
+static void
+test_emem_reset(krb5_context context)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data data;
+    size_t i, round;
+    uint32_t v;
+
+    sp = krb5_storage_emem_capacity(16);
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_emem_capacity: no mem");
+
+    for (round = 0; round < 3; round++) {
+	for (i = 0; i < 100000; i++)
+	    krb5_store_uint32(sp, i + round);
+	ret = krb5_storage_to_data(sp, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_storage_to_data");
+	if (data.length != 400000)
+	    krb5_errx(context, 1, "emem length %lu after round %lu",
+		      (unsigned long)data.length, (unsigned long)round);
+	krb5_data_free(&data);
+
+	krb5_storage_seek(sp, 4 * 4242, SEEK_SET);
+	ret = krb5_ret_uint32(sp, &v);
+	if (ret || v != 4242 + round)
+	    krb5_errx(context, 1, "emem content wrong after growth");
+
+	ret = krb5_storage_emem_reset(sp);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_storage_emem_reset");
+	if (krb5_storage_seek(sp, 0, SEEK_END) != 0)
+	    krb5_errx(context, 1, "emem not empty after reset");
+    }
+    krb5_storage_free(sp);
+
+    sp = krb5_storage_from_mem(&v, sizeof(v));
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_from_mem: no mem");
+    if (krb5_storage_emem_reset(sp) != EINVAL)
+	krb5_errx(context, 1, "reset of a mem storage not rejected");
+    krb5_storage_free(sp);
+}
+
 /*
  *
  */
@@ -327,6 +372,8 @@ main(int argc, char **argv)
     check_too_large(context, sp);
     krb5_storage_free(sp);
 
+    test_emem_reset(context);
+
 
     fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600);
     if (fd < 0)